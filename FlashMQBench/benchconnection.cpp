@@ -0,0 +1,939 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "benchconnection.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <random>
+#include <algorithm>
+#include <openssl/err.h>
+
+#include "../client.h"
+#include "../settings.h"
+#include "../utils.h"
+#include "../exceptions.h"
+
+#define BENCH_PAYLOAD_HEADER_SIZE 16
+#define BENCH_MAX_PENDING_WRITE (1024*1024)
+#define BENCH_PUBLISH_BATCH 256
+
+static const Settings benchParserSettings;
+
+static uint64_t nowNanoSeconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string roleToChar(BenchRole role)
+{
+    switch (role)
+    {
+    case BenchRole::Publisher:
+        return "p";
+    case BenchRole::Subscriber:
+        return "s";
+    default:
+        return "r";
+    }
+}
+
+BenchConnection::BenchConnection(const BenchOptions &options, BenchShared &shared, BenchRole role, int index, std::vector<uint64_t> &latencies) :
+    options(options),
+    shared(shared),
+    role(role),
+    index(index),
+    clientId(formatString("bench-%s-%s%d", options.runId.c_str(), roleToChar(role).c_str(), index)),
+    latencies(latencies),
+    readbuf(16384),
+    writebuf(16384),
+    payload(options.payloadSize, 'x')
+{
+    // An invalid fd, because the parser is never used for IO, and the constructor sets the fd to non-blocking.
+    parser = std::make_shared<Client>(-1, std::shared_ptr<ThreadData>(), nullptr, false, nullptr, &benchParserSettings, false);
+    parser->setClientProperties(options.protocolVersion, clientId, "bench", true, 60, benchParserSettings.maxPacketSize, 0);
+    parser->setAuthenticated(true);
+}
+
+BenchConnection::~BenchConnection()
+{
+    close();
+}
+
+BenchPhase BenchConnection::getStartPhase() const
+{
+    if (role == BenchRole::Storm)
+        return BenchPhase::Publish;
+
+    if (role == BenchRole::Subscriber && options.scenario == BenchScenario::RetainedFlood)
+        return BenchPhase::RetainedSubscribe;
+
+    return BenchPhase::Connect;
+}
+
+void BenchConnection::start(int epollfd)
+{
+    this->epollfd = epollfd;
+    connectSocket();
+}
+
+void BenchConnection::connectSocket()
+{
+    connectStartedAt = std::chrono::steady_clock::now();
+    lastSentAt = connectStartedAt;
+    readbuf.reset();
+    writebuf.reset();
+    rawIn.clear();
+    rawOut.clear();
+    rawOutPos = 0;
+    packetQueueIn.clear();
+    pingsOutstanding = 0;
+    writable = false;
+
+    fd = socket(options.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+    {
+        fail();
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    state = BenchConnectionState::TcpConnecting;
+
+    if (::connect(fd, reinterpret_cast<const struct sockaddr*>(&options.address), options.addressLen) < 0 && errno != EINPROGRESS)
+    {
+        fail();
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.ptr = this;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev));
+}
+
+/**
+ * @brief BenchConnection::fail is for transport and connect errors. Storm connections just go to their next round.
+ */
+void BenchConnection::fail()
+{
+    shared.connectErrors++;
+    close();
+
+    if (role == BenchRole::Storm)
+        finishStormRound();
+}
+
+void BenchConnection::close()
+{
+    if (ssl)
+    {
+        SSL_free(ssl);
+        ssl = nullptr;
+    }
+
+    if (fd >= 0)
+    {
+        // Closing removes it from the epoll set, because we never dup the fd.
+        ::close(fd);
+        fd = -1;
+    }
+
+    if (state != BenchConnectionState::NotStarted)
+        state = BenchConnectionState::Closed;
+}
+
+void BenchConnection::disconnect()
+{
+    if (state == BenchConnectionState::MqttConnecting || state == BenchConnectionState::Subscribing || state == BenchConnectionState::Ready)
+    {
+        Disconnect d(options.protocolVersion, ReasonCodes::Success);
+        queuePacket(MqttPacket(d));
+        flush();
+    }
+
+    close();
+}
+
+void BenchConnection::continueConnecting(uint32_t events)
+{
+    if (state == BenchConnectionState::TcpConnecting)
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+        if (error != 0 || (events & (EPOLLERR | EPOLLHUP)))
+        {
+            fail();
+            return;
+        }
+
+        if (!(events & EPOLLOUT))
+            return;
+
+        if (!options.tls)
+        {
+            onTransportUp();
+            return;
+        }
+
+        ssl = SSL_new(options.sslCtx);
+        SSL_set_fd(ssl, fd);
+        SSL_set_tlsext_host_name(ssl, options.host.c_str());
+        SSL_set_connect_state(ssl);
+        state = BenchConnectionState::TlsHandshake;
+    }
+
+    if (state == BenchConnectionState::TlsHandshake)
+    {
+        ERR_clear_error();
+        const int r = SSL_do_handshake(ssl);
+
+        if (r == 1)
+        {
+            onTransportUp();
+            return;
+        }
+
+        const int err = SSL_get_error(ssl, r);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+            fail();
+    }
+}
+
+void BenchConnection::onTransportUp()
+{
+    writable = true;
+
+    if (options.websocket)
+        startWebsocketHandshake();
+    else
+        sendConnect();
+}
+
+void BenchConnection::startWebsocketHandshake()
+{
+    state = BenchConnectionState::WebsocketHandshake;
+
+    const std::string keyBytes = getSecureRandomString(16);
+    websocketKey = base64Encode(reinterpret_cast<const unsigned char*>(keyBytes.data()), keyBytes.size());
+
+    const std::string request = formatString("GET /mqtt HTTP/1.1\r\n"
+                                             "Host: %s:%d\r\n"
+                                             "Upgrade: websocket\r\n"
+                                             "Connection: Upgrade\r\n"
+                                             "Sec-WebSocket-Key: %s\r\n"
+                                             "Sec-WebSocket-Protocol: mqtt\r\n"
+                                             "Sec-WebSocket-Version: 13\r\n"
+                                             "\r\n", options.host.c_str(), options.port, websocketKey.c_str());
+    rawOut.insert(rawOut.end(), request.begin(), request.end());
+    flush();
+}
+
+/**
+ * @brief BenchConnection::readWebsocketHandshake checks the HTTP answer once it's complete.
+ * @return whether the handshake is done. Anything after it is already websocket frames.
+ */
+bool BenchConnection::readWebsocketHandshake()
+{
+    const char *end = "\r\n\r\n";
+    auto pos = std::search(rawIn.begin(), rawIn.end(), end, end + 4);
+
+    if (pos == rawIn.end())
+        return false;
+
+    const std::string answer(rawIn.begin(), pos);
+    rawIn.erase(rawIn.begin(), pos + 4);
+
+    if (!startsWith(answer, "HTTP/1.1 101") || !strContains(answer, generateWebsocketAcceptString(websocketKey)))
+    {
+        fail();
+        return false;
+    }
+
+    sendConnect();
+    return true;
+}
+
+/**
+ * @brief BenchConnection::decodeWebsocketFrames moves the payload of complete frames to the read buffer, for the MQTT parser.
+ */
+void BenchConnection::decodeWebsocketFrames()
+{
+    size_t pos = 0;
+
+    while (state != BenchConnectionState::Closed && rawIn.size() - pos >= 2)
+    {
+        const uint8_t *frame = reinterpret_cast<const uint8_t*>(rawIn.data() + pos);
+        const size_t available = rawIn.size() - pos;
+        const uint8_t opcode = frame[0] & 0x0F;
+        const bool masked = frame[1] & 0x80;
+        size_t headerLen = 2;
+        uint64_t len = frame[1] & 0x7F;
+
+        if (len == 126)
+        {
+            headerLen += 2;
+            if (available < headerLen)
+                break;
+            len = (frame[2] << 8) | frame[3];
+        }
+        else if (len == 127)
+        {
+            headerLen += 8;
+            if (available < headerLen)
+                break;
+            len = 0;
+            for (int i = 0; i < 8; i++)
+                len = (len << 8) | frame[2 + i];
+        }
+
+        const size_t maskPos = headerLen;
+        if (masked)
+            headerLen += 4;
+
+        if (available < headerLen || available - headerLen < len)
+            break;
+
+        char *data = rawIn.data() + pos + headerLen;
+
+        if (masked)
+        {
+            for (size_t i = 0; i < len; i++)
+                data[i] ^= frame[maskPos + (i % 4)];
+        }
+
+        if (opcode <= 0x2)
+        {
+            readbuf.ensureFreeSpace(len);
+            readbuf.write(data, len);
+        }
+        else if (opcode == 0x8)
+        {
+            close();
+        }
+        else if (opcode == 0x9)
+        {
+            appendWebsocketFrame(0xA, data, len);
+        }
+
+        pos += headerLen + len;
+    }
+
+    rawIn.erase(rawIn.begin(), rawIn.begin() + std::min(pos, rawIn.size()));
+}
+
+void BenchConnection::appendWebsocketFrame(uint8_t opcode, const char *data, size_t len)
+{
+    thread_local std::minstd_rand maskGenerator(nowNanoSeconds());
+
+    rawOut.push_back(static_cast<char>(0x80 | opcode));
+
+    if (len < 126)
+    {
+        rawOut.push_back(static_cast<char>(0x80 | len));
+    }
+    else if (len <= 0xFFFF)
+    {
+        rawOut.push_back(static_cast<char>(0x80 | 126));
+        rawOut.push_back(static_cast<char>(len >> 8));
+        rawOut.push_back(static_cast<char>(len & 0xFF));
+    }
+    else
+    {
+        rawOut.push_back(static_cast<char>(0x80 | 127));
+        for (int i = 7; i >= 0; i--)
+            rawOut.push_back(static_cast<char>((static_cast<uint64_t>(len) >> (i * 8)) & 0xFF));
+    }
+
+    const uint32_t maskValue = maskGenerator();
+    char mask[4];
+    memcpy(mask, &maskValue, 4);
+    rawOut.insert(rawOut.end(), mask, mask + 4);
+
+    const size_t start = rawOut.size();
+    rawOut.insert(rawOut.end(), data, data + len);
+
+    for (size_t i = 0; i < len; i++)
+        rawOut[start + i] ^= mask[i % 4];
+}
+
+ssize_t BenchConnection::rawRead(char *buf, size_t len, bool &wouldBlock)
+{
+    wouldBlock = false;
+
+    if (ssl)
+    {
+        ERR_clear_error();
+        const int n = SSL_read(ssl, buf, len);
+
+        if (n > 0)
+            return n;
+
+        const int err = SSL_get_error(ssl, n);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            wouldBlock = true;
+        else if (err == SSL_ERROR_ZERO_RETURN)
+            return 0;
+        return -1;
+    }
+
+    const ssize_t n = read(fd, buf, len);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        wouldBlock = true;
+
+    return n;
+}
+
+ssize_t BenchConnection::rawWrite(const char *buf, size_t len, bool &wouldBlock)
+{
+    wouldBlock = false;
+
+    if (ssl)
+    {
+        ERR_clear_error();
+        const int n = SSL_write(ssl, buf, len);
+
+        if (n > 0)
+            return n;
+
+        const int err = SSL_get_error(ssl, n);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            wouldBlock = true;
+        return -1;
+    }
+
+    const ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        wouldBlock = true;
+
+    return n;
+}
+
+void BenchConnection::queuePacket(const MqttPacket &packet)
+{
+    writebuf.ensureFreeSpace(packet.getSizeIncludingNonPresentHeader());
+    packet.readIntoBuf(writebuf);
+    frameWriteBuffer();
+}
+
+/**
+ * @brief BenchConnection::frameWriteBuffer wraps the MQTT bytes in a websocket frame, so one per packet, like browser clients do.
+ */
+void BenchConnection::frameWriteBuffer()
+{
+    if (!options.websocket)
+        return;
+
+    while (writebuf.usedBytes() > 0)
+    {
+        const uint32_t n = writebuf.maxReadSize();
+        appendWebsocketFrame(0x2, writebuf.tailPtr(), n);
+        writebuf.advanceTail(n);
+    }
+
+    // Starting at the beginning again means the next packet doesn't wrap, and isn't split over two frames.
+    writebuf.reset();
+}
+
+void BenchConnection::flush()
+{
+    if (fd < 0 || state < BenchConnectionState::WebsocketHandshake || state == BenchConnectionState::Closed)
+        return;
+
+    if (!writable)
+        return;
+
+    bool wouldBlock = false;
+
+    while (rawOutPos < rawOut.size())
+    {
+        const ssize_t n = rawWrite(rawOut.data() + rawOutPos, rawOut.size() - rawOutPos, wouldBlock);
+
+        if (n < 0)
+        {
+            if (wouldBlock)
+            {
+                writable = false;
+                return;
+            }
+
+            fail();
+            return;
+        }
+
+        rawOutPos += n;
+        lastSentAt = std::chrono::steady_clock::now();
+    }
+
+    rawOut.clear();
+    rawOutPos = 0;
+
+    while (writebuf.usedBytes() > 0)
+    {
+        const ssize_t n = rawWrite(writebuf.tailPtr(), writebuf.maxReadSize(), wouldBlock);
+
+        if (n < 0)
+        {
+            if (wouldBlock)
+            {
+                writable = false;
+                return;
+            }
+
+            fail();
+            return;
+        }
+
+        writebuf.advanceTail(n);
+        lastSentAt = std::chrono::steady_clock::now();
+    }
+}
+
+void BenchConnection::sendConnect()
+{
+    state = BenchConnectionState::MqttConnecting;
+    Connect connect(options.protocolVersion, clientId);
+    connect.clean_start = true;
+    queuePacket(MqttPacket(connect));
+    flush();
+}
+
+uint16_t BenchConnection::getNextPacketId()
+{
+    if (++nextPacketId == 0)
+        ++nextPacketId;
+    return nextPacketId;
+}
+
+void BenchConnection::queuePublish(const std::string &topic, const std::string &payload, char qos, bool retain)
+{
+    Publish pub(topic, payload, qos);
+    pub.retain = retain;
+    pub.splitTopic = false;
+    MqttPacket packet(options.protocolVersion, pub);
+
+    if (qos > 0)
+    {
+        packet.setPacketId(getNextPacketId());
+        inflight++;
+    }
+
+    queuePacket(packet);
+}
+
+void BenchConnection::queuePing()
+{
+    const char ping[2] = { static_cast<char>(static_cast<uint8_t>(PacketType::PINGREQ) << 4), 0 };
+    writebuf.ensureFreeSpace(2);
+    writebuf.write(ping, 2);
+    frameWriteBuffer();
+    pingsOutstanding++;
+}
+
+void BenchConnection::setReady()
+{
+    state = BenchConnectionState::Ready;
+
+    if (!countedReady)
+    {
+        countedReady = true;
+        shared.ready++;
+    }
+}
+
+void BenchConnection::handleConnAck(MqttPacket &packet)
+{
+    const std::vector<char> &bites = packet.getBites();
+    const uint8_t returnCode = bites.at(packet.getFixedHeaderLength() + 1);
+
+    if (returnCode != 0)
+    {
+        fail();
+        return;
+    }
+
+    shared.connacks++;
+
+    if (role == BenchRole::Storm)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(now - connectStartedAt).count());
+        state = BenchConnectionState::Ready;
+        return;
+    }
+
+    if (role == BenchRole::Publisher)
+    {
+        setReady();
+        return;
+    }
+
+    state = BenchConnectionState::Subscribing;
+    const std::string filter = options.scenario == BenchScenario::RetainedFlood ? formatString("bench/%s/retained/#", options.runId.c_str())
+                                                                                : formatString("bench/%s/#", options.runId.c_str());
+    Subscribe subscribe(options.protocolVersion, getNextPacketId(), filter, options.qos);
+    queuePacket(MqttPacket(subscribe));
+}
+
+void BenchConnection::handlePublish(MqttPacket &packet)
+{
+    packet.parsePublishData();
+
+    if (packet.getQos() == 1)
+    {
+        PubResponse ack(options.protocolVersion, PacketType::PUBACK, ReasonCodes::Success, packet.getPacketId());
+        queuePacket(MqttPacket(ack));
+    }
+    else if (packet.getQos() == 2)
+    {
+        PubResponse rec(options.protocolVersion, PacketType::PUBREC, ReasonCodes::Success, packet.getPacketId());
+        queuePacket(MqttPacket(rec));
+    }
+
+    const std::string data = packet.getPayloadCopy();
+
+    // The clearing of retained messages of earlier runs.
+    if (data.empty())
+        return;
+
+    uint64_t latency = 0;
+
+    if (options.scenario == BenchScenario::RetainedFlood)
+    {
+        latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - connectStartedAt).count();
+    }
+    else if (data.size() >= BENCH_PAYLOAD_HEADER_SIZE)
+    {
+        uint64_t sentAt = 0;
+        memcpy(&sentAt, data.data(), sizeof(sentAt));
+        const uint64_t now = nowNanoSeconds();
+        latency = now > sentAt ? now - sentAt : 0;
+    }
+
+    latencies.push_back(latency);
+    shared.received++;
+    shared.receivedBytes += data.size();
+}
+
+/**
+ * @brief BenchConnection::handlePingResp is how publishers know the server has processed everything they sent before the ping.
+ *
+ * Keep-alive pings are only sent when none are outstanding, so when the count reaches zero, the barrier ping has been answered.
+ */
+void BenchConnection::handlePingResp()
+{
+    if (pingsOutstanding > 0)
+        pingsOutstanding--;
+
+    if (pingsOutstanding > 0)
+        return;
+
+    if (publishBarrierSent && !publishDoneCounted)
+    {
+        publishDoneCounted = true;
+        shared.publishersDone++;
+    }
+
+    if (cleanupSent && !cleanupDoneCounted)
+    {
+        cleanupDoneCounted = true;
+        shared.publishersCleanedUp++;
+    }
+}
+
+void BenchConnection::handlePacket(MqttPacket &packet)
+{
+    switch (packet.packetType)
+    {
+    case PacketType::CONNACK:
+        handleConnAck(packet);
+        break;
+    case PacketType::SUBACK:
+    {
+        SubAckData data = packet.parseSubAckData();
+        for (uint8_t code : data.subAckCodes)
+        {
+            if (code >= 0x80)
+                shared.protocolErrors++;
+        }
+        setReady();
+        break;
+    }
+    case PacketType::PUBLISH:
+        handlePublish(packet);
+        break;
+    case PacketType::PUBACK:
+        packet.parsePubAckData();
+        inflight--;
+        acked++;
+        shared.acked++;
+        break;
+    case PacketType::PUBREC:
+    {
+        packet.parsePubRecData();
+        PubResponse rel(options.protocolVersion, PacketType::PUBREL, ReasonCodes::Success, packet.getPacketId());
+        queuePacket(MqttPacket(rel));
+        break;
+    }
+    case PacketType::PUBREL:
+    {
+        packet.parsePubRelData();
+        PubResponse comp(options.protocolVersion, PacketType::PUBCOMP, ReasonCodes::Success, packet.getPacketId());
+        queuePacket(MqttPacket(comp));
+        break;
+    }
+    case PacketType::PUBCOMP:
+        packet.parsePubComp();
+        inflight--;
+        acked++;
+        shared.acked++;
+        break;
+    case PacketType::PINGRESP:
+        handlePingResp();
+        break;
+    case PacketType::DISCONNECT:
+        shared.protocolErrors++;
+        close();
+        break;
+    default:
+        shared.protocolErrors++;
+        break;
+    }
+}
+
+void BenchConnection::readAll()
+{
+    char buf[16384];
+    const int startRound = round;
+
+    // A storm connection may finish its round and reconnect while handling packets; the new socket gets its own events.
+    while (fd >= 0 && state != BenchConnectionState::Closed && round == startRound)
+    {
+        bool wouldBlock = false;
+        ssize_t n = 0;
+
+        if (options.websocket)
+        {
+            n = rawRead(buf, sizeof(buf), wouldBlock);
+            if (n > 0)
+                rawIn.insert(rawIn.end(), buf, buf + n);
+        }
+        else
+        {
+            if (readbuf.maxWriteSize() == 0)
+                readbuf.doubleSize();
+            n = rawRead(readbuf.headPtr(), readbuf.maxWriteSize(), wouldBlock);
+            if (n > 0)
+                readbuf.advanceHead(n);
+        }
+
+        if (n <= 0)
+        {
+            if (!wouldBlock)
+                fail();
+            return;
+        }
+
+        if (options.websocket)
+        {
+            if (state == BenchConnectionState::WebsocketHandshake && !readWebsocketHandshake())
+                continue;
+
+            decodeWebsocketFrames();
+        }
+
+        try
+        {
+            MqttPacket::bufferToMqttPackets(readbuf, packetQueueIn, parser);
+
+            for (MqttPacket &packet : packetQueueIn)
+            {
+                handlePacket(packet);
+
+                if (state == BenchConnectionState::Closed || round != startRound)
+                    break;
+            }
+        }
+        catch (ProtocolError &ex)
+        {
+            shared.protocolErrors++;
+            close();
+        }
+
+        packetQueueIn.clear();
+    }
+}
+
+void BenchConnection::finishStormRound()
+{
+    if (state == BenchConnectionState::Ready)
+        disconnect();
+
+    if (++round < options.rounds)
+    {
+        connectSocket();
+        return;
+    }
+
+    if (!done)
+    {
+        done = true;
+        shared.stormDone++;
+    }
+}
+
+void BenchConnection::handleEvents(uint32_t events)
+{
+    if (fd < 0 || state == BenchConnectionState::Closed)
+        return;
+
+    if (events & EPOLLOUT)
+        writable = true;
+
+    if (state == BenchConnectionState::TcpConnecting || state == BenchConnectionState::TlsHandshake)
+    {
+        continueConnecting(events);
+
+        if (state == BenchConnectionState::TcpConnecting || state == BenchConnectionState::TlsHandshake || state == BenchConnectionState::Closed)
+            return;
+    }
+
+    readAll();
+
+    if (role == BenchRole::Storm && state == BenchConnectionState::Ready)
+    {
+        finishStormRound();
+        return;
+    }
+
+    flush();
+}
+
+void BenchConnection::publishSome()
+{
+    const uint64_t messages = options.messages;
+
+    if (sent >= messages)
+    {
+        if (!publishBarrierSent && (options.qos == 0 || acked >= messages))
+        {
+            publishBarrierSent = true;
+            queuePing();
+            flush();
+        }
+        return;
+    }
+
+    uint64_t due = messages;
+
+    if (options.rate > 0)
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - shared.phaseStartedAt;
+        const uint64_t elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        due = std::min<uint64_t>(messages, elapsedUs * options.rate / 1000000 + 1);
+    }
+
+    const bool retained = options.scenario == BenchScenario::RetainedFlood;
+    const std::string topic = formatString("bench/%s/%d", options.runId.c_str(), index);
+
+    for (int i = 0; i < BENCH_PUBLISH_BATCH && sent < due; i++)
+    {
+        if (options.qos > 0 && inflight >= options.inflight)
+            break;
+
+        if (writebuf.usedBytes() + rawOut.size() - rawOutPos >= BENCH_MAX_PENDING_WRITE)
+            break;
+
+        const uint64_t sentAt = nowNanoSeconds();
+        const uint32_t idx = index;
+        const uint32_t seq = sent;
+        memcpy(&payload[0], &sentAt, sizeof(sentAt));
+        memcpy(&payload[8], &idx, sizeof(idx));
+        memcpy(&payload[12], &seq, sizeof(seq));
+
+        if (retained)
+            queuePublish(formatString("bench/%s/retained/%d/%u", options.runId.c_str(), index, seq), payload, options.qos, true);
+        else
+            queuePublish(topic, payload, options.qos, false);
+
+        sent++;
+        shared.published++;
+    }
+
+    flush();
+}
+
+void BenchConnection::cleanupRetained()
+{
+    for (int seq = 0; seq < options.messages; seq++)
+    {
+        queuePublish(formatString("bench/%s/retained/%d/%d", options.runId.c_str(), index, seq), "", 0, true);
+    }
+
+    cleanupSent = true;
+    queuePing();
+    flush();
+}
+
+/**
+ * @brief BenchConnection::work does the things not triggered by socket events.
+ * @return whether there is more to do right away, so the worker shouldn't block in epoll.
+ */
+bool BenchConnection::work()
+{
+    if (state != BenchConnectionState::Ready || role == BenchRole::Storm)
+        return false;
+
+    const BenchPhase phase = shared.phase;
+
+    if (role == BenchRole::Publisher)
+    {
+        if (phase == BenchPhase::Publish)
+        {
+            publishSome();
+
+            if (state == BenchConnectionState::Ready && sent < static_cast<uint64_t>(options.messages) && writable
+                && (options.qos == 0 || inflight < options.inflight))
+                return true;
+        }
+        else if (phase == BenchPhase::RetainedCleanup && !cleanupSent)
+        {
+            cleanupRetained();
+        }
+    }
+
+    if (state == BenchConnectionState::Ready && pingsOutstanding == 0 && std::chrono::steady_clock::now() - lastSentAt > std::chrono::seconds(20))
+    {
+        queuePing();
+        flush();
+    }
+
+    return false;
+}
@@ -0,0 +1,132 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BENCHCONNECTION_H
+#define BENCHCONNECTION_H
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <openssl/ssl.h>
+
+#include "../cirbuf.h"
+#include "../mqttpacket.h"
+#include "benchtypes.h"
+
+enum class BenchConnectionState
+{
+    NotStarted,
+    TcpConnecting,
+    TlsHandshake,
+    WebsocketHandshake,
+    MqttConnecting,
+    Subscribing,
+    Ready,
+    Closed
+};
+
+/**
+ * @brief The BenchConnection class is one client connection of the load generator.
+ *
+ * It does its own non-blocking IO, with optional TLS and websocket framing, and uses MqttPacket for creating and parsing packets.
+ * Parsing needs a client for context, so each connection has a thread-less dummy one, like when loading sessions from disk.
+ */
+class BenchConnection
+{
+    const BenchOptions &options;
+    BenchShared &shared;
+    const BenchRole role;
+    const int index;
+    const std::string clientId;
+    std::vector<uint64_t> &latencies;
+
+    int epollfd = -1;
+    int fd = -1;
+    SSL *ssl = nullptr;
+    BenchConnectionState state = BenchConnectionState::NotStarted;
+    bool writable = false;
+    bool countedReady = false;
+    bool done = false;
+
+    std::shared_ptr<Client> parser;
+    CirBuf readbuf;
+    CirBuf writebuf;
+    std::vector<char> rawIn;
+    std::vector<char> rawOut; // Websocket frames and the HTTP upgrade request; writebuf is only written directly for plain MQTT.
+    size_t rawOutPos = 0;
+    std::string websocketKey;
+    std::vector<MqttPacket> packetQueueIn;
+
+    std::chrono::time_point<std::chrono::steady_clock> connectStartedAt;
+    std::chrono::time_point<std::chrono::steady_clock> lastSentAt;
+    int round = 0;
+
+    uint64_t sent = 0;
+    uint64_t acked = 0;
+    int inflight = 0;
+    uint16_t nextPacketId = 0;
+    int pingsOutstanding = 0;
+    bool publishBarrierSent = false;
+    bool publishDoneCounted = false;
+    bool cleanupSent = false;
+    bool cleanupDoneCounted = false;
+    std::string payload;
+
+    ssize_t rawRead(char *buf, size_t len, bool &wouldBlock);
+    ssize_t rawWrite(const char *buf, size_t len, bool &wouldBlock);
+    void connectSocket();
+    void continueConnecting(uint32_t events);
+    void onTransportUp();
+    void fail();
+    void startWebsocketHandshake();
+    bool readWebsocketHandshake();
+    void decodeWebsocketFrames();
+    void appendWebsocketFrame(uint8_t opcode, const char *data, size_t len);
+    void frameWriteBuffer();
+    void sendConnect();
+    void handlePacket(MqttPacket &packet);
+    void handleConnAck(MqttPacket &packet);
+    void handlePublish(MqttPacket &packet);
+    void handlePingResp();
+    void setReady();
+    void publishSome();
+    void cleanupRetained();
+    void queuePublish(const std::string &topic, const std::string &payload, char qos, bool retain);
+    void queuePing();
+    uint16_t getNextPacketId();
+    void readAll();
+    void finishStormRound();
+
+public:
+    BenchConnection(const BenchOptions &options, BenchShared &shared, BenchRole role, int index, std::vector<uint64_t> &latencies);
+    BenchConnection(const BenchConnection &other) = delete;
+    ~BenchConnection();
+
+    void start(int epollfd);
+    void handleEvents(uint32_t events);
+    bool work();
+    void queuePacket(const MqttPacket &packet);
+    void flush();
+    void disconnect();
+    void close();
+
+    bool isStarted() const { return state != BenchConnectionState::NotStarted; }
+    bool isClosed() const { return state == BenchConnectionState::Closed; }
+    BenchPhase getStartPhase() const;
+};
+
+#endif // BENCHCONNECTION_H
@@ -0,0 +1,490 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <getopt.h>
+#include <netdb.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <openssl/ssl.h>
+
+#include "../logger.h"
+#include "../utils.h"
+#include "benchworker.h"
+
+static void doHelp(const char *arg)
+{
+    puts("flashmq-bench - load generator for MQTT servers");
+    puts("");
+    printf("Usage: %s [options]\n", arg);
+    puts("");
+    puts(" -h, --help                           Print help");
+    puts(" -H, --host <host>                    Server to connect to. Default 127.0.0.1.");
+    puts(" -p, --port <port>                    Default 1883.");
+    puts(" -s, --scenario <name>                pubsub, fan-in, fan-out, retained-flood or reconnect-storm. Default pubsub.");
+    puts("     --protocol <version>             3.1, 3.1.1 or 5. Default 3.1.1.");
+    puts("     --tls                            Connect with TLS. The server certificate is not verified.");
+    puts("     --websocket                      Use MQTT over websockets.");
+    puts("     --publishers <n>                 Publishing connections. Default 10, or 100 for fan-in.");
+    puts("     --subscribers <n>                Subscribing connections. Default 10, or 100 for fan-out.");
+    puts("     --connections <n>                Connections for reconnect-storm. Default 1000.");
+    puts("     --rounds <n>                     Connects per connection for reconnect-storm. Default 5.");
+    puts("     --messages <n>                   Messages per publisher. Default 10000.");
+    puts("     --payload-size <bytes>           At least 16, for the timestamp. Default 64.");
+    puts("     --qos <0-2>                      Default 0.");
+    puts("     --inflight <n>                   Unacknowledged QoS messages per publisher. Default 64.");
+    puts("     --rate <n>                       Messages per second per publisher. Default 0, unlimited.");
+    puts("     --threads <n>                    Worker threads. Default the number of CPUs.");
+    puts("     --timeout <s>                    Give up when nothing happens for this long. Default 30.");
+    puts("");
+    puts("The result is printed as JSON on stdout. Latencies are from publish to receive, from subscribe to receive");
+    puts("for retained-flood, and from connect to CONNACK for reconnect-storm.");
+}
+
+static BenchScenario parseScenario(const std::string &s)
+{
+    if (s == "pubsub")
+        return BenchScenario::PubSub;
+    if (s == "fan-in")
+        return BenchScenario::FanIn;
+    if (s == "fan-out")
+        return BenchScenario::FanOut;
+    if (s == "retained-flood")
+        return BenchScenario::RetainedFlood;
+    if (s == "reconnect-storm")
+        return BenchScenario::ReconnectStorm;
+    throw std::runtime_error(formatString("Unknown scenario '%s'.", s.c_str()));
+}
+
+static std::string scenarioToString(BenchScenario scenario)
+{
+    switch (scenario)
+    {
+    case BenchScenario::PubSub:
+        return "pubsub";
+    case BenchScenario::FanIn:
+        return "fan-in";
+    case BenchScenario::FanOut:
+        return "fan-out";
+    case BenchScenario::RetainedFlood:
+        return "retained-flood";
+    default:
+        return "reconnect-storm";
+    }
+}
+
+static ProtocolVersion parseProtocolVersion(const std::string &s)
+{
+    if (s == "3.1")
+        return ProtocolVersion::Mqtt31;
+    if (s == "3.1.1")
+        return ProtocolVersion::Mqtt311;
+    if (s == "5")
+        return ProtocolVersion::Mqtt5;
+    throw std::runtime_error(formatString("Unknown protocol version '%s'.", s.c_str()));
+}
+
+static std::string protocolVersionToString(ProtocolVersion p)
+{
+    switch (p)
+    {
+    case ProtocolVersion::Mqtt31:
+        return "3.1";
+    case ProtocolVersion::Mqtt5:
+        return "5";
+    default:
+        return "3.1.1";
+    }
+}
+
+static int parsePositive(const char *s, const char *name, int min)
+{
+    const int value = std::stoi(s);
+    if (value < min)
+        throw std::runtime_error(formatString("Value for '%s' must be at least %d.", name, min));
+    return value;
+}
+
+static void resolveAddress(BenchOptions &options)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result = nullptr;
+    const std::string port = std::to_string(options.port);
+    const int rc = getaddrinfo(options.host.c_str(), port.c_str(), &hints, &result);
+
+    if (rc != 0 || result == nullptr)
+        throw std::runtime_error(formatString("Can't resolve '%s': %s", options.host.c_str(), gai_strerror(rc)));
+
+    memcpy(&options.address, result->ai_addr, result->ai_addrlen);
+    options.addressLen = result->ai_addrlen;
+    freeaddrinfo(result);
+}
+
+static void raiseFileLimit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static double nanoToMicro(uint64_t ns)
+{
+    return static_cast<double>(ns) / 1000.0;
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+
+    size_t i = static_cast<size_t>(p * sorted.size());
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+/**
+ * @brief The PhaseWaiter class waits for a phase to complete, and gives up when the counters stop changing for too long.
+ */
+class PhaseWaiter
+{
+    const BenchShared &shared;
+    uint64_t lastSum = 0;
+
+public:
+    std::chrono::time_point<std::chrono::steady_clock> lastProgressAt = std::chrono::steady_clock::now();
+
+    PhaseWaiter(const BenchShared &shared) :
+        shared(shared)
+    {
+
+    }
+
+    template<typename F>
+    bool wait(F done, std::chrono::milliseconds stallLimit)
+    {
+        lastProgressAt = std::chrono::steady_clock::now();
+
+        while (!done())
+        {
+            const uint64_t sum = shared.ready + shared.published + shared.acked + shared.received + shared.connacks + shared.publishersDone
+                    + shared.publishersCleanedUp + shared.stormDone + shared.connectErrors + shared.protocolErrors;
+            const auto now = std::chrono::steady_clock::now();
+
+            if (sum != lastSum)
+            {
+                lastSum = sum;
+                lastProgressAt = now;
+            }
+            else if (now - lastProgressAt > stallLimit)
+            {
+                return false;
+            }
+
+            usleep(1000);
+        }
+
+        lastProgressAt = std::chrono::steady_clock::now();
+        return true;
+    }
+};
+
+static void setPhase(BenchShared &shared, BenchPhase phase)
+{
+    shared.phaseStartedAt = std::chrono::steady_clock::now();
+    shared.phase = phase;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] =
+    {
+        {"help", no_argument, nullptr, 'h'},
+        {"host", required_argument, nullptr, 'H'},
+        {"port", required_argument, nullptr, 'p'},
+        {"scenario", required_argument, nullptr, 's'},
+        {"protocol", required_argument, nullptr, 1},
+        {"tls", no_argument, nullptr, 2},
+        {"websocket", no_argument, nullptr, 3},
+        {"publishers", required_argument, nullptr, 4},
+        {"subscribers", required_argument, nullptr, 5},
+        {"connections", required_argument, nullptr, 6},
+        {"rounds", required_argument, nullptr, 7},
+        {"messages", required_argument, nullptr, 8},
+        {"payload-size", required_argument, nullptr, 9},
+        {"qos", required_argument, nullptr, 10},
+        {"inflight", required_argument, nullptr, 11},
+        {"rate", required_argument, nullptr, 12},
+        {"threads", required_argument, nullptr, 13},
+        {"timeout", required_argument, nullptr, 14},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    BenchOptions options;
+    int publishers = -1;
+    int subscribers = -1;
+
+    try
+    {
+        int option_index = 0;
+        int opt;
+        while((opt = getopt_long(argc, argv, "hH:p:s:", long_options, &option_index)) != -1)
+        {
+            switch(opt)
+            {
+            case 'H':
+                options.host = optarg;
+                break;
+            case 'p':
+                options.port = parsePositive(optarg, "port", 1);
+                break;
+            case 's':
+                options.scenario = parseScenario(optarg);
+                break;
+            case 1:
+                options.protocolVersion = parseProtocolVersion(optarg);
+                break;
+            case 2:
+                options.tls = true;
+                break;
+            case 3:
+                options.websocket = true;
+                break;
+            case 4:
+                publishers = parsePositive(optarg, "publishers", 1);
+                break;
+            case 5:
+                subscribers = parsePositive(optarg, "subscribers", 1);
+                break;
+            case 6:
+                options.connections = parsePositive(optarg, "connections", 1);
+                break;
+            case 7:
+                options.rounds = parsePositive(optarg, "rounds", 1);
+                break;
+            case 8:
+                options.messages = parsePositive(optarg, "messages", 1);
+                break;
+            case 9:
+                options.payloadSize = parsePositive(optarg, "payload-size", 16);
+                break;
+            case 10:
+                options.qos = parsePositive(optarg, "qos", 0);
+                if (options.qos > 2)
+                    throw std::runtime_error("QoS must be 0, 1 or 2.");
+                break;
+            case 11:
+                options.inflight = std::min(parsePositive(optarg, "inflight", 1), 65535);
+                break;
+            case 12:
+                options.rate = parsePositive(optarg, "rate", 0);
+                break;
+            case 13:
+                options.threads = parsePositive(optarg, "threads", 1);
+                break;
+            case 14:
+                options.timeout = parsePositive(optarg, "timeout", 1);
+                break;
+            case 'h':
+                doHelp(argv[0]);
+                return 0;
+            default:
+                doHelp(argv[0]);
+                return 16;
+            }
+        }
+
+        options.publishers = publishers > 0 ? publishers : (options.scenario == BenchScenario::FanIn ? 100 : options.scenario == BenchScenario::FanOut ? 1 : 10);
+        options.subscribers = subscribers > 0 ? subscribers : (options.scenario == BenchScenario::FanOut ? 100 : options.scenario == BenchScenario::FanIn ? 1 : 10);
+        options.runId = getSecureRandomString(8);
+
+        resolveAddress(options);
+    }
+    catch (std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    // Our own errors are counted; the logger of the shared code would only add noise.
+    Logger::getInstance()->setFlags(false, false, true);
+    signal(SIGPIPE, SIG_IGN);
+    raiseFileLimit();
+
+    if (options.tls)
+    {
+        options.sslCtx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(options.sslCtx, SSL_VERIFY_NONE, nullptr);
+        SSL_CTX_set_mode(options.sslCtx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+
+    const bool storm = options.scenario == BenchScenario::ReconnectStorm;
+    const bool retained = options.scenario == BenchScenario::RetainedFlood;
+    const int totalConnections = storm ? options.connections : options.publishers + options.subscribers;
+
+    int threadCount = options.threads > 0 ? options.threads : std::max<int>(1, std::thread::hardware_concurrency());
+    threadCount = std::min(threadCount, totalConnections);
+
+    BenchShared shared;
+    std::vector<std::unique_ptr<BenchWorker>> workers;
+    for (int i = 0; i < threadCount; i++)
+        workers.emplace_back(new BenchWorker(options, shared));
+
+    int next = 0;
+    if (storm)
+    {
+        for (int i = 0; i < options.connections; i++)
+            workers[next++ % threadCount]->addConnection(BenchRole::Storm, i);
+    }
+    else
+    {
+        // Interleaved, so each worker gets a share of both roles.
+        for (int i = 0; i < std::max(options.publishers, options.subscribers); i++)
+        {
+            if (i < options.subscribers)
+                workers[next++ % threadCount]->addConnection(BenchRole::Subscriber, i);
+            if (i < options.publishers)
+                workers[next++ % threadCount]->addConnection(BenchRole::Publisher, i);
+        }
+    }
+
+    PhaseWaiter waiter(shared);
+    const std::chrono::milliseconds stallLimit(options.timeout * 1000);
+    const std::chrono::milliseconds drainLimit(std::min(options.timeout * 1000, 2000));
+    bool completed = true;
+
+    std::chrono::time_point<std::chrono::steady_clock> measureStart;
+    std::chrono::time_point<std::chrono::steady_clock> measureEnd;
+    std::chrono::time_point<std::chrono::steady_clock> publishStart;
+    std::chrono::time_point<std::chrono::steady_clock> publishEnd;
+
+    if (!storm)
+    {
+        const uint64_t connectFirst = retained ? options.publishers : totalConnections;
+        setPhase(shared, BenchPhase::Connect);
+        for (std::unique_ptr<BenchWorker> &w : workers)
+            w->start();
+
+        // Results with missing connections mean little, so don't start publishing then.
+        completed = waiter.wait([&]() { return shared.ready + shared.connectErrors >= connectFirst; }, stallLimit) && shared.connectErrors == 0;
+    }
+
+    if (storm)
+    {
+        setPhase(shared, BenchPhase::Publish);
+        measureStart = publishStart = shared.phaseStartedAt;
+        for (std::unique_ptr<BenchWorker> &w : workers)
+            w->start();
+
+        completed = waiter.wait([&]() { return shared.stormDone >= static_cast<uint64_t>(options.connections); }, stallLimit);
+        measureEnd = publishEnd = waiter.lastProgressAt;
+    }
+    else if (completed)
+    {
+        setPhase(shared, BenchPhase::Publish);
+        measureStart = publishStart = shared.phaseStartedAt;
+        completed = waiter.wait([&]() { return shared.publishersDone >= static_cast<uint64_t>(options.publishers); }, stallLimit);
+        publishEnd = waiter.lastProgressAt;
+
+        if (retained)
+        {
+            const uint64_t readyTarget = options.publishers + options.subscribers;
+            setPhase(shared, BenchPhase::RetainedSubscribe);
+            measureStart = shared.phaseStartedAt;
+            completed = waiter.wait([&]() { return shared.ready + shared.connectErrors >= readyTarget; }, stallLimit) && completed;
+            waiter.wait([&]() { return shared.received >= shared.published * options.subscribers; }, drainLimit);
+            measureEnd = waiter.lastProgressAt;
+
+            setPhase(shared, BenchPhase::RetainedCleanup);
+            waiter.wait([&]() { return shared.publishersCleanedUp >= static_cast<uint64_t>(options.publishers); }, stallLimit);
+        }
+        else
+        {
+            // The server may drop messages for slow subscribers, so don't wait for them with the full timeout.
+            waiter.wait([&]() { return shared.received >= shared.published * options.subscribers; }, drainLimit);
+            measureEnd = waiter.lastProgressAt;
+        }
+    }
+    else
+    {
+        measureStart = measureEnd = publishStart = publishEnd = waiter.lastProgressAt;
+    }
+
+    setPhase(shared, BenchPhase::Done);
+
+    std::vector<uint64_t> latencies;
+    for (std::unique_ptr<BenchWorker> &w : workers)
+    {
+        w->join();
+        latencies.insert(latencies.end(), w->latencies.begin(), w->latencies.end());
+    }
+    workers.clear();
+    std::sort(latencies.begin(), latencies.end());
+
+    const double duration = std::max(1e-9, std::chrono::duration<double>(measureEnd - measureStart).count());
+    const double publishDuration = std::max(1e-9, std::chrono::duration<double>(publishEnd - publishStart).count());
+    const uint64_t published = shared.published;
+    const uint64_t received = storm ? shared.connacks.load() : shared.received.load();
+    const uint64_t expected = storm ? static_cast<uint64_t>(options.connections) * options.rounds : published * options.subscribers;
+
+    double mean = 0;
+    for (uint64_t l : latencies)
+        mean += l;
+    if (!latencies.empty())
+        mean /= latencies.size();
+
+    printf("{\n");
+    printf("  \"config\": {\"scenario\": \"%s\", \"host\": \"%s\", \"port\": %d, \"protocol\": \"%s\", \"tls\": %s, \"websocket\": %s, "
+           "\"publishers\": %d, \"subscribers\": %d, \"connections\": %d, \"rounds\": %d, \"messages\": %d, \"payload_size\": %d, "
+           "\"qos\": %d, \"inflight\": %d, \"rate\": %d, \"threads\": %d},\n",
+           scenarioToString(options.scenario).c_str(), options.host.c_str(), options.port, protocolVersionToString(options.protocolVersion).c_str(),
+           options.tls ? "true" : "false", options.websocket ? "true" : "false", storm ? 0 : options.publishers, storm ? 0 : options.subscribers,
+           storm ? options.connections : totalConnections, storm ? options.rounds : 1, options.messages, options.payloadSize,
+           options.qos, options.inflight, options.rate, threadCount);
+    printf("  \"completed\": %s,\n", completed ? "true" : "false");
+    printf("  \"duration_s\": %.6f,\n", duration);
+    printf("  \"published\": %lu,\n", published);
+    printf("  \"expected\": %lu,\n", expected);
+    printf("  \"received\": %lu,\n", received);
+    printf("  \"lost\": %lu,\n", expected > received ? expected - received : 0);
+    printf("  \"publish_rate\": %.1f,\n", published / publishDuration);
+    printf("  \"receive_rate\": %.1f,\n", received / duration);
+    printf("  \"receive_bytes_per_s\": %.1f,\n", shared.receivedBytes / duration);
+    printf("  \"latency_us\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"mean\": %.1f},\n",
+           nanoToMicro(latencies.empty() ? 0 : latencies.front()), nanoToMicro(percentile(latencies, 0.5)), nanoToMicro(percentile(latencies, 0.9)),
+           nanoToMicro(percentile(latencies, 0.99)), nanoToMicro(percentile(latencies, 0.999)),
+           nanoToMicro(latencies.empty() ? 0 : latencies.back()), mean / 1000.0);
+    printf("  \"connect_errors\": %lu,\n", shared.connectErrors.load());
+    printf("  \"protocol_errors\": %lu\n", shared.protocolErrors.load());
+    printf("}\n");
+
+    if (options.sslCtx)
+        SSL_CTX_free(options.sslCtx);
+
+    return completed ? 0 : 2;
+}
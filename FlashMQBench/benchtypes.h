@@ -0,0 +1,103 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BENCHTYPES_H
+#define BENCHTYPES_H
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+
+#include "../types.h"
+
+enum class BenchScenario
+{
+    PubSub,
+    FanIn,
+    FanOut,
+    RetainedFlood,
+    ReconnectStorm
+};
+
+/**
+ * @brief The BenchPhase enum is what the whole run is doing. The main thread advances it; the workers act on it.
+ */
+enum class BenchPhase
+{
+    Connect,
+    Publish,
+    RetainedSubscribe,
+    RetainedCleanup,
+    Done
+};
+
+enum class BenchRole
+{
+    Publisher,
+    Subscriber,
+    Storm
+};
+
+struct BenchOptions
+{
+    std::string host = "127.0.0.1";
+    int port = 1883;
+    BenchScenario scenario = BenchScenario::PubSub;
+    ProtocolVersion protocolVersion = ProtocolVersion::Mqtt311;
+    bool tls = false;
+    bool websocket = false;
+    int publishers = 10;
+    int subscribers = 10;
+    int connections = 1000;
+    int rounds = 5;
+    int messages = 10000;
+    int payloadSize = 64;
+    char qos = 0;
+    int inflight = 64;
+    int rate = 0;
+    int threads = 0;
+    int timeout = 30;
+    std::string runId;
+    SSL_CTX *sslCtx = nullptr;
+    struct sockaddr_storage address;
+    socklen_t addressLen = 0;
+};
+
+/**
+ * @brief The BenchShared struct holds the counters all workers update, and the phase they all follow.
+ */
+struct BenchShared
+{
+    std::atomic<BenchPhase> phase{BenchPhase::Connect};
+    std::chrono::time_point<std::chrono::steady_clock> phaseStartedAt = std::chrono::steady_clock::now();
+
+    std::atomic<uint64_t> ready{0};
+    std::atomic<uint64_t> published{0};
+    std::atomic<uint64_t> acked{0};
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> receivedBytes{0};
+    std::atomic<uint64_t> connacks{0};
+    std::atomic<uint64_t> publishersDone{0};
+    std::atomic<uint64_t> publishersCleanedUp{0};
+    std::atomic<uint64_t> stormDone{0};
+    std::atomic<uint64_t> connectErrors{0};
+    std::atomic<uint64_t> protocolErrors{0};
+};
+
+#endif // BENCHTYPES_H
@@ -0,0 +1,106 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "benchworker.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cstring>
+
+#include "../utils.h"
+
+#define BENCH_MAX_EVENTS 1024
+
+BenchWorker::BenchWorker(const BenchOptions &options, BenchShared &shared) :
+    options(options),
+    shared(shared)
+{
+    epollfd = check<std::runtime_error>(epoll_create(999));
+}
+
+BenchWorker::~BenchWorker()
+{
+    connections.clear();
+
+    if (epollfd >= 0)
+        close(epollfd);
+}
+
+void BenchWorker::addConnection(BenchRole role, int index)
+{
+    connections.emplace_back(new BenchConnection(options, shared, role, index, latencies));
+}
+
+void BenchWorker::start()
+{
+    thread = std::thread(&BenchWorker::loop, this);
+}
+
+void BenchWorker::join()
+{
+    if (thread.joinable())
+        thread.join();
+}
+
+void BenchWorker::loop()
+{
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    memset(&events, 0, sizeof (struct epoll_event)*BENCH_MAX_EVENTS);
+
+    while (true)
+    {
+        const BenchPhase phase = shared.phase;
+
+        if (phase == BenchPhase::Done)
+        {
+            for (std::unique_ptr<BenchConnection> &c : connections)
+                c->disconnect();
+            return;
+        }
+
+        bool busy = false;
+
+        for (std::unique_ptr<BenchConnection> &c : connections)
+        {
+            if (!c->isStarted())
+            {
+                if (phase >= c->getStartPhase())
+                    c->start(epollfd);
+                continue;
+            }
+
+            if (c->work())
+                busy = true;
+        }
+
+        // Publishers with more to send shouldn't wait for socket events, but still need to see the acks coming in.
+        const int fdcount = epoll_wait(epollfd, events, BENCH_MAX_EVENTS, busy ? 0 : 1);
+
+        if (fdcount < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(formatString("epoll_wait failed: %s", strerror(errno)));
+        }
+
+        for (int i = 0; i < fdcount; i++)
+        {
+            BenchConnection *c = static_cast<BenchConnection*>(events[i].data.ptr);
+            c->handleEvents(events[i].events);
+        }
+    }
+}
@@ -0,0 +1,52 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BENCHWORKER_H
+#define BENCHWORKER_H
+
+#include <thread>
+#include <vector>
+#include <memory>
+
+#include "benchconnection.h"
+
+/**
+ * @brief The BenchWorker class runs a share of the connections in its own thread and epoll instance.
+ */
+class BenchWorker
+{
+    const BenchOptions &options;
+    BenchShared &shared;
+    int epollfd = -1;
+    std::thread thread;
+    std::vector<std::unique_ptr<BenchConnection>> connections;
+
+    void loop();
+
+public:
+    std::vector<uint64_t> latencies;
+
+    BenchWorker(const BenchOptions &options, BenchShared &shared);
+    BenchWorker(const BenchWorker &other) = delete;
+    ~BenchWorker();
+
+    void addConnection(BenchRole role, int index);
+    void start();
+    void join();
+};
+
+#endif // BENCHWORKER_H
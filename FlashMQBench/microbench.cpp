@@ -0,0 +1,662 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "microbench.h"
+
+#include <random>
+#include <algorithm>
+#include <cassert>
+
+#include "../subscriptionstore.h"
+#include "../client.h"
+#include "../mqttpacket.h"
+#include "../cirbuf.h"
+#include "../acltree.h"
+#include "../publishcopyfactory.h"
+#include "../threadlocalutils.h"
+#include "../threadglobals.h"
+#include "../utils.h"
+
+MicroBenchState::MicroBenchState(size_t iterations) :
+    iterations(iterations)
+{
+
+}
+
+void MicroBenchState::resumeTiming()
+{
+    assert(!running);
+    running = true;
+    allocationsAtResume = microBenchAllocationCount();
+    resumedAt = std::chrono::steady_clock::now();
+}
+
+void MicroBenchState::pauseTiming()
+{
+    assert(running);
+    const auto now = std::chrono::steady_clock::now();
+    allocations += microBenchAllocationCount() - allocationsAtResume;
+    elapsed += now - resumedAt;
+    running = false;
+}
+
+std::chrono::nanoseconds MicroBenchState::getElapsed() const
+{
+    return elapsed;
+}
+
+uint64_t MicroBenchState::getAllocations() const
+{
+    return allocations;
+}
+
+std::string MicroBenchCase::fullName() const
+{
+    std::string result = name;
+
+    for (const std::pair<std::string, std::string> &p : params)
+    {
+        result.append("/");
+        result.append(p.first);
+        result.append("=");
+        result.append(p.second);
+    }
+
+    return result;
+}
+
+/**
+ * @brief The topics a tree of size n is made of. Publishes go to these too.
+ */
+static std::string sensorTopic(int i)
+{
+    return formatString("fleet/%d/%d/node%d/temperature", i % 50, (i / 50) % 20, i);
+}
+
+/**
+ * @brief sensorFilter gives the subscription for topic i, or a wildcard filter that matches it and those of its neighbours.
+ */
+static std::string sensorFilter(int i, bool wildcard)
+{
+    if (!wildcard)
+        return sensorTopic(i);
+
+    if (i % 2 == 0)
+        return formatString("fleet/%d/+/+/temperature", i % 50);
+
+    return formatString("fleet/%d/%d/#", i % 50, (i / 50) % 20);
+}
+
+static std::vector<bool> pickWildcards(int n, double ratio)
+{
+    std::mt19937 gen(n);
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    std::vector<bool> result(n);
+
+    for (int i = 0; i < n; i++)
+        result[i] = dist(gen) < ratio;
+
+    return result;
+}
+
+static std::string protocolVersionToString(ProtocolVersion p)
+{
+    switch (p)
+    {
+    case ProtocolVersion::Mqtt31:
+        return "3.1";
+    case ProtocolVersion::Mqtt5:
+        return "5";
+    default:
+        return "3.1.1";
+    }
+}
+
+static std::shared_ptr<Client> makeDummyClient(const Settings &settings, ProtocolVersion protocolVersion, const std::string &clientid)
+{
+    // Without thread data, it's a dummy client; a TESTING build doesn't touch epoll or the socket for fd 0.
+    std::shared_ptr<Client> client = std::make_shared<Client>(0, nullptr, nullptr, false, nullptr, &settings, false);
+    client->setClientProperties(protocolVersion, clientid, "bench", true, 60, settings.maxPacketSize, 0);
+    client->setAuthenticated(true);
+    return client;
+}
+
+/**
+ * @brief serializePublish gives the bytes of a publish like a client would send them.
+ */
+static std::string serializePublish(ProtocolVersion protocolVersion, Publish publish, uint16_t packetId)
+{
+    MqttPacket packet(protocolVersion, publish);
+    if (publish.qos > 0)
+        packet.setPacketId(packetId);
+
+    CirBuf buf(1024);
+    buf.ensureFreeSpace(packet.getSizeIncludingNonPresentHeader());
+    packet.readIntoBuf(buf);
+
+    std::string result(buf.usedBytes(), 0);
+    buf.read(&result[0], result.size());
+    return result;
+}
+
+/**
+ * @brief parsePublishes makes packets like the ones the server gets from clients, with subtopics and all.
+ */
+static std::vector<MqttPacket> parsePublishes(const std::vector<std::string> &serialized, std::shared_ptr<Client> &sender)
+{
+    std::vector<MqttPacket> result;
+
+    for (const std::string &bytes : serialized)
+    {
+        CirBuf buf(1024);
+        buf.ensureFreeSpace(bytes.size());
+        buf.write(bytes.data(), bytes.size());
+        MqttPacket::bufferToMqttPackets(buf, result, sender);
+    }
+
+    for (MqttPacket &packet : result)
+        packet.parsePublishData();
+
+    return result;
+}
+
+MicroBench::MicroBench() :
+    settings(std::make_shared<Settings>())
+{
+    // Like in the tests, the functions we call normally run in worker threads, so they look for that thread's globals.
+    auth = std::make_unique<Authentication>(*settings);
+    threadData = std::make_shared<ThreadData>(0, settings);
+    ThreadGlobals::assignSettings(settings.get());
+    ThreadGlobals::assign(auth.get());
+    ThreadGlobals::assignThreadData(threadData.get());
+
+    addSubscriptionStoreCases();
+    addCirBufCases();
+    addPacketParsingCases();
+    addSimdUtilsCases();
+    addAclTreeCases();
+    addPublishCopyFactoryCases();
+}
+
+/**
+ * @brief MicroBench::discardPendingWrites empties the write buffer of a dummy client, to prevent it becoming a slow consumer.
+ */
+void MicroBench::discardPendingWrites(Client &client)
+{
+    std::lock_guard<std::mutex> locker(client.writeBufMutex);
+    client.writebuf.reset();
+    client.sharedPayloadWrites.clear();
+    client.sharedPayloadBytes = 0;
+    client.writebufBytesTaken = 0;
+}
+
+void MicroBench::addSubscriptionStoreCases()
+{
+    for (int treeSize : {1000, 100000})
+    {
+        for (double wildcardRatio : {0.0, 0.1})
+        {
+            MicroBenchCase c;
+            c.name = "subscription_store.get_deepest_node";
+            c.params = {{"tree_size", std::to_string(treeSize)}, {"wildcard_ratio", formatString("%.2f", wildcardRatio)}};
+            c.setup = [treeSize, wildcardRatio]()
+            {
+                std::shared_ptr<SubscriptionStore> store = std::make_shared<SubscriptionStore>();
+                std::shared_ptr<std::vector<std::pair<std::string, std::vector<std::string>>>> filters =
+                        std::make_shared<std::vector<std::pair<std::string, std::vector<std::string>>>>();
+                const std::vector<bool> wildcards = pickWildcards(treeSize, wildcardRatio);
+
+                for (int i = 0; i < treeSize; i++)
+                {
+                    const std::string filter = sensorFilter(i, wildcards[i]);
+                    std::vector<std::string> subtopics;
+                    splitTopic(filter, subtopics);
+                    store->getDeepestNode(filter, subtopics);
+                    filters->emplace_back(filter, std::move(subtopics));
+                }
+
+                // Visit them in a different order than inserted, to not make it easy on the caches.
+                std::shuffle(filters->begin(), filters->end(), std::mt19937(treeSize));
+
+                return [store, filters](MicroBenchState &state)
+                {
+                    size_t next = 0;
+                    for (size_t i = 0; i < state.iterations; i++)
+                    {
+                        const std::pair<std::string, std::vector<std::string>> &f = (*filters)[next];
+                        store->getDeepestNode(f.first, f.second);
+
+                        if (++next >= filters->size())
+                            next = 0;
+                    }
+                };
+            };
+            cases.push_back(std::move(c));
+        }
+    }
+
+    struct QueueParams
+    {
+        int treeSize;
+        double wildcardRatio;
+        std::string protocols;
+        int payloadSize;
+    };
+
+    const std::vector<QueueParams> queueParams = {
+        {1000, 0.0, "mixed", 64},
+        {1000, 0.1, "mixed", 64},
+        {10000, 0.0, "mixed", 64},
+        {10000, 0.1, "mixed", 64},
+        {10000, 0.1, "3.1.1", 64},
+        {10000, 0.1, "5", 64},
+        {10000, 0.1, "mixed", 4096},
+    };
+
+    for (const QueueParams &p : queueParams)
+    {
+        MicroBenchCase c;
+        c.name = "subscription_store.queue_packet_at_subscribers";
+        c.params = {{"tree_size", std::to_string(p.treeSize)}, {"wildcard_ratio", formatString("%.2f", p.wildcardRatio)},
+                    {"protocols", p.protocols}, {"payload_size", std::to_string(p.payloadSize)}};
+
+        const std::shared_ptr<Settings> settings = this->settings;
+        c.setup = [p, settings]()
+        {
+            const int subscriberCount = 100;
+            const size_t packetCount = 1024;
+
+            std::shared_ptr<SubscriptionStore> store = std::make_shared<SubscriptionStore>();
+            std::shared_ptr<std::vector<std::shared_ptr<Client>>> subscribers = std::make_shared<std::vector<std::shared_ptr<Client>>>();
+
+            for (int i = 0; i < subscriberCount; i++)
+            {
+                ProtocolVersion pv = ProtocolVersion::Mqtt311;
+                if (p.protocols == "5" || (p.protocols == "mixed" && i % 2 == 1))
+                    pv = ProtocolVersion::Mqtt5;
+
+                std::shared_ptr<Client> client = makeDummyClient(*settings, pv, formatString("subscriber%d", i));
+                store->registerClientAndKickExistingOne(client, true, 65535, 0);
+                subscribers->push_back(client);
+            }
+
+            const std::vector<bool> wildcards = pickWildcards(p.treeSize, p.wildcardRatio);
+            for (int i = 0; i < p.treeSize; i++)
+            {
+                const std::string filter = sensorFilter(i, wildcards[i]);
+                std::vector<std::string> subtopics;
+                splitTopic(filter, subtopics);
+                store->addSubscription(subscribers->at(i % subscriberCount), filter, subtopics, 0);
+            }
+
+            // Made like the server makes packets for its own publishes, so they have their topic split like incoming ones do after handling.
+            const std::string payload(p.payloadSize, 'x');
+            std::shared_ptr<std::vector<MqttPacket>> packets = std::make_shared<std::vector<MqttPacket>>();
+            packets->reserve(packetCount);
+            for (size_t i = 0; i < packetCount; i++)
+            {
+                // Spread over the tree, with a stride that doesn't go through the groups in order.
+                const int topicIndex = static_cast<int>((i * 7919) % p.treeSize);
+                Publish pub(sensorTopic(topicIndex), payload, 0);
+                packets->emplace_back(ProtocolVersion::Mqtt311, pub);
+            }
+
+            return [store, subscribers, packets](MicroBenchState &state)
+            {
+                size_t next = 0;
+                for (size_t i = 0; i < state.iterations; i++)
+                {
+                    PublishCopyFactory factory(&(*packets)[next]);
+                    store->queuePacketAtSubscribers(factory);
+
+                    if (++next >= packets->size())
+                        next = 0;
+
+                    // A real client would write it out in the mean time.
+                    if (i % 64 == 63)
+                    {
+                        state.pauseTiming();
+                        for (std::shared_ptr<Client> &s : *subscribers)
+                            discardPendingWrites(*s);
+                        state.resumeTiming();
+                    }
+                }
+            };
+        };
+        cases.push_back(std::move(c));
+    }
+}
+
+void MicroBench::addCirBufCases()
+{
+    for (int chunkSize : {16, 256, 4096})
+    {
+        MicroBenchCase c;
+        c.name = "cirbuf.write_read";
+        c.params = {{"chunk_size", std::to_string(chunkSize)}};
+        c.setup = [chunkSize]()
+        {
+            std::shared_ptr<CirBuf> buf = std::make_shared<CirBuf>(16384);
+            std::shared_ptr<std::vector<char>> chunk = std::make_shared<std::vector<char>>(chunkSize, 'x');
+
+            // Start somewhere that makes the chunks wrap around the end.
+            buf->advanceHead(100);
+            buf->advanceTail(100);
+
+            return [buf, chunk](MicroBenchState &state)
+            {
+                for (size_t i = 0; i < state.iterations; i++)
+                {
+                    buf->write(chunk->data(), chunk->size());
+                    buf->read(chunk->data(), chunk->size());
+                }
+            };
+        };
+        cases.push_back(std::move(c));
+    }
+
+    for (int growTo : {4096, 1048576})
+    {
+        MicroBenchCase c;
+        c.name = "cirbuf.grow";
+        c.params = {{"grow_to", std::to_string(growTo)}};
+        c.setup = [growTo]()
+        {
+            std::shared_ptr<std::vector<char>> chunk = std::make_shared<std::vector<char>>(100, 'x');
+
+            return [growTo, chunk](MicroBenchState &state)
+            {
+                for (size_t i = 0; i < state.iterations; i++)
+                {
+                    // Growing with data in it, wrapped around, like a client's buffer that gets a big packet.
+                    CirBuf buf(1024);
+                    buf.advanceHead(1000);
+                    buf.advanceTail(1000);
+                    buf.write(chunk->data(), chunk->size());
+                    buf.ensureFreeSpace(growTo - 1);
+                }
+            };
+        };
+        cases.push_back(std::move(c));
+    }
+}
+
+void MicroBench::addPacketParsingCases()
+{
+    for (ProtocolVersion pv : {ProtocolVersion::Mqtt311, ProtocolVersion::Mqtt5})
+    {
+        for (int payloadSize : {16, 1024})
+        {
+            MicroBenchCase c;
+            c.name = "mqtt_packet.parse_publish";
+            c.params = {{"protocol", protocolVersionToString(pv)}, {"payload_size", std::to_string(payloadSize)}};
+
+            const std::shared_ptr<Settings> settings = this->settings;
+            c.setup = [pv, payloadSize, settings]()
+            {
+                const size_t batchSize = 64;
+
+                std::shared_ptr<Client> sender = makeDummyClient(*settings, pv, "publisher");
+                std::shared_ptr<std::string> batch = std::make_shared<std::string>();
+
+                for (size_t i = 0; i < batchSize; i++)
+                {
+                    Publish pub(sensorTopic(static_cast<int>(i)), std::string(payloadSize, 'x'), 1);
+                    batch->append(serializePublish(pv, pub, i + 1));
+                }
+
+                std::shared_ptr<CirBuf> buf = std::make_shared<CirBuf>(1024);
+                buf->ensureFreeSpace(batch->size());
+
+                return [sender, batch, buf, batchSize](MicroBenchState &state) mutable
+                {
+                    std::vector<MqttPacket> packets;
+                    packets.reserve(batchSize);
+
+                    size_t done = 0;
+                    while (done < state.iterations)
+                    {
+                        state.pauseTiming();
+                        packets.clear();
+                        buf->reset();
+                        buf->write(batch->data(), batch->size());
+                        const size_t n = std::min(batchSize, state.iterations - done);
+                        state.resumeTiming();
+
+                        MqttPacket::bufferToMqttPackets(*buf, packets, sender, n);
+                        for (MqttPacket &packet : packets)
+                            packet.parsePublishData();
+
+                        done += n;
+                    }
+                };
+            };
+            cases.push_back(std::move(c));
+        }
+    }
+}
+
+void MicroBench::addSimdUtilsCases()
+{
+#ifdef __SSE4_2__
+    for (int depth : {3, 10})
+    {
+        MicroBenchCase c;
+        c.name = "simd_utils.split_topic";
+        c.params = {{"depth", std::to_string(depth)}};
+        c.setup = [depth]()
+        {
+            std::shared_ptr<std::string> topic = std::make_shared<std::string>("fleet");
+            for (int i = 1; i < depth; i++)
+                topic->append(formatString("/level%d", i));
+
+            std::shared_ptr<SimdUtils> simd = std::make_shared<SimdUtils>();
+
+            return [topic, simd](MicroBenchState &state)
+            {
+                // Reused, like the callers do when they can.
+                std::vector<std::string> output;
+                for (size_t i = 0; i < state.iterations; i++)
+                    simd->splitTopic(*topic, output);
+            };
+        };
+        cases.push_back(std::move(c));
+    }
+
+    struct Utf8Params
+    {
+        std::string kind;
+        size_t length;
+    };
+
+    for (const Utf8Params &p : std::vector<Utf8Params>({{"ascii", 32}, {"ascii", 1024}, {"multibyte", 1024}}))
+    {
+        MicroBenchCase c;
+        c.name = "simd_utils.is_valid_utf8";
+        c.params = {{"content", p.kind}, {"length", std::to_string(p.length)}};
+        c.setup = [p]()
+        {
+            // Whole code points only, padded to the length.
+            const std::string unit = p.kind == "ascii" ? "sensor/" : "temp\xC2\xB0" "C\xE2\x82\xAC"; // Degree and euro signs.
+            std::shared_ptr<std::string> s = std::make_shared<std::string>();
+            while (s->length() + unit.length() <= p.length)
+                s->append(unit);
+            s->append(p.length - s->length(), 'x');
+
+            std::shared_ptr<SimdUtils> simd = std::make_shared<SimdUtils>();
+
+            return [s, simd](MicroBenchState &state)
+            {
+                for (size_t i = 0; i < state.iterations; i++)
+                {
+                    if (!simd->isValidUtf8(*s, true))
+                        throw std::runtime_error("Test string should be valid UTF-8.");
+                }
+            };
+        };
+        cases.push_back(std::move(c));
+    }
+#endif
+}
+
+void MicroBench::addAclTreeCases()
+{
+    for (int rules : {100, 10000})
+    {
+        for (double wildcardRatio : {0.0, 0.1})
+        {
+            MicroBenchCase c;
+            c.name = "acl_tree.find_permission";
+            c.params = {{"rules", std::to_string(rules)}, {"wildcard_ratio", formatString("%.2f", wildcardRatio)}};
+            c.setup = [rules, wildcardRatio]()
+            {
+                std::shared_ptr<AclTree> tree = std::make_shared<AclTree>();
+                const std::vector<bool> wildcards = pickWildcards(rules, wildcardRatio);
+
+                for (int i = 0; i < rules; i++)
+                    tree->addTopic(sensorFilter(i, wildcards[i]), AclGrant::ReadWrite, AclTopicType::Strings, "bench");
+
+                // A pattern rule is always looked at, so most ACL files have a few.
+                tree->addTopic("clients/%c/#", AclGrant::ReadWrite, AclTopicType::Patterns);
+
+                std::shared_ptr<std::vector<std::vector<std::string>>> topics = std::make_shared<std::vector<std::vector<std::string>>>();
+                for (int i = 0; i < 1024; i++)
+                {
+                    std::vector<std::string> subtopics;
+                    splitTopic(sensorTopic((i * 7919) % rules), subtopics);
+                    topics->push_back(std::move(subtopics));
+                }
+
+                return [tree, topics](MicroBenchState &state)
+                {
+                    const std::string username("bench");
+                    const std::string clientid("client1");
+
+                    size_t next = 0;
+                    for (size_t i = 0; i < state.iterations; i++)
+                    {
+                        tree->findPermission((*topics)[next], AclGrant::Write, username, clientid);
+
+                        if (++next >= topics->size())
+                            next = 0;
+                    }
+                };
+            };
+            cases.push_back(std::move(c));
+        }
+    }
+}
+
+void MicroBench::addPublishCopyFactoryCases()
+{
+    for (ProtocolVersion pv : {ProtocolVersion::Mqtt311, ProtocolVersion::Mqtt5})
+    {
+        for (const std::string targets : {"same", "mixed"})
+        {
+            for (int payloadSize : {64, 4096})
+            {
+                MicroBenchCase c;
+                c.name = "publish_copy_factory.get_optimum_packet";
+                c.params = {{"protocol", protocolVersionToString(pv)}, {"targets", targets}, {"payload_size", std::to_string(payloadSize)}};
+
+                const std::shared_ptr<Settings> settings = this->settings;
+                c.setup = [pv, targets, payloadSize, settings]()
+                {
+                    std::shared_ptr<Client> sender = makeDummyClient(*settings, pv, "publisher");
+                    Publish pub(sensorTopic(1), std::string(payloadSize, 'x'), 1);
+                    std::shared_ptr<std::vector<MqttPacket>> packets = std::make_shared<std::vector<MqttPacket>>(
+                                parsePublishes({serializePublish(pv, pub, 1)}, sender));
+
+                    // What a batch of subscribers asks of one incoming packet: the same as it came in, or a mix of versions and QoS levels.
+                    std::vector<std::pair<ProtocolVersion, char>> targetList = {{pv, 1}};
+                    if (targets == "mixed")
+                        targetList = {{ProtocolVersion::Mqtt311, 0}, {ProtocolVersion::Mqtt311, 1}, {ProtocolVersion::Mqtt5, 0}, {ProtocolVersion::Mqtt5, 1}};
+
+                    return [sender, packets, targetList](MicroBenchState &state)
+                    {
+                        MqttPacket &packet = packets->front();
+
+                        for (size_t i = 0; i < state.iterations; i++)
+                        {
+                            PublishCopyFactory factory(&packet);
+
+                            for (const std::pair<ProtocolVersion, char> &t : targetList)
+                                factory.getOptimumPacket(t.second, t.first, 0, false);
+                        }
+                    };
+                };
+                cases.push_back(std::move(c));
+            }
+        }
+    }
+}
+
+const std::vector<MicroBenchCase> &MicroBench::getCases() const
+{
+    return cases;
+}
+
+/**
+ * @brief MicroBench::run finds an iteration count that takes at least minTime, and reports the fastest of the repetitions with that count.
+ */
+MicroBenchResult MicroBench::run(const MicroBenchCase &benchCase, std::chrono::milliseconds minTime, int repetitions) const
+{
+    MicroBenchBody body = benchCase.setup();
+
+    auto runOnce = [&body](size_t iterations)
+    {
+        MicroBenchState state(iterations);
+        state.resumeTiming();
+        body(state);
+        state.pauseTiming();
+        return state;
+    };
+
+    size_t iterations = 1;
+    while (true)
+    {
+        const MicroBenchState state = runOnce(iterations);
+        const std::chrono::nanoseconds elapsed = state.getElapsed();
+
+        if (elapsed >= minTime)
+            break;
+
+        // Aim a bit over, so we don't end up just under it again.
+        const double perOp = std::max<double>(1.0, static_cast<double>(elapsed.count()) / iterations);
+        const size_t needed = static_cast<size_t>(std::chrono::nanoseconds(minTime).count() * 1.2 / perOp);
+        iterations = std::max(iterations + 1, std::min(needed, iterations * 100));
+    }
+
+    MicroBenchResult result;
+    result.benchCase = &benchCase;
+    result.iterations = iterations;
+    result.nsPerOp = -1;
+
+    for (int i = 0; i < repetitions; i++)
+    {
+        const MicroBenchState state = runOnce(iterations);
+        const double nsPerOp = static_cast<double>(state.getElapsed().count()) / iterations;
+
+        if (result.nsPerOp < 0 || nsPerOp < result.nsPerOp)
+        {
+            result.nsPerOp = nsPerOp;
+            result.allocationsPerOp = static_cast<double>(state.getAllocations()) / iterations;
+        }
+    }
+
+    return result;
+}
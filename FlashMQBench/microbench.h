@@ -0,0 +1,111 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <chrono>
+
+#include "../settings.h"
+#include "../authplugin.h"
+#include "../threaddata.h"
+
+/**
+ * @brief Number of calls to malloc, calloc and realloc so far, which includes those of operator new. Defined where they are replaced.
+ */
+uint64_t microBenchAllocationCount();
+
+/**
+ * @brief The MicroBenchState class is what a benchmark body gets. Only the running time and allocations between resumes and pauses count.
+ */
+class MicroBenchState
+{
+    std::chrono::time_point<std::chrono::steady_clock> resumedAt;
+    std::chrono::nanoseconds elapsed = std::chrono::nanoseconds(0);
+    uint64_t allocationsAtResume = 0;
+    uint64_t allocations = 0;
+    bool running = false;
+
+public:
+    const size_t iterations;
+
+    MicroBenchState(size_t iterations);
+
+    void resumeTiming();
+    void pauseTiming();
+
+    std::chrono::nanoseconds getElapsed() const;
+    uint64_t getAllocations() const;
+};
+
+typedef std::function<void(MicroBenchState &state)> MicroBenchBody;
+
+/**
+ * @brief The MicroBenchCase struct is one parameterized scenario. The setup runs once, untimed, and gives the body to time.
+ */
+struct MicroBenchCase
+{
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> params;
+    std::function<MicroBenchBody()> setup;
+
+    std::string fullName() const;
+};
+
+struct MicroBenchResult
+{
+    const MicroBenchCase *benchCase = nullptr;
+    size_t iterations = 0;
+    double nsPerOp = 0;
+    double allocationsPerOp = 0;
+};
+
+/**
+ * @brief The MicroBench class has the scenarios for the hot paths of the server, and the thread globals they need.
+ *
+ * It's a friend of some classes in testing builds, to reach functions that aren't public, or to reset state between rounds.
+ */
+class MicroBench
+{
+    std::shared_ptr<Settings> settings;
+    std::unique_ptr<Authentication> auth;
+    std::shared_ptr<ThreadData> threadData;
+
+    std::vector<MicroBenchCase> cases;
+
+    void addSubscriptionStoreCases();
+    void addCirBufCases();
+    void addPacketParsingCases();
+    void addSimdUtilsCases();
+    void addAclTreeCases();
+    void addPublishCopyFactoryCases();
+
+    static void discardPendingWrites(Client &client);
+
+public:
+    MicroBench();
+    MicroBench(const MicroBench &other) = delete;
+
+    const std::vector<MicroBenchCase> &getCases() const;
+    MicroBenchResult run(const MicroBenchCase &benchCase, std::chrono::milliseconds minTime, int repetitions) const;
+};
+
+#endif // MICROBENCH_H
@@ -0,0 +1,218 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <iostream>
+#include <atomic>
+#include <cstring>
+#include <getopt.h>
+
+#include "../logger.h"
+#include "../utils.h"
+#include "microbench.h"
+
+/*
+ * Allocations are counted by putting ourselves in front of glibc's malloc. This includes operator new, and the malloc and
+ * realloc calls of CirBuf.
+ */
+static std::atomic<uint64_t> allocationCount{0};
+
+extern "C"
+{
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+}
+
+uint64_t microBenchAllocationCount()
+{
+    return allocationCount.load(std::memory_order_relaxed);
+}
+
+static void doHelp(const char *arg)
+{
+    puts("flashmq-microbench - microbenchmarks of FlashMQ's data structures and hot functions");
+    puts("");
+    printf("Usage: %s [options]\n", arg);
+    puts("");
+    puts(" -h, --help                           Print help");
+    puts(" -l, --list                           List the benchmarks and exit.");
+    puts(" -f, --filter <text>                  Only run benchmarks whose name, with parameters, contains this.");
+    puts("     --min-time <ms>                  Time each measurement takes at least. Default 200.");
+    puts("     --repetitions <n>                Measurements per benchmark; the fastest counts. Default 3.");
+    puts("     --json                           Print the results as JSON, for tracking regressions.");
+    puts("");
+    puts("Allocations are calls to malloc, calloc and realloc, which includes operator new.");
+}
+
+static int parsePositive(const char *s, const char *name, int min)
+{
+    const int value = std::stoi(s);
+    if (value < min)
+        throw std::runtime_error(formatString("Value for '%s' must be at least %d.", name, min));
+    return value;
+}
+
+static void printJson(const std::vector<MicroBenchResult> &results, int minTime, int repetitions)
+{
+    printf("{\n");
+    printf("  \"version\": \"%s\",\n", FLASHMQ_VERSION);
+    printf("  \"min_time_ms\": %d,\n", minTime);
+    printf("  \"repetitions\": %d,\n", repetitions);
+    printf("  \"results\": [");
+
+    bool first = true;
+    for (const MicroBenchResult &r : results)
+    {
+        printf(first ? "\n" : ",\n");
+        first = false;
+
+        printf("    {\"name\": \"%s\", \"params\": {", r.benchCase->name.c_str());
+
+        bool firstParam = true;
+        for (const std::pair<std::string, std::string> &p : r.benchCase->params)
+        {
+            printf("%s\"%s\": \"%s\"", firstParam ? "" : ", ", p.first.c_str(), p.second.c_str());
+            firstParam = false;
+        }
+
+        printf("}, \"iterations\": %zu, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f}", r.iterations, r.nsPerOp, r.allocationsPerOp);
+    }
+
+    printf("\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] =
+    {
+        {"help", no_argument, nullptr, 'h'},
+        {"list", no_argument, nullptr, 'l'},
+        {"filter", required_argument, nullptr, 'f'},
+        {"min-time", required_argument, nullptr, 1},
+        {"repetitions", required_argument, nullptr, 2},
+        {"json", no_argument, nullptr, 3},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    bool list = false;
+    bool json = false;
+    std::string filter;
+    int minTime = 200;
+    int repetitions = 3;
+
+    try
+    {
+        int option_index = 0;
+        int opt;
+        while((opt = getopt_long(argc, argv, "hlf:", long_options, &option_index)) != -1)
+        {
+            switch(opt)
+            {
+            case 'l':
+                list = true;
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 1:
+                minTime = parsePositive(optarg, "min-time", 1);
+                break;
+            case 2:
+                repetitions = parsePositive(optarg, "repetitions", 1);
+                break;
+            case 3:
+                json = true;
+                break;
+            case 'h':
+                doHelp(argv[0]);
+                return 0;
+            default:
+                doHelp(argv[0]);
+                return 16;
+            }
+        }
+    }
+    catch (std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    Logger::getInstance()->setFlags(false, false, true);
+
+    try
+    {
+        MicroBench bench;
+        std::vector<MicroBenchResult> results;
+
+        for (const MicroBenchCase &c : bench.getCases())
+        {
+            const std::string fullName = c.fullName();
+
+            if (!filter.empty() && fullName.find(filter) == std::string::npos)
+                continue;
+
+            if (list)
+            {
+                puts(fullName.c_str());
+                continue;
+            }
+
+            const MicroBenchResult r = bench.run(c, std::chrono::milliseconds(minTime), repetitions);
+            results.push_back(r);
+
+            // Progress goes to stderr, so stdout is only the result when it's JSON.
+            FILE *out = json ? stderr : stdout;
+            fprintf(out, "%-100s %12.1f ns/op %10.2f allocs/op\n", fullName.c_str(), r.nsPerOp, r.allocationsPerOp);
+            fflush(out);
+        }
+
+        if (json && !list)
+            printJson(results, minTime, repetitions);
+    }
+    catch (std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -47,6 +47,14 @@ SOURCES +=  tst_maintests.cpp \
     ../persistencefile.cpp \
     ../sessionsandsubscriptionsdb.cpp \
     ../qospacketqueue.cpp \
+    ../qosspillfile.cpp \
+    ../zerocopypins.cpp \
+    ../handover.cpp \
+    ../cluster.cpp \
+    ../threadshards.cpp \
+    ../bridgeconfig.cpp \
+    ../bridge.cpp \
+    ../replay.cpp \
     ../threadglobals.cpp \
     ../threadloop.cpp \
     ../publishcopyfactory.cpp \
@@ -95,9 +103,19 @@ HEADERS += \
     ../persistencefile.h \
     ../sessionsandsubscriptionsdb.h \
     ../qospacketqueue.h \
+    ../qosspillfile.h \
+    ../zerocopypins.h \
+    ../handover.h \
+    ../cluster.h \
+    ../threadshards.h \
+    ../spscqueue.h \
+    ../bridgeconfig.h \
+    ../bridge.h \
+    ../replay.h \
     ../threadglobals.h \
     ../threadloop.h \
     ../publishcopyfactory.h \
+    ../packetwriter.h \
     ../variablebyteint.h \
     ../mqtt5properties.h \
     ../globalstats.h \
@@ -23,6 +23,9 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <QHostInfo>
 #include <list>
 #include <unordered_map>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
 
 #include "cirbuf.h"
 #include "mainapp.h"
@@ -34,6 +37,13 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "session.h"
 #include "threaddata.h"
 #include "threadglobals.h"
+#include "qosspillfile.h"
+#include "packetwriter.h"
+#include "cluster.h"
+#include "threadshards.h"
+#include "threadloop.h"
+#include "bridge.h"
+#include "publishcopyfactory.h"
 
 #include "flashmqtestclient.h"
 
@@ -100,14 +110,35 @@ private slots:
     void testPacketInt16Parse();
 
     void testTopicsMatch();
+    void testParseCpuList();
 
     void testRetainedMessageDB();
     void testRetainedMessageDBNotPresent();
     void testRetainedMessageDBEmptyList();
+    void testRetainedMessageShards();
+    void testBatchedSubscribe();
+    void testExactSubscriptions();
+    void testParallelFanOut();
+    void testShardInterest();
+    void testShardedStores();
 
     void testSavingSessions();
+    void testQoSSpillFile();
+    void testQoSSpillFileCompacts();
+    void testQoSPublishQueuePacing();
+    void testSessionCompaction();
+    void testPublisherBackpressure();
+    void testReadBudgetRoundRobin();
+
+    void testClusterInterest();
+    void testClusterMessage();
+    void testHandoverMessage();
+    void testBridge();
 
     void testParsePacket();
+    void testPacketWriter();
+    void testSharedPayload();
+    void testZeroCopyPins();
 
     void testDowngradeQoSOnSubscribeQos2to2();
     void testDowngradeQoSOnSubscribeQos2to1();
@@ -905,6 +936,34 @@ void MainTests::testTopicsMatch()
 
 }
 
+void MainTests::testParseCpuList()
+{
+    QVERIFY(parseCpuList("3") == std::vector<int>({3}));
+    QVERIFY(parseCpuList("0-3") == std::vector<int>({0, 1, 2, 3}));
+    QVERIFY(parseCpuList("0-1,4,6-7") == std::vector<int>({0, 1, 4, 6, 7}));
+    QVERIFY(parseCpuList("5,2") == std::vector<int>({5, 2}));
+    QVERIFY(parseCpuList("2-2") == std::vector<int>({2}));
+
+    // Whitespace around parts and numbers is allowed, as are empty parts and overlap.
+    QVERIFY(parseCpuList(" 0 - 2 , 8 ") == std::vector<int>({0, 1, 2, 8}));
+    QVERIFY(parseCpuList("1,,2,") == std::vector<int>({1, 2}));
+    QVERIFY(parseCpuList("0-2,1-3") == std::vector<int>({0, 1, 2, 3}));
+
+    QVERIFY_EXCEPTION_THROWN(parseCpuList(""), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList(" , "), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("a"), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("3x"), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("1.5"), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("+1"), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("-1"), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("1-"), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("3-1"), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("1-2-3"), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("1 2"), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList(std::to_string(CPU_SETSIZE)), ConfigFileException);
+    QVERIFY_EXCEPTION_THROWN(parseCpuList("99999999999999999999"), ConfigFileException);
+}
+
 void MainTests::testRetainedMessageDB()
 {
     try
@@ -1009,6 +1068,468 @@ void MainTests::testRetainedMessageDBEmptyList()
     }
 }
 
+void MainTests::testRetainedMessageShards()
+{
+    try
+    {
+        std::shared_ptr<Settings> settings(new Settings());
+        ThreadGlobals::assignSettings(settings.get());
+        SubscriptionStore store;
+
+        std::vector<std::string> topics {"one/two", "one/three", "four", "/five", "$SYS/six"};
+        for (const std::string &topic : topics)
+        {
+            Publish publish(topic, "payload", 0);
+            splitTopic(topic, publish.subtopics);
+            store.setRetainedMessage(publish, publish.subtopics);
+        }
+
+        MYCASTCOMPARE(store.getRetainedMessageCount(), 5);
+        MYCASTCOMPARE(store.retainedMessageShards.size(), 4);
+
+        // Topics starting with '$' are not included.
+        std::vector<RetainedMessage> messages;
+        store.getRetainedMessages(messages);
+        MYCASTCOMPARE(messages.size(), 4);
+
+        // Removing doesn't make a shard.
+        Publish removal("seven/eight", "", 0);
+        splitTopic(removal.topic, removal.subtopics);
+        store.setRetainedMessage(removal, removal.subtopics);
+        MYCASTCOMPARE(store.retainedMessageShards.size(), 4);
+
+        Publish removal2("one/two", "", 0);
+        splitTopic(removal2.topic, removal2.subtopics);
+        store.setRetainedMessage(removal2, removal2.subtopics);
+        MYCASTCOMPARE(store.getRetainedMessageCount(), 4);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+void MainTests::testBatchedSubscribe()
+{
+    try
+    {
+        std::shared_ptr<Settings> settings(new Settings());
+        std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings));
+
+        Authentication auth(*settings.get());
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        std::vector<std::pair<std::string, char>> retained {{"a/b", 2}, {"a/c", 1}, {"d", 1}, {"$SYS/e", 1}};
+        for (const std::pair<std::string, char> &r : retained)
+        {
+            Publish publish(r.first, "payload", r.second);
+            splitTopic(r.first, publish.subtopics);
+            store->setRetainedMessage(publish, publish.subtopics);
+        }
+
+        std::shared_ptr<Client> c1(new Client(0, t, nullptr, false, nullptr, settings.get(), false));
+        c1->setClientProperties(ProtocolVersion::Mqtt5, "c1", "user1", true, 60);
+        store->registerClientAndKickExistingOne(c1, false, 512, 120);
+        std::shared_ptr<Session> ses = c1->getSession();
+
+        // Offline, so the retained messages are queued, where we can see them.
+        c1.reset();
+        std::shared_ptr<Client> c1Again(new Client(0, t, nullptr, false, nullptr, settings.get(), false));
+        c1Again->setClientProperties(ProtocolVersion::Mqtt5, "c1", "user1", true, 60);
+
+        std::vector<std::pair<std::string, char>> filters {{"a/b", 1}, {"a/+", 2}, {"#", 1}, {"d", 0}};
+        std::vector<SubscriptionForAdding> subscriptions;
+        for (const std::pair<std::string, char> &f : filters)
+        {
+            std::vector<std::string> subtopics;
+            splitTopic(f.first, subtopics);
+            subscriptions.emplace_back(std::string(f.first), std::move(subtopics), f.second);
+        }
+
+        store->addSubscriptions(c1Again, subscriptions);
+
+        MYCASTCOMPARE(store->getSubscriptionsOfSession(ses).size(), 4);
+
+        // Each matching retained message once, with the highest QoS of the filters matching it.
+        std::map<std::string, char> queued;
+        for (const Publish &publish : ses->getQueuedPublishes())
+        {
+            QVERIFY(queued.emplace(publish.topic, publish.qos).second);
+        }
+
+        MYCASTCOMPARE(queued.size(), 3);
+        MYCASTCOMPARE(queued["a/b"], 2);
+        MYCASTCOMPARE(queued["a/c"], 1);
+        MYCASTCOMPARE(queued["d"], 1);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+void MainTests::testExactSubscriptions()
+{
+    try
+    {
+        std::shared_ptr<Settings> settings(new Settings());
+        std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings));
+
+        Authentication auth(*settings.get());
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        std::vector<std::shared_ptr<Client>> clients;
+        std::vector<std::shared_ptr<Session>> sessions;
+        const std::vector<std::string> filters {"devices/1/cmd", "devices/+/cmd", "devices/#", "$SYS/cmd"};
+
+        for (size_t i = 0; i < filters.size(); i++)
+        {
+            std::shared_ptr<Client> c(new Client(0, t, nullptr, false, nullptr, settings.get(), false));
+            c->setClientProperties(ProtocolVersion::Mqtt5, formatString("c%d", static_cast<int>(i)), "user", true, 60);
+            store->registerClientAndKickExistingOne(c, false, 512, 120);
+
+            std::vector<std::string> subtopics;
+            splitTopic(filters[i], subtopics);
+            store->addSubscription(c, filters[i], subtopics, 1);
+
+            clients.push_back(c);
+            sessions.push_back(c->getSession());
+        }
+
+        MYCASTCOMPARE(store->exactSubscriptions.size(), 1);
+        MYCASTCOMPARE(store->getSubscriptionCount(), 4);
+
+        std::set<std::string> subscriptionFilters;
+        store->getSubscriptionFilters(subscriptionFilters);
+        MYCASTCOMPARE(subscriptionFilters.size(), 3);
+        QVERIFY(subscriptionFilters.count("devices/1/cmd") == 1);
+
+        // Offline, so the publishes are queued, where we can see them.
+        clients.clear();
+
+        for (const std::string &topic : {"devices/1/cmd", "devices/2/cmd"})
+        {
+            Publish publish(topic, "payload", 1);
+            splitTopic(topic, publish.subtopics);
+            PublishCopyFactory factory(&publish);
+            store->queuePacketAtLocalSubscribers(factory);
+        }
+
+        MYCASTCOMPARE(sessions[0]->getQueuedPublishes().size(), 1);
+        MYCASTCOMPARE(sessions[1]->getQueuedPublishes().size(), 2);
+        MYCASTCOMPARE(sessions[2]->getQueuedPublishes().size(), 2);
+        MYCASTCOMPARE(sessions[3]->getQueuedPublishes().size(), 0);
+
+        std::shared_ptr<Client> c0(new Client(0, t, nullptr, false, nullptr, settings.get(), false));
+        c0->setClientProperties(ProtocolVersion::Mqtt5, "c0", "user", true, 60);
+        store->removeSubscription(c0, "devices/1/cmd");
+        QVERIFY(store->exactSubscriptions.empty());
+        MYCASTCOMPARE(store->getSubscriptionCount(), 3);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+void MainTests::testParallelFanOut()
+{
+    try
+    {
+        std::shared_ptr<Settings> settings(new Settings());
+        settings->parallelFanOutThreshold = 3;
+        ThreadGlobals::assignSettings(settings.get());
+        std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+        std::shared_ptr<ThreadData> t1(new ThreadData(0, settings));
+        std::shared_ptr<ThreadData> t2(new ThreadData(1, settings));
+
+        Authentication auth(*settings.get());
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t1.get());
+
+        std::vector<std::shared_ptr<Client>> clients;
+        std::vector<std::shared_ptr<Session>> sessions;
+        const std::string topic = "fan/out";
+
+        for (int i = 0; i < 3; i++)
+        {
+            std::shared_ptr<ThreadData> &t = i == 0 ? t1 : t2;
+            std::shared_ptr<Client> c(new Client(0, t, nullptr, false, nullptr, settings.get(), false));
+            c->setClientProperties(ProtocolVersion::Mqtt5, formatString("c%d", i), "user", true, 60);
+            store->registerClientAndKickExistingOne(c, false, 512, 120);
+
+            std::vector<std::string> subtopics;
+            splitTopic(topic, subtopics);
+            store->addSubscription(c, topic, subtopics, 1);
+
+            clients.push_back(c);
+            sessions.push_back(c->getSession());
+        }
+
+        auto publish = [&](const std::string &payload) {
+            Publish pub(topic, payload, 1);
+            splitTopic(topic, pub.subtopics);
+            PublishCopyFactory factory(&pub);
+            store->queuePacketAtLocalSubscribers(factory);
+        };
+
+        // The receivers in the other thread get it from that thread.
+        publish("one");
+        MYCASTCOMPARE(sessions[0]->getQueuedPublishes().size(), 1);
+        MYCASTCOMPARE(sessions[1]->getQueuedPublishes().size(), 0);
+        QCOMPARE(t1->fanOutsPending.load(), 1);
+
+        // Fewer receivers than the threshold, but it has to wait its turn after the first one.
+        store->removeSubscription(clients[2], topic);
+        publish("two");
+        MYCASTCOMPARE(sessions[0]->getQueuedPublishes().size(), 2);
+        MYCASTCOMPARE(sessions[1]->getQueuedPublishes().size(), 0);
+        QCOMPARE(t1->fanOutsPending.load(), 2);
+
+        auto runTasksOfT2 = [&]() {
+            ThreadGlobals::assignThreadData(t2.get());
+            t2->runQueuedTasks();
+            ThreadGlobals::assignThreadData(t1.get());
+        };
+
+        runTasksOfT2();
+        QCOMPARE(t1->fanOutsPending.load(), 0);
+
+        std::vector<Publish> queued = sessions[1]->getQueuedPublishes();
+        MYCASTCOMPARE(queued.size(), 2);
+        QCOMPARE(queued[0].payload, std::string("one"));
+        QCOMPARE(queued[1].payload, std::string("two"));
+        MYCASTCOMPARE(sessions[2]->getQueuedPublishes().size(), 1);
+
+        // Nothing in progress and few receivers, so it's done here.
+        publish("three");
+        MYCASTCOMPARE(sessions[1]->getQueuedPublishes().size(), 3);
+        QVERIFY(t2->taskQueue.empty());
+
+        // A receiver that disconnects while a fan-out to its thread is pending gets the next ones from there too, in order.
+        std::vector<std::string> subtopics;
+        splitTopic(topic, subtopics);
+        store->addSubscription(clients[2], topic, subtopics, 1);
+        publish("four");
+        QCOMPARE(t1->fanOutsPending.load(), 1);
+        sessions[1]->client.reset();
+        QVERIFY(sessions[1]->getLastThread() == t2);
+        publish("five");
+        MYCASTCOMPARE(sessions[1]->getQueuedPublishes().size(), 3);
+        QCOMPARE(t1->fanOutsPending.load(), 2);
+
+        runTasksOfT2();
+        QCOMPARE(t1->fanOutsPending.load(), 0);
+        queued = sessions[1]->getQueuedPublishes();
+        MYCASTCOMPARE(queued.size(), 5);
+        QCOMPARE(queued[3].payload, std::string("four"));
+        QCOMPARE(queued[4].payload, std::string("five"));
+
+        // Without fan-outs pending there, it's done here.
+        publish("six");
+        MYCASTCOMPARE(sessions[1]->getQueuedPublishes().size(), 6);
+        QCOMPARE(t1->fanOutsPending.load(), 1);
+
+        // A task that is discarded, like when its thread stops, isn't pending anymore.
+        {
+            std::forward_list<std::function<void()>> dropped;
+            dropped.swap(t2->taskQueue);
+        }
+        QCOMPARE(t1->fanOutsPending.load(), 0);
+        QVERIFY(t1->getThreadsWithFanOutsPending().empty());
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+void MainTests::testShardInterest()
+{
+    ShardInterest interest;
+
+    auto match = [&](const std::string &topic) {
+        std::vector<std::string> subtopics;
+        splitTopic(topic, subtopics);
+        return interest.mightMatch(subtopics, topic[0] == '$');
+    };
+
+    QVERIFY(!match("a/b"));
+
+    interest.add("a/+/c");
+    interest.add("$SYS/broker/#");
+    QVERIFY(match("a/b/c"));
+    QVERIFY(match("a"));
+    QVERIFY(match("$SYS/broker/uptime"));
+    QVERIFY(!match("b/b/c"));
+
+    // Wildcards at the first level match everything, except topics starting with '$'.
+    interest.add("+/x");
+    QVERIFY(match("b/b/c"));
+    QVERIFY(!match("$other/x"));
+
+    interest.rebuild({"b/#"});
+    QVERIFY(!match("a/b/c"));
+    QVERIFY(!match("$SYS/broker/uptime"));
+    QVERIFY(match("b/b/c"));
+    QVERIFY(!match("c"));
+}
+
+void MainTests::testShardedStores()
+{
+    try
+    {
+        std::shared_ptr<Settings> settings(new Settings());
+        ThreadGlobals::assignSettings(settings.get());
+        std::shared_ptr<SubscriptionStore> globalStore(new SubscriptionStore());
+        std::shared_ptr<ThreadShards> shards(new ThreadShards(2));
+        std::vector<std::shared_ptr<ThreadData>> threads;
+
+        for (int i = 0; i < 2; i++)
+        {
+            std::shared_ptr<ThreadData> t(new ThreadData(i, settings));
+            t->subscriptionStore = std::make_shared<SubscriptionStore>();
+            t->subscriptionStore->setShard(shards, i, globalStore);
+            t->shards = shards;
+            threads.push_back(t);
+        }
+        shards->setThreads(threads);
+
+        std::shared_ptr<ThreadData> &t1 = threads[0];
+        std::shared_ptr<ThreadData> &t2 = threads[1];
+        std::shared_ptr<SubscriptionStore> &store1 = t1->subscriptionStore;
+        std::shared_ptr<SubscriptionStore> &store2 = t2->subscriptionStore;
+
+        Authentication auth(*settings.get());
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t1.get());
+
+        std::shared_ptr<Client> c1(new Client(0, t1, nullptr, false, nullptr, settings.get(), false));
+        c1->setClientProperties(ProtocolVersion::Mqtt5, "mover", "user", false, 60);
+        store1->registerClientAndKickExistingOne(c1, false, 512, 120);
+        std::vector<std::string> subtopics;
+        splitTopic("shard/+", subtopics);
+        store1->addSubscription(c1, "shard/+", subtopics, 1);
+
+        auto publish = [&](std::shared_ptr<ThreadData> &thread, const std::string &topic, const std::string &payload) {
+            ThreadGlobals::assignThreadData(thread.get());
+            Publish pub(topic, payload, 1);
+            splitTopic(topic, pub.subtopics);
+            PublishCopyFactory factory(&pub);
+            thread->subscriptionStore->queuePacketAtSubscribers(factory);
+        };
+
+        auto handleMessages = [&](std::shared_ptr<ThreadData> &thread) {
+            ThreadGlobals::assignThreadData(thread.get());
+            thread->handleShardMessages();
+        };
+
+        // Publishes from the other thread arrive over the channel, and only when the interest matches.
+        publish(t2, "shard/a", "one");
+        publish(t2, "other/a", "nope");
+        MYCASTCOMPARE(c1->getSession()->getQueuedPublishes().size(), 0);
+        handleMessages(t1);
+        std::vector<Publish> queued = c1->getSession()->getQueuedPublishes();
+        MYCASTCOMPARE(queued.size(), 1);
+        QCOMPARE(queued[0].payload, std::string("one"));
+
+        // Connecting to the other thread keeps the session in the first thread, with its subscriptions and queued messages.
+        ThreadGlobals::assignThreadData(t2.get());
+        QVERIFY(shards->lockSession("mover") == c1->getSession());
+        std::shared_ptr<Client> c2(new Client(0, t2, nullptr, false, nullptr, settings.get(), false));
+        c2->setClientProperties(ProtocolVersion::Mqtt5, "mover", "user", false, 60);
+        store2->registerClientAndKickExistingOne(c2, false, 512, 120);
+
+        MYCASTCOMPARE(store1->getSessionCount(), 1);
+        MYCASTCOMPARE(store2->getSessionCount(), 0);
+        QVERIFY(c2->getSession() == c1->getSession());
+        QVERIFY(c2->getSessionStore() == store1);
+        MYCASTCOMPARE(c2->getSession()->getQueuedPublishes().size(), 1);
+
+        publish(t1, "shard/b", "two");
+        queued = c2->getSession()->getQueuedPublishes();
+        MYCASTCOMPARE(queued.size(), 2);
+        QCOMPARE(queued[1].payload, std::string("two"));
+
+        // Subscribing from the other thread makes the first thread's store interested.
+        ThreadGlobals::assignThreadData(t2.get());
+        splitTopic("late/+", subtopics);
+        c2->getSessionStore()->addSubscription(c2, "late/+", subtopics, 1);
+        publish(t2, "late/a", "three");
+        handleMessages(t1);
+        queued = c2->getSession()->getQueuedPublishes();
+        MYCASTCOMPARE(queued.size(), 3);
+        QCOMPARE(queued[2].payload, std::string("three"));
+
+        // A removed session is forgotten, so the client id can have a session in another thread next time.
+        std::shared_ptr<Client> c3(new Client(0, t2, nullptr, false, nullptr, settings.get(), false));
+        c3->setClientProperties(ProtocolVersion::Mqtt5, "temp", "user", true, 60);
+        store2->registerClientAndKickExistingOne(c3, true, 512, 0);
+        MYCASTCOMPARE(store2->getSessionCount(), 1);
+        store2->removeSession(c3->getSession());
+        QVERIFY(!shards->lockSession("temp"));
+
+        ThreadGlobals::assignThreadData(t1.get());
+        std::shared_ptr<Client> c4(new Client(0, t1, nullptr, false, nullptr, settings.get(), false));
+        c4->setClientProperties(ProtocolVersion::Mqtt5, "temp", "user", true, 60);
+        store1->registerClientAndKickExistingOne(c4, true, 512, 0);
+        QVERIFY(c4->getSessionStore() == store1);
+        MYCASTCOMPARE(store1->getSessionCount(), 2);
+        MYCASTCOMPARE(store2->getSessionCount(), 0);
+
+        // A client destroyed in another thread has its will sent by the thread of its session, because only that one may send from it.
+        ThreadGlobals::assignThreadData(t2.get());
+        std::shared_ptr<Client> willReceiver(new Client(0, t2, nullptr, false, nullptr, settings.get(), false));
+        willReceiver->setClientProperties(ProtocolVersion::Mqtt5, "willreceiver", "user", false, 60);
+        store2->registerClientAndKickExistingOne(willReceiver, false, 512, 120);
+        splitTopic("will/+", subtopics);
+        store2->addSubscription(willReceiver, "will/+", subtopics, 1);
+
+        ThreadGlobals::assignThreadData(t1.get());
+        std::shared_ptr<Client> dying(new Client(0, t1, nullptr, false, nullptr, settings.get(), false));
+        dying->setClientProperties(ProtocolVersion::Mqtt5, "dying", "user", true, 60);
+        WillPublish will(Publish("will/dying", "gone", 1));
+        splitTopic(will.topic, will.subtopics);
+        dying->setWill(std::move(will));
+        store1->registerClientAndKickExistingOne(dying, true, 512, 0);
+
+        ThreadGlobals::assignThreadData(t2.get());
+        dying.reset();
+        QVERIFY(!t1->taskQueue.empty());
+        handleMessages(t2);
+        MYCASTCOMPARE(willReceiver->getSession()->getQueuedPublishes().size(), 0);
+
+        ThreadGlobals::assignThreadData(t1.get());
+        t1->runQueuedTasks();
+        handleMessages(t2);
+        queued = willReceiver->getSession()->getQueuedPublishes();
+        MYCASTCOMPARE(queued.size(), 1);
+        QCOMPARE(queued[0].payload, std::string("gone"));
+        MYCASTCOMPARE(store1->getSessionCount(), 2);
+
+        // The sessions of all threads go in one file, and are spread again when loading.
+        SubscriptionStore::saveSessionsAndSubscriptions("/tmp/flashmqtests_sharded_sessions.db", {store1.get(), store2.get()});
+        SubscriptionStore loaded1;
+        SubscriptionStore loaded2;
+        std::unordered_map<std::string, size_t> shardsOfClients;
+        shardsOfClients["mover"] = 0;
+        shardsOfClients["willreceiver"] = 1;
+        SubscriptionStore::loadSessionsAndSubscriptions("/tmp/flashmqtests_sharded_sessions.db", {&loaded1, &loaded2}, shardsOfClients);
+        MYCASTCOMPARE(loaded1.getSessionCount(), 1);
+        MYCASTCOMPARE(loaded2.getSessionCount(), 1);
+        MYCASTCOMPARE(loaded1.getSubscriptionCount(), 2);
+        MYCASTCOMPARE(loaded2.getSubscriptionCount(), 1);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
 void MainTests::testSavingSessions()
 {
     try
@@ -1076,17 +1597,19 @@ void MainTests::testSavingSessions()
 
             QCOMPARE(ses->username, ses2->username);
             QCOMPARE(ses->client_id, ses2->client_id);
-            QCOMPARE(ses->incomingQoS2MessageIds, ses2->incomingQoS2MessageIds);
-            QCOMPARE(ses->outgoingQoS2MessageIds, ses2->outgoingQoS2MessageIds);
-            QCOMPARE(ses->nextPacketId, ses2->nextPacketId);
+            QVERIFY(ses->qosState);
+            QVERIFY(ses2->qosState);
+            QVERIFY(ses->qosState->incomingQoS2MessageIds == ses2->qosState->incomingQoS2MessageIds);
+            QVERIFY(ses->qosState->outgoingQoS2MessageIds == ses2->qosState->outgoingQoS2MessageIds);
+            QCOMPARE(ses->qosState->nextPacketId, ses2->qosState->nextPacketId);
         }
 
 
         std::unordered_map<std::string, std::list<SubscriptionForSerializing>> store1Subscriptions;
-        store->getSubscriptions(&store->root, "", true, store1Subscriptions);
+        store->getSubscriptions(store1Subscriptions);
 
         std::unordered_map<std::string, std::list<SubscriptionForSerializing>> store2Subscriptions;
-        store2->getSubscriptions(&store->root, "", true, store2Subscriptions);
+        store2->getSubscriptions(store2Subscriptions);
 
         MYCASTCOMPARE(store1Subscriptions.size(), 4);
         MYCASTCOMPARE(store2Subscriptions.size(), 4);
@@ -1098,6 +1621,11 @@ void MainTests::testSavingSessions()
 
             QCOMPARE(subscList1.size(), subscList2.size());
 
+            // The order of subscribers of a filter is not kept.
+            auto byClientId = [](const SubscriptionForSerializing &a, const SubscriptionForSerializing &b) { return a.clientId < b.clientId; };
+            subscList1.sort(byClientId);
+            subscList2.sort(byClientId);
+
             auto subs1It = subscList1.begin();
             auto subs2It = subscList2.begin();
 
@@ -1122,6 +1650,934 @@ void MainTests::testSavingSessions()
     }
 }
 
+void MainTests::testQoSSpillFile()
+{
+    try
+    {
+        Settings settings;
+        settings.storageDir = "/tmp";
+
+        std::string longpayload = getSecureRandomString(65537);
+
+        std::vector<Publish> publishes;
+        publishes.emplace_back("one/two/three", "payload", 1);
+        publishes.emplace_back("one/two/wer", longpayload, 2);
+        publishes.emplace_back("one/e/wer", "µsdf", 1);
+
+        QoSSpillFile spill(settings);
+
+        for (Publish &pub : publishes)
+            spill.write(pub);
+
+        MYCASTCOMPARE(spill.size(), publishes.size());
+
+        // Taking one out before writing more, to test the interleaving of reads and writes.
+        Publish first;
+        QVERIFY(spill.read(first));
+        QCOMPARE(first.topic, publishes.front().topic);
+        QCOMPARE(first.payload, publishes.front().payload);
+
+        publishes.emplace_back("/boe", longpayload, 1);
+        spill.write(publishes.back());
+
+        for (auto it = std::next(publishes.begin()); it != publishes.end(); it++)
+        {
+            Publish loaded;
+            QVERIFY(spill.read(loaded));
+            QCOMPARE(loaded.topic, it->topic);
+            QCOMPARE(loaded.payload, it->payload);
+            QCOMPARE(loaded.qos, it->qos);
+        }
+
+        Publish none;
+        QVERIFY(!spill.read(none));
+        MYCASTCOMPARE(spill.size(), 0);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+/**
+ * @brief MainTests::testQoSSpillFileCompacts checks that the file doesn't keep growing when the reader stays behind the writer.
+ */
+void MainTests::testQoSSpillFileCompacts()
+{
+    try
+    {
+        Settings settings;
+        settings.storageDir = "/tmp";
+
+        const std::string payload = getSecureRandomString(10000);
+
+        QoSSpillFile spill(settings);
+
+        uint32_t written = 0;
+        uint32_t read = 0;
+
+        for (int round = 0; round < 50; round++)
+        {
+            for (int i = 0; i < 10; i++)
+            {
+                Publish pub(formatString("spill/%d", written++), payload, 1);
+                spill.write(pub);
+            }
+
+            for (int i = 0; i < 9; i++)
+            {
+                Publish loaded;
+                QVERIFY(spill.read(loaded));
+                QCOMPARE(loaded.topic, formatString("spill/%d", read++));
+                QCOMPARE(loaded.payload, payload);
+            }
+
+            QVERIFY(spill.writePos < 3 * QOS_SPILL_FILE_COMPACT_BYTES);
+        }
+
+        MYCASTCOMPARE(spill.size(), written - read);
+
+        Publish loaded;
+        while (spill.read(loaded))
+        {
+            QCOMPARE(loaded.topic, formatString("spill/%d", read++));
+        }
+
+        QCOMPARE(read, written);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+void MainTests::testQoSPublishQueuePacing()
+{
+    QoSPublishQueue queue;
+
+    for (uint16_t id = 1; id <= 4; id++)
+    {
+        Publish pub("one/two", formatString("payload %d", id), 1);
+        queue.queuePublish(std::move(pub), id, id <= 2);
+    }
+
+    QVERIFY(queue.hasUnsent());
+    QCOMPARE(queue.takeNextToSend()->getPacketId(), static_cast<uint16_t>(3));
+
+    // Removing the next one to send moves on to the one after it.
+    QVERIFY(queue.erase(4));
+    QVERIFY(!queue.hasUnsent());
+
+    queue.markAllUnsent();
+    QCOMPARE(queue.takeNextToSend()->getPacketId(), static_cast<uint16_t>(1));
+
+    QoSPublishQueue copy(queue);
+    QCOMPARE(copy.takeNextToSend()->getPacketId(), static_cast<uint16_t>(2));
+
+    queue.markAllSent();
+    QVERIFY(!queue.hasUnsent());
+    MYCASTCOMPARE(queue.size(), 3);
+}
+
+void MainTests::testSessionCompaction()
+{
+    try
+    {
+        std::shared_ptr<Settings> settings(new Settings());
+        std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings));
+
+        Authentication auth(*settings.get());
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        std::shared_ptr<Client> c1(new Client(0, t, nullptr, false, nullptr, settings.get(), false));
+        c1->setClientProperties(ProtocolVersion::Mqtt5, "c1", "user1", true, 60);
+        store->registerClientAndKickExistingOne(c1, false, 10, 120);
+        std::shared_ptr<Session> ses = c1->getSession();
+
+        QVERIFY(ses->isCompact());
+
+        // Connected clients keep their QoS state, even when it's idle.
+        ses->addIncomingQoS2MessageId(5);
+        QVERIFY(!ses->isCompact());
+        QVERIFY(ses->removeIncomingQoS2MessageId(5));
+        QVERIFY(!ses->compact());
+
+        c1.reset();
+        QVERIFY(ses->compact());
+
+        Publish publish("a/b/c", "Hello", 1);
+        MqttPacket publishPacket(ProtocolVersion::Mqtt5, publish);
+        PublishCopyFactory fac(&publishPacket);
+        ses->writePacket(fac, 1);
+
+        // A queued message keeps it from being compacted. Only sending it takes from the quota.
+        QVERIFY(!ses->compact());
+        MYCASTCOMPARE(ses->qosState->qosPacketQueue.size(), 1);
+        QVERIFY(ses->qosState->qosPacketQueue.hasUnsent());
+        QCOMPARE(ses->qosState->flowControlQuota, 10);
+
+        QVERIFY(ses->clearQosMessage(ses->qosState->nextPacketId, true));
+        QVERIFY(ses->compact());
+        QVERIFY(ses->getQueuedPublishes().empty());
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+/**
+ * @brief MainTests::testPublisherBackpressure checks that a subscriber over half its watermark pauses the publisher, and that
+ * draining it to a quarter resumes the publisher with the PUBACKs it held back.
+ */
+void MainTests::testPublisherBackpressure()
+{
+    try
+    {
+        std::shared_ptr<Settings> settings(new Settings());
+        settings->publisherBackpressure = true;
+        settings->clientWriteBufferWatermark = 4096;
+        ThreadGlobals::assignSettings(settings.get());
+        std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings));
+
+        Authentication auth(*settings.get());
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        // Real sockets, so the subscriber can be drained and we can see what the publisher gets.
+        auto makeClient = [&](const std::string &clientId, int &peer) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0)
+                throw std::runtime_error("socketpair failed");
+            peer = fds[1];
+
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof (struct epoll_event));
+            ev.data.fd = fds[0];
+            check<std::runtime_error>(epoll_ctl(t->epollfd, EPOLL_CTL_ADD, fds[0], &ev));
+
+            std::shared_ptr<Client> c(new Client(fds[0], t, nullptr, false, nullptr, settings.get(), false));
+            c->setClientProperties(ProtocolVersion::Mqtt5, clientId, "user", true, 60);
+            store->registerClientAndKickExistingOne(c, false, 512, 120);
+            return c;
+        };
+
+        int publisherPeer = -1;
+        int subscriberPeer = -1;
+        std::shared_ptr<Client> publisher = makeClient("publisher", publisherPeer);
+        std::shared_ptr<Client> subscriber = makeClient("subscriber", subscriberPeer);
+
+        // The packet has to come from the publisher, like it was read from its socket.
+        auto publish = [&]() {
+            Publish pub("back/pressure", std::string(1000, 'x'), 0);
+            MqttPacket staging(ProtocolVersion::Mqtt5, pub);
+            CirBuf buf(2048);
+            staging.readIntoBuf(buf);
+
+            std::vector<MqttPacket> parsed;
+            MqttPacket::bufferToMqttPackets(buf, parsed, publisher);
+            parsed.front().parsePublishData();
+            PublishCopyFactory factory(&parsed.front());
+            subscriber->writeMqttPacketAndBlameThisClient(factory, 0, 0);
+        };
+
+        auto readPeer = [](int peer) {
+            char buf[16384];
+            ssize_t n = read(peer, buf, sizeof(buf));
+            return n > 0 ? n : 0;
+        };
+
+        publish();
+        QVERIFY(!publisher->isPausedByBackpressure());
+
+        publish();
+        publish();
+        QVERIFY(publisher->isPausedByBackpressure());
+
+        // The PUBACK would let an MQTT5 publisher send more, so it waits.
+        publisher->writePublishResponse(PacketType::PUBACK, ReasonCodes::Success, 7);
+        QVERIFY(publisher->writeBufIntoFd());
+        MYCASTCOMPARE(readPeer(publisherPeer), 0);
+
+        QVERIFY(subscriber->writeBufIntoFd());
+        QVERIFY(!publisher->isPausedByBackpressure());
+        QVERIFY(readPeer(subscriberPeer) > 3000);
+
+        t->runQueuedTasks();
+        QVERIFY(publisher->writeBufIntoFd());
+        MYCASTCOMPARE(readPeer(publisherPeer), 4);
+
+        close(publisherPeer);
+        close(subscriberPeer);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+/**
+ * @brief MainTests::testReadBudgetRoundRobin checks that clients with more input than their packet budget take turns, and get
+ * one turn per iteration of the thread loop, also when epoll reports them again.
+ */
+void MainTests::testReadBudgetRoundRobin()
+{
+    try
+    {
+        std::shared_ptr<Settings> settings(new Settings());
+        settings->clientReadBudgetPackets = 2;
+        ThreadGlobals::assignSettings(settings.get());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings));
+
+        Authentication auth(*settings.get());
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        std::vector<std::string> handledFrom;
+        std::vector<int> peers;
+
+        auto makeClient = [&](const std::string &clientId) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0)
+                throw std::runtime_error("socketpair failed");
+            peers.push_back(fds[1]);
+
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof (struct epoll_event));
+            ev.data.fd = fds[0];
+            check<std::runtime_error>(epoll_ctl(t->epollfd, EPOLL_CTL_ADD, fds[0], &ev));
+
+            std::shared_ptr<Client> c(new Client(fds[0], t, nullptr, false, nullptr, settings.get(), false));
+            c->setClientProperties(ProtocolVersion::Mqtt5, clientId, "user", true, 60);
+            c->onPacketReceived = [&handledFrom, clientId](MqttPacket &) { handledFrom.push_back(clientId); };
+
+            // Five publishes at once, which takes three turns with a budget of two.
+            for (int i = 0; i < 5; i++)
+            {
+                Publish pub("read/budget", "payload", 0);
+                MqttPacket packet(ProtocolVersion::Mqtt5, pub);
+                CirBuf buf(1024);
+                packet.readIntoBuf(buf);
+                check<std::runtime_error>(write(fds[1], buf.tailPtr(), buf.usedBytes()));
+            }
+
+            return c;
+        };
+
+        std::shared_ptr<Client> a = makeClient("a");
+        std::shared_ptr<Client> b = makeClient("b");
+        std::vector<MqttPacket> packetQueueIn;
+
+        t->loopIteration++;
+        handleClientEvents(t.get(), a, EPOLLIN, packetQueueIn);
+        handleClientEvents(t.get(), b, EPOLLIN, packetQueueIn);
+        MYCASTCOMPARE(t->clientsWithPendingInput.size(), 2);
+
+        // In the next iteration, epoll reporting a client again doesn't give it a second turn.
+        t->loopIteration++;
+        handleClientsWithPendingInput(t.get(), packetQueueIn);
+        handleClientEvents(t.get(), a, EPOLLIN, packetQueueIn);
+        MYCASTCOMPARE(handledFrom.size(), 8);
+
+        t->loopIteration++;
+        handleClientsWithPendingInput(t.get(), packetQueueIn);
+        QVERIFY(t->clientsWithPendingInput.empty());
+
+        const std::vector<std::string> expected {"a", "a", "b", "b", "a", "a", "b", "b", "a", "b"};
+        QVERIFY(handledFrom == expected);
+
+        for (int peer : peers)
+            close(peer);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+/**
+ * @brief MainTests::testSharedPayload checks that a large received payload is referenced by write queues instead of copied, and that
+ * the packets and the bytes subscribers get are the same as with a copied payload.
+ */
+void MainTests::testSharedPayload()
+{
+    try
+    {
+        std::shared_ptr<Settings> settings(new Settings());
+        settings->sharedPayloadThreshold = 1024;
+        ThreadGlobals::assignSettings(settings.get());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings));
+
+        Authentication auth(*settings.get());
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        auto bufToString = [](CirBuf &buf)
+        {
+            std::string result(buf.usedBytes(), 0);
+            buf.read(&result[0], result.size());
+            return result;
+        };
+
+        std::shared_ptr<Client> publisher(new Client(0, t, nullptr, false, nullptr, settings.get(), false));
+        publisher->setClientProperties(ProtocolVersion::Mqtt5, "publisher", "user", true, 60);
+
+        const std::string payload = getSecureRandomString(5000);
+        Publish pub("shared/payload", payload, 1);
+        MqttPacket staging(ProtocolVersion::Mqtt5, pub);
+        staging.setPacketId(3);
+        QVERIFY(staging.getSharedPayload());
+
+        CirBuf stagingBuf(1024);
+        staging.readIntoBuf(stagingBuf);
+        MYCASTCOMPARE(stagingBuf.usedBytes(), staging.getSizeIncludingNonPresentHeader());
+        const std::string stagingBytes = bufToString(stagingBuf);
+
+        std::vector<MqttPacket> parsed;
+        stagingBuf.write(stagingBytes.data(), stagingBytes.size());
+        MqttPacket::bufferToMqttPackets(stagingBuf, parsed, publisher);
+        QVERIFY(parsed.size() == 1);
+        MqttPacket &received = parsed.front();
+        received.parsePublishData();
+        received.parsePublishData();
+
+        // The payload is not in the packet bytes anymore, and not copied elsewhere: it is in the received bytes.
+        QVERIFY(received.getSharedPayload());
+        QVERIFY(received.getBites().size() < 100);
+        MYCASTCOMPARE(received.getPayloadLen(), payload.size());
+        QCOMPARE(received.getPayloadCopy(), payload);
+
+        CirBuf receivedBuf(1024);
+        received.readIntoBuf(receivedBuf);
+        QCOMPARE(bufToString(receivedBuf), stagingBytes);
+
+        // A copy references the same payload, and doesn't depend on the original.
+        {
+            std::unique_ptr<MqttPacket> copy = std::make_unique<MqttPacket>(received);
+            QVERIFY(copy->getSharedPayload() == received.getSharedPayload());
+            std::vector<MqttPacket> discard;
+            discard.push_back(std::move(received));
+            discard.clear();
+            parsed.clear();
+            copy->readIntoBuf(receivedBuf);
+            QCOMPARE(bufToString(receivedBuf), stagingBytes);
+            parsed.push_back(std::move(*copy));
+        }
+
+        // The subscriber's write queue references the payload, and the bytes on the socket are the same.
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0)
+            throw std::runtime_error("socketpair failed");
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof (struct epoll_event));
+        ev.data.fd = fds[0];
+        check<std::runtime_error>(epoll_ctl(t->epollfd, EPOLL_CTL_ADD, fds[0], &ev));
+
+        std::shared_ptr<Client> subscriber(new Client(fds[0], t, nullptr, false, nullptr, settings.get(), false));
+        subscriber->setClientProperties(ProtocolVersion::Mqtt5, "subscriber", "user", true, 60);
+
+        PublishCopyFactory factory(&parsed.front());
+        subscriber->writeMqttPacketAndBlameThisClient(factory, 1, 3);
+        subscriber->writeMqttPacketAndBlameThisClient(factory, 0, 0);
+        MYCASTCOMPARE(subscriber->sharedPayloadWrites.size(), 2);
+        QVERIFY(subscriber->sharedPayloadWrites.front().payload == parsed.front().getSharedPayload());
+        QVERIFY(subscriber->writeBufIntoFd());
+
+        std::string onSocket(stagingBytes.size() * 3, 0);
+        const ssize_t n = read(fds[1], &onSocket[0], onSocket.size());
+        QVERIFY(n > 0);
+        onSocket.resize(n);
+
+        Publish pubQos0("shared/payload", payload, 0);
+        CirBuf expectedBuf(1024);
+        MqttPacket(ProtocolVersion::Mqtt5, pubQos0).readIntoBuf(expectedBuf);
+        QCOMPARE(onSocket, stagingBytes + bufToString(expectedBuf));
+
+        // A Publish, like the ones fanned out to other threads, is also made into a packet once, for the receivers that can share it.
+        PublishCopyFactory publishFactory(&pub);
+        MqttPacket *shared = publishFactory.getOptimumPacket(1, ProtocolVersion::Mqtt5, 0, false);
+        QVERIFY(shared->getSharedPayload());
+        QVERIFY(publishFactory.getOptimumPacket(1, ProtocolVersion::Mqtt5, 0, false) == shared);
+        QVERIFY(publishFactory.getOptimumPacket(1, ProtocolVersion::Mqtt311, 0, false) != shared);
+        QVERIFY(publishFactory.getOptimumPacket(1, ProtocolVersion::Mqtt5, 1, false) != shared);
+
+        subscriber->sharedPayloadWrites.clear();
+        subscriber->writeMqttPacketAndBlameThisClient(publishFactory, 1, 4);
+        subscriber->writeMqttPacketAndBlameThisClient(publishFactory, 1, 5);
+        MYCASTCOMPARE(subscriber->sharedPayloadWrites.size(), 2);
+        QVERIFY(subscriber->sharedPayloadWrites.front().payload == subscriber->sharedPayloadWrites.back().payload);
+
+        close(fds[1]);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+/**
+ * @brief MainTests::testZeroCopyPins checks which payloads stay referenced for the completion notifications, and that a removed client
+ * leaves them with its thread.
+ */
+void MainTests::testZeroCopyPins()
+{
+    try
+    {
+        std::shared_ptr<const char> one(new char[10], std::default_delete<char[]>());
+        std::shared_ptr<const char> two(new char[10], std::default_delete<char[]>());
+        std::weak_ptr<const char> weakOne = one;
+        std::weak_ptr<const char> weakTwo = two;
+
+        // Sends 0 and 1 are of the first payload, 2 of the second.
+        ZeroCopyPins pins;
+        pins.pin(one);
+        pins.pin(one);
+        pins.pin(two);
+        one.reset();
+        two.reset();
+        MYCASTCOMPARE(pins.size(), 2);
+
+        pins.release(0);
+        QVERIFY(!weakOne.expired());
+        pins.release(1);
+        QVERIFY(weakOne.expired());
+        QVERIFY(!weakTwo.expired());
+        pins.release(2);
+        QVERIFY(weakTwo.expired());
+        QVERIFY(pins.empty());
+
+        // The numbers wrap around, and survive a handover.
+        ZeroCopyPins handedOver;
+        handedOver.restore(0xFFFFFFFE, {0xFFFFFFFD});
+        std::shared_ptr<const char> three(new char[10], std::default_delete<char[]>());
+        handedOver.pin(three);
+        handedOver.pin(three);
+        MYCASTCOMPARE(handedOver.getSendCounter(), 0);
+        QVERIFY(handedOver.getPinnedSendNumbers() == std::vector<uint32_t>({0xFFFFFFFD, 0xFFFFFFFF}));
+        handedOver.release(0xFFFFFFFE);
+        MYCASTCOMPARE(handedOver.size(), 1);
+        handedOver.release(0);
+        QVERIFY(handedOver.empty());
+
+        std::shared_ptr<Settings> settings(new Settings());
+        ThreadGlobals::assignSettings(settings.get());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings));
+
+        Authentication auth(*settings.get());
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0)
+            throw std::runtime_error("socketpair failed");
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof (struct epoll_event));
+        ev.data.fd = fds[0];
+        check<std::runtime_error>(epoll_ctl(t->epollfd, EPOLL_CTL_ADD, fds[0], &ev));
+
+        // The removed client's payload stays referenced, until the kernel says it's done.
+        std::shared_ptr<const char> four(new char[10], std::default_delete<char[]>());
+        std::weak_ptr<const char> weakFour = four;
+        std::shared_ptr<Client> c(new Client(fds[0], t, nullptr, false, nullptr, settings.get(), false));
+        c->zeroCopyPins.pin(four);
+        four.reset();
+        c.reset();
+        t->runQueuedTasks();
+        QVERIFY(!weakFour.expired());
+        MYCASTCOMPARE(t->zeroCopyDrains.size(), 1);
+
+        t->reapZeroCopyDrains();
+        MYCASTCOMPARE(t->zeroCopyDrains.size(), 1);
+
+        t->zeroCopyDrains.front().pins.release(0);
+        t->reapZeroCopyDrains();
+        QVERIFY(weakFour.expired());
+        QVERIFY(t->zeroCopyDrains.empty());
+
+        close(fds[1]);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+void MainTests::testClusterInterest()
+{
+    ClusterInterest interest;
+
+    QVERIFY(interest.add("one/two/three"));
+    QVERIFY(interest.add("one/+/four"));
+    QVERIFY(interest.add("five/#"));
+    QVERIFY(!interest.add("one/+/four"));
+    MYCASTCOMPARE(interest.size(), 3);
+
+    auto matches = [&interest](const std::string &topic) {
+        std::vector<std::string> subtopics;
+        splitTopic(topic, subtopics);
+        return interest.matches(subtopics);
+    };
+
+    QVERIFY(matches("one/two/three"));
+    QVERIFY(matches("one/bla/four"));
+    QVERIFY(matches("five"));
+    QVERIFY(matches("five/six/seven"));
+    QVERIFY(!matches("one/two"));
+    QVERIFY(!matches("one/two/three/four"));
+    QVERIFY(!matches("six"));
+
+    QVERIFY(interest.remove("one/+/four"));
+    QVERIFY(!interest.remove("one/+/four"));
+    QVERIFY(!interest.remove("one/two"));
+    MYCASTCOMPARE(interest.size(), 2);
+
+    QVERIFY(!matches("one/bla/four"));
+    QVERIFY(matches("one/two/three"));
+
+    interest.clear();
+    QVERIFY(!matches("one/two/three"));
+    MYCASTCOMPARE(interest.size(), 0);
+}
+
+void MainTests::testClusterMessage()
+{
+    try
+    {
+        Publish publish("one/two/three", getSecureRandomString(70000), 2);
+        publish.setExpireAfter(3600);
+
+        ClusterMessage msg(ClusterMessageType::SessionState);
+        msg.writeString("clientid");
+        msg.writeUint16(1234);
+        msg.writeUint32(0xDEADBEEF);
+        msg.writePublish(publish);
+
+        const std::vector<char> &frame = msg.getFrame();
+        ClusterMessage received(frame.data(), frame.size());
+
+        QCOMPARE(received.getType(), ClusterMessageType::SessionState);
+        QCOMPARE(received.readString(), std::string("clientid"));
+        QCOMPARE(received.readUint16(), static_cast<uint16_t>(1234));
+        QCOMPARE(received.readUint32(), static_cast<uint32_t>(0xDEADBEEF));
+
+        Publish loaded = received.readPublish();
+        QCOMPARE(loaded.topic, publish.topic);
+        QCOMPARE(loaded.payload, publish.payload);
+        QCOMPARE(loaded.qos, publish.qos);
+        QVERIFY(loaded.getHasExpireInfo());
+
+        // Reading past the end is an error, not a crash.
+        QVERIFY_EXCEPTION_THROWN(received.readUint8(), std::runtime_error);
+
+        // Other nodes can't make us deliver on topics a client couldn't publish on.
+        for (const std::string &topic : {std::string("one/+/three"), std::string("one/#"), std::string(""), std::string("one/\xC3\x28")})
+        {
+            ClusterMessage bad(ClusterMessageType::Publish);
+            bad.writeString(topic);
+            bad.writeString("payload");
+            bad.writeUint8(0);
+            bad.writeUint8(0);
+            bad.writeUint32(0);
+
+            const std::vector<char> &badFrame = bad.getFrame();
+            ClusterMessage badReceived(badFrame.data(), badFrame.size());
+            QVERIFY_EXCEPTION_THROWN(badReceived.readPublish(), std::runtime_error);
+        }
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+/**
+ * @brief MainTests::testHandoverMessage sends a message with an fd over a Unix socket, and reads it back.
+ */
+void MainTests::testHandoverMessage()
+{
+    try
+    {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+            throw std::runtime_error("socketpair failed");
+
+        int pipeFds[2];
+        if (pipe(pipeFds) != 0)
+            throw std::runtime_error("pipe failed");
+
+        const std::string big = getSecureRandomString(100000);
+
+        HandoverMessage msg(HandoverMessageType::Client);
+        msg.writeUint8(5);
+        msg.writeUint16(1234);
+        msg.writeUint32(0xDEADBEEF);
+        msg.writeString(big);
+        msg.writeString("");
+
+        // The message is bigger than the socket buffer, so the sending and receiving have to overlap.
+        std::thread sender([&]() { msg.sendTo(sockets[0], pipeFds[1]); });
+
+        HandoverMessage received;
+        const int fd = received.receiveFrom(sockets[1]);
+        sender.join();
+
+        QCOMPARE(received.getType(), HandoverMessageType::Client);
+        QCOMPARE(received.readUint8(), static_cast<uint8_t>(5));
+        QCOMPARE(received.readUint16(), static_cast<uint16_t>(1234));
+        QCOMPARE(received.readUint32(), static_cast<uint32_t>(0xDEADBEEF));
+        QCOMPARE(received.readString(), big);
+
+        // The empty string is the last thing in the message.
+        QCOMPARE(received.readString(), std::string());
+        QVERIFY_EXCEPTION_THROWN(received.readUint8(), std::runtime_error);
+
+        // The received fd is another descriptor for the same pipe.
+        QVERIFY(fd >= 0 && fd != pipeFds[1]);
+        QVERIFY(write(fd, "x", 1) == 1);
+        char c = 0;
+        QVERIFY(read(pipeFds[0], &c, 1) == 1);
+        QCOMPARE(c, 'x');
+
+        // Without an fd.
+        HandoverMessage done(HandoverMessageType::Done);
+        done.sendTo(sockets[0]);
+        HandoverMessage receivedDone;
+        QCOMPARE(receivedDone.receiveFrom(sockets[1]), -1);
+        QCOMPARE(receivedDone.getType(), HandoverMessageType::Done);
+
+        close(fd);
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        close(sockets[0]);
+        close(sockets[1]);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+/**
+ * @brief MainTests::testBridge forwards publishes to the test server, and to a fake server that doesn't acknowledge them by itself, to
+ * see the topic filters, the window of unacknowledged publishes, and the resending in order after a reconnect.
+ */
+void MainTests::testBridge()
+{
+    int listenFd = -1;
+    int upstreamFd = -1;
+
+    try
+    {
+        Settings settings;
+
+        {
+            BridgeConfig config;
+            config.address = "127.0.0.1";
+            config.port = 1883;
+            config.clientId = "bridge-to-test-server";
+            config.topics = {"sensors/#", "+/status"};
+
+            std::shared_ptr<Bridge> bridge = std::make_shared<Bridge>(settings, config);
+            std::shared_ptr<SubscriptionStore> store = std::make_shared<SubscriptionStore>();
+            store->addBridge(bridge);
+            bridge->start();
+
+            FlashMQTestClient receiver;
+            receiver.start();
+            receiver.connectClient(ProtocolVersion::Mqtt311);
+            receiver.subscribe("#", 1);
+            receiver.clearReceivedLists();
+
+            for (const std::string topic : {"sensors/one/temp", "other/thing", "lamp/status", "lamp/status/extra", "sensors"})
+            {
+                Publish pub(topic, "payload of " + topic, 1);
+                PublishCopyFactory factory(&pub);
+                store->queuePacketAtSubscribers(factory);
+            }
+
+            receiver.waitForMessageCount(3, 5);
+            QThread::msleep(200);
+
+            std::vector<std::string> topics;
+            for (MqttPacket &p : receiver.receivedPublishes)
+            {
+                topics.push_back(p.getPublishData().topic);
+            }
+
+            QVERIFY(topics == std::vector<std::string>({"sensors/one/temp", "lamp/status", "sensors"}));
+            QCOMPARE(receiver.receivedPublishes.front().getPayloadCopy(), std::string("payload of sensors/one/temp"));
+
+            bridge->quit();
+        }
+
+        listenFd = check<std::runtime_error>(socket(AF_INET, SOCK_STREAM, 0));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addrLen = sizeof(addr);
+        check<std::runtime_error>(bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)));
+        check<std::runtime_error>(listen(listenFd, 4));
+        check<std::runtime_error>(getsockname(listenFd, reinterpret_cast<struct sockaddr*>(&addr), &addrLen));
+
+        std::string received;
+
+        // Reads until there are 'count' whole packets, or nothing more comes in time. A packet is the first byte and the rest.
+        auto readPackets = [&](size_t count, int timeoutMs)
+        {
+            std::vector<std::pair<uint8_t, std::string>> packets;
+
+            while (true)
+            {
+                while (received.size() >= 2)
+                {
+                    size_t remainingLength = 0;
+                    size_t headerLength = 1;
+                    bool complete = false;
+
+                    for (int shift = 0; shift <= 21 && headerLength < received.size(); shift += 7)
+                    {
+                        const uint8_t b = received[headerLength++];
+                        remainingLength += (b & 0x7F) << shift;
+
+                        if (!(b & 0x80))
+                        {
+                            complete = true;
+                            break;
+                        }
+                    }
+
+                    if (!complete || received.size() < headerLength + remainingLength)
+                        break;
+
+                    packets.emplace_back(static_cast<uint8_t>(received[0]), received.substr(headerLength, remainingLength));
+                    received.erase(0, headerLength + remainingLength);
+                }
+
+                if (packets.size() >= count)
+                    break;
+
+                struct pollfd pfd;
+                memset(&pfd, 0, sizeof(pfd));
+                pfd.fd = upstreamFd;
+                pfd.events = POLLIN;
+
+                if (poll(&pfd, 1, timeoutMs) <= 0)
+                    break;
+
+                char buf[4096];
+                const ssize_t n = read(upstreamFd, buf, sizeof(buf));
+                if (n <= 0)
+                    break;
+                received.append(buf, n);
+            }
+
+            return packets;
+        };
+
+        auto acceptUpstream = [&]()
+        {
+            struct pollfd pfd;
+            memset(&pfd, 0, sizeof(pfd));
+            pfd.fd = listenFd;
+            pfd.events = POLLIN;
+
+            if (poll(&pfd, 1, 5000) <= 0)
+                throw std::runtime_error("The bridge didn't connect.");
+
+            upstreamFd = check<std::runtime_error>(accept(listenFd, nullptr, nullptr));
+            received.clear();
+
+            const std::vector<std::pair<uint8_t, std::string>> connect = readPackets(1, 5000);
+            if (connect.size() != 1 || (connect.front().first >> 4) != static_cast<uint8_t>(PacketType::CONNECT))
+                throw std::runtime_error("The bridge didn't send CONNECT.");
+
+            const char connack[4] = {0x20, 0x02, 0x00, 0x00};
+            check<std::runtime_error>(write(upstreamFd, connack, sizeof(connack)));
+        };
+
+        auto getTopics = [](const std::vector<std::pair<uint8_t, std::string>> &packets)
+        {
+            std::vector<std::string> topics;
+            for (const std::pair<uint8_t, std::string> &packet : packets)
+            {
+                const std::string &body = packet.second;
+                const size_t len = (static_cast<uint8_t>(body.at(0)) << 8) | static_cast<uint8_t>(body.at(1));
+                topics.push_back(body.substr(2, len));
+            }
+            return topics;
+        };
+
+        auto acknowledge = [&](const std::vector<std::pair<uint8_t, std::string>> &packets)
+        {
+            for (const std::pair<uint8_t, std::string> &packet : packets)
+            {
+                const std::string &body = packet.second;
+                const size_t len = (static_cast<uint8_t>(body.at(0)) << 8) | static_cast<uint8_t>(body.at(1));
+                const char puback[4] = {0x40, 0x02, body.at(2 + len), body.at(3 + len)};
+                check<std::runtime_error>(write(upstreamFd, puback, sizeof(puback)));
+            }
+        };
+
+        BridgeConfig config;
+        config.address = "127.0.0.1";
+        config.port = ntohs(addr.sin_port);
+        config.clientId = "bridge-to-fake-server";
+        config.topics = {"#"};
+        config.maxInflight = 4;
+
+        std::shared_ptr<Bridge> bridge = std::make_shared<Bridge>(settings, config);
+        bridge->start();
+
+        acceptUpstream();
+
+        for (int i = 0; i < 10; i++)
+        {
+            Publish pub(formatString("q/%d", i), "payload", 1);
+            PublishCopyFactory factory(&pub);
+            bridge->forward(factory);
+        }
+
+        // No more than the window is sent without acknowledgement, and each acknowledgement lets another one go.
+        const std::vector<std::pair<uint8_t, std::string>> first = readPackets(5, 500);
+        QVERIFY(getTopics(first) == std::vector<std::string>({"q/0", "q/1", "q/2", "q/3"}));
+
+        acknowledge({first.at(0), first.at(1)});
+        const std::vector<std::pair<uint8_t, std::string>> second = readPackets(3, 500);
+        QVERIFY(getTopics(second) == std::vector<std::string>({"q/4", "q/5"}));
+
+        // After a reconnect, the unacknowledged ones are sent again first, in order.
+        close(upstreamFd);
+        upstreamFd = -1;
+        acceptUpstream();
+
+        const std::vector<std::pair<uint8_t, std::string>> resent = readPackets(5, 500);
+        QVERIFY(getTopics(resent) == std::vector<std::string>({"q/2", "q/3", "q/4", "q/5"}));
+
+        acknowledge(resent);
+        const std::vector<std::pair<uint8_t, std::string>> rest = readPackets(5, 500);
+        QVERIFY(getTopics(rest) == std::vector<std::string>({"q/6", "q/7", "q/8", "q/9"}));
+
+        acknowledge(rest);
+        QVERIFY(readPackets(1, 300).empty());
+
+        bridge->quit();
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+
+    if (upstreamFd >= 0)
+        close(upstreamFd);
+    if (listenFd >= 0)
+        close(listenFd);
+}
+
 void MainTests::testParsePacketHelper(const std::string &topic, char from_qos, bool retain)
 {
     Logger::getInstance()->setFlags(false, false, true);
@@ -1212,6 +2668,111 @@ void testDowngradeQoSOnSubscribeHelper(const char pub_qos, const char sub_qos)
     QVERIFY(recv.payload() == payload);
 }
 
+/**
+ * @brief MainTests::testPacketWriter checks that packets written without an MqttPacket have the same bytes as those with.
+ */
+void MainTests::testPacketWriter()
+{
+    auto bufToString = [](CirBuf &buf)
+    {
+        std::string result(buf.usedBytes(), 0);
+        buf.read(&result[0], result.size());
+        return result;
+    };
+
+    const std::vector<PacketType> responseTypes = {PacketType::PUBACK, PacketType::PUBREC, PacketType::PUBREL, PacketType::PUBCOMP};
+
+    for (const PacketType type : responseTypes)
+    {
+        for (const ReasonCodes reason : {ReasonCodes::Success, ReasonCodes::PacketIdentifierNotFound})
+        {
+            CirBuf expected(64);
+            PubResponse responseMqtt5(ProtocolVersion::Mqtt5, type, reason, 1234);
+            MqttPacket(responseMqtt5).readIntoBuf(expected);
+
+            CirBuf written(64);
+            written.ensureFreeSpace(PacketWriter<ProtocolVersion::Mqtt5>::getPubResponseLength(reason));
+
+            switch (type)
+            {
+            case PacketType::PUBACK:
+                PacketWriter<ProtocolVersion::Mqtt5>::writePubResponse<PacketType::PUBACK>(written, reason, 1234);
+                break;
+            case PacketType::PUBREC:
+                PacketWriter<ProtocolVersion::Mqtt5>::writePubResponse<PacketType::PUBREC>(written, reason, 1234);
+                break;
+            case PacketType::PUBREL:
+                PacketWriter<ProtocolVersion::Mqtt5>::writePubResponse<PacketType::PUBREL>(written, reason, 1234);
+                break;
+            default:
+                PacketWriter<ProtocolVersion::Mqtt5>::writePubResponse<PacketType::PUBCOMP>(written, reason, 1234);
+            }
+
+            QCOMPARE(bufToString(written), bufToString(expected));
+        }
+    }
+
+    {
+        CirBuf expected(64);
+        PubResponse response(ProtocolVersion::Mqtt311, PacketType::PUBREL, ReasonCodes::PacketIdentifierNotFound, 4321);
+        MqttPacket(response).readIntoBuf(expected);
+
+        CirBuf written(64);
+        PacketWriter<ProtocolVersion::Mqtt311>::writePubResponse<PacketType::PUBREL>(written, ReasonCodes::PacketIdentifierNotFound, 4321);
+        QCOMPARE(bufToString(written), bufToString(expected));
+    }
+
+    for (int qos = 0; qos < 3; qos++)
+    {
+        for (const size_t payloadLength : {0, 10, 200, 20000})
+        {
+            for (const uint16_t topicAlias : {0, 3})
+            {
+                Publish publish("a/b/c", std::string(payloadLength, 'x'), qos);
+                publish.retain = payloadLength > 100;
+                publish.topicAlias = topicAlias;
+                publish.skipTopic = topicAlias > 0 && qos == 2;
+                publish.constructPropertyBuilder();
+                publish.propertyBuilder->writeContentType("text/plain");
+                publish.setExpireAfter(60);
+
+                CirBuf expected(64);
+                MqttPacket packet(ProtocolVersion::Mqtt5, publish);
+                if (qos > 0)
+                    packet.setPacketId(7);
+                packet.readIntoBuf(expected);
+
+                CirBuf written(64);
+                const ClientSpecificProperties clientProperties = publish.getClientSpecificProperties();
+                QVERIFY(clientProperties.getLen() > 0);
+                VariableByteInt remainingLength;
+                const size_t length = PacketWriter<ProtocolVersion::Mqtt5>::getPublishLength(publish, qos, clientProperties, remainingLength);
+                QCOMPARE(length, packet.getSizeIncludingNonPresentHeader());
+                written.ensureFreeSpace(length);
+                PacketWriter<ProtocolVersion::Mqtt5>::writePublish(written, publish, qos, clientProperties, remainingLength, qos > 0 ? 7 : 0);
+                QCOMPARE(bufToString(written), bufToString(expected));
+
+                // MQTT3 has no properties, and no aliases.
+                publish.topicAlias = 0;
+                publish.skipTopic = false;
+
+                CirBuf expected3(64);
+                MqttPacket packet3(ProtocolVersion::Mqtt311, publish);
+                if (qos > 0)
+                    packet3.setPacketId(7);
+                packet3.readIntoBuf(expected3);
+
+                CirBuf written3(64);
+                const ClientSpecificProperties noProperties;
+                const size_t length3 = PacketWriter<ProtocolVersion::Mqtt311>::getPublishLength(publish, qos, noProperties, remainingLength);
+                written3.ensureFreeSpace(length3);
+                PacketWriter<ProtocolVersion::Mqtt311>::writePublish(written3, publish, qos, noProperties, remainingLength, qos > 0 ? 7 : 0);
+                QCOMPARE(bufToString(written3), bufToString(expected3));
+            }
+        }
+    }
+}
+
 void MainTests::testDowngradeQoSOnSubscribeQos2to2()
 {
     testDowngradeQoSOnSubscribeHelper(2, 2);
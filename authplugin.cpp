@@ -482,7 +482,7 @@ void Authentication::loadMosquittoPasswordFile()
                 {
                     if (field.size() == 0)
                     {
-                        throw std::runtime_error(formatString("An empty field was found in '%'", line.c_str()));
+                        throw std::runtime_error(formatString("An empty field was found in '%s'", line.c_str()));
                     }
                 }
 
@@ -0,0 +1,587 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "bridge.h"
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include "utils.h"
+#include "exceptions.h"
+#include "settings.h"
+#include "mqttpacket.h"
+#include "publishcopyfactory.h"
+#include "threadglobals.h"
+
+#define BRIDGE_MAX_EVENTS 16
+#define BRIDGE_READ_CHUNK 16384
+#define BRIDGE_WRITE_BUFFER_TARGET 1048576 // Stop serializing publishes when this much is waiting to be written.
+
+InFlightPublish::InFlightPublish(uint16_t packetId, Publish &&publish) :
+    packetId(packetId),
+    publish(publish)
+{
+
+}
+
+Bridge::Bridge(const Settings &settings, const BridgeConfig &config) :
+    config(config),
+    settings(settings),
+    writeBuf(16384)
+{
+    for (const std::string &topic : config.topics)
+    {
+        topics.add(topic);
+    }
+
+    epollfd = check<std::runtime_error>(epoll_create(999));
+    eventFd = check<std::runtime_error>(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = eventFd;
+    ev.events = EPOLLIN;
+    check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_ADD, eventFd, &ev));
+}
+
+Bridge::~Bridge()
+{
+    quit();
+
+    if (fd >= 0)
+        close(fd);
+    if (eventFd >= 0)
+        close(eventFd);
+    if (epollfd >= 0)
+        close(epollfd);
+}
+
+void Bridge::start()
+{
+    running = true;
+    thread = std::thread(&Bridge::run, this);
+    pthread_setname_np(thread.native_handle(), "Bridge");
+}
+
+void Bridge::quit()
+{
+    if (!running)
+        return;
+
+    running = false;
+
+    uint64_t one = 1;
+    check<std::runtime_error>(write(eventFd, &one, sizeof(uint64_t)));
+
+    if (thread.joinable())
+        thread.join();
+}
+
+/**
+ * @brief Bridge::matches says whether publishes on this topic are forwarded. The topics don't change, so this needs no lock.
+ */
+bool Bridge::matches(const std::vector<std::string> &subtopics) const
+{
+    return topics.matches(subtopics);
+}
+
+/**
+ * @brief Bridge::forward gives a publish to the bridge thread. Called from the worker threads.
+ */
+void Bridge::forward(PublishCopyFactory &copyFactory)
+{
+    Publish publish(copyFactory.getPublishData());
+    publish.topicAlias = 0;
+    publish.skipTopic = false;
+
+    {
+        std::lock_guard<std::mutex> locker(incomingMutex);
+        incoming.push_back(std::move(publish));
+    }
+
+    wakeUp();
+}
+
+void Bridge::wakeUp()
+{
+    if (wakeUpPending.exchange(true))
+        return;
+
+    uint64_t one = 1;
+    check<std::runtime_error>(write(eventFd, &one, sizeof(uint64_t)));
+}
+
+void Bridge::run()
+{
+    ThreadGlobals::assignSettings(&settings);
+
+    struct epoll_event events[BRIDGE_MAX_EVENTS];
+    memset(&events, 0, sizeof (struct epoll_event)*BRIDGE_MAX_EVENTS);
+
+    std::chrono::time_point<std::chrono::steady_clock> nextDropLog;
+
+    while (running)
+    {
+        const int num_fds = epoll_wait(epollfd, events, BRIDGE_MAX_EVENTS, 100);
+
+        if (num_fds < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            logger->logf(LOG_ERR, "Waiting for bridge to '%s' error: %s", config.getName().c_str(), strerror(errno));
+        }
+
+        try
+        {
+            for (int i = 0; i < num_fds; i++)
+            {
+                if (events[i].data.fd == eventFd)
+                {
+                    uint64_t eventfd_value = 0;
+                    check<std::runtime_error>(read(eventFd, &eventfd_value, sizeof(uint64_t)));
+                    wakeUpPending = false;
+                }
+                else if (events[i].data.fd == fd && fd >= 0)
+                {
+                    handleEvents(events[i].events);
+                }
+            }
+
+            takeIncoming();
+
+            const auto now = std::chrono::steady_clock::now();
+
+            if (state == BridgeState::Disconnected && now >= nextConnectAttempt)
+                connectUpstream();
+
+            if (state == BridgeState::Connected)
+                fillWriteBuffer();
+
+            flush();
+            checkKeepAlive();
+
+            if (droppedPublishes > droppedPublishesLogged && now >= nextDropLog)
+            {
+                logger->logf(LOG_WARNING, "Bridge to '%s' dropped %lu publishes, because its buffer is full.", config.getName().c_str(),
+                             droppedPublishes - droppedPublishesLogged);
+                droppedPublishesLogged = droppedPublishes;
+                nextDropLog = now + std::chrono::seconds(10);
+            }
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Error in bridge to '%s': %s", config.getName().c_str(), ex.what());
+            disconnect(ex.what());
+        }
+    }
+
+    takeIncoming();
+
+    const size_t left = queue.size() + inFlight.size() + (spillFile ? spillFile->size() : 0);
+    if (left > 0)
+        logger->logf(LOG_WARNING, "Bridge to '%s' had %lu publishes left to forward.", config.getName().c_str(), left);
+}
+
+void Bridge::takeIncoming()
+{
+    std::vector<Publish> publishes;
+
+    {
+        std::lock_guard<std::mutex> locker(incomingMutex);
+        publishes.swap(incoming);
+    }
+
+    for (Publish &publish : publishes)
+    {
+        addToQueue(std::move(publish));
+    }
+}
+
+/**
+ * @brief Bridge::addToQueue buffers a publish until it can be sent. Once publishes are spilled to disk, new ones go there too, to keep the order.
+ */
+void Bridge::addToQueue(Publish &&publish)
+{
+    const bool spilling = spillFile && spillFile->size() > 0;
+
+    if (!spilling && queue.size() < config.maxBufferedMessages)
+    {
+        queue.push_back(std::move(publish));
+        return;
+    }
+
+    if (!settings.storageDir.empty())
+    {
+        if (!spillFile)
+            spillFile = std::make_unique<QoSSpillFile>(settings);
+
+        spillFile->write(publish);
+        return;
+    }
+
+    queue.pop_front();
+    droppedPublishes++;
+    queue.push_back(std::move(publish));
+}
+
+bool Bridge::takeFromQueue(Publish &publish)
+{
+    if (!queue.empty())
+    {
+        publish = queue.front();
+        queue.pop_front();
+        return true;
+    }
+
+    if (spillFile)
+        return spillFile->read(publish);
+
+    return false;
+}
+
+void Bridge::connectUpstream()
+{
+    std::chrono::milliseconds reconnectInterval(5000);
+#ifdef TESTING
+    reconnectInterval = std::chrono::milliseconds(200);
+#endif
+    nextConnectAttempt = std::chrono::steady_clock::now() + reconnectInterval;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    const std::string service = std::to_string(config.port);
+
+    struct addrinfo *addrs = nullptr;
+    const int rc = getaddrinfo(config.address.c_str(), service.c_str(), &hints, &addrs);
+    if (rc != 0)
+    {
+        logger->logf(LOG_WARNING, "Can't resolve bridge address '%s': %s", config.address.c_str(), gai_strerror(rc));
+        return;
+    }
+
+    fd = socket(addrs->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, addrs->ai_addr, addrs->ai_addrlen) < 0 && errno != EINPROGRESS)
+    {
+        logger->logf(LOG_DEBUG, "Connecting bridge to '%s' failed: %s", config.getName().c_str(), strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addrs);
+
+    if (fd < 0)
+        return;
+
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = EPOLLIN | EPOLLOUT;
+    check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev));
+
+    waitingForWritable = true;
+    state = BridgeState::Connecting;
+}
+
+/**
+ * @brief Bridge::disconnect closes the connection. Unacknowledged publishes go back to the front of the queue, to be sent again after
+ * reconnecting.
+ */
+void Bridge::disconnect(const std::string &reason)
+{
+    if (state == BridgeState::Disconnected)
+        return;
+
+    if (state == BridgeState::Connected)
+        logger->logf(LOG_NOTICE, "Bridge to '%s' disconnected: %s", config.getName().c_str(), reason.c_str());
+    else
+        logger->logf(LOG_DEBUG, "Bridge to '%s' failed to connect: %s", config.getName().c_str(), reason.c_str());
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    fd = -1;
+    state = BridgeState::Disconnected;
+
+    readBuf.clear();
+    writeBuf.reset();
+
+    for (auto it = inFlight.rbegin(); it != inFlight.rend(); it++)
+    {
+        queue.push_front(std::move(it->publish));
+    }
+    inFlight.clear();
+}
+
+void Bridge::handleEvents(uint32_t events)
+{
+    if (state == BridgeState::Connecting)
+    {
+        int error = 0;
+        socklen_t len = sizeof(int);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+        if (error != 0)
+        {
+            disconnect(strerror(error));
+            return;
+        }
+
+        if (!(events & EPOLLOUT))
+            return;
+
+        Connect connect(config.protocolVersion, config.clientId);
+        connect.username = config.username;
+        connect.password = config.password;
+        connect.keepalive = config.keepalive;
+        MqttPacket connectPacket(connect);
+        connectPacket.readIntoBuf(writeBuf);
+
+        // The keep-alive counts from here, not from the epoch.
+        lastRead = std::chrono::steady_clock::now();
+        lastWrite = lastRead;
+        state = BridgeState::WaitingForConnAck;
+        return;
+    }
+
+    if (events & EPOLLIN)
+        readFromUpstream();
+
+    if ((events & (EPOLLERR | EPOLLHUP)) && state != BridgeState::Disconnected)
+        disconnect("socket is in ERR or HUP state");
+}
+
+void Bridge::readFromUpstream()
+{
+    for (int i = 0; i < 16 && state != BridgeState::Disconnected; i++)
+    {
+        const size_t oldSize = readBuf.size();
+        readBuf.resize(oldSize + BRIDGE_READ_CHUNK);
+        const ssize_t n = recv(fd, &readBuf[oldSize], BRIDGE_READ_CHUNK, 0);
+        readBuf.resize(oldSize + std::max<ssize_t>(n, 0));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (n <= 0)
+        {
+            disconnect(n == 0 ? "connection closed by server" : strerror(errno));
+            return;
+        }
+
+        lastRead = std::chrono::steady_clock::now();
+
+        if (n < BRIDGE_READ_CHUNK)
+            break;
+    }
+
+    size_t pos = 0;
+
+    while (state != BridgeState::Disconnected && readBuf.size() - pos >= 2)
+    {
+        size_t remainingLength = 0;
+        size_t headerLength = 1;
+        bool complete = false;
+
+        for (int shift = 0; shift <= 21 && pos + headerLength < readBuf.size(); shift += 7)
+        {
+            const uint8_t b = readBuf[pos + headerLength++];
+            remainingLength += (b & 0x7F) << shift;
+
+            if (!(b & 0x80))
+            {
+                complete = true;
+                break;
+            }
+        }
+
+        if (!complete)
+        {
+            if (headerLength > 4)
+                throw ProtocolError("Invalid remaining length from bridge server.", ReasonCodes::MalformedPacket);
+            break;
+        }
+
+        if (readBuf.size() - pos - headerLength < remainingLength)
+            break;
+
+        handlePacket(readBuf[pos], &readBuf[pos + headerLength], remainingLength);
+        pos += headerLength + remainingLength;
+    }
+
+    if (state != BridgeState::Disconnected)
+        readBuf.erase(readBuf.begin(), readBuf.begin() + pos);
+}
+
+void Bridge::handlePacket(uint8_t firstByte, const char *data, size_t len)
+{
+    const PacketType type = static_cast<PacketType>(firstByte >> 4);
+
+    if (type == PacketType::CONNACK)
+    {
+        if (state != BridgeState::WaitingForConnAck || len < 2)
+            throw ProtocolError("Unexpected CONNACK from bridge server.", ReasonCodes::ProtocolError);
+
+        const uint8_t rc = data[1];
+        if (rc != 0)
+        {
+            disconnect(formatString("server refused the connection with code %d", rc));
+            return;
+        }
+
+        state = BridgeState::Connected;
+        logger->logf(LOG_NOTICE, "Bridge to '%s' connected. %lu publishes to catch up on.", config.getName().c_str(),
+                     queue.size() + (spillFile ? spillFile->size() : 0));
+    }
+    else if (type == PacketType::PUBACK)
+    {
+        if (len < 2)
+            throw ProtocolError("Invalid PUBACK from bridge server.", ReasonCodes::MalformedPacket);
+
+        const uint16_t packetId = (static_cast<uint8_t>(data[0]) << 8) | static_cast<uint8_t>(data[1]);
+        const uint8_t rc = len > 2 ? data[2] : 0;
+
+        auto pos = std::find_if(inFlight.begin(), inFlight.end(), [packetId](const InFlightPublish &p) { return p.packetId == packetId; });
+        if (pos == inFlight.end())
+            return;
+
+        if (rc >= 0x80)
+            logger->logf(LOG_WARNING, "Bridge server '%s' didn't accept publish on '%s': reason code %d", config.getName().c_str(),
+                         pos->publish.topic.c_str(), rc);
+
+        inFlight.erase(pos);
+    }
+    else if (type == PacketType::DISCONNECT)
+    {
+        disconnect("server sent DISCONNECT");
+    }
+}
+
+/**
+ * @brief Bridge::fillWriteBuffer serializes publishes until the window of unacknowledged ones is full, so they're written together.
+ */
+void Bridge::fillWriteBuffer()
+{
+    while (writeBuf.usedBytes() < BRIDGE_WRITE_BUFFER_TARGET && inFlight.size() < config.maxInflight)
+    {
+        Publish publish;
+        if (!takeFromQueue(publish))
+            break;
+
+        if (publish.hasExpired())
+            continue;
+
+        publish.qos = std::min<char>(publish.qos, config.maxQos);
+
+        MqttPacket packet(config.protocolVersion, publish);
+
+        if (publish.qos > 0)
+        {
+            if (++nextPacketId == 0)
+                nextPacketId++;
+
+            packet.setPacketId(nextPacketId);
+            inFlight.emplace_back(nextPacketId, std::move(publish));
+        }
+
+        packet.readIntoBuf(writeBuf);
+    }
+}
+
+void Bridge::flush()
+{
+    if (state == BridgeState::Disconnected || state == BridgeState::Connecting)
+        return;
+
+    while (writeBuf.usedBytes() > 0)
+    {
+        const ssize_t n = send(fd, writeBuf.tailPtr(), writeBuf.maxReadSize(), MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                setWaitForWritable(true);
+                return;
+            }
+
+            disconnect(formatString("write error: %s", strerror(errno)));
+            return;
+        }
+
+        writeBuf.advanceTail(n);
+        lastWrite = std::chrono::steady_clock::now();
+    }
+
+    setWaitForWritable(false);
+}
+
+void Bridge::setWaitForWritable(bool wait)
+{
+    if (waitingForWritable == wait)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = fd;
+    ev.events = wait ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev));
+
+    waitingForWritable = wait;
+}
+
+void Bridge::checkKeepAlive()
+{
+    if (state != BridgeState::WaitingForConnAck && state != BridgeState::Connected)
+        return;
+
+    const auto now = std::chrono::steady_clock::now();
+
+    if (now - lastRead > std::chrono::seconds(config.keepalive + config.keepalive / 2))
+    {
+        disconnect("no response from server");
+        return;
+    }
+
+    if (state == BridgeState::Connected && now - lastWrite > std::chrono::seconds(config.keepalive / 2))
+    {
+        const char pingreq[2] = {static_cast<char>(static_cast<uint8_t>(PacketType::PINGREQ) << 4), 0};
+        writeBuf.ensureFreeSpace(2);
+        writeBuf.write(pingreq, 2);
+        flush();
+    }
+}
@@ -0,0 +1,131 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "forward_declarations.h"
+#include "types.h"
+#include "cirbuf.h"
+#include "bridgeconfig.h"
+#include "cluster.h"
+#include "qosspillfile.h"
+#include "settings.h"
+#include "logger.h"
+
+enum class BridgeState
+{
+    Disconnected,
+    Connecting,
+    WaitingForConnAck,
+    Connected
+};
+
+/**
+ * @brief The InFlightPublish struct is a QoS 1 publish sent upstream that hasn't been acknowledged yet.
+ */
+struct InFlightPublish
+{
+    uint16_t packetId;
+    Publish publish;
+
+    InFlightPublish(uint16_t packetId, Publish &&publish);
+};
+
+/**
+ * @brief The Bridge class forwards publishes on the configured topics to an upstream server, over an MQTT connection in its own thread.
+ *
+ * To the subscription store, it's a subscriber that receives all publishes matching its topics. The worker threads only copy those
+ * into a list; the bridge thread serializes as many as fit in the window of unacknowledged QoS 1 publishes into one write buffer,
+ * and writes them with one send. While the upstream server is down, or doesn't keep up, publishes are kept in memory, and beyond
+ * that, spilled to disk, in order.
+ *
+ * Only publishes from clients of this server are forwarded; not the ones that came from other cluster nodes, or the bridge would
+ * forward them more than once.
+ */
+class Bridge
+{
+    const BridgeConfig config;
+    Settings settings; // Own copy, to assign as thread global in the bridge thread.
+    ClusterInterest topics;
+
+    int epollfd = -1;
+    int eventFd = -1;
+    int fd = -1;
+    std::thread thread;
+    std::atomic<bool> running {false};
+    std::atomic<bool> wakeUpPending {false};
+
+    std::mutex incomingMutex;
+    std::vector<Publish> incoming;
+
+    std::deque<Publish> queue;
+    std::unique_ptr<QoSSpillFile> spillFile;
+    std::deque<InFlightPublish> inFlight;
+    uint16_t nextPacketId = 0;
+    uint64_t droppedPublishes = 0;
+    uint64_t droppedPublishesLogged = 0;
+
+    BridgeState state = BridgeState::Disconnected;
+    std::chrono::time_point<std::chrono::steady_clock> nextConnectAttempt;
+    std::chrono::time_point<std::chrono::steady_clock> lastWrite;
+    std::chrono::time_point<std::chrono::steady_clock> lastRead;
+    bool waitingForWritable = false;
+
+    std::vector<char> readBuf;
+    CirBuf writeBuf;
+
+    Logger *logger = Logger::getInstance();
+
+    void wakeUp();
+    void run();
+    void takeIncoming();
+    void addToQueue(Publish &&publish);
+    bool takeFromQueue(Publish &publish);
+    void connectUpstream();
+    void disconnect(const std::string &reason);
+    void handleEvents(uint32_t events);
+    void readFromUpstream();
+    void handlePacket(uint8_t firstByte, const char *data, size_t len);
+    void fillWriteBuffer();
+    void flush();
+    void setWaitForWritable(bool wait);
+    void checkKeepAlive();
+
+public:
+    Bridge(const Settings &settings, const BridgeConfig &config);
+    Bridge(const Bridge &other) = delete;
+    ~Bridge();
+
+    void start();
+    void quit();
+
+    bool matches(const std::vector<std::string> &subtopics) const;
+    void forward(PublishCopyFactory &copyFactory);
+};
+
+#endif // BRIDGE_H
@@ -0,0 +1,45 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "bridgeconfig.h"
+
+#include "utils.h"
+#include "exceptions.h"
+
+void BridgeConfig::isValid()
+{
+    if (address.empty())
+        throw ConfigFileException("A bridge needs an 'address'.");
+
+    if (port <= 0 || port > 65535)
+        throw ConfigFileException(formatString("Bridge port nr %d is not valid", port));
+
+    if (clientId.empty())
+        throw ConfigFileException(formatString("Bridge to '%s' needs a 'client_id'.", address.c_str()));
+
+    if (topics.empty())
+        throw ConfigFileException(formatString("Bridge to '%s' has no 'topic' to forward.", address.c_str()));
+
+    if (!password.empty() && username.empty())
+        throw ConfigFileException(formatString("Bridge to '%s' has a password, but no username.", address.c_str()));
+}
+
+std::string BridgeConfig::getName() const
+{
+    return formatString("%s:%d", address.c_str(), port);
+}
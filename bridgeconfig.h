@@ -0,0 +1,48 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BRIDGECONFIG_H
+#define BRIDGECONFIG_H
+
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+/**
+ * @brief The BridgeConfig struct is a 'bridge' block in the config file: an upstream server that publishes on some topics are forwarded to.
+ */
+struct BridgeConfig
+{
+    std::string address;
+    int port = 1883;
+    std::string clientId;
+    std::string username;
+    std::string password;
+    std::vector<std::string> topics;
+    ProtocolVersion protocolVersion = ProtocolVersion::Mqtt311;
+    char maxQos = 1;
+    uint16_t maxInflight = 64; // QoS 1 publishes sent before the first PUBACK comes back.
+    uint16_t keepalive = 60;
+    size_t maxBufferedMessages = 100000; // In memory. Beyond that, they're spilled to disk when there is a storage_dir, or the oldest are dropped.
+
+    void isValid();
+    std::string getName() const;
+};
+
+#endif // BRIDGECONFIG_H
@@ -3,10 +3,30 @@
 thisfile=$(readlink --canonicalize "$0")
 thisdir=$(dirname "$thisfile")
 
+usage()
+{
+  echo "Usage: $0 [Debug|Release] [--lto] [--pgo] [--bolt]
+
+  --lto   Link-time optimization.
+  --pgo   Profile-guided optimization: an instrumented build, the training workload in pgo-train.sh, and the final build.
+  --bolt  Optimize the layout of the final binary with llvm-bolt, trained with the same workload."
+}
+
 BUILD_TYPE="Release"
-if [[ "$1" == "Debug" ]]; then
-  BUILD_TYPE="Debug"
-fi
+LTO="OFF"
+PGO=false
+BOLT=false
+
+for arg in "$@"; do
+  case "$arg" in
+    Debug|Release) BUILD_TYPE="$arg" ;;
+    --lto) LTO="ON" ;;
+    --pgo) PGO=true ;;
+    --bolt) BOLT=true ;;
+    -h|--help) usage; exit 0 ;;
+    *) >&2 usage; exit 1 ;;
+  esac
+done
 
 BUILD_DIR="FlashMQBuild$BUILD_TYPE"
 
@@ -21,8 +41,52 @@ fi
 
 cd "$BUILD_DIR"
 
-cmake -DCMAKE_BUILD_TYPE="$BUILD_TYPE" "$thisdir"
+CMAKE_ARGS=(-DCMAKE_BUILD_TYPE="$BUILD_TYPE" -DFMQ_LTO="$LTO")
+
+if $BOLT; then
+  CMAKE_ARGS+=(-DFMQ_BOLT=ON)
+else
+  CMAKE_ARGS+=(-DFMQ_BOLT=OFF)
+fi
+
+if $PGO || $BOLT; then
+  # The training workload needs the load generator.
+  cmake -S "$thisdir/FlashMQBench" -B FlashMQBench -DCMAKE_BUILD_TYPE=Release
+  make -C FlashMQBench -j flashmq-bench
+fi
+
+if $PGO; then
+  PROFILE_DIR="$PWD/pgo-profile"
+  rm -rf "$PROFILE_DIR"
+
+  # Same build dir for both builds, because GCC finds the profile data by object file path.
+  cmake "${CMAKE_ARGS[@]}" -DFMQ_PGO=generate -DFMQ_PGO_DIR="$PROFILE_DIR" "$thisdir"
+  make -j
+  "$thisdir/pgo-train.sh" ./FlashMQ FlashMQBench/flashmq-bench
+
+  # Clang writes raw profiles, that need merging.
+  if compgen -G "$PROFILE_DIR/*.profraw" > /dev/null; then
+    llvm-profdata merge -output="$PROFILE_DIR/flashmq.profdata" "$PROFILE_DIR"/*.profraw
+  fi
+
+  CMAKE_ARGS+=(-DFMQ_PGO=use -DFMQ_PGO_DIR="$PROFILE_DIR")
+else
+  CMAKE_ARGS+=(-DFMQ_PGO=)
+fi
+
+cmake "${CMAKE_ARGS[@]}" "$thisdir"
 make -j
+
+if $BOLT; then
+  rm -f bolt.fdata
+  llvm-bolt FlashMQ -instrument -instrumentation-file="$PWD/bolt.fdata" -o FlashMQ.bolt-instrumented
+  "$thisdir/pgo-train.sh" ./FlashMQ.bolt-instrumented FlashMQBench/flashmq-bench
+  llvm-bolt FlashMQ -o FlashMQ.bolt -data=bolt.fdata -reorder-blocks=ext-tsp -reorder-functions=hfsort -split-functions -split-all-cold -icf=1
+  mv FlashMQ.bolt FlashMQ
+  rm -f FlashMQ.bolt-instrumented
+fi
+
+# The package contains the binary as built above; packaging doesn't relink it.
 cpack
 
 FLASHMQ_VERSION=$(./FlashMQ --version | grep -Ei 'Flashmq.*version.*' | grep -oE '[^ ]+$')
@@ -157,7 +157,7 @@ void CirBuf::doubleSize(uint factor)
 #endif
 
 #ifdef TESTING
-    memset(&buf[head], 5, maxWriteSize() + 2);
+    memset(&buf[head], 5, maxWriteSize());
 #endif
 
     primedForSizeReset = false;
@@ -22,10 +22,12 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <iostream>
 #include <cassert>
 #include <chrono>
+#include <sys/socket.h>
 
 #include "logger.h"
 #include "utils.h"
 #include "threadglobals.h"
+#include "packetwriter.h"
 
 StowedClientRegistrationData::StowedClientRegistrationData(bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval) :
     clean_start(clean_start),
@@ -35,6 +37,14 @@ StowedClientRegistrationData::StowedClientRegistrationData(bool clean_start, uin
 
 }
 
+SharedPayloadWrite::SharedPayloadWrite(uint64_t writebufPos, const std::shared_ptr<const char> &payload, size_t size) :
+    writebufPos(writebufPos),
+    payload(payload),
+    size(size)
+{
+
+}
+
 Client::Client(int fd, std::shared_ptr<ThreadData> threadData, SSL *ssl, bool websocket, struct sockaddr *addr, const Settings *settings, bool fuzzMode) :
     fd(fd),
     fuzzMode(fuzzMode),
@@ -42,6 +52,10 @@ Client::Client(int fd, std::shared_ptr<ThreadData> threadData, SSL *ssl, bool we
     maxOutgoingPacketSize(settings->maxPacketSize), // Same as initialBufferSize comment.
     maxIncomingPacketSize(settings->maxPacketSize),
     maxIncomingTopicAliasValue(settings->maxIncomingTopicAliasValue), // Retaining snapshot of current setting, to not confuse clients when the setting changes.
+    writeBufferWatermark(settings->clientWriteBufferWatermark),
+    slowConsumerPolicy(settings->slowConsumerPolicy),
+    publisherBackpressure(settings->publisherBackpressure),
+    sharedPayloadThreshold(settings->sharedPayloadThreshold),
     ioWrapper(ssl, websocket, initialBufferSize, this),
     readbuf(initialBufferSize),
     writebuf(initialBufferSize),
@@ -57,6 +71,29 @@ Client::Client(int fd, std::shared_ptr<ThreadData> threadData, SSL *ssl, bool we
         transportStr = websocket ? "TCP/Websocket/MQTT/SSL" : "TCP/MQTT/SSL";
     else
         transportStr = websocket ? "TCP/Websocket/MQTT/Non-SSL" : "TCP/MQTT/Non-SSL";
+
+#ifdef SO_ZEROCOPY
+    // Only plain sockets can send from our buffers; SSL and websockets transform the data first.
+    if (settings->zeroCopySends && !ssl && !websocket && !fuzzMode)
+    {
+        int one = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+            zeroCopy = true;
+        else
+            logger->logf(LOG_DEBUG, "Enabling SO_ZEROCOPY failed: %s", strerror(errno));
+    }
+#endif
+
+#ifdef SO_BUSY_POLL
+    // Has the kernel poll the device queue on reads, instead of waiting for the interrupt. Values above net.core.busy_read
+    // need CAP_NET_ADMIN.
+    if (settings->busyPollMicroseconds > 0 && !fuzzMode)
+    {
+        int usecs = settings->busyPollMicroseconds;
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) != 0)
+            logger->logf(LOG_DEBUG, "Setting SO_BUSY_POLL failed: %s", strerror(errno));
+    }
+#endif
 }
 
 Client::~Client()
@@ -65,12 +102,23 @@ Client::~Client()
     if (this->epoll_fd == 0)
         return;
 
+    // The connection lives on in the new process. Our copy of the fd was already removed from epoll.
+    if (handedOver)
+    {
+        logger->logf(LOG_INFO, "Handed over client '%s'.", repr().c_str());
+        close(fd);
+        return;
+    }
+
     if (disconnectReason.empty())
         disconnectReason = "not specified";
 
     logger->logf(LOG_NOTICE, "Removing client '%s'. Reason(s): %s", repr().c_str(), disconnectReason.c_str());
 
-    std::shared_ptr<SubscriptionStore> store = MainApp::getMainApp()->getSubscriptionStore();
+    releaseBackpressuredPublishers();
+
+    // The last reference may go in another thread, so not the store of the calling thread.
+    std::shared_ptr<SubscriptionStore> store = getSessionStore();
 
     if (willPublish)
     {
@@ -79,9 +127,18 @@ Client::~Client()
 
     if (fd > 0) // this check is essentially for testing, when working with a dummy fd.
     {
-        if (epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0)
+        if (!fuzzMode && epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0)
             logger->logf(LOG_ERR, "Removing fd %d of client '%s' from epoll produced error: %s", fd, repr().c_str(), strerror(errno));
-        close(fd);
+
+        // The kernel may still read the payloads of zero-copy sends, and only reports when it's done on the socket's error queue.
+        std::shared_ptr<ThreadData> td = threadData.lock();
+        if (!zeroCopyPins.empty() && td)
+        {
+            shutdown(fd, SHUT_RDWR);
+            td->queueDrainZeroCopySends(fd, zeroCopyPins);
+        }
+        else
+            close(fd);
     }
 
     if (session && session->getDestroyOnDisconnect())
@@ -133,19 +190,26 @@ void Client::markAsDisconnecting()
     disconnecting = true;
 }
 
-// false means any kind of error we want to get rid of the client for.
-bool Client::readFdIntoBuffer()
+/**
+ * @brief Client::readFdIntoBuffer reads what's available on the socket.
+ * @param budget stops reading after this many bytes, so one client can't keep the thread busy. 0 means no limit.
+ * @return false means any kind of error we want to get rid of the client for.
+ */
+bool Client::readFdIntoBuffer(const size_t budget)
 {
     if (disconnecting)
         return false;
 
     IoWrapResult error = IoWrapResult::Success;
     int n = 0;
+    size_t bytesRead = 0;
+    readBudgetExhausted = false;
     while (readbuf.freeSpace() > 0 && (n = ioWrapper.readWebsocketAndOrSsl(fd, readbuf.headPtr(), readbuf.maxWriteSize(), &error)) != 0)
     {
         if (n > 0)
         {
             readbuf.advanceHead(n);
+            bytesRead += n;
         }
 
         if (error == IoWrapResult::Interrupted)
@@ -166,6 +230,12 @@ bool Client::readFdIntoBuffer()
                 break;
             }
         }
+
+        if (budget > 0 && bytesRead >= budget)
+        {
+            readBudgetExhausted = true;
+            break;
+        }
     }
 
     if (error == IoWrapResult::Disconnected)
@@ -192,6 +262,65 @@ void Client::writeText(const std::string &text)
     setReadyForWriting(true);
 }
 
+/**
+ * @brief Client::makeRoomForPacket grows the write buffer for a packet, and applies the slow consumer policy to publishes. Needs writeBufMutex.
+ * @param bytesToCopy is what goes in the write buffer. That's less than the packet size when the payload is shared.
+ * @return whether to write the packet.
+ */
+bool Client::makeRoomForPacket(const size_t packetSize, const size_t bytesToCopy, const bool sharePayload, const PacketType packetType, const char qos)
+{
+    // We have to allow big packets, yet don't allow a slow loris subscriber to grow huge write buffers. Without a configured
+    // watermark, the limit is relative to the packet size.
+    const uint32_t growBufMaxTo = writeBufferWatermark > 0 ? std::max<uint32_t>(writeBufferWatermark, packetSize)
+                                                           : std::min<int>(packetSize * 1000, this->maxOutgoingPacketSize);
+
+    // Grow as far as we can. We have to make room for one MQTT packet.
+    writebuf.ensureFreeSpace(bytesToCopy, growBufMaxTo);
+
+    // Then it's a slow consumer when a publish doesn't fit, even after resizing. This means we do allow pings. And by default,
+    // only QoS 0 is dropped, because QoS packets are queued and limited elsewhere.
+    if (packetType == PacketType::PUBLISH)
+    {
+        const size_t pendingBytes = getPendingWriteBytes();
+        const bool aboveWatermark = writeBufferWatermark > 0 && pendingBytes + packetSize > writeBufferWatermark;
+        const bool doesNotFit = sharePayload ? pendingBytes + packetSize > growBufMaxTo : packetSize > writebuf.freeSpace();
+
+        if (aboveWatermark || doesNotFit)
+        {
+            if (slowConsumerPolicy == SlowConsumerPolicy::Disconnect)
+            {
+                setDisconnectReason("slow consumer: write buffer full");
+                throw std::runtime_error("Client's write buffer is full.");
+            }
+
+            if (qos == 0)
+            {
+                if (session)
+                    session->getDropCounters().writeBufferFull++;
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Client::packetWritten does the bookkeeping after a packet went into the write buffer. Needs writeBufMutex.
+ */
+void Client::packetWritten(const PacketType packetType)
+{
+    if (packetType == PacketType::PUBLISH)
+    {
+        ThreadData *td = ThreadGlobals::getThreadData();
+        td->sentMessageCounter.inc();
+    }
+    else if (packetType == PacketType::DISCONNECT)
+        setReadyForDisconnect();
+
+    setReadyForWriting(true);
+}
+
 void Client::writeMqttPacket(const MqttPacket &packet)
 {
     const size_t packetSize = packet.getSizeIncludingNonPresentHeader();
@@ -205,31 +334,63 @@ void Client::writeMqttPacket(const MqttPacket &packet)
 
     std::lock_guard<std::mutex> locker(writeBufMutex);
 
-    // We have to allow big packets, yet don't allow a slow loris subscriber to grow huge write buffers. This
-    // could be enhanced a lot, but it's a start.
-    const uint32_t growBufMaxTo = std::min<int>(packetSize * 1000, this->maxOutgoingPacketSize);
+    // Large payloads are not copied into the write buffer, but written from the packet's payload, that all subscribers share.
+    const bool sharePayload = packet.packetType == PacketType::PUBLISH && sharedPayloadThreshold > 0 && packet.getPayloadLen() >= sharedPayloadThreshold
+                              && packet.getSharedPayload();
+    const size_t bytesToCopy = sharePayload ? packetSize - packet.getPayloadLen() : packetSize;
 
-    // Grow as far as we can. We have to make room for one MQTT packet.
-    writebuf.ensureFreeSpace(packetSize, growBufMaxTo);
+    if (!makeRoomForPacket(packetSize, bytesToCopy, sharePayload, packet.packetType, packet.getQos()))
+        return;
 
-    // And drop a publish when it doesn't fit, even after resizing. This means we do allow pings. And
-    // QoS packet are queued and limited elsewhere.
-    if (packet.packetType == PacketType::PUBLISH && packet.getQos() == 0 && packetSize > writebuf.freeSpace())
+    if (sharePayload)
     {
-        return;
+        packet.readIntoBufWithoutPayload(writebuf);
+        sharedPayloadWrites.emplace_back(writebufBytesTaken + writebuf.usedBytes(), packet.getSharedPayload(), packet.getPayloadLen());
+        sharedPayloadBytes += packet.getPayloadLen();
     }
-
-    packet.readIntoBuf(writebuf);
-
-    if (packet.packetType == PacketType::PUBLISH)
+    else
     {
-        ThreadData *td = ThreadGlobals::getThreadData();
-        td->sentMessageCounter.inc();
+        packet.readIntoBuf(writebuf);
     }
-    else if (packet.packetType == PacketType::DISCONNECT)
-        setReadyForDisconnect();
 
-    setReadyForWriting(true);
+    packetWritten(packet.packetType);
+}
+
+/**
+ * @brief Client::writePublish serializes a publish for this client straight into the write buffer. See PacketWriter.
+ * @param qos is the QoS for this client, which may be lower than the one of the publish.
+ */
+template<ProtocolVersion version>
+void Client::writePublish(const Publish &publish, const char qos, const uint16_t packetId)
+{
+    typedef PacketWriter<version> Writer;
+
+    ClientSpecificProperties clientProperties;
+    if (Writer::mqtt5)
+        clientProperties = publish.getClientSpecificProperties();
+
+    VariableByteInt remainingLength;
+    const size_t packetSize = Writer::getPublishLength(publish, qos, clientProperties, remainingLength);
+
+    // [MQTT-3.1.2-25]
+    if (packetSize > this->maxOutgoingPacketSize)
+        return;
+
+    std::lock_guard<std::mutex> locker(writeBufMutex);
+
+    if (!makeRoomForPacket(packetSize, packetSize, false, PacketType::PUBLISH, qos))
+        return;
+
+    Writer::writePublish(writebuf, publish, qos, clientProperties, remainingLength, packetId);
+    packetWritten(PacketType::PUBLISH);
+}
+
+void Client::writePublish(const Publish &publish, const char qos, const uint16_t packetId)
+{
+    if (protocolVersion >= ProtocolVersion::Mqtt5)
+        writePublish<ProtocolVersion::Mqtt5>(publish, qos, packetId);
+    else
+        writePublish<ProtocolVersion::Mqtt311>(publish, qos, packetId); // MQTT 3.1 publishes are the same.
 }
 
 void Client::writeMqttPacketAndBlameThisClient(PublishCopyFactory &copyFactory, char max_qos, uint16_t packet_id)
@@ -249,19 +410,187 @@ void Client::writeMqttPacketAndBlameThisClient(PublishCopyFactory &copyFactory,
         topic_alias = id;
     }
 
-    MqttPacket *p = copyFactory.getOptimumPacket(max_qos, this->protocolVersion, topic_alias, skip_topic);
+    // A packet that would be made for this client only is better written without one. Large payloads are shared, which needs the packet.
+    const bool smallPayload = sharedPayloadThreshold == 0 || copyFactory.getPayloadLen() < sharedPayloadThreshold;
+    Publish *directPublish = smallPayload ? copyFactory.getPublishToWriteDirectly(max_qos, this->protocolVersion, topic_alias, skip_topic) : nullptr;
+
+    if (directPublish)
+    {
+        try
+        {
+            writePublish(*directPublish, max_qos, packet_id);
+        }
+        catch (std::exception &ex)
+        {
+            std::shared_ptr<ThreadData> td = this->threadData.lock();
+            if (td)
+                td->removeClientQueued(fd);
+        }
+    }
+    else
+    {
+        MqttPacket *p = copyFactory.getOptimumPacket(max_qos, this->protocolVersion, topic_alias, skip_topic);
+
+        assert(p->getQos() <= max_qos);
+
+        if (p->getQos() > 0)
+        {
+            // This may change the packet ID and QoS of the incoming packet for each subscriber, but because we don't store that packet anywhere,
+            // that should be fine.
+            p->setPacketId(packet_id);
+            p->setQos(max_qos);
+        }
+
+        writeMqttPacketAndBlameThisClient(*p);
+    }
+
+    if (publisherBackpressure)
+        applyBackpressure(copyFactory);
+}
+
+/**
+ * @brief Client::applyBackpressure pauses reading from the publisher of a packet when our write buffer is over half the watermark.
+ * @param copyFactory
+ *
+ * This is called from the publisher's thread, so it can set its read readiness. We resume it when we've drained to a quarter.
+ */
+void Client::applyBackpressure(PublishCopyFactory &copyFactory)
+{
+    std::shared_ptr<Client> publisher;
+
+    {
+        std::lock_guard<std::mutex> locker(writeBufMutex);
+
+        if (getPendingWriteBytes() < writeBufferWatermark / 2)
+            return;
+
+        publisher = copyFactory.getSender();
+
+        if (!publisher || publisher.get() == this)
+            return;
+
+        for (const std::weak_ptr<Client> &p : backpressuredPublishers)
+        {
+            if (p.lock() == publisher)
+                return;
+        }
+
+        backpressuredPublishers.push_back(publisher);
+        publisher->backpressureSources++;
+    }
+
+    logger->logf(LOG_DEBUG, "Pausing reading from publisher '%s' because subscriber '%s' can't keep up.", publisher->getClientId().c_str(), clientid.c_str());
+    publisher->setReadyForReading(false);
+}
+
+/**
+ * @brief Client::releaseBackpressuredPublishers lets publishers we paused continue, once no other subscriber holds them back.
+ *
+ * Call with writeBufMutex locked, or from the destructor.
+ */
+void Client::releaseBackpressuredPublishers()
+{
+    for (const std::weak_ptr<Client> &p : backpressuredPublishers)
+    {
+        std::shared_ptr<Client> publisher = p.lock();
+
+        if (!publisher)
+            continue;
+
+        if (--publisher->backpressureSources > 0)
+            continue;
+
+        std::shared_ptr<ThreadData> td = publisher->threadData.lock();
+        if (td)
+            td->queueResumeBackpressuredClient(publisher);
+    }
+
+    backpressuredPublishers.clear();
+}
+
+template<ProtocolVersion version>
+void Client::writePubResponse(const PacketType packetType, const ReasonCodes reasonCode, const uint16_t packetId)
+{
+    typedef PacketWriter<version> Writer;
+
+    const uint8_t length = Writer::getPubResponseLength(reasonCode);
+
+    if (length > this->maxOutgoingPacketSize)
+        return;
+
+    std::lock_guard<std::mutex> locker(writeBufMutex);
+
+    writebuf.ensureFreeSpace(length);
+
+    switch (packetType)
+    {
+    case PacketType::PUBACK:
+        Writer::template writePubResponse<PacketType::PUBACK>(writebuf, reasonCode, packetId);
+        break;
+    case PacketType::PUBREC:
+        Writer::template writePubResponse<PacketType::PUBREC>(writebuf, reasonCode, packetId);
+        break;
+    case PacketType::PUBREL:
+        Writer::template writePubResponse<PacketType::PUBREL>(writebuf, reasonCode, packetId);
+        break;
+    case PacketType::PUBCOMP:
+        Writer::template writePubResponse<PacketType::PUBCOMP>(writebuf, reasonCode, packetId);
+        break;
+    default:
+        throw std::runtime_error("Bug: not a publish response.");
+    }
+
+    setReadyForWriting(true);
+}
+
+/**
+ * @brief Client::writePubResponse writes a PUBACK, PUBREC, PUBREL or PUBCOMP straight into the write buffer.
+ * @param reasonCode is only sent to MQTT5 clients.
+ */
+void Client::writePubResponse(const PacketType packetType, const ReasonCodes reasonCode, const uint16_t packetId)
+{
+    if (protocolVersion >= ProtocolVersion::Mqtt5)
+        writePubResponse<ProtocolVersion::Mqtt5>(packetType, reasonCode, packetId);
+    else
+        writePubResponse<ProtocolVersion::Mqtt311>(packetType, reasonCode, packetId); // MQTT 3.1 acks are the same.
+}
+
+/**
+ * @brief Client::writePublishResponse writes a PUBACK or PUBREC, or holds it back when we're paused for backpressure.
+ *
+ * MQTT5 clients then hit their receive maximum, so they stop sending instead of filling their TCP buffers.
+ */
+void Client::writePublishResponse(const PacketType packetType, const ReasonCodes reasonCode, const uint16_t packetId)
+{
+    if (backpressureSources > 0 && protocolVersion >= ProtocolVersion::Mqtt5)
+    {
+        deferredPublishResponses.push_back({packetType, reasonCode, packetId});
+        return;
+    }
+
+    writePubResponse(packetType, reasonCode, packetId);
+}
 
-    assert(p->getQos() <= max_qos);
+void Client::resumeAfterBackpressure()
+{
+    // We may have been paused again in the mean time.
+    if (backpressureSources > 0)
+        return;
 
-    if (p->getQos() > 0)
+    for (const DeferredPubResponse &r : deferredPublishResponses)
     {
-        // This may change the packet ID and QoS of the incoming packet for each subscriber, but because we don't store that packet anywhere,
-        // that should be fine.
-        p->setPacketId(packet_id);
-        p->setQos(max_qos);
+        writePubResponse(r.packetType, r.reasonCode, r.packetId);
     }
+    deferredPublishResponses.clear();
+
+    // Not reading was not the client's fault.
+    lastActivity = std::chrono::steady_clock::now();
 
-    writeMqttPacketAndBlameThisClient(*p);
+    // Packets left in the read buffer won't be reported by epoll.
+    if (readbuf.usedBytes() > 0)
+        packetBudgetExhausted = true;
+
+    setReadyForReading(readbuf.freeSpace() > 0);
 }
 
 // Helper method to avoid the exception ending up at the sender of messages, which would then get disconnected.
@@ -279,6 +608,285 @@ void Client::writeMqttPacketAndBlameThisClient(const MqttPacket &packet)
     }
 }
 
+/**
+ * @brief Client::writeZeroCopy sends without copying into the kernel, and keeps the payload referenced until the kernel reports completion.
+ *
+ * Every successful send() with MSG_ZEROCOPY gets the next number of a counter of the socket. Completion notifications on the socket's
+ * error queue report ranges of those numbers. See reapZeroCopyCompletionsLocked().
+ */
+ssize_t Client::writeZeroCopy(const char *buf, size_t nbytes, const std::shared_ptr<const char> &payload, IoWrapResult *error)
+{
+#ifdef MSG_ZEROCOPY
+    *error = IoWrapResult::Success;
+    ssize_t n = send(fd, buf, nbytes, MSG_ZEROCOPY | MSG_NOSIGNAL);
+
+    if (n < 0)
+    {
+        n = 0;
+
+        // The kernel limits how much memory can be pinned (optmem_max); the normal write copies.
+        if (errno == ENOBUFS)
+            return ioWrapper.writeWebsocketAndOrSsl(fd, buf, nbytes, error);
+        else if (errno == EINTR)
+            *error = IoWrapResult::Interrupted;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            *error = IoWrapResult::Wouldblock;
+        else
+            check<std::runtime_error>(-1);
+
+        return n;
+    }
+
+    zeroCopyPins.pin(payload);
+
+    return n;
+#else
+    (void)payload;
+    return ioWrapper.writeWebsocketAndOrSsl(fd, buf, nbytes, error);
+#endif
+}
+
+/**
+ * @brief Client::reapZeroCopyCompletionsLocked releases the payloads of finished zero-copy sends. See ZeroCopyPins.
+ *
+ * When the kernel says it copied the data anyway, like it does on loopback, we stop using zero-copy for this client, because it's then
+ * only overhead.
+ */
+void Client::reapZeroCopyCompletionsLocked()
+{
+    if (zeroCopyPins.reap(fd) && zeroCopy)
+    {
+        logger->logf(LOG_DEBUG, "Kernel copied zero-copy send for %s. Not using zero-copy anymore.", repr().c_str());
+        zeroCopy = false;
+    }
+}
+
+/**
+ * @brief Client::reapZeroCopyCompletions handles EPOLLERR when that was just the kernel reporting finished zero-copy sends.
+ * @return false when there's a real socket error.
+ */
+bool Client::reapZeroCopyCompletions()
+{
+    std::lock_guard<std::mutex> locker(writeBufMutex);
+
+    if (zeroCopyPins.empty())
+        return false;
+
+    reapZeroCopyCompletionsLocked();
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+        return false;
+
+    return true;
+}
+
+/**
+ * @brief Client::prepareHandover stops handling a client that can be handed over to a new process, when upgrading. Call from its thread.
+ * @return whether the client is handed over.
+ *
+ * Only plain MQTT connections can be handed over, because SSL and websocket state can't be transferred. Clients still in the
+ * middle of connecting or disconnecting are also excluded.
+ */
+bool Client::prepareHandover()
+{
+    if (ioWrapper.isSsl() || ioWrapper.isWebsocket())
+        return false;
+
+    if (!connectPacketSeen || !authenticated || !session || stagedConnack || disconnecting || disconnectWhenBytesWritten)
+        return false;
+
+    std::lock_guard<std::mutex> locker(writeBufMutex);
+
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0)
+        return false;
+
+    handedOver = true;
+    return true;
+}
+
+/**
+ * @brief Client::writeHandoverState serializes the connection state. Only when all threads have stopped.
+ *
+ * The session itself is not in here; it's saved with the other sessions. The bytes of shared payloads are put back in their
+ * place in the write buffer stream.
+ */
+void Client::writeHandoverState(HandoverMessage &msg)
+{
+    assert(handedOver);
+
+    std::lock_guard<std::mutex> locker(writeBufMutex);
+
+    msg.writeUint8(static_cast<uint8_t>(protocolVersion));
+    msg.writeString(clientid);
+    msg.writeString(username);
+    msg.writeUint16(keepalive);
+    msg.writeUint8(clean_start);
+    msg.writeUint32(maxOutgoingPacketSize);
+    msg.writeUint16(maxOutgoingTopicAliasValue);
+    msg.writeUint16(session->getClientReceiveMax());
+    msg.writeUint32(session->getCurrentSessionExpiryInterval());
+
+    msg.writeUint16(curOutgoingTopicAlias);
+    msg.writeUint32(outgoingTopicAliases.size());
+    for (auto &pair : outgoingTopicAliases)
+    {
+        msg.writeString(pair.first);
+        msg.writeUint16(pair.second);
+    }
+
+    msg.writeUint32(incomingTopicAliases.size());
+    for (auto &pair : incomingTopicAliases)
+    {
+        msg.writeUint16(pair.first);
+        msg.writeString(pair.second);
+    }
+
+    msg.writeUint8(!!willPublish);
+    if (willPublish)
+    {
+        MqttPacket willpacket(ProtocolVersion::Mqtt5, *willPublish);
+
+        // Dummy, to please the parser on reading.
+        if (willPublish->qos > 0)
+            willpacket.setPacketId(666);
+
+        CirBuf cirbuf(1024);
+        cirbuf.ensureFreeSpace(willpacket.getSizeIncludingNonPresentHeader() + 32);
+        willpacket.readIntoBuf(cirbuf);
+
+        msg.writeUint16(willpacket.getFixedHeaderLength());
+        msg.writeUint32(willPublish->will_delay);
+        msg.writeUint32(cirbuf.usedBytes());
+        std::vector<char> buf(cirbuf.usedBytes());
+        cirbuf.read(buf.data(), buf.size());
+        msg.writeBytes(buf.data(), buf.size());
+    }
+
+    std::vector<char> buf(readbuf.usedBytes());
+    readbuf.read(buf.data(), buf.size());
+    msg.writeUint32(buf.size());
+    msg.writeBytes(buf.data(), buf.size());
+
+    buf.clear();
+    for (const SharedPayloadWrite &w : sharedPayloadWrites)
+    {
+        const size_t before = w.writebufPos - writebufBytesTaken;
+        const size_t start = buf.size();
+        buf.resize(start + before);
+        writebuf.read(&buf[start], before);
+        writebufBytesTaken += before;
+        buf.insert(buf.end(), w.payload.get() + w.written, w.payload.get() + w.size);
+    }
+    const size_t start = buf.size();
+    buf.resize(start + writebuf.usedBytes());
+    writebuf.read(&buf[start], writebuf.usedBytes());
+    msg.writeUint32(buf.size());
+    msg.writeBytes(buf.data(), buf.size());
+
+    // The kernel keeps its own reference to the pages of unfinished zero-copy sends, but the new process needs to expect the
+    // notifications, with the socket's numbering.
+    const std::vector<uint32_t> pinnedSendNumbers = zeroCopyPins.getPinnedSendNumbers();
+    msg.writeUint32(zeroCopyPins.getSendCounter());
+    msg.writeUint32(pinnedSendNumbers.size());
+    for (uint32_t sendNr : pinnedSendNumbers)
+    {
+        msg.writeUint32(sendNr);
+    }
+}
+
+/**
+ * @brief Client::readHandoverState is the counterpart of writeHandoverState(), on a fresh client in the new process.
+ * @param willParser is a client to parse the will with, like when loading sessions.
+ *
+ * The client is left with registration data for SubscriptionStore::registerHandedOverClient().
+ */
+void Client::readHandoverState(HandoverMessage &msg, std::shared_ptr<Client> &willParser)
+{
+    const ProtocolVersion protocolVersion = static_cast<ProtocolVersion>(msg.readUint8());
+    const std::string clientId = msg.readString();
+    const std::string username = msg.readString();
+    const uint16_t keepalive = msg.readUint16();
+    const bool cleanStart = msg.readUint8();
+    const uint32_t maxOutgoingPacketSize = msg.readUint32();
+    const uint16_t maxOutgoingTopicAliasValue = msg.readUint16();
+    const uint16_t clientReceiveMax = msg.readUint16();
+    const uint32_t sessionExpiryInterval = msg.readUint32();
+
+    setClientProperties(protocolVersion, clientId, username, true, keepalive, maxOutgoingPacketSize, maxOutgoingTopicAliasValue);
+    setRegistrationData(cleanStart, clientReceiveMax, sessionExpiryInterval);
+    setAuthenticated(true);
+
+    curOutgoingTopicAlias = msg.readUint16();
+    const uint32_t nrOfOutgoingAliases = msg.readUint32();
+    for (uint32_t i = 0; i < nrOfOutgoingAliases; i++)
+    {
+        const std::string topic = msg.readString();
+        outgoingTopicAliases[topic] = msg.readUint16();
+    }
+
+    const uint32_t nrOfIncomingAliases = msg.readUint32();
+    for (uint32_t i = 0; i < nrOfIncomingAliases; i++)
+    {
+        const uint16_t id = msg.readUint16();
+        incomingTopicAliases[id] = msg.readString();
+    }
+
+    if (msg.readUint8())
+    {
+        const uint16_t fixedHeaderLength = msg.readUint16();
+        const uint32_t willDelay = msg.readUint32();
+        const uint32_t packlen = msg.readUint32();
+
+        CirBuf cirbuf(1024);
+        cirbuf.ensureFreeSpace(packlen + 32);
+        std::vector<char> buf(packlen);
+        msg.readBytes(buf.data(), packlen);
+        cirbuf.write(buf.data(), packlen);
+
+        MqttPacket willpacket(cirbuf, packlen, fixedHeaderLength, willParser);
+        willpacket.parsePublishData();
+        WillPublish will = willpacket.getPublishData();
+        will.will_delay = willDelay;
+        setWill(std::move(will));
+    }
+
+    const uint32_t readbufLen = msg.readUint32();
+    std::vector<char> buf(readbufLen);
+    msg.readBytes(buf.data(), readbufLen);
+    readbuf.ensureFreeSpace(readbufLen);
+    readbuf.write(buf.data(), readbufLen);
+
+    // Packets the old process didn't get to, that epoll won't tell us about.
+    packetBudgetExhausted = readbufLen > 0;
+
+    const uint32_t writebufLen = msg.readUint32();
+    buf.resize(writebufLen);
+    msg.readBytes(buf.data(), writebufLen);
+    writebuf.ensureFreeSpace(writebufLen);
+    writebuf.write(buf.data(), writebufLen);
+
+    const uint32_t zeroCopySendCounter = msg.readUint32();
+    const uint32_t nrOfZeroCopyPins = msg.readUint32();
+    std::vector<uint32_t> pinnedSendNumbers;
+    for (uint32_t i = 0; i < nrOfZeroCopyPins; i++)
+    {
+        pinnedSendNumbers.push_back(msg.readUint32());
+    }
+    zeroCopyPins.restore(zeroCopySendCounter, pinnedSendNumbers);
+
+    lastActivity = std::chrono::steady_clock::now();
+}
+
+/**
+ * @brief Client::getPendingWriteBytes is what's in the write buffer, plus the shared payloads that go with it. Needs writeBufMutex.
+ */
+size_t Client::getPendingWriteBytes() const
+{
+    return writebuf.usedBytes() + sharedPayloadBytes;
+}
+
 // Ping responses are always the same, so hardcoding it for optimization.
 void Client::writePingResp()
 {
@@ -306,12 +914,47 @@ bool Client::writeBufIntoFd()
 
     IoWrapResult error = IoWrapResult::Success;
     int n;
-    while (writebuf.usedBytes() > 0 || ioWrapper.hasPendingWrite())
+    while (writebuf.usedBytes() > 0 || !sharedPayloadWrites.empty() || ioWrapper.hasPendingWrite())
     {
-        n = ioWrapper.writeWebsocketAndOrSsl(fd, writebuf.tailPtr(), writebuf.maxReadSize(), &error);
+        // The write buffer is written up to where the next shared payload goes. An incomplete SSL write is retried with the same
+        // source, because the positions only change when something was written.
+        SharedPayloadWrite *sharedPayload = nullptr;
+        if (!sharedPayloadWrites.empty() && sharedPayloadWrites.front().writebufPos == writebufBytesTaken)
+            sharedPayload = &sharedPayloadWrites.front();
 
-        if (n > 0)
-            writebuf.advanceTail(n);
+        if (sharedPayload)
+        {
+            const char *src = sharedPayload->payload.get() + sharedPayload->written;
+            const size_t len = sharedPayload->size - sharedPayload->written;
+
+            if (zeroCopy)
+                n = writeZeroCopy(src, len, sharedPayload->payload, &error);
+            else
+                n = ioWrapper.writeWebsocketAndOrSsl(fd, src, len, &error);
+
+            if (n > 0)
+            {
+                sharedPayload->written += n;
+                sharedPayloadBytes -= n;
+
+                if (sharedPayload->written == sharedPayload->size)
+                    sharedPayloadWrites.pop_front();
+            }
+        }
+        else
+        {
+            size_t len = writebuf.maxReadSize();
+            if (!sharedPayloadWrites.empty())
+                len = std::min<uint64_t>(len, sharedPayloadWrites.front().writebufPos - writebufBytesTaken);
+
+            n = ioWrapper.writeWebsocketAndOrSsl(fd, writebuf.tailPtr(), len, &error);
+
+            if (n > 0)
+            {
+                writebuf.advanceTail(n);
+                writebufBytesTaken += n;
+            }
+        }
 
         if (error == IoWrapResult::Interrupted)
             continue;
@@ -319,9 +962,12 @@ bool Client::writeBufIntoFd()
             break;
     }
 
-    const bool bufferHasData = writebuf.usedBytes() > 0;
+    const bool bufferHasData = writebuf.usedBytes() > 0 || !sharedPayloadWrites.empty();
     setReadyForWriting(bufferHasData || error == IoWrapResult::Wouldblock);
 
+    if (!backpressuredPublishers.empty() && getPendingWriteBytes() <= writeBufferWatermark / 4)
+        releaseBackpressuredPublishers();
+
     return true;
 }
 
@@ -346,6 +992,10 @@ bool Client::keepAliveExpired()
     if (keepalive == 0)
         return false;
 
+    // When we don't read from it, we can't see its pings.
+    if (backpressureSources > 0 || handedOver)
+        return false;
+
     const std::chrono::time_point<std::chrono::steady_clock> now = std::chrono::steady_clock::now();
 
     if (!authenticated)
@@ -423,7 +1073,7 @@ void Client::sendOrQueueWill()
     if (!this->willPublish)
         return;
 
-    std::shared_ptr<SubscriptionStore> store = MainApp::getMainApp()->getSubscriptionStore();
+    std::shared_ptr<SubscriptionStore> store = getSessionStore();
     store->queueWillMessage(willPublish, session);
     this->willPublish.reset();
 }
@@ -457,6 +1107,24 @@ void Client::serverInitiatedDisconnect(ReasonCodes reason)
     }
 }
 
+/**
+ * @brief Client::disconnectSlowConsumer removes the client from its thread. It can be called from other threads.
+ * @param reason
+ *
+ * There's no DISCONNECT packet, because it would end up behind the data the client isn't reading.
+ */
+void Client::disconnectSlowConsumer(const std::string &reason)
+{
+    {
+        std::lock_guard<std::mutex> locker(writeBufMutex);
+        setDisconnectReason(reason);
+    }
+
+    std::shared_ptr<ThreadData> td = this->threadData.lock();
+    if (td)
+        td->removeClientQueued(fd);
+}
+
 /**
  * @brief Client::setRegistrationData sets parameters for the session to be registered. We set them as arguments here to
  * possibly use later, because with extended authentication, session registration doesn't happen on the first CONNECT packet.
@@ -540,7 +1208,6 @@ const std::string &Client::getExtendedAuthenticationMethod() const
     return this->extendedAuthenticationMethod;
 }
 
-#ifndef NDEBUG
 /**
  * @brief IoWrapper::setFakeUpgraded().
  */
@@ -548,22 +1215,20 @@ void Client::setFakeUpgraded()
 {
     ioWrapper.setFakeUpgraded();
 }
-#endif
 
 // Call this from a place you know the writeBufMutex is locked, or we're still only doing SSL accept.
 void Client::setReadyForWriting(bool val)
 {
-#ifndef NDEBUG
+    // Fuzzed and replayed clients don't have a socket in epoll.
     if (fuzzMode)
         return;
-#endif
 
 #ifdef TESTING
     if (fd == 0)
         return;
 #endif
 
-    if (disconnecting)
+    if (disconnecting || handedOver)
         return;
 
     if (ioWrapper.getSslReadWantsWrite())
@@ -584,19 +1249,21 @@ void Client::setReadyForWriting(bool val)
 
 void Client::setReadyForReading(bool val)
 {
-#ifndef NDEBUG
+    // Fuzzed and replayed clients don't have a socket in epoll.
     if (fuzzMode)
         return;
-#endif
 
 #ifdef TESTING
     if (fd == 0)
         return;
 #endif
 
-    if (disconnecting)
+    if (disconnecting || handedOver)
         return;
 
+    if (backpressureSources > 0)
+        val = false;
+
     // This looks a bit like a race condition, but all calls to this method are from a threads's event loop, so we should be OK.
     if (val == this->readyForReading)
         return;
@@ -616,12 +1283,41 @@ void Client::setReadyForReading(bool val)
     }
 }
 
-void Client::bufferToMqttPackets(std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender)
+void Client::bufferToMqttPackets(std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender, const size_t maxPackets)
 {
-    MqttPacket::bufferToMqttPackets(readbuf, packetQueueIn, sender);
+    MqttPacket::bufferToMqttPackets(readbuf, packetQueueIn, sender, maxPackets);
+    packetBudgetExhausted = maxPackets > 0 && packetQueueIn.size() >= maxPackets;
     setReadyForReading(readbuf.freeSpace() > 0);
 }
 
+/**
+ * @brief Client::hasPendingInput says whether the last turn ended on a budget, instead of on having read everything.
+ *
+ * When only the read budget was hit, epoll will report the socket again, but SSL may have decrypted data buffered that epoll
+ * doesn't know about, so we don't rely on that.
+ */
+bool Client::hasPendingInput() const
+{
+    return readBudgetExhausted || packetBudgetExhausted;
+}
+
+bool Client::isPausedByBackpressure() const
+{
+    return backpressureSources > 0;
+}
+
+/**
+ * @brief Client::takeTurn registers a read turn in the given loop iteration.
+ * @return false when the client already had its turn in this iteration.
+ */
+bool Client::takeTurn(uint64_t iteration)
+{
+    if (lastTurnIteration == iteration)
+        return false;
+    lastTurnIteration = iteration;
+    return true;
+}
+
 void Client::setClientProperties(ProtocolVersion protocolVersion, const std::string &clientId, const std::string username, bool connectPacketSeen, uint16_t keepalive)
 {
     const Settings *settings = ThreadGlobals::getSettings();
@@ -657,8 +1353,27 @@ std::shared_ptr<Session> Client::getSession()
     return this->session;
 }
 
+void Client::setSessionStore(const std::shared_ptr<SubscriptionStore> &store)
+{
+    this->sessionStore = store;
+}
+
+/**
+ * @brief Client::getSessionStore gives the store with the session and subscriptions of the client. That's the one of its thread, unless
+ * the session was already in another thread in the sharded thread model.
+ */
+std::shared_ptr<SubscriptionStore> Client::getSessionStore() const
+{
+    if (this->sessionStore)
+        return this->sessionStore;
+
+    return MainApp::getMainApp()->getSubscriptionStore(threadData.lock().get());
+}
+
 void Client::setDisconnectReason(const std::string &reason)
 {
+    std::lock_guard<std::mutex> locker(disconnectReasonMutex);
+
     if (!this->disconnectReason.empty())
         this->disconnectReason += ", ";
     this->disconnectReason.append(reason);
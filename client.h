@@ -24,6 +24,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <mutex>
 #include <iostream>
 #include <time.h>
+#include <atomic>
+#include <deque>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -36,8 +38,11 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "cirbuf.h"
 #include "types.h"
 #include "iowrapper.h"
+#include "settings.h"
+#include "handover.h"
 
 #include "publishcopyfactory.h"
+#include "zerocopypins.h"
 
 #define MQTT_HEADER_LENGH 2
 
@@ -54,9 +59,37 @@ struct StowedClientRegistrationData
     StowedClientRegistrationData(bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval);
 };
 
+/**
+ * @brief The SharedPayloadWrite struct is a large publish payload in the write queue of a client. It's referenced instead of copied
+ * into the write buffer, so all subscribers share one copy.
+ */
+struct SharedPayloadWrite
+{
+    uint64_t writebufPos = 0; // Position in the stream of write buffer bytes where the payload goes.
+    std::shared_ptr<const char> payload;
+    size_t size = 0;
+    size_t written = 0;
+
+    SharedPayloadWrite(uint64_t writebufPos, const std::shared_ptr<const char> &payload, size_t size);
+};
+
+/**
+ * @brief The DeferredPubResponse struct is a PUBACK or PUBREC that is held back while the publisher is paused for backpressure.
+ */
+struct DeferredPubResponse
+{
+    PacketType packetType;
+    ReasonCodes reasonCode;
+    uint16_t packetId;
+};
+
 class Client
 {
     friend class IoWrapper;
+#ifdef TESTING
+    friend class MainTests;
+    friend class MicroBench;
+#endif
 
     int fd;
     bool fuzzMode = false;
@@ -70,6 +103,11 @@ class Client
     uint16_t maxOutgoingTopicAliasValue = 0;
     const uint16_t maxIncomingTopicAliasValue;
 
+    const uint32_t writeBufferWatermark;
+    const SlowConsumerPolicy slowConsumerPolicy;
+    const bool publisherBackpressure;
+    const uint32_t sharedPayloadThreshold;
+
     IoWrapper ioWrapper;
     std::string transportStr;
     std::string address;
@@ -77,12 +115,23 @@ class Client
     CirBuf readbuf;
     CirBuf writebuf;
 
+    // Goes with the writebuf and is protected by writeBufMutex as well.
+    std::deque<SharedPayloadWrite> sharedPayloadWrites;
+    size_t sharedPayloadBytes = 0;
+    uint64_t writebufBytesTaken = 0;
+
+    // Shared payloads sent with MSG_ZEROCOPY stay referenced until the kernel says it's done with them. Also protected by writeBufMutex.
+    bool zeroCopy = false;
+    ZeroCopyPins zeroCopyPins;
+
     bool authenticated = false;
     bool connectPacketSeen = false;
     bool readyForWriting = false;
     bool readyForReading = true;
     bool disconnectWhenBytesWritten = false;
     bool disconnecting = false;
+    bool handedOver = false;
+    std::mutex disconnectReasonMutex; // Another thread can give a reason, like when it takes over the session.
     std::string disconnectReason;
     std::chrono::time_point<std::chrono::steady_clock> lastActivity;
 
@@ -98,6 +147,7 @@ class Client
     std::mutex writeBufMutex;
 
     std::shared_ptr<Session> session;
+    std::shared_ptr<SubscriptionStore> sessionStore; // Only in the sharded thread model, where it can be the store of another thread.
 
     std::unordered_map<uint16_t, std::string> incomingTopicAliases;
 
@@ -109,10 +159,32 @@ class Client
 
     std::unique_ptr<StowedClientRegistrationData> registrationData;
 
+    // As publisher: the amount of subscribers we're paused for, and the QoS responses we hold back in the mean time.
+    std::atomic<int> backpressureSources {0};
+    std::vector<DeferredPubResponse> deferredPublishResponses;
+
+    // As subscriber: the publishers we paused. Protected by writeBufMutex.
+    std::vector<std::weak_ptr<Client>> backpressuredPublishers;
+
+    // Read scheduling, only touched by the owning thread. See do_thread_work().
+    bool readBudgetExhausted = false;
+    bool packetBudgetExhausted = false;
+    uint64_t lastTurnIteration = 0;
+
     Logger *logger = Logger::getInstance();
 
     void setReadyForWriting(bool val);
     void setReadyForReading(bool val);
+    size_t getPendingWriteBytes() const;
+    ssize_t writeZeroCopy(const char *buf, size_t nbytes, const std::shared_ptr<const char> &payload, IoWrapResult *error);
+    void reapZeroCopyCompletionsLocked();
+    void applyBackpressure(PublishCopyFactory &copyFactory);
+    void releaseBackpressuredPublishers();
+    bool makeRoomForPacket(const size_t packetSize, const size_t bytesToCopy, const bool sharePayload, const PacketType packetType, const char qos);
+    void packetWritten(const PacketType packetType);
+    template<ProtocolVersion version> void writePubResponse(const PacketType packetType, const ReasonCodes reasonCode, const uint16_t packetId);
+    template<ProtocolVersion version> void writePublish(const Publish &publish, const char qos, const uint16_t packetId);
+    void writePublish(const Publish &publish, const char qos, const uint16_t packetId);
 
 public:
     Client(int fd, std::shared_ptr<ThreadData> threadData, SSL *ssl, bool websocket, struct sockaddr *addr, const Settings *settings, bool fuzzMode=false);
@@ -129,8 +201,16 @@ public:
 
     void startOrContinueSslAccept();
     void markAsDisconnecting();
-    bool readFdIntoBuffer();
-    void bufferToMqttPackets(std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender);
+    bool prepareHandover();
+    bool isHandedOver() const { return handedOver; }
+    void writeHandoverState(HandoverMessage &msg);
+    void readHandoverState(HandoverMessage &msg, std::shared_ptr<Client> &willParser);
+    bool readFdIntoBuffer(const size_t budget = 0);
+    bool reapZeroCopyCompletions();
+    void bufferToMqttPackets(std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender, const size_t maxPackets = 0);
+    bool hasPendingInput() const;
+    bool isPausedByBackpressure() const;
+    bool takeTurn(uint64_t iteration);
     void setClientProperties(ProtocolVersion protocolVersion, const std::string &clientId, const std::string username, bool connectPacketSeen, uint16_t keepalive);
     void setClientProperties(ProtocolVersion protocolVersion, const std::string &clientId, const std::string username, bool connectPacketSeen, uint16_t keepalive,
                              uint32_t maxOutgoingPacketSize, uint16_t maxOutgoingTopicAliasValue);
@@ -146,6 +226,9 @@ public:
     std::shared_ptr<WillPublish> &getWill() { return this->willPublish; }
     void assignSession(std::shared_ptr<Session> &session);
     std::shared_ptr<Session> getSession();
+    void setSessionStore(const std::shared_ptr<SubscriptionStore> &store);
+    std::shared_ptr<SubscriptionStore> getSessionStore() const;
+    std::shared_ptr<ThreadData> lockThreadData() const { return threadData.lock(); }
     void setDisconnectReason(const std::string &reason);
     std::chrono::seconds getSecondsTillKillTime() const;
 
@@ -154,9 +237,12 @@ public:
     void writeMqttPacket(const MqttPacket &packet);
     void writeMqttPacketAndBlameThisClient(PublishCopyFactory &copyFactory, char max_qos, uint16_t packet_id);
     void writeMqttPacketAndBlameThisClient(const MqttPacket &packet);
+    void writePubResponse(const PacketType packetType, const ReasonCodes reasonCode, const uint16_t packetId);
+    void writePublishResponse(const PacketType packetType, const ReasonCodes reasonCode, const uint16_t packetId);
+    void resumeAfterBackpressure();
     bool writeBufIntoFd();
     bool isBeingDisconnected() const { return disconnectWhenBytesWritten; }
-    bool readyForDisconnecting() const { return disconnectWhenBytesWritten && writebuf.usedBytes() == 0; }
+    bool readyForDisconnecting() const { return disconnectWhenBytesWritten && writebuf.usedBytes() == 0 && sharedPayloadWrites.empty(); }
 
     // Do this before calling an action that makes this client ready for writing, so that the EPOLLOUT will handle it.
     void setReadyForDisconnect() { disconnectWhenBytesWritten = true; }
@@ -174,6 +260,7 @@ public:
 
     void sendOrQueueWill();
     void serverInitiatedDisconnect(ReasonCodes reason);
+    void disconnectSlowConsumer(const std::string &reason);
 
     void setRegistrationData(bool clean_start, uint16_t client_receive_max, uint32_t sessionExpiryInterval);
     const std::unique_ptr<StowedClientRegistrationData> &getRegistrationData() const;
@@ -191,9 +278,7 @@ public:
     std::function<void(MqttPacket &packet)> onPacketReceived;
 #endif
 
-#ifndef NDEBUG
     void setFakeUpgraded();
-#endif
 
 };
 
@@ -0,0 +1,1423 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "cluster.h"
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <cassert>
+
+#include "openssl/hmac.h"
+#include "openssl/crypto.h"
+
+#include "utils.h"
+#include "settings.h"
+#include "subscriptionstore.h"
+#include "threaddata.h"
+#include "publishcopyfactory.h"
+#include "rwlockguard.h"
+
+#define CLUSTER_MAX_EVENTS 64
+#define CLUSTER_MAX_MESSAGE_SIZE 272629760 // The largest MQTT packet, with room to spare. Also limits the queued messages of a moving session.
+#define CLUSTER_MAX_HANDSHAKE_MESSAGE_SIZE 4096 // Until a peer proved it knows the secret.
+#define CLUSTER_HANDSHAKE_TIMEOUT_SECONDS 10
+#define CLUSTER_NONCE_LENGTH 32
+#define CLUSTER_MAX_PENDING_BYTES 67108864 // Publishes for a link that doesn't keep up are dropped above this.
+#define CLUSTER_READ_CHUNK 65536
+#define CLUSTER_FILTERS_PER_MESSAGE 1000
+
+ClusterMessage::ClusterMessage(ClusterMessageType type)
+{
+    data.resize(4);
+    data.push_back(static_cast<char>(type));
+}
+
+/**
+ * @brief ClusterMessage::ClusterMessage makes a received message, from a frame that includes the length.
+ */
+ClusterMessage::ClusterMessage(const char *frame, size_t len) :
+    data(frame, frame + len)
+{
+    if (data.size() < 5)
+        throw std::runtime_error("Cluster message is shorter than its header.");
+}
+
+void ClusterMessage::checkAvailable(size_t len) const
+{
+    if (pos + len > data.size())
+        throw std::runtime_error("Cluster message is shorter than expected.");
+}
+
+ClusterMessageType ClusterMessage::getType() const
+{
+    return static_cast<ClusterMessageType>(data[4]);
+}
+
+/**
+ * @brief ClusterMessage::getSize is the size of the frame, including the length.
+ */
+size_t ClusterMessage::getSize() const
+{
+    return data.size();
+}
+
+void ClusterMessage::writeUint8(uint8_t x)
+{
+    data.push_back(static_cast<char>(x));
+}
+
+void ClusterMessage::writeUint16(uint16_t x)
+{
+    const uint16_t n = htons(x);
+    const char *b = reinterpret_cast<const char*>(&n);
+    data.insert(data.end(), b, b + sizeof(n));
+}
+
+void ClusterMessage::writeUint32(uint32_t x)
+{
+    const uint32_t n = htonl(x);
+    const char *b = reinterpret_cast<const char*>(&n);
+    data.insert(data.end(), b, b + sizeof(n));
+}
+
+void ClusterMessage::writeString(const std::string &s)
+{
+    writeUint32(s.length());
+    data.insert(data.end(), s.begin(), s.end());
+}
+
+/**
+ * @brief ClusterMessage::writePublish writes what a node needs to give a publish to its subscribers. Like when saving them to disk, that
+ * leaves out the MQTT5 properties, except the expiry. The retain flag is left out; that is in the message type.
+ */
+void ClusterMessage::writePublish(const Publish &publish)
+{
+    writeString(publish.topic);
+    writeString(publish.payload);
+    writeUint8(publish.qos);
+
+    uint32_t expiresAfter = 0;
+    if (publish.hasExpireInfo)
+    {
+        const std::chrono::seconds age = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - publish.createdAt);
+        expiresAfter = std::max<int64_t>((publish.expiresAfter - age).count(), 0);
+    }
+
+    writeUint8(publish.hasExpireInfo);
+    writeUint32(expiresAfter);
+}
+
+uint8_t ClusterMessage::readUint8()
+{
+    checkAvailable(1);
+    return static_cast<uint8_t>(data[pos++]);
+}
+
+uint16_t ClusterMessage::readUint16()
+{
+    checkAvailable(2);
+    uint16_t n = 0;
+    std::memcpy(&n, data.data() + pos, sizeof(n));
+    pos += sizeof(n);
+    return ntohs(n);
+}
+
+uint32_t ClusterMessage::readUint32()
+{
+    checkAvailable(4);
+    uint32_t n = 0;
+    std::memcpy(&n, data.data() + pos, sizeof(n));
+    pos += sizeof(n);
+    return ntohl(n);
+}
+
+std::string ClusterMessage::readString()
+{
+    const uint32_t len = readUint32();
+    checkAvailable(len);
+    std::string s(data.data() + pos, len);
+    pos += len;
+    return s;
+}
+
+Publish ClusterMessage::readPublish()
+{
+    std::string topic = readString();
+    std::string payload = readString();
+    const uint8_t qos = readUint8();
+
+    if (!isValidPublishPath(topic) || !isValidUtf8(topic, true) || qos > 2)
+        throw std::runtime_error("Invalid publish in cluster message.");
+
+    Publish publish(topic, payload, qos);
+
+    const bool hasExpireInfo = readUint8();
+    const uint32_t expiresAfter = readUint32();
+    if (hasExpireInfo)
+        publish.setExpireAfter(expiresAfter);
+
+    return publish;
+}
+
+/**
+ * @brief ClusterMessage::getFrame fills in the length, and gives the bytes to send.
+ */
+const std::vector<char> &ClusterMessage::getFrame()
+{
+    const uint32_t len = htonl(data.size() - 4);
+    std::memcpy(data.data(), &len, sizeof(len));
+    return data;
+}
+
+bool ClusterInterest::Node::empty() const
+{
+    return children.empty() && !childrenPlus && !filterEnds && !filterEndsWithPound;
+}
+
+bool ClusterInterest::add(const std::string &filter)
+{
+    std::vector<std::string> subtopics;
+    splitTopic(filter, subtopics);
+
+    Node *node = &root;
+    for (const std::string &subtopic : subtopics)
+    {
+        // A '#' is always the last in a valid filter.
+        if (subtopic == "#")
+        {
+            if (node->filterEndsWithPound)
+                return false;
+
+            node->filterEndsWithPound = true;
+            count++;
+            return true;
+        }
+
+        std::unique_ptr<Node> &child = subtopic == "+" ? node->childrenPlus : node->children[subtopic];
+
+        if (!child)
+            child = std::make_unique<Node>();
+
+        node = child.get();
+    }
+
+    if (node->filterEnds)
+        return false;
+
+    node->filterEnds = true;
+    count++;
+    return true;
+}
+
+bool ClusterInterest::remove(const std::string &filter)
+{
+    std::vector<std::string> subtopics;
+    splitTopic(filter, subtopics);
+
+    const bool removed = removeRecursively(subtopics.begin(), subtopics.end(), &root);
+
+    if (removed)
+        count--;
+
+    return removed;
+}
+
+/**
+ * @brief ClusterInterest::removeRecursively unsets the end of a filter, and removes the nodes that are then not needed anymore.
+ * @return whether the filter was there.
+ */
+bool ClusterInterest::removeRecursively(std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
+                                        Node *this_node)
+{
+    if (cur_subtopic_it == end)
+    {
+        const bool wasThere = this_node->filterEnds;
+        this_node->filterEnds = false;
+        return wasThere;
+    }
+
+    const std::string &subtopic = *cur_subtopic_it;
+
+    if (subtopic == "#")
+    {
+        const bool wasThere = this_node->filterEndsWithPound;
+        this_node->filterEndsWithPound = false;
+        return wasThere;
+    }
+
+    Node *child = nullptr;
+    if (subtopic == "+")
+    {
+        child = this_node->childrenPlus.get();
+    }
+    else
+    {
+        auto pos = this_node->children.find(subtopic);
+        if (pos != this_node->children.end())
+            child = pos->second.get();
+    }
+
+    if (!child)
+        return false;
+
+    const bool removed = removeRecursively(++cur_subtopic_it, end, child);
+
+    if (removed && child->empty())
+    {
+        if (subtopic == "+")
+            this_node->childrenPlus.reset();
+        else
+            this_node->children.erase(subtopic);
+    }
+
+    return removed;
+}
+
+void ClusterInterest::clear()
+{
+    root.children.clear();
+    root.childrenPlus.reset();
+    root.filterEnds = false;
+    root.filterEndsWithPound = false;
+    count = 0;
+}
+
+bool ClusterInterest::matches(const std::vector<std::string> &subtopics) const
+{
+    return matchesRecursively(subtopics.begin(), subtopics.end(), &root);
+}
+
+/**
+ * @brief ClusterInterest::matchesRecursively is like SubscriptionStore::publishRecursively(), but stops at the first match.
+ *
+ * A filter ending in '#' also matches its parent level, so 'one/#' matches 'one'.
+ */
+bool ClusterInterest::matchesRecursively(std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
+                                         const Node *this_node)
+{
+    if (this_node->filterEndsWithPound)
+        return true;
+
+    if (cur_subtopic_it == end)
+        return this_node->filterEnds;
+
+    const std::string &cur_subtop = *cur_subtopic_it;
+    const auto next_subtopic = ++cur_subtopic_it;
+
+    auto pos = this_node->children.find(cur_subtop);
+    if (pos != this_node->children.end() && matchesRecursively(next_subtopic, end, pos->second.get()))
+        return true;
+
+    if (this_node->childrenPlus)
+        return matchesRecursively(next_subtopic, end, this_node->childrenPlus.get());
+
+    return false;
+}
+
+size_t ClusterInterest::size() const
+{
+    return count;
+}
+
+ClusterLink::ClusterLink(int fd, bool outgoing, const std::string &address) :
+    fd(fd),
+    outgoing(outgoing),
+    connecting(outgoing),
+    address(address),
+    handshakeDeadline(std::chrono::steady_clock::now() + std::chrono::seconds(CLUSTER_HANDSHAKE_TIMEOUT_SECONDS))
+{
+
+}
+
+ClusterLink::~ClusterLink()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+ * @brief ClusterLink::queue adds the message to the bytes the cluster thread will write. Wake it up after.
+ * @param mayDrop is for publishes, which are dropped when the peer doesn't keep up.
+ * @return whether it was queued.
+ */
+bool ClusterLink::queue(ClusterMessage &msg, bool mayDrop)
+{
+    const std::vector<char> &frame = msg.getFrame();
+
+    std::lock_guard<std::mutex> locker(pendingMutex);
+
+    if (mayDrop && !pending.empty() && pending.size() + frame.size() > CLUSTER_MAX_PENDING_BYTES)
+    {
+        droppedPublishes++;
+        return false;
+    }
+
+    pending.insert(pending.end(), frame.begin(), frame.end());
+    return true;
+}
+
+bool ClusterLink::isInterested(const std::vector<std::string> &subtopics)
+{
+    RWLockGuard locker(&interestRwlock);
+    locker.rdlock();
+    return interest.matches(subtopics);
+}
+
+const std::string &ClusterLink::getPeerName() const
+{
+    return peerName;
+}
+
+ClusterNode::ClusterNode(const Settings &settings, std::shared_ptr<SubscriptionStore> subscriptionStore) :
+    nodeName(settings.clusterNodeName),
+    secret(settings.clusterSecret),
+    bindAddress(settings.clusterBindAddress),
+    port(settings.clusterPort),
+    subscriptionStore(subscriptionStore)
+{
+    epollfd = check<std::runtime_error>(epoll_create(999));
+    eventFd = check<std::runtime_error>(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = eventFd;
+    ev.events = EPOLLIN;
+    check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_ADD, eventFd, &ev));
+
+    for (const std::string &address : settings.clusterPeers)
+    {
+        ClusterPeer peer;
+        peer.address = address;
+        peers.push_back(peer);
+    }
+}
+
+ClusterNode::~ClusterNode()
+{
+    quit();
+
+    if (listenFd >= 0)
+        close(listenFd);
+    if (eventFd >= 0)
+        close(eventFd);
+    if (epollfd >= 0)
+        close(epollfd);
+}
+
+void ClusterNode::createListenSocket()
+{
+    const int family = strContains(bindAddress, ":") ? AF_INET6 : AF_INET;
+    BindAddr bindAddr = getBindAddr(family, bindAddress, port);
+
+    listenFd = check<std::runtime_error>(socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+
+    int optval = 1;
+    check<std::runtime_error>(setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)));
+    check<std::runtime_error>(bind(listenFd, bindAddr.p.get(), bindAddr.len));
+    check<std::runtime_error>(listen(listenFd, 128));
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = listenFd;
+    ev.events = EPOLLIN;
+    check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_ADD, listenFd, &ev));
+
+    logger->logf(LOG_NOTICE, "Cluster node '%s' listening for other nodes on [%s]:%d", nodeName.c_str(), bindAddress.c_str(), port);
+}
+
+/**
+ * @brief ClusterNode::start starts the cluster thread. Publishes from other nodes are given to the worker threads to deliver.
+ */
+void ClusterNode::start(const std::vector<std::shared_ptr<ThreadData>> &threads)
+{
+    this->threads = threads;
+
+    if (port > 0)
+        createListenSocket();
+
+    nextInterestSync = std::chrono::steady_clock::now();
+    running = true;
+
+    thread = std::thread(&ClusterNode::run, this);
+    pthread_setname_np(thread.native_handle(), "Cluster");
+}
+
+void ClusterNode::quit()
+{
+    if (!running)
+        return;
+
+    running = false;
+
+    uint64_t one = 1;
+    check<std::runtime_error>(write(eventFd, &one, sizeof(uint64_t)));
+
+    if (thread.joinable())
+        thread.join();
+}
+
+/**
+ * @brief ClusterNode::wakeUp makes the cluster thread write what was queued. Many publishes only need one wake-up.
+ */
+void ClusterNode::wakeUp()
+{
+    if (wakeUpPending.exchange(true))
+        return;
+
+    uint64_t one = 1;
+    check<std::runtime_error>(write(eventFd, &one, sizeof(uint64_t)));
+}
+
+void ClusterNode::run()
+{
+    struct epoll_event events[CLUSTER_MAX_EVENTS];
+    memset(&events, 0, sizeof (struct epoll_event)*CLUSTER_MAX_EVENTS);
+
+    while (running)
+    {
+        const int num_fds = epoll_wait(epollfd, events, CLUSTER_MAX_EVENTS, 100);
+
+        if (num_fds < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            logger->logf(LOG_ERR, "Waiting for cluster links error: %s", strerror(errno));
+        }
+
+        for (int i = 0; i < num_fds; i++)
+        {
+            const int fd = events[i].data.fd;
+
+            try
+            {
+                if (fd == eventFd)
+                {
+                    uint64_t eventfd_value = 0;
+                    check<std::runtime_error>(read(fd, &eventfd_value, sizeof(uint64_t)));
+
+                    // Before writing, so a queue after this wakes us again.
+                    wakeUpPending = false;
+                }
+                else if (fd == listenFd)
+                {
+                    acceptLink();
+                }
+                else
+                {
+                    auto pos = std::find_if(links.begin(), links.end(), [fd](const std::shared_ptr<ClusterLink> &l) { return l->fd == fd; });
+
+                    if (pos != links.end())
+                        handleLinkEvents(*pos, events[i].events);
+                }
+            }
+            catch (std::exception &ex)
+            {
+                logger->logf(LOG_ERR, "Error in cluster thread: %s", ex.what());
+            }
+        }
+
+        for (std::shared_ptr<ClusterLink> &link : links)
+        {
+            flushLink(link);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+
+        try
+        {
+            connectToPeers();
+            closeStaleHandshakes();
+
+            if (now >= nextInterestSync)
+            {
+                syncInterest();
+                nextInterestSync = now + std::chrono::seconds(5);
+            }
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Error in cluster thread: %s", ex.what());
+        }
+
+        removeClosedLinks();
+    }
+
+    // What the worker threads queued last, like wills at shutdown, as far as the sockets take it.
+    for (std::shared_ptr<ClusterLink> &link : links)
+    {
+        flushLink(link);
+    }
+
+    RWLockGuard locker(&linksRwlock);
+    locker.wrlock();
+    links.clear();
+}
+
+/**
+ * @brief ClusterNode::connectToPeers (re)connects to configured peers we have no link with. Either side of a pair may have the other
+ * configured; when they connect both ways, handleHello() picks one link.
+ */
+void ClusterNode::connectToPeers()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    for (ClusterPeer &peer : peers)
+    {
+        if (peer.isSelf || !peer.link.expired() || now < peer.nextAttempt)
+            continue;
+
+        if (!peer.nodeName.empty())
+        {
+            const std::string &name = peer.nodeName;
+            if (std::any_of(links.begin(), links.end(), [&name](const std::shared_ptr<ClusterLink> &l) { return l->established && l->peerName == name; }))
+                continue;
+        }
+
+        peer.nextAttempt = now + std::chrono::seconds(2);
+
+        const size_t colon = peer.address.rfind(':');
+        std::string host = peer.address.substr(0, colon);
+        const std::string service = peer.address.substr(colon + 1);
+
+        if (host.length() > 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.length() - 2);
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+
+        struct addrinfo *addrs = nullptr;
+        const int rc = getaddrinfo(host.c_str(), service.c_str(), &hints, &addrs);
+        if (rc != 0)
+        {
+            logger->logf(LOG_WARNING, "Can't resolve cluster peer '%s': %s", peer.address.c_str(), gai_strerror(rc));
+            continue;
+        }
+
+        int fd = socket(addrs->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, addrs->ai_addr, addrs->ai_addrlen) < 0 && errno != EINPROGRESS)
+        {
+            logger->logf(LOG_DEBUG, "Connecting to cluster peer '%s' failed: %s", peer.address.c_str(), strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+
+        freeaddrinfo(addrs);
+
+        if (fd < 0)
+            continue;
+
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        std::shared_ptr<ClusterLink> link = std::make_shared<ClusterLink>(fd, true, peer.address);
+        addLink(link);
+        peer.link = link;
+    }
+}
+
+void ClusterNode::acceptLink()
+{
+    struct sockaddr_in6 addrBiggest;
+    struct sockaddr *addr = reinterpret_cast<sockaddr*>(&addrBiggest);
+    socklen_t len = sizeof(struct sockaddr_in6);
+    memset(addr, 0, len);
+
+    const int fd = accept4(listenFd, addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            logger->logf(LOG_ERR, "Accepting cluster link failed: %s", strerror(errno));
+        return;
+    }
+
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    std::shared_ptr<ClusterLink> link = std::make_shared<ClusterLink>(fd, false, sockaddrToString(addr));
+    addLink(link);
+    sendHello(link);
+}
+
+void ClusterNode::addLink(const std::shared_ptr<ClusterLink> &link)
+{
+    link->workerIndex = nextWorkerIndex++;
+    link->waitingForWritable = link->connecting;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = link->fd;
+    ev.events = link->connecting ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_ADD, link->fd, &ev));
+
+    RWLockGuard locker(&linksRwlock);
+    locker.wrlock();
+    links.push_back(link);
+}
+
+/**
+ * @brief ClusterNode::closeLink closes the connection. The link itself is removed from the list at the end of the loop iteration.
+ */
+void ClusterNode::closeLink(const std::shared_ptr<ClusterLink> &link, const std::string &reason)
+{
+    if (link->closed)
+        return;
+
+    if (link->established)
+        logger->logf(LOG_NOTICE, "Cluster link with node '%s' at %s closed: %s", link->peerName.c_str(), link->address.c_str(), reason.c_str());
+    else
+        logger->logf(LOG_DEBUG, "Cluster link with %s closed: %s", link->address.c_str(), reason.c_str());
+
+    link->closed = true;
+    link->established = false;
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, link->fd, nullptr);
+    close(link->fd);
+    link->fd = -1;
+}
+
+void ClusterNode::removeClosedLinks()
+{
+    if (std::none_of(links.begin(), links.end(), [](const std::shared_ptr<ClusterLink> &l) { return l->closed; }))
+        return;
+
+    RWLockGuard locker(&linksRwlock);
+    locker.wrlock();
+    links.erase(std::remove_if(links.begin(), links.end(), [](const std::shared_ptr<ClusterLink> &l) { return l->closed; }), links.end());
+}
+
+void ClusterNode::handleLinkEvents(const std::shared_ptr<ClusterLink> &link, uint32_t events)
+{
+    if (link->connecting)
+    {
+        int error = 0;
+        socklen_t len = sizeof(int);
+        getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+        if (error != 0)
+        {
+            closeLink(link, strerror(error));
+            return;
+        }
+
+        if (!(events & EPOLLOUT))
+            return;
+
+        link->connecting = false;
+        link->handshakeDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(CLUSTER_HANDSHAKE_TIMEOUT_SECONDS);
+        logger->logf(LOG_INFO, "Connected to cluster peer %s.", link->address.c_str());
+        sendHello(link);
+        return;
+    }
+
+    if (events & EPOLLIN)
+        readFromLink(link);
+
+    if ((events & (EPOLLERR | EPOLLHUP)) && !link->closed)
+        closeLink(link, "socket is in ERR or HUP state");
+
+    if (events & EPOLLOUT)
+        flushLink(link);
+}
+
+/**
+ * @brief ClusterNode::readFromLink reads and handles the messages. Publishes are given to a worker thread in batches; all work for the
+ * same link goes to the same worker thread, to keep the order.
+ */
+void ClusterNode::readFromLink(const std::shared_ptr<ClusterLink> &link)
+{
+    std::vector<char> &buf = link->readBuf;
+
+    for (int i = 0; i < 16; i++)
+    {
+        const size_t oldSize = buf.size();
+        buf.resize(oldSize + CLUSTER_READ_CHUNK);
+        const ssize_t n = recv(link->fd, &buf[oldSize], CLUSTER_READ_CHUNK, 0);
+        buf.resize(oldSize + std::max<ssize_t>(n, 0));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (n <= 0)
+        {
+            closeLink(link, n == 0 ? "connection closed by peer" : strerror(errno));
+            break;
+        }
+
+        if (n < CLUSTER_READ_CHUNK)
+            break;
+    }
+
+    std::shared_ptr<std::vector<Publish>> publishes = std::make_shared<std::vector<Publish>>();
+    std::shared_ptr<ThreadData> worker = getWorker(link);
+
+    auto givePublishesToWorker = [&]()
+    {
+        if (publishes->empty())
+            return;
+
+        if (worker)
+            worker->queueClusterPublishes(publishes);
+
+        publishes = std::make_shared<std::vector<Publish>>();
+    };
+
+    size_t parsePos = 0;
+
+    try
+    {
+        while (!link->closed && buf.size() - parsePos >= 4)
+        {
+            uint32_t len = 0;
+            std::memcpy(&len, &buf[parsePos], sizeof(len));
+            len = ntohl(len);
+
+            const uint32_t maxLen = link->established ? CLUSTER_MAX_MESSAGE_SIZE : CLUSTER_MAX_HANDSHAKE_MESSAGE_SIZE;
+
+            if (len < 1 || len > maxLen)
+                throw std::runtime_error(formatString("invalid message length %u", len));
+
+            if (buf.size() - parsePos - 4 < len)
+                break;
+
+            ClusterMessage msg(&buf[parsePos], len + 4);
+            parsePos += len + 4;
+
+            const ClusterMessageType type = msg.getType();
+
+            if (type == ClusterMessageType::Hello)
+            {
+                handleHello(link, msg);
+                continue;
+            }
+
+            if (type == ClusterMessageType::Auth)
+            {
+                handleAuth(link, msg);
+                continue;
+            }
+
+            if (!link->established)
+                throw std::runtime_error("message before the handshake");
+
+            if (type == ClusterMessageType::InterestAdd || type == ClusterMessageType::InterestRemove)
+            {
+                handleInterest(link, msg);
+            }
+            else if (type == ClusterMessageType::Publish || type == ClusterMessageType::RetainedMessage)
+            {
+                publishes->push_back(msg.readPublish());
+                publishes->back().retain = type == ClusterMessageType::RetainedMessage;
+            }
+            else if (type == ClusterMessageType::SessionTakeover)
+            {
+                const std::string clientId = msg.readString();
+                const bool wantState = msg.readUint8();
+
+                givePublishesToWorker();
+                if (worker)
+                    worker->queueReleaseClusterSession(link->peerName, clientId, wantState);
+            }
+            else if (type == ClusterMessageType::SessionState)
+            {
+                std::shared_ptr<ClusterSessionState> state = std::make_shared<ClusterSessionState>();
+                state->clientId = msg.readString();
+
+                const uint32_t subscriptionCount = msg.readUint32();
+                for (uint32_t i = 0; i < subscriptionCount; i++)
+                {
+                    std::string filter = msg.readString();
+                    const char qos = std::min<uint8_t>(msg.readUint8(), 2);
+                    state->subscriptions.emplace_back(std::move(filter), qos);
+                }
+
+                const uint32_t publishCount = msg.readUint32();
+                for (uint32_t i = 0; i < publishCount; i++)
+                {
+                    state->publishes.push_back(msg.readPublish());
+                }
+
+                givePublishesToWorker();
+                if (worker)
+                    worker->queueAdoptClusterSessionState(state);
+            }
+            else
+            {
+                throw std::runtime_error(formatString("unknown message type %d", static_cast<int>(type)));
+            }
+        }
+    }
+    catch (std::exception &ex)
+    {
+        closeLink(link, formatString("protocol error: %s", ex.what()));
+    }
+
+    givePublishesToWorker();
+
+    buf.erase(buf.begin(), buf.begin() + parsePos);
+}
+
+void ClusterNode::flushLink(const std::shared_ptr<ClusterLink> &link)
+{
+    if (link->closed || link->connecting)
+        return;
+
+    while (true)
+    {
+        if (link->writingPos >= link->writing.size())
+        {
+            link->writing.clear();
+            link->writingPos = 0;
+
+            std::lock_guard<std::mutex> locker(link->pendingMutex);
+
+            if (link->pending.empty())
+                break;
+
+            link->writing.swap(link->pending);
+        }
+
+        const ssize_t n = send(link->fd, &link->writing[link->writingPos], link->writing.size() - link->writingPos, MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                setWaitForWritable(link, true);
+                return;
+            }
+
+            closeLink(link, formatString("write error: %s", strerror(errno)));
+            return;
+        }
+
+        link->writingPos += n;
+    }
+
+    setWaitForWritable(link, false);
+}
+
+void ClusterNode::setWaitForWritable(const std::shared_ptr<ClusterLink> &link, bool wait)
+{
+    if (link->waitingForWritable == wait)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = link->fd;
+    ev.events = wait ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_MOD, link->fd, &ev));
+
+    link->waitingForWritable = wait;
+}
+
+void ClusterNode::sendHello(const std::shared_ptr<ClusterLink> &link)
+{
+    link->ownNonce = getSecureRandomString(CLUSTER_NONCE_LENGTH);
+
+    ClusterMessage msg(ClusterMessageType::Hello);
+    msg.writeUint8(CLUSTER_PROTOCOL_VERSION);
+    msg.writeString(nodeName);
+    msg.writeString(link->ownNonce);
+    link->queue(msg);
+}
+
+/**
+ * @brief ClusterNode::makeAuthProof is the HMAC a node sends to prove it knows the secret. Because it covers the nonces of both sides, it
+ * can't be replayed on another link, and because it covers the sender's name, a node can't be made to prove itself to itself.
+ */
+std::string ClusterNode::makeAuthProof(const std::string &senderNonce, const std::string &receiverNonce, const std::string &senderName) const
+{
+    const std::string input = senderNonce + receiverNonce + senderName;
+
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen = 0;
+
+    if (!HMAC(EVP_sha256(), secret.data(), secret.length(), reinterpret_cast<const unsigned char*>(input.data()), input.length(), md, &mdLen))
+        throw std::runtime_error("Making cluster handshake HMAC failed.");
+
+    return std::string(reinterpret_cast<const char*>(md), mdLen);
+}
+
+/**
+ * @brief ClusterNode::handleHello answers the hello of a peer with proof that we know the secret. The link is only usable once the peer
+ * did the same, in handleAuth().
+ */
+void ClusterNode::handleHello(const std::shared_ptr<ClusterLink> &link, ClusterMessage &msg)
+{
+    const uint8_t version = msg.readUint8();
+
+    if (version != CLUSTER_PROTOCOL_VERSION)
+        throw std::runtime_error(formatString("node speaks cluster protocol version %d instead of %d", version, CLUSTER_PROTOCOL_VERSION));
+
+    const std::string name = msg.readString();
+    const std::string nonce = msg.readString();
+
+    if (name.empty() || nonce.length() != CLUSTER_NONCE_LENGTH || link->established || !link->claimedName.empty() || link->ownNonce.empty())
+        throw std::runtime_error("invalid hello");
+
+    if (name == nodeName)
+    {
+        // Only when the nonce is ours is it really this node, and not another one with the same name.
+        const bool isSelf = std::any_of(links.begin(), links.end(), [&nonce](const std::shared_ptr<ClusterLink> &l) { return l->ownNonce == nonce; });
+
+        for (ClusterPeer &peer : peers)
+        {
+            if (peer.link.lock() == link)
+                peer.isSelf = isSelf;
+        }
+
+        closeLink(link, isSelf ? "that's this node itself" : "node has the same name as this node");
+        return;
+    }
+
+    link->claimedName = name;
+    link->peerNonce = nonce;
+
+    ClusterMessage auth(ClusterMessageType::Auth);
+    auth.writeString(makeAuthProof(link->ownNonce, link->peerNonce, nodeName));
+    link->queue(auth);
+}
+
+/**
+ * @brief ClusterNode::handleAuth makes the link usable when the peer proved it knows the secret. When there already is a link with the
+ * node, because both connected, the one made by the node with the lowest name stays. Both nodes come to the same conclusion that way.
+ */
+void ClusterNode::handleAuth(const std::shared_ptr<ClusterLink> &link, ClusterMessage &msg)
+{
+    const std::string proof = msg.readString();
+
+    if (link->established || link->claimedName.empty())
+        throw std::runtime_error("unexpected handshake message");
+
+    const std::string expected = makeAuthProof(link->peerNonce, link->ownNonce, link->claimedName);
+
+    if (proof.length() != expected.length() || CRYPTO_memcmp(proof.data(), expected.data(), expected.length()) != 0)
+    {
+        logger->logf(LOG_WARNING, "Rejecting cluster link with %s: node claiming to be '%s' doesn't know the cluster secret.",
+                     link->address.c_str(), link->claimedName.c_str());
+        throw std::runtime_error("wrong cluster secret");
+    }
+
+    const std::string name = link->claimedName;
+
+    for (ClusterPeer &peer : peers)
+    {
+        if (peer.link.lock() != link)
+            continue;
+
+        peer.nodeName = name;
+        peer.isSelf = false;
+    }
+
+    auto existing = std::find_if(links.begin(), links.end(), [&](const std::shared_ptr<ClusterLink> &l) {
+        return l != link && l->established && l->peerName == name;
+    });
+
+    if (existing != links.end())
+    {
+        const std::string &existingInitiator = (*existing)->outgoing ? nodeName : name;
+        const std::string &newInitiator = link->outgoing ? nodeName : name;
+
+        // The same initiator again means the old link is stale.
+        if (newInitiator <= existingInitiator)
+        {
+            closeLink(*existing, "replaced by another link with the same node");
+        }
+        else
+        {
+            closeLink(link, "there already is a link with this node");
+            return;
+        }
+    }
+
+    link->peerName = name;
+    logger->logf(LOG_NOTICE, "Cluster link with node '%s' at %s is up.", name.c_str(), link->address.c_str());
+
+    sendInitialState(link);
+}
+
+/**
+ * @brief ClusterNode::closeStaleHandshakes closes links that didn't finish the handshake in time, so connections that never say anything
+ * don't stay open.
+ */
+void ClusterNode::closeStaleHandshakes()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    for (const std::shared_ptr<ClusterLink> &link : links)
+    {
+        if (!link->established && !link->closed && !link->connecting && now > link->handshakeDeadline)
+            closeLink(link, "no handshake in time");
+    }
+}
+
+void ClusterNode::handleInterest(const std::shared_ptr<ClusterLink> &link, ClusterMessage &msg)
+{
+    const bool add = msg.getType() == ClusterMessageType::InterestAdd;
+    const uint32_t count = msg.readUint32();
+
+    RWLockGuard locker(&link->interestRwlock);
+    locker.wrlock();
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const std::string filter = msg.readString();
+
+        if (add)
+            link->interest.add(filter);
+        else
+            link->interest.remove(filter);
+    }
+}
+
+/**
+ * @brief ClusterNode::sendInitialState tells a new peer our interest and retained messages. From then on, it gets changes and publishes.
+ */
+void ClusterNode::sendInitialState(const std::shared_ptr<ClusterLink> &link)
+{
+    size_t filterCount = 0;
+
+    {
+        std::lock_guard<std::mutex> locker(interestMutex);
+
+        const std::vector<std::string> filters(announcedInterest.begin(), announcedInterest.end());
+        filterCount = filters.size();
+        queueInterestMessages(ClusterMessageType::InterestAdd, filters, link);
+
+        link->established = true;
+    }
+
+    std::vector<RetainedMessage> retainedMessages;
+    subscriptionStore->getRetainedMessages(retainedMessages);
+
+    for (const RetainedMessage &rm : retainedMessages)
+    {
+        ClusterMessage msg(ClusterMessageType::RetainedMessage);
+        msg.writePublish(rm.publish);
+        link->queue(msg);
+    }
+
+    logger->logf(LOG_INFO, "Sent %zu topic filters and %zu retained messages to cluster node '%s'.", filterCount,
+                 retainedMessages.size(), link->peerName.c_str());
+}
+
+/**
+ * @brief ClusterNode::syncInterest tells other nodes which filters are new and which are gone, compared to what they were told.
+ *
+ * New subscriptions are announced right away by subscriptionAdded(), so this is mainly for removing interest, which doesn't need to
+ * be fast; until then, a node only gets publishes it doesn't need.
+ */
+void ClusterNode::syncInterest()
+{
+    std::lock_guard<std::mutex> locker(interestMutex);
+
+    std::set<std::string> current;
+    subscriptionStore->getSubscriptionFilters(current);
+
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+    std::set_difference(current.begin(), current.end(), announcedInterest.begin(), announcedInterest.end(), std::back_inserter(added));
+    std::set_difference(announcedInterest.begin(), announcedInterest.end(), current.begin(), current.end(), std::back_inserter(removed));
+
+    announcedInterest.swap(current);
+
+    queueInterestMessages(ClusterMessageType::InterestAdd, added, nullptr);
+    queueInterestMessages(ClusterMessageType::InterestRemove, removed, nullptr);
+
+    for (std::shared_ptr<ClusterLink> &link : links)
+    {
+        std::lock_guard<std::mutex> pendingLocker(link->pendingMutex);
+
+        if (link->droppedPublishes > link->droppedPublishesLogged)
+        {
+            logger->logf(LOG_WARNING, "Dropped %lu publishes for cluster node '%s', because it doesn't keep up.",
+                         link->droppedPublishes - link->droppedPublishesLogged, link->peerName.c_str());
+            link->droppedPublishesLogged = link->droppedPublishes;
+        }
+    }
+}
+
+/**
+ * @brief ClusterNode::queueInterestMessages sends filters in messages of limited size.
+ * @param onlyLink is the link to send to, or null for all links.
+ */
+void ClusterNode::queueInterestMessages(ClusterMessageType type, const std::vector<std::string> &filters, const std::shared_ptr<ClusterLink> &onlyLink)
+{
+    for (size_t i = 0; i < filters.size(); i += CLUSTER_FILTERS_PER_MESSAGE)
+    {
+        const size_t end = std::min<size_t>(filters.size(), i + CLUSTER_FILTERS_PER_MESSAGE);
+
+        ClusterMessage msg(type);
+        msg.writeUint32(end - i);
+
+        for (size_t j = i; j < end; j++)
+        {
+            msg.writeString(filters[j]);
+        }
+
+        if (onlyLink)
+            onlyLink->queue(msg);
+        else
+            queueAtAllLinks(msg);
+    }
+}
+
+void ClusterNode::queueAtAllLinks(ClusterMessage &msg)
+{
+    {
+        RWLockGuard locker(&linksRwlock);
+        locker.rdlock();
+
+        for (const std::shared_ptr<ClusterLink> &link : links)
+        {
+            if (link->established)
+                link->queue(msg);
+        }
+    }
+
+    wakeUp();
+}
+
+std::shared_ptr<ThreadData> ClusterNode::getWorker(const std::shared_ptr<ClusterLink> &link) const
+{
+    if (threads.empty())
+        return std::shared_ptr<ThreadData>();
+
+    return threads[link->workerIndex % threads.size()];
+}
+
+/**
+ * @brief ClusterNode::forwardPublish sends a publish to the nodes that have subscribers for it. Called from the worker threads.
+ */
+void ClusterNode::forwardPublish(PublishCopyFactory &copyFactory)
+{
+    const std::vector<std::string> &subtopics = copyFactory.getSubtopics();
+    std::unique_ptr<ClusterMessage> msg;
+    bool queued = false;
+
+    {
+        RWLockGuard locker(&linksRwlock);
+        locker.rdlock();
+
+        for (const std::shared_ptr<ClusterLink> &link : links)
+        {
+            if (!link->established || !link->isInterested(subtopics))
+                continue;
+
+            if (!msg)
+            {
+                msg = std::make_unique<ClusterMessage>(ClusterMessageType::Publish);
+                msg->writePublish(copyFactory.getPublishData());
+            }
+
+            queued |= link->queue(*msg, true);
+        }
+    }
+
+    if (queued)
+        wakeUp();
+}
+
+/**
+ * @brief ClusterNode::forwardRetainedMessage sends a retained message, or its removal, to all nodes, interested or not.
+ *
+ * These are never dropped like publishes are, because there is no resync of retained messages after the initial state, so a dropped
+ * one would leave the nodes with different retained messages for good.
+ */
+void ClusterNode::forwardRetainedMessage(const Publish &publish)
+{
+    ClusterMessage msg(ClusterMessageType::RetainedMessage);
+    msg.writePublish(publish);
+
+    bool queued = false;
+
+    {
+        RWLockGuard locker(&linksRwlock);
+        locker.rdlock();
+
+        for (const std::shared_ptr<ClusterLink> &link : links)
+        {
+            if (link->established)
+                queued |= link->queue(msg);
+        }
+    }
+
+    if (queued)
+        wakeUp();
+}
+
+/**
+ * @brief ClusterNode::subscriptionAdded announces a filter right away, so publishes on other nodes reach a new subscriber without delay.
+ */
+void ClusterNode::subscriptionAdded(const std::string &topic)
+{
+    // Those are in the separate '$' tree of the subscription store, which only gets the local $SYS publishes.
+    if (!topic.empty() && topic[0] == '$')
+        return;
+
+    std::lock_guard<std::mutex> locker(interestMutex);
+
+    if (!announcedInterest.insert(topic).second)
+        return;
+
+    ClusterMessage msg(ClusterMessageType::InterestAdd);
+    msg.writeUint32(1);
+    msg.writeString(topic);
+    queueAtAllLinks(msg);
+}
+
+/**
+ * @brief ClusterNode::subscriptionsAdded is subscriptionAdded() for many filters, like the ones of one subscribe, with fewer messages.
+ */
+void ClusterNode::subscriptionsAdded(const std::vector<std::string> &topics)
+{
+    std::vector<std::string> newFilters;
+
+    std::lock_guard<std::mutex> locker(interestMutex);
+
+    for (const std::string &topic : topics)
+    {
+        if (!topic.empty() && topic[0] == '$')
+            continue;
+
+        if (announcedInterest.insert(topic).second)
+            newFilters.push_back(topic);
+    }
+
+    queueInterestMessages(ClusterMessageType::InterestAdd, newFilters, nullptr);
+}
+
+/**
+ * @brief ClusterNode::takeOverSessionFromOtherNodes makes other nodes disconnect the client with this id, and hand over its session.
+ * @param wantState is false for a clean start; then only the disconnecting is needed.
+ */
+void ClusterNode::takeOverSessionFromOtherNodes(const std::string &clientId, bool wantState)
+{
+    ClusterMessage msg(ClusterMessageType::SessionTakeover);
+    msg.writeString(clientId);
+    msg.writeUint8(wantState);
+    queueAtAllLinks(msg);
+}
+
+/**
+ * @brief ClusterNode::releaseSession gives up the session, because its client connected to another node. Runs on a worker thread.
+ *
+ * Like for a local takeover, the old connection is disconnected with its will. The subscriptions and queued QoS messages go to the other
+ * node. Messages that were spilled to disk stay behind.
+ */
+void ClusterNode::releaseSession(const std::string &peerName, const std::string &clientId, bool wantState)
+{
+    std::shared_ptr<Session> session = subscriptionStore->releaseSession(clientId);
+
+    if (!session)
+        return;
+
+    logger->logf(LOG_NOTICE, "Client '%s' connected to cluster node '%s'. Handing over its session.", clientId.c_str(), peerName.c_str());
+
+    std::shared_ptr<Client> client = session->makeSharedClient();
+    if (client)
+    {
+        client->setDisconnectReason(formatString("Client connected to cluster node '%s'", peerName.c_str()));
+        client->serverInitiatedDisconnect(ReasonCodes::SessionTakenOver);
+    }
+
+    if (!wantState)
+        return;
+
+    const std::vector<std::pair<std::string, char>> subscriptions = subscriptionStore->getSubscriptionsOfSession(session);
+    const std::vector<Publish> publishes = session->getQueuedPublishes();
+
+    ClusterMessage msg(ClusterMessageType::SessionState);
+    msg.writeString(clientId);
+
+    msg.writeUint32(subscriptions.size());
+    for (const std::pair<std::string, char> &sub : subscriptions)
+    {
+        msg.writeString(sub.first);
+        msg.writeUint8(sub.second);
+    }
+
+    // The peer doesn't take messages over the maximum size, so what doesn't fit stays behind, like what was spilled to disk.
+    size_t publishCount = 0;
+    size_t size = msg.getSize() + 4;
+    for (const Publish &publish : publishes)
+    {
+        size += publish.topic.length() + publish.payload.length() + 14;
+        if (size > CLUSTER_MAX_MESSAGE_SIZE)
+            break;
+        publishCount++;
+    }
+
+    if (publishCount < publishes.size())
+    {
+        logger->logf(LOG_WARNING, "Session of client '%s' has too many queued messages to move to cluster node '%s'. %zu of %zu are dropped.",
+                     clientId.c_str(), peerName.c_str(), publishes.size() - publishCount, publishes.size());
+    }
+
+    msg.writeUint32(publishCount);
+    for (size_t i = 0; i < publishCount; i++)
+    {
+        msg.writePublish(publishes[i]);
+    }
+
+    bool queued = false;
+
+    {
+        RWLockGuard locker(&linksRwlock);
+        locker.rdlock();
+
+        for (const std::shared_ptr<ClusterLink> &link : links)
+        {
+            if (link->established && link->peerName == peerName)
+                queued |= link->queue(msg);
+        }
+    }
+
+    if (queued)
+        wakeUp();
+    else
+        logger->logf(LOG_WARNING, "Link with cluster node '%s' is gone. Session of client '%s' is lost.", peerName.c_str(), clientId.c_str());
+}
+
+/**
+ * @brief ClusterNode::adoptSessionState gives the session of a client that came from another node its subscriptions and queued
+ * messages. Runs on a worker thread.
+ */
+void ClusterNode::adoptSessionState(const ClusterSessionState &state)
+{
+    subscriptionStore->adoptSessionState(state);
+}
@@ -0,0 +1,274 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <unordered_map>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "forward_declarations.h"
+#include "types.h"
+#include "logger.h"
+
+#define CLUSTER_PROTOCOL_VERSION 2
+
+enum class ClusterMessageType : uint8_t
+{
+    Hello = 1,
+    InterestAdd = 2,
+    InterestRemove = 3,
+    Publish = 4,
+    RetainedMessage = 5,
+    SessionTakeover = 6,
+    SessionState = 7,
+    Auth = 8
+};
+
+/**
+ * @brief The ClusterMessage class is what cluster nodes send each other over their links.
+ *
+ * On the wire, a message is a four byte length followed by the data, of which the first byte is the type. Unlike for handover
+ * messages, numbers are in network byte order, because nodes can be on different machines.
+ */
+class ClusterMessage
+{
+    std::vector<char> data;
+    size_t pos = 5;
+
+    void checkAvailable(size_t len) const;
+
+public:
+    ClusterMessage(ClusterMessageType type);
+    ClusterMessage(const char *frame, size_t len);
+    ClusterMessage(const ClusterMessage &other) = delete;
+    ClusterMessage(ClusterMessage &&other) = default;
+
+    ClusterMessageType getType() const;
+    size_t getSize() const;
+
+    void writeUint8(uint8_t x);
+    void writeUint16(uint16_t x);
+    void writeUint32(uint32_t x);
+    void writeString(const std::string &s);
+    void writePublish(const Publish &publish);
+
+    uint8_t readUint8();
+    uint16_t readUint16();
+    uint32_t readUint32();
+    std::string readString();
+    Publish readPublish();
+
+    const std::vector<char> &getFrame();
+};
+
+/**
+ * @brief The ClusterInterest class is the set of topic filters a peer has subscribers for, in a tree to match topics against.
+ *
+ * It's a set, so adding or removing a filter twice is the same as doing it once. It's not thread safe.
+ */
+class ClusterInterest
+{
+    struct Node
+    {
+        std::unordered_map<std::string, std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> childrenPlus;
+        bool filterEnds = false;
+        bool filterEndsWithPound = false;
+
+        bool empty() const;
+    };
+
+    Node root;
+    size_t count = 0;
+
+    static bool matchesRecursively(std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
+                                   const Node *this_node);
+    static bool removeRecursively(std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
+                                  Node *this_node);
+
+public:
+    bool add(const std::string &filter);
+    bool remove(const std::string &filter);
+    void clear();
+    bool matches(const std::vector<std::string> &subtopics) const;
+    size_t size() const;
+};
+
+/**
+ * @brief The ClusterLink class is the connection with one other node. Everything goes over it: interest, publishes and sessions.
+ *
+ * Any thread can queue messages on it, but only the cluster thread does the IO.
+ */
+class ClusterLink
+{
+    friend class ClusterNode;
+
+    int fd = -1;
+    bool outgoing = false;
+    bool connecting = false;
+    bool waitingForWritable = false;
+    bool closed = false;
+    std::string address;
+    std::string peerName;
+    size_t workerIndex = 0;
+    std::atomic<bool> established {false};
+
+    // The handshake: the nonces both sides sent in their hello, and the name the peer claims until it proved it knows the secret.
+    std::string ownNonce;
+    std::string peerNonce;
+    std::string claimedName;
+    std::chrono::time_point<std::chrono::steady_clock> handshakeDeadline;
+
+    std::vector<char> readBuf;
+    std::vector<char> writing;
+    size_t writingPos = 0;
+
+    std::mutex pendingMutex;
+    std::vector<char> pending;
+    uint64_t droppedPublishes = 0;
+    uint64_t droppedPublishesLogged = 0;
+
+    pthread_rwlock_t interestRwlock = PTHREAD_RWLOCK_INITIALIZER;
+    ClusterInterest interest;
+
+public:
+    ClusterLink(int fd, bool outgoing, const std::string &address);
+    ClusterLink(const ClusterLink &other) = delete;
+    ~ClusterLink();
+
+    bool queue(ClusterMessage &msg, bool mayDrop = false);
+    bool isInterested(const std::vector<std::string> &subtopics);
+    const std::string &getPeerName() const;
+};
+
+struct ClusterPeer
+{
+    std::string address;
+    std::string nodeName; // Known after the first hello.
+    std::weak_ptr<ClusterLink> link;
+    std::chrono::time_point<std::chrono::steady_clock> nextAttempt;
+    bool isSelf = false;
+};
+
+/**
+ * @brief The ClusterSessionState struct is the state of a session that moved here from another node, or from another thread in the sharded
+ * thread model, to be given to the session here.
+ */
+struct ClusterSessionState
+{
+    std::string clientId;
+    std::vector<std::pair<std::string, char>> subscriptions;
+    std::vector<Publish> publishes;
+};
+
+/**
+ * @brief The ClusterNode class connects this server to the other nodes of the cluster, in its own thread.
+ *
+ * Nodes tell each other which topic filters they have subscribers for, and only publishes matching those are forwarded. Retained
+ * messages go to all nodes, so they can be given to new subscribers anywhere. When a client connects to a node, the other nodes
+ * are told to give up their session with that client id, and, unless it's a clean start, send its subscriptions and queued QoS
+ * messages along.
+ *
+ * Publishes received from other nodes are only given to local subscribers; that and a full mesh of links prevents loops.
+ *
+ * A link is only used after both nodes proved they know the cluster secret, with an HMAC over the nonces of both hellos. The link itself
+ * is not encrypted.
+ */
+class ClusterNode
+{
+    const std::string nodeName;
+    const std::string secret;
+    const std::string bindAddress;
+    const int port;
+
+    std::shared_ptr<SubscriptionStore> subscriptionStore;
+    std::vector<std::shared_ptr<ThreadData>> threads;
+    size_t nextWorkerIndex = 0;
+
+    int epollfd = -1;
+    int eventFd = -1;
+    int listenFd = -1;
+    std::thread thread;
+    std::atomic<bool> running {false};
+    std::atomic<bool> wakeUpPending {false};
+
+    // Only the cluster thread changes the links, with the lock held. Other threads lock to forward.
+    pthread_rwlock_t linksRwlock = PTHREAD_RWLOCK_INITIALIZER;
+    std::vector<std::shared_ptr<ClusterLink>> links;
+    std::vector<ClusterPeer> peers;
+
+    // The topic filters other nodes have been told about. Guarded by its mutex, which is taken before the links lock.
+    std::mutex interestMutex;
+    std::set<std::string> announcedInterest;
+    std::chrono::time_point<std::chrono::steady_clock> nextInterestSync;
+
+    Logger *logger = Logger::getInstance();
+
+    void createListenSocket();
+    void wakeUp();
+    void run();
+    void connectToPeers();
+    void acceptLink();
+    void addLink(const std::shared_ptr<ClusterLink> &link);
+    void closeLink(const std::shared_ptr<ClusterLink> &link, const std::string &reason);
+    void removeClosedLinks();
+    void handleLinkEvents(const std::shared_ptr<ClusterLink> &link, uint32_t events);
+    void readFromLink(const std::shared_ptr<ClusterLink> &link);
+    void flushLink(const std::shared_ptr<ClusterLink> &link);
+    void setWaitForWritable(const std::shared_ptr<ClusterLink> &link, bool wait);
+    void handleHello(const std::shared_ptr<ClusterLink> &link, ClusterMessage &msg);
+    void handleAuth(const std::shared_ptr<ClusterLink> &link, ClusterMessage &msg);
+    std::string makeAuthProof(const std::string &senderNonce, const std::string &receiverNonce, const std::string &senderName) const;
+    void closeStaleHandshakes();
+    void handleInterest(const std::shared_ptr<ClusterLink> &link, ClusterMessage &msg);
+    void sendHello(const std::shared_ptr<ClusterLink> &link);
+    void sendInitialState(const std::shared_ptr<ClusterLink> &link);
+    void syncInterest();
+    void queueAtAllLinks(ClusterMessage &msg);
+    void queueInterestMessages(ClusterMessageType type, const std::vector<std::string> &filters, const std::shared_ptr<ClusterLink> &onlyLink);
+    std::shared_ptr<ThreadData> getWorker(const std::shared_ptr<ClusterLink> &link) const;
+
+public:
+    ClusterNode(const Settings &settings, std::shared_ptr<SubscriptionStore> subscriptionStore);
+    ClusterNode(const ClusterNode &other) = delete;
+    ~ClusterNode();
+
+    void start(const std::vector<std::shared_ptr<ThreadData>> &threads);
+    void quit();
+
+    void forwardPublish(PublishCopyFactory &copyFactory);
+    void forwardRetainedMessage(const Publish &publish);
+    void subscriptionAdded(const std::string &topic);
+    void subscriptionsAdded(const std::vector<std::string> &topics);
+    void takeOverSessionFromOtherNodes(const std::string &clientId, bool wantState);
+
+    void releaseSession(const std::string &peerName, const std::string &clientId, bool wantState);
+    void adoptSessionState(const ClusterSessionState &state);
+};
+
+#endif // CLUSTER_H
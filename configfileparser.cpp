@@ -23,6 +23,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "fstream"
 #include <regex>
 #include "sys/stat.h"
+#include <sys/un.h>
 
 #include "openssl/ssl.h"
 #include "openssl/err.h"
@@ -112,6 +113,28 @@ ConfigFileParser::ConfigFileParser(const std::string &path) :
     validKeys.insert("storage_dir");
     validKeys.insert("max_qos_msg_pending_per_client");
     validKeys.insert("max_qos_bytes_pending_per_client");
+    validKeys.insert("client_write_buffer_watermark");
+    validKeys.insert("slow_consumer_policy");
+    validKeys.insert("publisher_backpressure");
+    validKeys.insert("client_read_budget_bytes");
+    validKeys.insert("client_read_budget_packets");
+    validKeys.insert("shared_payload_threshold");
+    validKeys.insert("zero_copy_sends");
+    validKeys.insert("handover_socket");
+    validKeys.insert("worker_cpus");
+    validKeys.insert("timer_cpus");
+    validKeys.insert("logger_cpus");
+    validKeys.insert("save_state_cpus");
+    validKeys.insert("numa_local_clients");
+    validKeys.insert("steer_by_incoming_cpu");
+    validKeys.insert("busy_poll_us");
+    validKeys.insert("parallel_fanout_threshold");
+    validKeys.insert("thread_model");
+    validKeys.insert("cluster_node_name");
+    validKeys.insert("cluster_secret");
+    validKeys.insert("cluster_bind_address");
+    validKeys.insert("cluster_port");
+    validKeys.insert("cluster_peer");
 
     validListenKeys.insert("port");
     validListenKeys.insert("protocol");
@@ -120,6 +143,19 @@ ConfigFileParser::ConfigFileParser(const std::string &path) :
     validListenKeys.insert("inet_protocol");
     validListenKeys.insert("inet4_bind_address");
     validListenKeys.insert("inet6_bind_address");
+    validListenKeys.insert("ktls");
+
+    validBridgeKeys.insert("address");
+    validBridgeKeys.insert("port");
+    validBridgeKeys.insert("client_id");
+    validBridgeKeys.insert("username");
+    validBridgeKeys.insert("password");
+    validBridgeKeys.insert("topic");
+    validBridgeKeys.insert("protocol_version");
+    validBridgeKeys.insert("qos");
+    validBridgeKeys.insert("max_inflight");
+    validBridgeKeys.insert("keepalive");
+    validBridgeKeys.insert("max_buffered_messages");
 
     settings = std::make_unique<Settings>();
 }
@@ -142,7 +178,7 @@ void ConfigFileParser::loadFile(bool test)
 
     std::list<std::string> lines;
 
-    const std::regex key_value_regex("^([a-zA-Z0-9_\\-]+) +([a-zA-Z0-9_\\-/\\.:]+)$");
+    const std::regex key_value_regex("^([a-zA-Z0-9_\\-]+) +([a-zA-Z0-9_\\-/\\.:#+]+)$");
     const std::regex block_regex_start("^([a-zA-Z0-9_\\-]+) *\\{$");
     const std::regex block_regex_end("^\\}$");
 
@@ -202,6 +238,7 @@ void ConfigFileParser::loadFile(bool test)
 
     ConfigParseLevel curParseLevel = ConfigParseLevel::Root;
     std::shared_ptr<Listener> curListener;
+    std::shared_ptr<BridgeConfig> curBridge;
     std::unique_ptr<Settings> tmpSettings = std::make_unique<Settings>();
 
     // Then once we know the config file is valid, process it.
@@ -217,6 +254,11 @@ void ConfigFileParser::loadFile(bool test)
                 curParseLevel = ConfigParseLevel::Listen;
                 curListener = std::make_shared<Listener>();
             }
+            else if (matches[1].str() == "bridge")
+            {
+                curParseLevel = ConfigParseLevel::Bridge;
+                curBridge = std::make_shared<BridgeConfig>();
+            }
             else
             {
                 throw ConfigFileException(formatString("'%s' is not a valid block.", key.c_str()));
@@ -232,6 +274,12 @@ void ConfigFileParser::loadFile(bool test)
                 tmpSettings->listeners.push_back(curListener);
                 curListener.reset();
             }
+            else if (curParseLevel == ConfigParseLevel::Bridge)
+            {
+                curBridge->isValid();
+                tmpSettings->bridges.push_back(curBridge);
+                curBridge.reset();
+            }
 
             curParseLevel = ConfigParseLevel::Root;
             continue;
@@ -287,6 +335,81 @@ void ConfigFileParser::loadFile(bool test)
                 {
                     curListener->inet6BindAddress = value;
                 }
+                if (key == "ktls")
+                {
+                    curListener->ktls = stringTruthiness(value);
+                }
+
+                continue;
+            }
+
+            if (curParseLevel == ConfigParseLevel::Bridge)
+            {
+                testKeyValidity(key, validBridgeKeys);
+
+                if (key == "address")
+                {
+                    curBridge->address = value;
+                }
+                else if (key == "port")
+                {
+                    curBridge->port = std::stoi(value);
+                }
+                else if (key == "client_id")
+                {
+                    curBridge->clientId = value;
+                }
+                else if (key == "username")
+                {
+                    curBridge->username = value;
+                }
+                else if (key == "password")
+                {
+                    curBridge->password = value;
+                }
+                else if (key == "topic")
+                {
+                    if (!isValidSubscribePath(value))
+                        throw ConfigFileException(formatString("Bridge topic '%s' is not a valid topic filter.", value.c_str()));
+                    curBridge->topics.push_back(value);
+                }
+                else if (key == "protocol_version")
+                {
+                    if (value == "3.1.1")
+                        curBridge->protocolVersion = ProtocolVersion::Mqtt311;
+                    else if (value == "5")
+                        curBridge->protocolVersion = ProtocolVersion::Mqtt5;
+                    else
+                        throw ConfigFileException(formatString("Bridge protocol_version '%s' is invalid. Valid values are 3.1.1 and 5.", value.c_str()));
+                }
+                else if (key == "qos")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 0 || newVal > 1)
+                        throw ConfigFileException(formatString("Bridge qos value '%d' is invalid. Valid values are 0 and 1.", newVal));
+                    curBridge->maxQos = newVal;
+                }
+                else if (key == "max_inflight")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 1 || newVal > 0xFFFF)
+                        throw ConfigFileException(formatString("Bridge max_inflight value '%d' is invalid. Valid values are between 1 and 65535.", newVal));
+                    curBridge->maxInflight = newVal;
+                }
+                else if (key == "keepalive")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 5 || newVal > 0xFFFF)
+                        throw ConfigFileException(formatString("Bridge keepalive value '%d' is invalid. Valid values are between 5 and 65535.", newVal));
+                    curBridge->keepalive = newVal;
+                }
+                else if (key == "max_buffered_messages")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 1)
+                        throw ConfigFileException(formatString("Bridge max_buffered_messages value '%d' is invalid. Valid values are 1 or higher.", newVal));
+                    curBridge->maxBufferedMessages = newVal;
+                }
 
                 continue;
             }
@@ -462,6 +585,184 @@ void ConfigFileParser::loadFile(bool test)
                     tmpSettings->maxQosBytesPendingPerClient = newVal;
                 }
 
+                if (key == "client_write_buffer_watermark")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal != 0 && newVal < 4096)
+                    {
+                        throw ConfigFileException(formatString("client_write_buffer_watermark value '%d' is invalid. Valid values are 0 (auto), or 4096 or higher.", newVal));
+                    }
+                    tmpSettings->clientWriteBufferWatermark = newVal;
+                }
+
+                if (key == "slow_consumer_policy")
+                {
+                    if (value == "drop_newest")
+                        tmpSettings->slowConsumerPolicy = SlowConsumerPolicy::DropNewest;
+                    else if (value == "drop_oldest")
+                        tmpSettings->slowConsumerPolicy = SlowConsumerPolicy::DropOldest;
+                    else if (value == "disconnect")
+                        tmpSettings->slowConsumerPolicy = SlowConsumerPolicy::Disconnect;
+                    else if (value == "spill_to_disk")
+                        tmpSettings->slowConsumerPolicy = SlowConsumerPolicy::SpillToDisk;
+                    else
+                        throw ConfigFileException(formatString("Invalid slow_consumer_policy: %s", value.c_str()));
+                }
+
+                if (key == "publisher_backpressure")
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings->publisherBackpressure = tmp;
+                }
+
+                if (key == "client_read_budget_bytes")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal != 0 && newVal < 4096)
+                    {
+                        throw ConfigFileException(formatString("client_read_budget_bytes value '%d' is invalid. Valid values are 0 (unlimited), or 4096 or higher.", newVal));
+                    }
+                    tmpSettings->clientReadBudgetBytes = newVal;
+                }
+
+                if (key == "client_read_budget_packets")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 0)
+                    {
+                        throw ConfigFileException(formatString("client_read_budget_packets value '%d' is invalid. Valid values are 0 (unlimited) or higher.", newVal));
+                    }
+                    tmpSettings->clientReadBudgetPackets = newVal;
+                }
+
+                if (key == "shared_payload_threshold")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal != 0 && newVal < 4096)
+                    {
+                        throw ConfigFileException(formatString("shared_payload_threshold value '%d' is invalid. Valid values are 0 (disabled), or 4096 or higher.", newVal));
+                    }
+                    tmpSettings->sharedPayloadThreshold = newVal;
+                }
+
+                if (key == "zero_copy_sends")
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings->zeroCopySends = tmp;
+                }
+
+                if (key == "handover_socket")
+                {
+                    if (value.empty() || value.front() != '/')
+                        throw ConfigFileException(formatString("handover_socket '%s' must be an absolute path.", value.c_str()));
+                    if (value.length() >= sizeof(sockaddr_un::sun_path))
+                        throw ConfigFileException(formatString("handover_socket '%s' is too long for a unix socket path.", value.c_str()));
+                    checkWritableDir<ConfigFileException>(dirnameOf(value));
+                    tmpSettings->handoverSocket = value;
+                }
+
+                if (key == "worker_cpus")
+                {
+                    tmpSettings->workerCpus = parseCpuList(value);
+                }
+
+                if (key == "timer_cpus")
+                {
+                    tmpSettings->timerCpus = parseCpuList(value);
+                }
+
+                if (key == "logger_cpus")
+                {
+                    tmpSettings->loggerCpus = parseCpuList(value);
+                }
+
+                if (key == "save_state_cpus")
+                {
+                    tmpSettings->saveStateCpus = parseCpuList(value);
+                }
+
+                if (key == "numa_local_clients")
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings->numaLocalClients = tmp;
+                }
+
+                if (key == "steer_by_incoming_cpu")
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings->steerByIncomingCpu = tmp;
+                }
+
+                if (key == "busy_poll_us")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 0 || newVal > 1000000)
+                    {
+                        throw ConfigFileException(formatString("busy_poll_us value '%d' is invalid. Valid values are between 0 (disabled) and 1000000.", newVal));
+                    }
+                    tmpSettings->busyPollMicroseconds = newVal;
+                }
+
+                if (key == "parallel_fanout_threshold")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 0)
+                    {
+                        throw ConfigFileException(formatString("parallel_fanout_threshold value '%d' is invalid. Valid values are 0 (disabled) or higher.", newVal));
+                    }
+                    tmpSettings->parallelFanOutThreshold = newVal;
+                }
+
+                if (key == "thread_model")
+                {
+                    if (value == "shared")
+                        tmpSettings->threadModel = ThreadModel::Shared;
+                    else if (value == "sharded")
+                        tmpSettings->threadModel = ThreadModel::Sharded;
+                    else
+                        throw ConfigFileException(formatString("Invalid thread_model: %s", value.c_str()));
+                }
+
+                if (key == "cluster_node_name")
+                {
+                    if (value.length() > 256)
+                        throw ConfigFileException(formatString("cluster_node_name '%s' is longer than 256 characters.", value.c_str()));
+                    tmpSettings->clusterNodeName = value;
+                }
+
+                if (key == "cluster_secret")
+                {
+                    if (value.length() < 16)
+                        throw ConfigFileException("cluster_secret must be at least 16 characters.");
+                    tmpSettings->clusterSecret = value;
+                }
+
+                if (key == "cluster_bind_address")
+                {
+                    tmpSettings->clusterBindAddress = value;
+                }
+
+                if (key == "cluster_port")
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 0 || newVal > 0xFFFF)
+                    {
+                        throw ConfigFileException(formatString("cluster_port value '%d' is invalid. Valid values are between 0 (don't listen) and 65535.", newVal));
+                    }
+                    tmpSettings->clusterPort = newVal;
+                }
+
+                if (key == "cluster_peer")
+                {
+                    const size_t colon = value.rfind(':');
+                    if (colon == std::string::npos || colon == 0 || colon + 1 == value.length())
+                        throw ConfigFileException(formatString("cluster_peer '%s' is invalid. It must be host:port.", value.c_str()));
+                    const int peerPort = std::stoi(value.substr(colon + 1));
+                    if (peerPort <= 0 || peerPort > 0xFFFF)
+                        throw ConfigFileException(formatString("cluster_peer '%s' has an invalid port.", value.c_str()));
+                    tmpSettings->clusterPeers.push_back(value);
+                }
+
                 if (key == "max_incoming_topic_alias_value")
                 {
                     int newVal = std::stoi(value);
@@ -489,6 +790,46 @@ void ConfigFileParser::loadFile(bool test)
         }
     }
 
+    if (tmpSettings->slowConsumerPolicy == SlowConsumerPolicy::SpillToDisk && tmpSettings->storageDir.empty())
+    {
+        throw ConfigFileException("slow_consumer_policy 'spill_to_disk' requires 'storage_dir' to be set.");
+    }
+
+    if (tmpSettings->publisherBackpressure && tmpSettings->clientWriteBufferWatermark == 0)
+    {
+        throw ConfigFileException("publisher_backpressure requires 'client_write_buffer_watermark' to be set.");
+    }
+
+    if (tmpSettings->zeroCopySends && tmpSettings->sharedPayloadThreshold == 0)
+    {
+        throw ConfigFileException("Option 'zero_copy_sends' works on shared payloads, so it needs 'shared_payload_threshold'.");
+    }
+
+    if (!tmpSettings->handoverSocket.empty() && tmpSettings->storageDir.empty())
+    {
+        throw ConfigFileException("handover_socket requires 'storage_dir' to be set, because sessions are passed on through it.");
+    }
+
+    if (tmpSettings->clusterNodeName.empty() && (tmpSettings->clusterPort > 0 || !tmpSettings->clusterPeers.empty()))
+    {
+        throw ConfigFileException("cluster_port and cluster_peer require 'cluster_node_name' to be set.");
+    }
+
+    if (!tmpSettings->clusterNodeName.empty() && tmpSettings->clusterPort == 0 && tmpSettings->clusterPeers.empty())
+    {
+        throw ConfigFileException("cluster_node_name requires 'cluster_port' or 'cluster_peer' to be set, to be able to link with other nodes.");
+    }
+
+    if (!tmpSettings->clusterNodeName.empty() && tmpSettings->clusterSecret.empty())
+    {
+        throw ConfigFileException("cluster_node_name requires 'cluster_secret' to be set, which all nodes must share.");
+    }
+
+    if (tmpSettings->threadModel == ThreadModel::Sharded && !tmpSettings->clusterNodeName.empty())
+    {
+        throw ConfigFileException("thread_model 'sharded' can't be combined with clustering yet.");
+    }
+
     tmpSettings->authOptCompatWrap = AuthOptCompatWrap(authOpts);
     tmpSettings->flashmqAuthPluginOpts = std::move(authOpts);
 
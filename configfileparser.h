@@ -28,12 +28,14 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 
 #include "sslctxmanager.h"
 #include "listener.h"
+#include "bridgeconfig.h"
 #include "settings.h"
 
 enum class ConfigParseLevel
 {
     Root,
-    Listen
+    Listen,
+    Bridge
 };
 
 class ConfigFileParser
@@ -41,6 +43,7 @@ class ConfigFileParser
     const std::string path;
     std::set<std::string> validKeys;
     std::set<std::string> validListenKeys;
+    std::set<std::string> validBridgeKeys;
 
     std::unique_ptr<Settings> settings;
 
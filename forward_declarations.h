@@ -27,7 +27,16 @@ class SubscriptionStore;
 class Session;
 class Settings;
 class Mqtt5PropertyBuilder;
+class ClientSpecificProperties;
 class SessionsAndSubscriptionsDB;
+class ClusterNode;
+struct ClusterSessionState;
+class ThreadShards;
+struct SessionsAndSubscriptionsResult;
+class Bridge;
+class PublishCopyFactory;
+struct ReceivingSubscriber;
+class Publish;
 
 
 #endif // FORWARD_DECLARATIONS_H
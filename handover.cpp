@@ -0,0 +1,215 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "handover.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+#include <stdexcept>
+#include <cassert>
+
+#include "utils.h"
+
+HandoverMessage::HandoverMessage(HandoverMessageType type)
+{
+    data.push_back(static_cast<char>(type));
+}
+
+void HandoverMessage::checkAvailable(size_t len) const
+{
+    if (pos + len > data.size())
+        throw std::runtime_error("Handover message is shorter than expected.");
+}
+
+HandoverMessageType HandoverMessage::getType() const
+{
+    if (data.empty())
+        throw std::runtime_error("Empty handover message.");
+
+    return static_cast<HandoverMessageType>(data[0]);
+}
+
+void HandoverMessage::writeUint8(uint8_t x)
+{
+    data.push_back(static_cast<char>(x));
+}
+
+void HandoverMessage::writeUint16(uint16_t x)
+{
+    writeBytes(reinterpret_cast<const char*>(&x), sizeof(x));
+}
+
+void HandoverMessage::writeUint32(uint32_t x)
+{
+    writeBytes(reinterpret_cast<const char*>(&x), sizeof(x));
+}
+
+void HandoverMessage::writeBytes(const char *b, size_t len)
+{
+    data.insert(data.end(), b, b + len);
+}
+
+void HandoverMessage::writeString(const std::string &s)
+{
+    writeUint32(s.length());
+    writeBytes(s.data(), s.length());
+}
+
+uint8_t HandoverMessage::readUint8()
+{
+    checkAvailable(1);
+    return static_cast<uint8_t>(data[pos++]);
+}
+
+uint16_t HandoverMessage::readUint16()
+{
+    uint16_t x = 0;
+    readBytes(reinterpret_cast<char*>(&x), sizeof(x));
+    return x;
+}
+
+uint32_t HandoverMessage::readUint32()
+{
+    uint32_t x = 0;
+    readBytes(reinterpret_cast<char*>(&x), sizeof(x));
+    return x;
+}
+
+void HandoverMessage::readBytes(char *b, size_t len)
+{
+    checkAvailable(len);
+    std::memcpy(b, data.data() + pos, len);
+    pos += len;
+}
+
+std::string HandoverMessage::readString()
+{
+    const uint32_t len = readUint32();
+    checkAvailable(len);
+    std::string s(data.data() + pos, len);
+    pos += len;
+    return s;
+}
+
+/**
+ * @brief HandoverMessage::sendTo sends the message on a blocking Unix socket.
+ * @param fd is attached with SCM_RIGHTS when it's not -1. The receiver gets its own descriptor for the same socket.
+ */
+void HandoverMessage::sendTo(int sock, int fd) const
+{
+    assert(!data.empty());
+
+    uint32_t len = data.size();
+
+    struct iovec iov;
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    std::memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+
+    const ssize_t n = check<std::runtime_error>(sendmsg(sock, &msg, MSG_NOSIGNAL));
+    if (n != sizeof(len))
+        throw std::runtime_error("Short write of handover message header.");
+
+    size_t written = 0;
+    while (written < data.size())
+    {
+        const ssize_t w = send(sock, &data[written], data.size() - written, MSG_NOSIGNAL);
+
+        if (w < 0 && errno == EINTR)
+            continue;
+
+        check<std::runtime_error>(w);
+        written += w;
+    }
+}
+
+/**
+ * @brief HandoverMessage::receiveFrom reads one message from a blocking Unix socket.
+ * @return the attached file descriptor, or -1.
+ */
+int HandoverMessage::receiveFrom(int sock)
+{
+    uint32_t len = 0;
+
+    struct iovec iov;
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    std::memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    const ssize_t n = check<std::runtime_error>(recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC));
+    if (n != sizeof(len))
+        throw std::runtime_error("Handover connection closed unexpectedly.");
+
+    int fd = -1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+    {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+            std::memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    }
+
+    data.resize(len);
+    pos = 1;
+
+    size_t received = 0;
+    while (received < len)
+    {
+        const ssize_t r = recv(sock, &data[received], len - received, 0);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r == 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            throw std::runtime_error("Handover connection closed unexpectedly.");
+        }
+
+        check<std::runtime_error>(r);
+        received += r;
+    }
+
+    return fd;
+}
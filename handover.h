@@ -0,0 +1,84 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+// How long the old process waits for the request, after a new one connects. The main loop doesn't do anything else in the meantime.
+#define HANDOVER_REQUEST_TIMEOUT_MS 1000
+
+enum class HandoverMessageType : uint8_t
+{
+    Request = 1,
+    ListenSocket = 2,
+    Client = 3,
+    Done = 4
+};
+
+/**
+ * @brief The HandoverMessage class is what an old and a new FlashMQ process exchange on the handover socket, when upgrading.
+ *
+ * Messages go over a Unix socket, optionally with a file descriptor attached using SCM_RIGHTS. On the wire, a message is a four byte
+ * length followed by the data, of which the first byte is the type. An attached fd travels with the length.
+ */
+class HandoverMessage
+{
+    std::vector<char> data;
+    size_t pos = 1;
+
+    void checkAvailable(size_t len) const;
+
+public:
+    HandoverMessage() = default;
+    HandoverMessage(HandoverMessageType type);
+    HandoverMessage(const HandoverMessage &other) = delete;
+    HandoverMessage(HandoverMessage &&other) = default;
+    HandoverMessage &operator=(HandoverMessage &&other) = default;
+
+    HandoverMessageType getType() const;
+
+    void writeUint8(uint8_t x);
+    void writeUint16(uint16_t x);
+    void writeUint32(uint32_t x);
+    void writeBytes(const char *b, size_t len);
+    void writeString(const std::string &s);
+
+    uint8_t readUint8();
+    uint16_t readUint16();
+    uint32_t readUint32();
+    void readBytes(char *b, size_t len);
+    std::string readString();
+
+    void sendTo(int sock, int fd = -1) const;
+    int receiveFrom(int sock);
+};
+
+/**
+ * @brief The HandedOverClient struct is a client connection received from the previous process, waiting to be given to a thread.
+ */
+struct HandedOverClient
+{
+    int fd = -1;
+    HandoverMessage state;
+};
+
+#endif // HANDOVER_H
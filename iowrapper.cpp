@@ -107,6 +107,22 @@ void IoWrapper::startOrContinueSslAccept()
     }
     parentClient->setReadyForWriting(false); // Undo write readiness that may have have happened during SSL handshake
     sslAccepted = true;
+
+    /*
+     * When the listener has kTLS enabled and the kernel accepted the negotiated cipher, record encryption of outgoing data is
+     * done by the kernel. We can then write to the socket directly, like non-SSL clients. Reading stays with SSL_read(), because
+     * it needs to handle non-data records, but OpenSSL will use the kernel's decryption if that was also enabled.
+     */
+#ifdef SSL_OP_ENABLE_KTLS
+    ktlsSend = BIO_get_ktls_send(SSL_get_wbio(ssl));
+
+    if (SSL_get_options(ssl) & SSL_OP_ENABLE_KTLS)
+    {
+        const bool ktlsRecv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+        logger->logf(LOG_DEBUG, "kTLS for %s: send %s, receive %s.", parentClient->repr().c_str(), ktlsSend ? "on" : "off (fallback)",
+                     ktlsRecv ? "on" : "off (fallback)");
+    }
+#endif
 }
 
 bool IoWrapper::getSslReadWantsWrite() const
@@ -144,16 +160,14 @@ WebsocketState IoWrapper::getWebsocketState() const
     return websocketState;
 }
 
-#ifndef NDEBUG
 /**
- * @brief IoWrapper::setFakeUpgraded marks this wrapper as upgraded. This is for fuzzing, so to bypass the sha1 protected handshake
- * of websockets.
+ * @brief IoWrapper::setFakeUpgraded marks this wrapper as upgraded. This is for fuzzing and replaying, so to bypass the sha1 protected
+ * handshake of websockets.
  */
 void IoWrapper::setFakeUpgraded()
 {
     websocketState = WebsocketState::Upgraded;
 }
-#endif
 
 /**
  * @brief SSL and non-SSL sockets behave differently. For one, reading 0 doesn't mean 'disconnected' with an SSL
@@ -246,7 +260,8 @@ ssize_t IoWrapper::writeOrSslWrite(int fd, const void *buf, size_t nbytes, IoWra
     *error = IoWrapResult::Success;
     ssize_t n = 0;
 
-    if (!ssl)
+    // With kTLS send offload, the kernel makes TLS records of what we write, so the plain socket path applies.
+    if (!ssl || ktlsSend)
     {
         // A write on a socket with count=0 is unspecified.
         assert(nbytes > 0);
@@ -561,7 +576,7 @@ ssize_t IoWrapper::websocketBytesToReadBuffer(void *buf, const size_t nbytes, Io
         {
             // Specs: "MQTT Control Packets MUST be sent in WebSocket binary data frames. If any other type of data frame is
             // received the recipient MUST close the Network Connection [MQTT-6.0.0-1]".
-            throw ProtocolError(formatString("Websocket frames must be 'binary' or 'ping'. Received: %d", incompleteWebsocketRead.opcode));
+            throw ProtocolError(formatString("Websocket frames must be 'binary' or 'ping'. Received: %d", static_cast<int>(incompleteWebsocketRead.opcode)));
         }
 
         if (!incompleteWebsocketRead.sillWorkingOnFrame())
@@ -110,6 +110,7 @@ class IoWrapper
     IncompleteSslWrite incompleteSslWrite;
     bool sslReadWantsWrite = false;
     bool sslWriteWantsRead = false;
+    bool ktlsSend = false;
 
     bool websocket;
     WebsocketState websocketState = WebsocketState::NotUpgraded;
@@ -136,9 +137,7 @@ public:
     bool isWebsocket() const;
     WebsocketState getWebsocketState() const;
 
-#ifndef NDEBUG
     void setFakeUpgraded();
-#endif
 
     ssize_t readWebsocketAndOrSsl(int fd, void *buf, size_t nbytes, IoWrapResult *error);
     ssize_t writeWebsocketAndOrSsl(int fd, const void *buf, size_t nbytes, IoWrapResult *error);
@@ -19,6 +19,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 
 #include "utils.h"
 #include "exceptions.h"
+#include "logger.h"
 
 void Listener::isValid()
 {
@@ -43,6 +44,9 @@ void Listener::isValid()
             else
                 port = 1883;
         }
+
+        if (ktls)
+            throw ConfigFileException("Option 'ktls' is only valid on SSL listeners.");
     }
 
     if (port <= 0 || port > 65534)
@@ -88,6 +92,17 @@ void Listener::loadCertAndKeyFromConfig()
         SSL_CTX_set_options(sslctx->get(), SSL_OP_NO_TLSv1); // TODO: config option
 
         SSL_CTX_set_mode(sslctx->get(), SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+        if (ktls)
+        {
+#ifdef SSL_OP_ENABLE_KTLS
+            // Whether the kernel actually takes over depends on the kernel's TLS module and the negotiated cipher. IoWrapper checks per connection.
+            SSL_CTX_set_options(sslctx->get(), SSL_OP_ENABLE_KTLS);
+#else
+            Logger::getInstance()->logf(LOG_WARNING, "kTLS requested on %s listener on port %d, but this OpenSSL version doesn't support it.",
+                                        getProtocolName().c_str(), port);
+#endif
+        }
     }
 
     if (SSL_CTX_use_certificate_file(sslctx->get(), sslFullchain.c_str(), SSL_FILETYPE_PEM) != 1)
@@ -39,6 +39,7 @@ struct Listener
     bool websocket = false;
     std::string sslFullchain;
     std::string sslPrivkey;
+    bool ktls = false;
     std::unique_ptr<SslCtxManager> sslctx;
 
     void isValid();
@@ -175,6 +175,11 @@ void Logger::setFlags(bool logDebug, bool logSubscriptions, bool quiet)
         curLogLevel &= ~(LOG_NOTICE | LOG_INFO);
 }
 
+void Logger::setAffinity(const std::vector<int> &cpus)
+{
+    setThreadAffinity(writerThread.native_handle(), cpus);
+}
+
 void Logger::quit()
 {
     running = false;
@@ -23,6 +23,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 #include "semaphore.h"
 
 #include "flashmq_plugin.h"
@@ -76,6 +77,7 @@ public:
 
     void setLogPath(const std::string &path);
     void setFlags(bool logDebug, bool logSubscriptions, bool quiet);
+    void setAffinity(const std::vector<int> &cpus);
 
     void quit();
 
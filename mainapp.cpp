@@ -23,6 +23,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <sys/sysinfo.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <memory>
 
 #include <openssl/ssl.h>
@@ -34,6 +36,9 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "authplugin.h"
 #include "threadglobals.h"
 #include "globalstats.h"
+#include "cluster.h"
+#include "bridge.h"
+#include "threadshards.h"
 
 MainApp *MainApp::instance = nullptr;
 
@@ -52,6 +57,11 @@ MainApp::MainApp(const std::string &configFilePath) :
         this->num_threads = settings->threadCount;
         logger->logf(LOG_NOTICE, "%d threads specified by 'thread_count'.", num_threads);
     }
+    else if (!settings->workerCpus.empty())
+    {
+        this->num_threads = settings->workerCpus.size();
+        logger->logf(LOG_NOTICE, "%d threads, one for each CPU in 'worker_cpus'.", num_threads);
+    }
     else
     {
         logger->logf(LOG_NOTICE, "%d CPUs are detected, making as many threads. Use 'thread_count' setting to override.", num_threads);
@@ -87,10 +97,16 @@ MainApp::MainApp(const std::string &configFilePath) :
         timer.addCallback(fAuthPluginPeriodicEvent, settings->authPluginTimerPeriod*1000, "Auth plugin periodic event.");
     }
 
+    // Before loading state, because a running instance saves its state as part of handing over.
+    receiveHandover();
+
     if (!settings->storageDir.empty())
     {
         subscriptionStore->loadRetainedMessages(settings->getRetainedMessagesDBFile());
-        subscriptionStore->loadSessionsAndSubscriptions(settings->getSessionsDBFile());
+
+        // In the sharded thread model, the sessions go to the stores of the threads, when starting.
+        if (settings->threadModel == ThreadModel::Shared)
+            subscriptionStore->loadSessionsAndSubscriptions(settings->getSessionsDBFile());
     }
 
     auto fSaveState = std::bind(&MainApp::saveStateInThread, this);
@@ -104,6 +120,8 @@ MainApp::~MainApp()
 {
     if (epollFdAccept > 0)
         close(epollFdAccept);
+    if (handoverListenFd >= 0)
+        close(handoverListenFd);
 }
 
 void MainApp::doHelp(const char *arg)
@@ -122,6 +140,13 @@ void MainApp::doHelp(const char *arg)
     puts("                                      client is upgrade, and bypass the cryptograhically secured websocket");
     puts("                                      handshake.");
 #endif
+    puts(" -r, --replay <capture.dat>           Replay the bytes a client would send, as fast as possible, and report packets/s");
+    puts("                                      and time per stage: read, parse, handle (auth, matching and serializing for");
+    puts("                                      subscribers), write and disconnect. Can be given more than once. Naming is like");
+    puts("                                      for --fuzz-file. Doesn't listen; the config file is used for settings and auth.");
+    puts("     --replay-clients <n>             In-process clients, each replaying a file. Default one per file.");
+    puts("     --replay-threads <n>             Threads to divide the clients over. Default 1.");
+    puts("     --replay-rounds <n>              Times each client replays its file, as a new connection. Default 100.");
     puts(" -V, --version                        Show version");
     puts(" -l, --license                        Show license");
 }
@@ -152,22 +177,30 @@ std::list<ScopedSocket> MainApp::createListenSocket(const std::shared_ptr<Listen
 
         try
         {
-            logger->logf(LOG_NOTICE, "Creating %s %s listener on [%s]:%d", pname.c_str(), listener->getProtocolName().c_str(),
-                         listener->getBindAddress(p).c_str(), listener->port);
-
             BindAddr bindAddr = getBindAddr(family, listener->getBindAddress(p), listener->port);
+            int listen_fd = takeHandedOverListenSocket(bindAddr);
 
-            int listen_fd = check<std::runtime_error>(socket(family, SOCK_STREAM, 0));
+            if (listen_fd >= 0)
+            {
+                logger->logf(LOG_NOTICE, "Taking over %s %s listener on port %d", pname.c_str(), listener->getProtocolName().c_str(), listener->port);
+            }
+            else
+            {
+                logger->logf(LOG_NOTICE, "Creating %s %s listener on [%s]:%d", pname.c_str(), listener->getProtocolName().c_str(),
+                             listener->getBindAddress(p).c_str(), listener->port);
 
-            // Not needed for now. Maybe I will make multiple accept threads later, with SO_REUSEPORT.
-            int optval = 1;
-            check<std::runtime_error>(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &optval, sizeof(optval)));
+                listen_fd = check<std::runtime_error>(socket(family, SOCK_STREAM, 0));
 
-            int flags = fcntl(listen_fd, F_GETFL);
-            check<std::runtime_error>(fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK ));
+                // Not needed for now. Maybe I will make multiple accept threads later, with SO_REUSEPORT.
+                int optval = 1;
+                check<std::runtime_error>(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &optval, sizeof(optval)));
 
-            check<std::runtime_error>(bind(listen_fd, bindAddr.p.get(), bindAddr.len));
-            check<std::runtime_error>(listen(listen_fd, 32768));
+                int flags = fcntl(listen_fd, F_GETFL);
+                check<std::runtime_error>(fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK ));
+
+                check<std::runtime_error>(bind(listen_fd, bindAddr.p.get(), bindAddr.len));
+                check<std::runtime_error>(listen(listen_fd, 32768));
+            }
 
             struct epoll_event ev;
             memset(&ev, 0, sizeof (struct epoll_event));
@@ -225,6 +258,11 @@ void MainApp::setFuzzFile(const std::string &fuzzFilePath)
     this->fuzzFilePath = fuzzFilePath;
 }
 
+void MainApp::setReplayOptions(const ReplayOptions &replayOptions)
+{
+    this->replayOptions = replayOptions;
+}
+
 /**
  * @brief MainApp::queuePublishStatsOnDollarTopic publishes the dollar topics, on a thread that has thread local authentication.
  */
@@ -260,13 +298,27 @@ void MainApp::saveStateInThread()
 
     pthread_t native = saveStateThread.native_handle();
     pthread_setname_np(native, "SaveState");
+
+    if (!settings->saveStateCpus.empty())
+        setThreadAffinity(native, settings->saveStateCpus);
 }
 
 void MainApp::queueSendQueuedWills()
 {
     std::lock_guard<std::mutex> locker(eventMutex);
 
-    if (!threads.empty())
+    // In the sharded thread model, each thread has its own sessions, so they all do it.
+    if (shards)
+    {
+        for (std::shared_ptr<ThreadData> &t : threads)
+        {
+            auto f = std::bind(&ThreadData::queueSendingQueuedWills, t.get());
+            taskQueue.push_front(f);
+        }
+
+        wakeUpThread();
+    }
+    else if (!threads.empty())
     {
         std::shared_ptr<ThreadData> t = threads[nextThreadForTasks++ % threads.size()];
         auto f = std::bind(&ThreadData::queueSendingQueuedWills, t.get());
@@ -280,7 +332,17 @@ void MainApp::queueRemoveExpiredSessions()
 {
     std::lock_guard<std::mutex> locker(eventMutex);
 
-    if (!threads.empty())
+    if (shards)
+    {
+        for (std::shared_ptr<ThreadData> &t : threads)
+        {
+            auto f = std::bind(&ThreadData::queueRemoveExpiredSessions, t.get());
+            taskQueue.push_front(f);
+        }
+
+        wakeUpThread();
+    }
+    else if (!threads.empty())
     {
         std::shared_ptr<ThreadData> t = threads[nextThreadForTasks++ % threads.size()];
         auto f = std::bind(&ThreadData::queueRemoveExpiredSessions, t.get());
@@ -306,6 +368,317 @@ void MainApp::waitForDisconnectsInitiated()
     }
 }
 
+/**
+ * @brief MainApp::receiveHandover takes the listeners and clients of a running instance, when 'handover_socket' is set and one is there.
+ *
+ * The running instance stops, saves its state, and then passes on the sockets. Anything that goes wrong halfway is logged, and
+ * we start with what we got. Listeners that didn't come are created normally.
+ */
+void MainApp::receiveHandover()
+{
+    if (settings->handoverSocket.empty())
+        return;
+
+    ScopedSocket sock(check<std::runtime_error>(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)));
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, settings->handoverSocket.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (connect(sock.socket, reinterpret_cast<struct sockaddr*>(&addr), sizeof(struct sockaddr_un)) < 0)
+    {
+        if (errno != ENOENT && errno != ECONNREFUSED)
+            logger->logf(LOG_ERR, "Connecting to handover socket '%s' failed: %s", settings->handoverSocket.c_str(), strerror(errno));
+        return;
+    }
+
+    logger->logf(LOG_NOTICE, "Taking over from the running instance on '%s'.", settings->handoverSocket.c_str());
+
+    try
+    {
+        HandoverMessage(HandoverMessageType::Request).sendTo(sock.socket);
+
+        while (true)
+        {
+            HandoverMessage msg;
+            const int fd = msg.receiveFrom(sock.socket);
+            const HandoverMessageType type = msg.getType();
+
+            if (type == HandoverMessageType::ListenSocket && fd >= 0)
+            {
+                handedOverListenFds.push_back(fd);
+            }
+            else if (type == HandoverMessageType::Client && fd >= 0)
+            {
+                HandedOverClient client;
+                client.fd = fd;
+                client.state = std::move(msg);
+                handedOverClients.push_back(std::move(client));
+            }
+            else
+            {
+                if (fd >= 0)
+                    close(fd);
+
+                if (type == HandoverMessageType::Done)
+                    break;
+
+                throw std::runtime_error(formatString("Invalid handover message of type %d.", static_cast<int>(type)));
+            }
+        }
+    }
+    catch (std::exception &ex)
+    {
+        logger->logf(LOG_ERR, "Handover was interrupted: %s", ex.what());
+    }
+
+    logger->logf(LOG_NOTICE, "Received %d listen sockets and %d clients from the previous instance.", handedOverListenFds.size(),
+                 handedOverClients.size());
+}
+
+/**
+ * @brief MainApp::takeHandedOverListenSocket finds a handed over listen socket for a listener. They are matched on family, address and port.
+ * @return the fd, or -1.
+ */
+int MainApp::takeHandedOverListenSocket(const BindAddr &bindAddr)
+{
+    for (auto it = handedOverListenFds.begin(); it != handedOverListenFds.end(); it++)
+    {
+        struct sockaddr_in6 addrBiggest;
+        struct sockaddr *addr = reinterpret_cast<sockaddr*>(&addrBiggest);
+        socklen_t len = sizeof(struct sockaddr_in6);
+        memset(addr, 0, len);
+
+        if (getsockname(*it, addr, &len) < 0 || addr->sa_family != bindAddr.p->sa_family)
+            continue;
+
+        if (addr->sa_family == AF_INET)
+        {
+            const struct sockaddr_in *bound = reinterpret_cast<struct sockaddr_in*>(addr);
+            const struct sockaddr_in *wanted = reinterpret_cast<struct sockaddr_in*>(bindAddr.p.get());
+
+            if (bound->sin_port != wanted->sin_port || bound->sin_addr.s_addr != wanted->sin_addr.s_addr)
+                continue;
+        }
+        else
+        {
+            const struct sockaddr_in6 *wanted = reinterpret_cast<struct sockaddr_in6*>(bindAddr.p.get());
+
+            if (addrBiggest.sin6_port != wanted->sin6_port || memcmp(&addrBiggest.sin6_addr, &wanted->sin6_addr, sizeof(struct in6_addr)) != 0)
+                continue;
+        }
+
+        const int fd = *it;
+        handedOverListenFds.erase(it);
+        return fd;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief MainApp::adoptHandedOverClients gives the clients handed over by the previous process to the threads.
+ * @return the thread index of each client, so its saved session can be loaded in the same thread in the sharded thread model.
+ */
+std::unordered_map<std::string, size_t> MainApp::adoptHandedOverClients()
+{
+    std::unordered_map<std::string, size_t> threadsOfClients;
+
+    if (handedOverClients.empty() || threads.empty())
+        return threadsOfClients;
+
+    // Like when loading sessions, a client is needed to parse the wills with.
+    std::shared_ptr<ThreadData> dummyThreadData;
+    std::shared_ptr<Client> willParser = std::make_shared<Client>(0, dummyThreadData, nullptr, false, nullptr, settings.get(), false);
+    willParser->setClientProperties(ProtocolVersion::Mqtt5, "Dummyforparsinghandedoverwills", "nobody", true, 60);
+
+    uint next_thread_index = 0;
+
+    for (HandedOverClient &handedOver : handedOverClients)
+    {
+        const size_t threadIndex = next_thread_index++ % threads.size();
+        std::shared_ptr<ThreadData> thread_data = threads[threadIndex];
+
+        try
+        {
+            struct sockaddr_in6 addrBiggest;
+            struct sockaddr *addr = reinterpret_cast<sockaddr*>(&addrBiggest);
+            socklen_t len = sizeof(struct sockaddr_in6);
+            memset(addr, 0, len);
+            getpeername(handedOver.fd, addr, &len);
+
+            std::shared_ptr<Client> client = std::make_shared<Client>(handedOver.fd, thread_data, nullptr, false, addr, settings.get());
+            handedOver.fd = -1;
+
+            client->readHandoverState(handedOver.state, willParser);
+            threadsOfClients[client->getClientId()] = threadIndex;
+            thread_data->queueAdoptHandedOverClient(client);
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Error taking over client: %s", ex.what());
+
+            if (handedOver.fd >= 0)
+                close(handedOver.fd);
+        }
+    }
+
+    handedOverClients.clear();
+
+    return threadsOfClients;
+}
+
+/**
+ * @brief MainApp::createHandoverSocket listens on 'handover_socket' for a new instance that wants to take over.
+ */
+void MainApp::createHandoverSocket()
+{
+    if (settings->handoverSocket.empty())
+        return;
+
+    const std::string &path = settings->handoverSocket;
+
+    if (unlink(path.c_str()) < 0 && errno != ENOENT)
+        throw std::runtime_error(formatString("Can't remove old handover socket '%s': %s", path.c_str(), strerror(errno)));
+
+    handoverListenFd = check<std::runtime_error>(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0));
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    check<std::runtime_error>(bind(handoverListenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(struct sockaddr_un)));
+
+    // Whoever can connect, gets all client connections.
+    check<std::runtime_error>(chmod(path.c_str(), S_IRUSR | S_IWUSR));
+    check<std::runtime_error>(listen(handoverListenFd, 1));
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (struct epoll_event));
+    ev.data.fd = handoverListenFd;
+    ev.events = EPOLLIN;
+    check<std::runtime_error>(epoll_ctl(this->epollFdAccept, EPOLL_CTL_ADD, handoverListenFd, &ev));
+
+    logger->logf(LOG_INFO, "Listening for handover requests on '%s'.", path.c_str());
+}
+
+/**
+ * @brief MainApp::acceptHandoverRequest stops the app, to hand over to the instance that connected.
+ */
+void MainApp::acceptHandoverRequest()
+{
+    ScopedSocket conn(check<std::runtime_error>(accept4(handoverListenFd, nullptr, nullptr, SOCK_CLOEXEC)));
+
+    struct ucred cred;
+    socklen_t len = sizeof(struct ucred);
+    check<std::runtime_error>(getsockopt(conn.socket, SOL_SOCKET, SO_PEERCRED, &cred, &len));
+
+    if (cred.uid != getuid())
+        throw std::runtime_error(formatString("Refusing handover request from uid %d.", cred.uid));
+
+    // So a peer that connects but doesn't send anything can't stall us.
+    struct timeval timeout;
+    timeout.tv_sec = HANDOVER_REQUEST_TIMEOUT_MS / 1000;
+    timeout.tv_usec = (HANDOVER_REQUEST_TIMEOUT_MS % 1000) * 1000;
+    check<std::runtime_error>(setsockopt(conn.socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+
+    HandoverMessage msg;
+    if (msg.receiveFrom(conn.socket) >= 0 || msg.getType() != HandoverMessageType::Request)
+        throw std::runtime_error("Invalid handover request.");
+
+    logger->logf(LOG_NOTICE, "Handover requested by pid %d.", cred.pid);
+
+    // There can only be one.
+    close(handoverListenFd);
+    handoverListenFd = -1;
+
+    handoverConnection = conn.socket;
+    conn.socket = 0;
+
+    quit();
+}
+
+void MainApp::waitForHandoverPrepared()
+{
+    while(std::any_of(threads.begin(), threads.end(), [](std::shared_ptr<ThreadData> t){ return !t->allClientsPreparedForHandover; }))
+    {
+        usleep(1000);
+    }
+}
+
+/**
+ * @brief MainApp::sendHandover passes the listen sockets and the prepared clients to the new instance. Only when the threads have stopped.
+ */
+void MainApp::sendHandover(const std::map<int, std::shared_ptr<Listener>> &listenerMap)
+{
+    ScopedSocket conn(handoverConnection);
+    handoverConnection = -1;
+
+    try
+    {
+        for (auto &pair : listenerMap)
+        {
+            HandoverMessage(HandoverMessageType::ListenSocket).sendTo(conn.socket, pair.first);
+        }
+
+        int count = 0;
+        for (std::shared_ptr<ThreadData> &thread : threads)
+        {
+            for (std::shared_ptr<Client> &client : thread->getHandedOverClients())
+            {
+                HandoverMessage msg(HandoverMessageType::Client);
+                client->writeHandoverState(msg);
+                msg.sendTo(conn.socket, client->getFd());
+                count++;
+            }
+        }
+
+        HandoverMessage(HandoverMessageType::Done).sendTo(conn.socket);
+
+        logger->logf(LOG_NOTICE, "Handed over %d listen sockets and %d clients.", listenerMap.size(), count);
+    }
+    catch (std::exception &ex)
+    {
+        logger->logf(LOG_ERR, "Handover failed: %s", ex.what());
+    }
+}
+
+/**
+ * @brief MainApp::getThreadForIncomingCpu picks a thread for a connection, based on the CPU that handled its packets in the kernel.
+ * @return a thread pinned to that CPU, one on the same NUMA node, or nothing.
+ */
+std::shared_ptr<ThreadData> MainApp::getThreadForIncomingCpu(int fd, uint &next_thread_index)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0)
+        return std::shared_ptr<ThreadData>();
+
+    std::vector<std::shared_ptr<ThreadData>> candidates;
+    for (std::shared_ptr<ThreadData> &thread : threads)
+    {
+        if (thread->pinnedCpu == cpu)
+            candidates.push_back(thread);
+    }
+
+    const int node = cpu < static_cast<int>(cpuNumaNodes.size()) ? cpuNumaNodes[cpu] : -1;
+    if (candidates.empty() && node >= 0)
+    {
+        for (std::shared_ptr<ThreadData> &thread : threads)
+        {
+            if (thread->numaNode == node)
+                candidates.push_back(thread);
+        }
+    }
+
+    if (candidates.empty())
+        return std::shared_ptr<ThreadData>();
+
+    return candidates[next_thread_index++ % candidates.size()];
+}
+
 void MainApp::saveState()
 {
     std::lock_guard<std::mutex> lg(saveStateMutex);
@@ -318,7 +691,7 @@ void MainApp::saveState()
             subscriptionStore->saveRetainedMessages(retainedDBPath);
 
             const std::string sessionsDBPath = settings->getSessionsDBFile();
-            subscriptionStore->saveSessionsAndSubscriptions(sessionsDBPath);
+            SubscriptionStore::saveSessionsAndSubscriptions(sessionsDBPath, getSessionStores());
 
             logger->logf(LOG_INFO, "Saving states done");
         }
@@ -340,6 +713,10 @@ void MainApp::initMainApp(int argc, char *argv[])
         {"config-file", required_argument, nullptr, 'c'},
         {"test-config", no_argument, nullptr, 't'},
         {"fuzz-file", required_argument, nullptr, 'z'},
+        {"replay", required_argument, nullptr, 'r'},
+        {"replay-clients", required_argument, nullptr, 1},
+        {"replay-threads", required_argument, nullptr, 2},
+        {"replay-rounds", required_argument, nullptr, 3},
         {"version", no_argument, nullptr, 'V'},
         {"license", no_argument, nullptr, 'l'},
         {nullptr, 0, nullptr, 0}
@@ -358,11 +735,12 @@ void MainApp::initMainApp(int argc, char *argv[])
     }
 
     std::string fuzzFile;
+    ReplayOptions replayOptions;
 
     int option_index = 0;
     int opt;
     bool testConfig = false;
-    while((opt = getopt_long(argc, argv, "hc:Vltz:", long_options, &option_index)) != -1)
+    while((opt = getopt_long(argc, argv, "hc:Vltz:r:", long_options, &option_index)) != -1)
     {
         switch(opt)
         {
@@ -378,6 +756,18 @@ void MainApp::initMainApp(int argc, char *argv[])
         case 'z':
             fuzzFile = optarg;
             break;
+        case 'r':
+            replayOptions.files.push_back(optarg);
+            break;
+        case 1:
+            replayOptions.clients = std::max(1, atoi(optarg));
+            break;
+        case 2:
+            replayOptions.threads = std::max(1, atoi(optarg));
+            break;
+        case 3:
+            replayOptions.rounds = std::max(1, atoi(optarg));
+            break;
         case 'h':
             MainApp::doHelp(argv[0]);
             exit(16);
@@ -415,6 +805,7 @@ void MainApp::initMainApp(int argc, char *argv[])
 
     instance = new MainApp(configFile);
     instance->setFuzzFile(fuzzFile);
+    instance->setReplayOptions(replayOptions);
 }
 
 
@@ -427,6 +818,16 @@ MainApp *MainApp::getMainApp()
 
 void MainApp::start()
 {
+    if (!replayOptions.files.empty())
+    {
+        // A log line per replayed connection would be most of what we measure.
+        logger->setFlags(false, false, true);
+
+        Replayer replayer(replayOptions, settings, subscriptionStore);
+        replayer.run();
+        return;
+    }
+
 #ifndef NDEBUG
     if (fuzzFilePath.empty())
     {
@@ -451,6 +852,15 @@ void MainApp::start()
         }
     }
 
+    for (int fd : handedOverListenFds)
+    {
+        logger->logf(LOG_NOTICE, "Closing handed over listen socket that is not in the config anymore.");
+        close(fd);
+    }
+    handedOverListenFds.clear();
+
+    createHandoverSocket();
+
 #ifdef NDEBUG
     logger->noLongerLogToStd();
 #endif
@@ -534,15 +944,70 @@ void MainApp::start()
     }
 #endif
 
+    if (!settings->clusterNodeName.empty())
+    {
+        cluster = std::make_shared<ClusterNode>(*settings, subscriptionStore);
+        subscriptionStore->setCluster(cluster);
+    }
+
+    for (const std::shared_ptr<BridgeConfig> &bridgeConfig : settings->bridges)
+    {
+        std::shared_ptr<Bridge> bridge = std::make_shared<Bridge>(*settings, *bridgeConfig);
+        subscriptionStore->addBridge(bridge);
+        bridges.push_back(bridge);
+        bridge->start();
+    }
+
     GlobalStats *globalStats = GlobalStats::getInstance();
 
+    if (settings->threadModel == ThreadModel::Sharded)
+    {
+        logger->logf(LOG_NOTICE, "Using the sharded thread model: each thread has its own sessions and subscriptions.");
+        shards = std::make_shared<ThreadShards>(num_threads);
+    }
+
     for (int i = 0; i < num_threads; i++)
     {
         std::shared_ptr<ThreadData> t = std::make_shared<ThreadData>(i, settings);
-        t->start(&do_thread_work);
+
+        if (shards)
+        {
+            t->subscriptionStore = std::make_shared<SubscriptionStore>();
+            t->subscriptionStore->setShard(shards, i, subscriptionStore);
+            t->shards = shards;
+
+            for (const std::shared_ptr<Bridge> &bridge : bridges)
+                t->subscriptionStore->addBridge(bridge);
+        }
+
         threads.push_back(t);
     }
 
+    if (shards)
+        shards->setThreads(threads);
+
+    // Before starting the threads, so in the sharded thread model, the sessions can be loaded in the threads of their clients.
+    const std::unordered_map<std::string, size_t> threadsOfHandedOverClients = adoptHandedOverClients();
+
+    if (shards && !settings->storageDir.empty())
+        SubscriptionStore::loadSessionsAndSubscriptions(settings->getSessionsDBFile(), getSessionStores(), threadsOfHandedOverClients);
+
+    for (std::shared_ptr<ThreadData> &t : threads)
+    {
+        t->start(&do_thread_work);
+    }
+
+    if (cluster)
+        cluster->start(threads);
+
+    if (settings->steerByIncomingCpu)
+    {
+        for (int cpu = 0; cpu < get_nprocs_conf(); cpu++)
+        {
+            cpuNumaNodes.push_back(getCpuNumaNode(cpu));
+        }
+    }
+
     // Populate the $SYS topics, otherwise you have to wait until the timer expires.
     if (!threads.empty())
         threads.front()->queuePublishStatsOnDollarTopic(threads);
@@ -569,12 +1034,13 @@ void MainApp::start()
             int cur_fd = events[i].data.fd;
             try
             {
-                if (cur_fd != taskEventFd)
+                if (cur_fd == handoverListenFd)
+                {
+                    acceptHandoverRequest();
+                }
+                else if (cur_fd != taskEventFd)
                 {
                     std::shared_ptr<Listener> listener = listenerMap[cur_fd];
-                    std::shared_ptr<ThreadData> thread_data = threads[next_thread_index++ % num_threads];
-
-                    logger->logf(LOG_INFO, "Accepting connection on thread %d on %s", thread_data->threadnr, listener->getProtocolName().c_str());
 
                     struct sockaddr_in6 addrBiggest;
                     struct sockaddr *addr = reinterpret_cast<sockaddr*>(&addrBiggest);
@@ -582,6 +1048,14 @@ void MainApp::start()
                     memset(addr, 0, len);
                     int fd = check<std::runtime_error>(accept(cur_fd, addr, &len));
 
+                    std::shared_ptr<ThreadData> thread_data;
+                    if (settings->steerByIncomingCpu)
+                        thread_data = getThreadForIncomingCpu(fd, next_thread_index);
+                    if (!thread_data)
+                        thread_data = threads[next_thread_index++ % num_threads];
+
+                    logger->logf(LOG_INFO, "Accepting connection on thread %d on %s", thread_data->threadnr, listener->getProtocolName().c_str());
+
                     SSL *clientSSL = nullptr;
                     if (listener->isSsl())
                     {
@@ -597,8 +1071,15 @@ void MainApp::start()
                         SSL_set_fd(clientSSL, fd);
                     }
 
-                    std::shared_ptr<Client> client = std::make_shared<Client>(fd, thread_data, clientSSL, listener->websocket, addr, settings.get());
-                    thread_data->giveClient(client);
+                    if (settings->numaLocalClients)
+                    {
+                        thread_data->queueCreateClient(fd, clientSSL, listener->websocket, addrBiggest, settings.get());
+                    }
+                    else
+                    {
+                        std::shared_ptr<Client> client = std::make_shared<Client>(fd, thread_data, clientSSL, listener->websocket, addr, settings.get());
+                        thread_data->giveClient(client);
+                    }
 
                     globalStats->socketConnects.inc();
                 }
@@ -632,6 +1113,16 @@ void MainApp::start()
         }
     }
 
+    if (handoverConnection >= 0)
+    {
+        logger->logf(LOG_DEBUG, "Having all threads prepare their clients for handover.");
+        for(std::shared_ptr<ThreadData> &thread : threads)
+        {
+            thread->queuePrepareHandover();
+        }
+        waitForHandoverPrepared();
+    }
+
     logger->logf(LOG_DEBUG, "Having all client in all threads send or queue their will.");
     for(std::shared_ptr<ThreadData> &thread : threads)
     {
@@ -680,10 +1171,22 @@ void MainApp::start()
         }
     }
 
+    // After the threads, so what they sent last, like wills, still goes out.
+    if (cluster)
+        cluster->quit();
+
+    for (std::shared_ptr<Bridge> &bridge : bridges)
+    {
+        bridge->quit();
+    }
+
     saveState();
 
     if (saveStateThread.joinable())
         saveStateThread.join();
+
+    if (handoverConnection >= 0)
+        sendHandover(listenerMap);
 }
 
 void MainApp::quit()
@@ -739,6 +1242,8 @@ void MainApp::loadConfig()
     logger->setLogPath(settings->logPath);
     logger->queueReOpen();
     logger->setFlags(settings->logDebug, settings->logSubscriptions, settings->quiet);
+    logger->setAffinity(settings->loggerCpus);
+    timer.setAffinity(settings->timerCpus);
 
     setlimits();
 
@@ -789,8 +1294,45 @@ void MainApp::queueCleanup()
     wakeUpThread();
 }
 
+/**
+ * @brief MainApp::getSubscriptionStore gives the store of the calling thread. That's the global one, unless it's a worker thread in the
+ * sharded thread model.
+ */
 std::shared_ptr<SubscriptionStore> MainApp::getSubscriptionStore()
 {
+    return getSubscriptionStore(ThreadGlobals::getThreadData());
+}
+
+std::shared_ptr<SubscriptionStore> MainApp::getSubscriptionStore(const ThreadData *threadData)
+{
+    if (threadData && threadData->subscriptionStore)
+        return threadData->subscriptionStore;
+
     return this->subscriptionStore;
 }
 
+/**
+ * @brief MainApp::getSessionStores gives the stores with sessions, which are the ones of the threads in the sharded thread model.
+ */
+std::vector<SubscriptionStore*> MainApp::getSessionStores()
+{
+    std::vector<SubscriptionStore*> stores;
+
+    if (shards)
+    {
+        for (std::shared_ptr<ThreadData> &thread : threads)
+            stores.push_back(thread->subscriptionStore.get());
+    }
+    else
+    {
+        stores.push_back(subscriptionStore.get());
+    }
+
+    return stores;
+}
+
+std::shared_ptr<ClusterNode> MainApp::getCluster()
+{
+    return this->cluster;
+}
+
@@ -41,6 +41,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "timer.h"
 #include "scopedsocket.h"
 #include "oneinstancelock.h"
+#include "handover.h"
+#include "replay.h"
 
 class MainApp
 {
@@ -55,6 +57,9 @@ class MainApp
     bool running = true;
     std::vector<std::shared_ptr<ThreadData>> threads;
     std::shared_ptr<SubscriptionStore> subscriptionStore;
+    std::shared_ptr<ClusterNode> cluster;
+    std::shared_ptr<ThreadShards> shards;
+    std::vector<std::shared_ptr<Bridge>> bridges;
     std::unique_ptr<ConfigFileParser> confFileParser;
     std::forward_list<std::function<void()>> taskQueue;
     int epollFdAccept = -1;
@@ -70,6 +75,7 @@ class MainApp
     std::list<std::shared_ptr<Listener>> listeners;
     std::mutex quitMutex;
     std::string fuzzFilePath;
+    ReplayOptions replayOptions;
     OneInstanceLock oneInstanceLock;
 
     Logger *logger = Logger::getInstance();
@@ -77,6 +83,13 @@ class MainApp
     std::thread saveStateThread;
     std::mutex saveStateMutex;
 
+    int handoverListenFd = -1;
+    int handoverConnection = -1;
+    std::vector<int> handedOverListenFds;
+    std::vector<HandedOverClient> handedOverClients;
+
+    std::vector<int> cpuNumaNodes;
+
     void setlimits();
     void loadConfig();
     void reloadConfig();
@@ -88,6 +101,7 @@ class MainApp
     void queuePasswordFileReloadAllThreads();
     void queueAuthPluginPeriodicEventAllThreads();
     void setFuzzFile(const std::string &fuzzFilePath);
+    void setReplayOptions(const ReplayOptions &replayOptions);
     void queuePublishStatsOnDollarTopic();
     void saveState();
     void saveStateInThread();
@@ -95,6 +109,14 @@ class MainApp
     void queueRemoveExpiredSessions();
     void waitForWillsQueued();
     void waitForDisconnectsInitiated();
+    void receiveHandover();
+    int takeHandedOverListenSocket(const BindAddr &bindAddr);
+    std::unordered_map<std::string, size_t> adoptHandedOverClients();
+    void createHandoverSocket();
+    void acceptHandoverRequest();
+    void waitForHandoverPrepared();
+    std::shared_ptr<ThreadData> getThreadForIncomingCpu(int fd, uint &next_thread_index);
+    void sendHandover(const std::map<int, std::shared_ptr<Listener>> &listenerMap);
 
     MainApp(const std::string &configFilePath);
 public:
@@ -112,6 +134,9 @@ public:
     void queueCleanup();
 
     std::shared_ptr<SubscriptionStore> getSubscriptionStore();
+    std::shared_ptr<SubscriptionStore> getSubscriptionStore(const ThreadData *threadData);
+    std::vector<SubscriptionStore*> getSessionStores();
+    std::shared_ptr<ClusterNode> getCluster();
 };
 
 #endif // MAINAPP_H
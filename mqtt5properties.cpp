@@ -9,18 +9,17 @@
 Mqtt5PropertyBuilder::Mqtt5PropertyBuilder()
 {
     genericBytes.reserve(128);
-    clientSpecificBytes.reserve(128);
 }
 
-size_t Mqtt5PropertyBuilder::getLength()
+size_t Mqtt5PropertyBuilder::getLength() const
 {
-    length = genericBytes.size() + clientSpecificBytes.size();
-    return length.getLen() + genericBytes.size() + clientSpecificBytes.size();
+    return getVarInt().getLen() + genericBytes.size();
 }
 
-const VariableByteInt &Mqtt5PropertyBuilder::getVarInt()
+VariableByteInt Mqtt5PropertyBuilder::getVarInt() const
 {
-    length = genericBytes.size() + clientSpecificBytes.size();
+    VariableByteInt length;
+    length = genericBytes.size();
     return length;
 }
 
@@ -29,16 +28,6 @@ const std::vector<char> &Mqtt5PropertyBuilder::getGenericBytes() const
     return genericBytes;
 }
 
-const std::vector<char> &Mqtt5PropertyBuilder::getclientSpecificBytes() const
-{
-    return clientSpecificBytes;
-}
-
-void Mqtt5PropertyBuilder::clearClientSpecificBytes()
-{
-    clientSpecificBytes.clear();
-}
-
 std::shared_ptr<std::vector<std::pair<std::string, std::string>>> Mqtt5PropertyBuilder::getUserProperties() const
 {
     return this->userProperties;
@@ -104,11 +93,6 @@ void Mqtt5PropertyBuilder::writePayloadFormatIndicator(uint8_t val)
     writeUint8(Mqtt5Properties::PayloadFormatIndicator, val);
 }
 
-void Mqtt5PropertyBuilder::writeMessageExpiryInterval(uint32_t val)
-{
-    writeUint32(Mqtt5Properties::MessageExpiryInterval, val, clientSpecificBytes);
-}
-
 void Mqtt5PropertyBuilder::writeResponseTopic(const std::string &str)
 {
     writeStr(Mqtt5Properties::ResponseTopic, str);
@@ -130,11 +114,6 @@ void Mqtt5PropertyBuilder::writeCorrelationData(const std::string &correlationDa
     writeStr(Mqtt5Properties::CorrelationData, correlationData);
 }
 
-void Mqtt5PropertyBuilder::writeTopicAlias(const uint16_t id)
-{
-    writeUint16(Mqtt5Properties::TopicAlias, id, clientSpecificBytes);
-}
-
 void Mqtt5PropertyBuilder::writeAuthenticationMethod(const std::string &method)
 {
     writeStr(Mqtt5Properties::AuthenticationMethod, method);
@@ -154,7 +133,6 @@ void Mqtt5PropertyBuilder::setNewUserProperties(const std::shared_ptr<std::vecto
 {
     assert(!this->userProperties);
     assert(this->genericBytes.empty());
-    assert(this->clientSpecificBytes.empty());
 
     this->userProperties = userProperties;
 }
@@ -257,3 +235,23 @@ void Mqtt5PropertyBuilder::write2Str(Mqtt5Properties prop, const std::string &on
     }
 }
 
+
+void ClientSpecificProperties::writeMessageExpiryInterval(uint32_t val)
+{
+    assert(static_cast<size_t>(len) + 5 <= sizeof(bytes));
+
+    bytes[len++] = static_cast<uint8_t>(Mqtt5Properties::MessageExpiryInterval);
+    bytes[len++] = static_cast<uint8_t>(val >> 24);
+    bytes[len++] = static_cast<uint8_t>(val >> 16);
+    bytes[len++] = static_cast<uint8_t>(val >> 8);
+    bytes[len++] = static_cast<uint8_t>(val);
+}
+
+void ClientSpecificProperties::writeTopicAlias(const uint16_t id)
+{
+    assert(static_cast<size_t>(len) + 3 <= sizeof(bytes));
+
+    bytes[len++] = static_cast<uint8_t>(Mqtt5Properties::TopicAlias);
+    bytes[len++] = static_cast<uint8_t>(id >> 8);
+    bytes[len++] = static_cast<uint8_t>(id);
+}
@@ -6,12 +6,14 @@
 #include "types.h"
 #include "variablebyteint.h"
 
+/**
+ * @brief The Mqtt5PropertyBuilder class encodes properties. For publishes, it's the block that is the same for all recipients, so it
+ * can be encoded once and shared by the copies of a publish and all packets made from it. Don't change it once it's shared.
+ */
 class Mqtt5PropertyBuilder
 {
     std::vector<char> genericBytes;
-    std::vector<char> clientSpecificBytes; // only relevant for publishes
     std::shared_ptr<std::vector<std::pair<std::string, std::string>>> userProperties;
-    VariableByteInt length;
 
     void writeUint32(Mqtt5Properties prop, const uint32_t x, std::vector<char> &target) const;
     void writeUint16(Mqtt5Properties prop, const uint16_t x);
@@ -22,11 +24,9 @@ class Mqtt5PropertyBuilder
 public:
     Mqtt5PropertyBuilder();
 
-    size_t getLength();
-    const VariableByteInt &getVarInt();
+    size_t getLength() const;
+    VariableByteInt getVarInt() const;
     const std::vector<char> &getGenericBytes() const;
-    const std::vector<char> &getclientSpecificBytes() const;
-    void clearClientSpecificBytes();
     std::shared_ptr<std::vector<std::pair<std::string, std::string>>> getUserProperties() const;
 
     void writeServerKeepAlive(uint16_t val);
@@ -41,15 +41,29 @@ public:
     void writeSharedSubscriptionAvailable(uint8_t val);
     void writeContentType(const std::string &format);
     void writePayloadFormatIndicator(uint8_t val);
-    void writeMessageExpiryInterval(uint32_t val);
     void writeResponseTopic(const std::string &str);
     void writeUserProperty(std::string &&key, std::string &&value);
     void writeCorrelationData(const std::string &correlationData);
-    void writeTopicAlias(const uint16_t id);
     void writeAuthenticationMethod(const std::string &method);
     void writeAuthenticationData(const std::string &data);
     void writeWillDelay(uint32_t delay);
     void setNewUserProperties(const std::shared_ptr<std::vector<std::pair<std::string, std::string>>> &userProperties);
 };
 
+/**
+ * @brief The ClientSpecificProperties class has the publish properties that differ per recipient: the remaining message expiry and the
+ * topic alias. They're encoded on the stack when writing a publish, behind the shared block of the Mqtt5PropertyBuilder.
+ */
+class ClientSpecificProperties
+{
+    char bytes[8]; // Message expiry interval is 5 bytes, topic alias 3.
+    uint8_t len = 0;
+
+public:
+    void writeMessageExpiryInterval(uint32_t val);
+    void writeTopicAlias(const uint16_t id);
+    const char *data() const { return bytes; }
+    uint8_t getLen() const { return len; }
+};
+
 #endif // MQTT5PROPERTIES_H
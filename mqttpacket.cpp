@@ -23,6 +23,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 
 #include "utils.h"
 #include "threadglobals.h"
+#include "threadshards.h"
 
 // constructor for parsing incoming packets
 MqttPacket::MqttPacket(CirBuf &buf, size_t packet_len, size_t fixed_header_length, std::shared_ptr<Client> &sender) :
@@ -110,26 +111,39 @@ MqttPacket::MqttPacket(const UnsubAck &unsubAck) :
     calculateRemainingLength();
 }
 
-size_t MqttPacket::setClientSpecificPropertiesAndGetRequiredSizeForPublish(const ProtocolVersion protocolVersion, Publish &publish) const
+/**
+ * @brief MqttPacket::getRequiredSizeForPublish gives the size of the bytes of a publish packet, without the fixed header.
+ * @return the size, without the payload when that is shared instead of copied.
+ */
+size_t MqttPacket::getRequiredSizeForPublish(const ProtocolVersion protocolVersion, const Publish &publish, const ClientSpecificProperties &clientProperties)
 {
     size_t result = publish.getLengthWithoutFixedHeader();
+    if (shouldSharePayload(publish.payload.length()))
+        result -= publish.payload.length();
     if (protocolVersion >= ProtocolVersion::Mqtt5)
     {
-        publish.setClientSpecificProperties();
-
-        const size_t proplen = publish.propertyBuilder ? publish.propertyBuilder->getLength() : 1;
-        result += proplen;
+        const uint32_t propertyLength = publish.getPropertyLength(clientProperties);
+        VariableByteInt propertyLengthField;
+        propertyLengthField = propertyLength;
+        result += propertyLengthField.getLen() + propertyLength;
     }
     return result;
 }
 
+MqttPacket::MqttPacket(const ProtocolVersion protocolVersion, const Publish &_publish) :
+    MqttPacket(protocolVersion, _publish, _publish.getClientSpecificProperties())
+{
+
+}
+
 /**
  * @brief Construct a packet for a specific protocol version.
  * @param protocolVersion is required here, and not on the Publish object, because publishes don't have a protocol until they are for a specific client.
  * @param _publish
+ * @param clientProperties are the MQTT5 properties for the client this packet is for, like the topic alias.
  */
-MqttPacket::MqttPacket(const ProtocolVersion protocolVersion, Publish &_publish) :
-    bites(setClientSpecificPropertiesAndGetRequiredSizeForPublish(protocolVersion, _publish))
+MqttPacket::MqttPacket(const ProtocolVersion protocolVersion, const Publish &_publish, const ClientSpecificProperties &clientProperties) :
+    bites(getRequiredSizeForPublish(protocolVersion, _publish, clientProperties))
 {
     if (_publish.topic.length() > 0xFFFF)
     {
@@ -163,22 +177,31 @@ MqttPacket::MqttPacket(const ProtocolVersion protocolVersion, Publish &_publish)
 
     if (protocolVersion >= ProtocolVersion::Mqtt5)
     {
-        // Step 1: make certain properties available as objects, because FlashMQ needs access to them for internal logic (only ACL checking at this point).
-        if (_publish.splitTopic && _publish.hasUserProperties())
-        {
-            this->publishData.constructPropertyBuilder();
-            this->publishData.propertyBuilder->setNewUserProperties(_publish.propertyBuilder->getUserProperties());
-        }
+        // Step 1: make certain properties available as objects, because FlashMQ needs access to them for internal logic (only ACL checking at
+        // this point). The property block is immutable, so it can just be shared.
+        if (_publish.splitTopic)
+            this->publishData.propertyBuilder = _publish.propertyBuilder;
 
         // Step 2: this line will make sure the whole byte array containing all properties as flat bytes is present in the 'bites' vector,
         // which is sent to the subscribers.
-        writeProperties(_publish.propertyBuilder);
+        writePublishProperties(_publish, clientProperties);
     }
 
     payloadStart = pos;
     payloadLen = _publish.payload.length();
 
-    writeBytes(_publish.payload.c_str(), _publish.payload.length());
+    if (shouldSharePayload(payloadLen))
+    {
+        assert(bites.size() == payloadStart);
+        std::shared_ptr<std::vector<char>> payload = std::make_shared<std::vector<char>>(_publish.payload.begin(), _publish.payload.end());
+        sharedPayload = std::shared_ptr<const char>(payload, payload->data());
+        payloadInBites = false;
+    }
+    else
+    {
+        writeBytes(_publish.payload.c_str(), _publish.payload.length());
+    }
+
     calculateRemainingLength();
 }
 
@@ -237,15 +260,14 @@ MqttPacket::MqttPacket(const Auth &auth) :
     calculateRemainingLength();
 }
 
+/**
+ * @brief MqttPacket::MqttPacket constructs a connect packet, for the test client and for bridges to other servers.
+ */
 MqttPacket::MqttPacket(const Connect &connect) :
     bites(connect.getLengthWithoutFixedHeader()),
     protocolVersion(connect.protocolVersion),
     packetType(PacketType::CONNECT)
 {
-#ifndef TESTING
-    throw NotImplementedException("Code is only for testing.");
-#endif
-
     first_byte = static_cast<char>(packetType) << 4;
 
     const std::string magicString = connect.getMagicString();
@@ -262,10 +284,15 @@ MqttPacket::MqttPacket(const Connect &connect) :
         flags |= (connect.will->retain << 5);
     }
 
+    if (!connect.username.empty())
+        flags |= 0x80;
+
+    if (!connect.password.empty())
+        flags |= 0x40;
+
     writeByte(flags);
 
-    // Keep-alive
-    writeUint16(60);
+    writeUint16(connect.keepalive);
 
     if (connect.protocolVersion >= ProtocolVersion::Mqtt5)
     {
@@ -285,6 +312,12 @@ MqttPacket::MqttPacket(const Connect &connect) :
         writeString(connect.will->payload);
     }
 
+    if (!connect.username.empty())
+        writeString(connect.username);
+
+    if (!connect.password.empty())
+        writeString(connect.password);
+
     calculateRemainingLength();
 }
 
@@ -312,9 +345,13 @@ MqttPacket::MqttPacket(const Subscribe &subscribe) :
     calculateRemainingLength();
 }
 
-void MqttPacket::bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender)
+/**
+ * @brief MqttPacket::bufferToMqttPackets parses all complete packets from the buffer into packetQueueIn.
+ * @param maxPackets stops parsing when packetQueueIn holds that many packets; the rest stays in the buffer. 0 means no limit.
+ */
+void MqttPacket::bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender, const size_t maxPackets)
 {
-    while (buf.usedBytes() >= MQTT_HEADER_LENGH)
+    while (buf.usedBytes() >= MQTT_HEADER_LENGH && (maxPackets == 0 || packetQueueIn.size() < maxPackets))
     {
         // Determine the packet length by decoding the variable length
         int remaining_length_i = 1; // index of 'remaining length' field is one after start.
@@ -699,7 +736,9 @@ void MqttPacket::handleConnect()
 
         if (protocolVersion >= ProtocolVersion::Mqtt311 && !connectData.clean_start)
         {
-            existingSession = subscriptionStore->lockSession(connectData.client_id);
+            // In the sharded thread model, the session may be in the store of another thread.
+            const std::shared_ptr<ThreadShards> &shards = ThreadGlobals::getThreadData()->shards;
+            existingSession = shards ? shards->lockSession(connectData.client_id) : subscriptionStore->lockSession(connectData.client_id);
             if (existingSession)
                 sessionPresent = true;
         }
@@ -1012,6 +1051,7 @@ void MqttPacket::handleSubscribe()
     Authentication &authentication = *ThreadGlobals::getAuth();
 
     std::list<ReasonCodes> subs_reponse_codes;
+    std::vector<SubscriptionForAdding> subscriptions;
     while (remainingAfterPos() > 0)
     {
         std::string topic = readBytesToString(true);
@@ -1032,7 +1072,7 @@ void MqttPacket::handleSubscribe()
         if (authentication.aclCheck(sender->getClientId(), sender->getUsername(), topic, subtopics, AclAccess::subscribe, qos, false, getUserProperties()) == AuthResult::success)
         {
             logger->logf(LOG_SUBSCRIBE, "Client '%s' subscribed to '%s' QoS %d", sender->repr().c_str(), topic.c_str(), qos);
-            MainApp::getMainApp()->getSubscriptionStore()->addSubscription(sender, topic, subtopics, qos);
+            subscriptions.emplace_back(std::move(topic), std::move(subtopics), qos);
             subs_reponse_codes.push_back(static_cast<ReasonCodes>(qos));
         }
         else
@@ -1051,6 +1091,9 @@ void MqttPacket::handleSubscribe()
         throw ProtocolError("No topics specified to subscribe to.", ReasonCodes::MalformedPacket);
     }
 
+    // All at once, because some clients subscribe to thousands of filters in one packet.
+    sender->getSessionStore()->addSubscriptions(sender, subscriptions);
+
     SubAck subAck(this->protocolVersion, packet_id, subs_reponse_codes);
     MqttPacket response(subAck);
     sender->writeMqttPacket(response);
@@ -1101,7 +1144,7 @@ void MqttPacket::handleUnsubscribe()
         if (topic.empty())
             throw ProtocolError("Subscribe topic is empty.", ReasonCodes::MalformedPacket);
 
-        MainApp::getMainApp()->getSubscriptionStore()->removeSubscription(sender, topic);
+        sender->getSessionStore()->removeSubscription(sender, topic);
         logger->logf(LOG_UNSUBSCRIBE, "Client '%s' unsubscribed from '%s'", sender->repr().c_str(), topic.c_str());
     }
 
@@ -1226,8 +1269,22 @@ void MqttPacket::parsePublishData()
     if (publishData.topic.empty())
         throw ProtocolError("Empty publish topic", ReasonCodes::ProtocolError);
 
-    payloadLen = remainingAfterPos();
     payloadStart = pos;
+
+    // Parsing again finds the payload already taken out.
+    if (!payloadInBites)
+        return;
+
+    payloadLen = remainingAfterPos();
+
+    if (shouldSharePayload(payloadLen))
+    {
+        // The received bytes become the shared payload, and only what comes before the payload is copied back.
+        std::shared_ptr<std::vector<char>> received = std::make_shared<std::vector<char>>(std::move(bites));
+        bites.assign(received->begin(), received->begin() + payloadStart);
+        sharedPayload = std::shared_ptr<const char>(received, received->data() + payloadStart);
+        payloadInBites = false;
+    }
 }
 
 void MqttPacket::handlePublish()
@@ -1290,9 +1347,7 @@ void MqttPacket::handlePublish()
     if (publishData.qos > 0)
     {
         const PacketType responseType = publishData.qos == 1 ? PacketType::PUBACK : PacketType::PUBREC;
-        PubResponse pubAck(this->protocolVersion, responseType, ackCode, _packet_id);
-        MqttPacket response(pubAck);
-        sender->writeMqttPacket(response);
+        sender->writePublishResponse(responseType, ackCode, _packet_id);
     }
 }
 
@@ -1342,9 +1397,7 @@ void MqttPacket::handlePubRec()
 
         // MQTT5: "[The sender] MUST send a PUBREL packet when it receives a PUBREC packet from the receiver with a Reason Code value less than 0x80"
         const ReasonCodes reason = foundAndRemoved ? ReasonCodes::Success : ReasonCodes::PacketIdentifierNotFound;
-        PubResponse pubRel(this->protocolVersion, PacketType::PUBREL, reason, packet_id);
-        MqttPacket response(pubRel);
-        sender->writeMqttPacket(response);
+        sender->writePubResponse(PacketType::PUBREL, reason, packet_id);
     }
 }
 
@@ -1369,9 +1422,7 @@ void MqttPacket::handlePubRel()
     const bool foundAndRemoved = sender->getSession()->removeIncomingQoS2MessageId(packet_id);
     const ReasonCodes reason = foundAndRemoved ? ReasonCodes::Success : ReasonCodes::PacketIdentifierNotFound;
 
-    PubResponse pubcomp(this->protocolVersion, PacketType::PUBCOMP, reason, packet_id);
-    MqttPacket response(pubcomp);
-    sender->writeMqttPacket(response);
+    sender->writePubResponse(PacketType::PUBCOMP, reason, packet_id);
 }
 
 void MqttPacket::parsePubComp()
@@ -1439,7 +1490,7 @@ SubAckData MqttPacket::parseSubAckData()
 void MqttPacket::calculateRemainingLength()
 {
     assert(fixed_header_length == 0); // because you're not supposed to call this on packet that we already know the length of.
-    this->remainingLength = bites.size();
+    this->remainingLength = bites.size() + (payloadInBites ? 0 : payloadLen);
 }
 
 void MqttPacket::setPosToDataStart()
@@ -1495,7 +1546,8 @@ std::string MqttPacket::getPayloadCopy() const
 {
     assert(payloadStart > 0);
     assert(pos <= bites.size());
-    std::string payload(&bites[payloadStart], payloadLen);
+    const char *src = payloadInBites ? bites.data() + payloadStart : sharedPayload.get();
+    std::string payload(src, payloadLen);
     return payload;
 }
 
@@ -1516,7 +1568,7 @@ uint8_t MqttPacket::getFixedHeaderLength() const
 
 size_t MqttPacket::getSizeIncludingNonPresentHeader() const
 {
-    size_t total = bites.size();
+    size_t total = bites.size() + (payloadInBites ? 0 : payloadLen);
 
     if (fixed_header_length == 0)
     {
@@ -1630,11 +1682,27 @@ void MqttPacket::writeProperties(const std::shared_ptr<Mqtt5PropertyBuilder> &pr
         writeVariableByteInt(properties->getVarInt());
         const std::vector<char> &b = properties->getGenericBytes();
         writeBytes(b.data(), b.size());
-        const std::vector<char> &b2 = properties->getclientSpecificBytes();
-        writeBytes(b2.data(), b2.size());
     }
 }
 
+/**
+ * @brief MqttPacket::writePublishProperties writes the shared property block of the publish, and then the properties for this recipient.
+ */
+void MqttPacket::writePublishProperties(const Publish &publish, const ClientSpecificProperties &clientProperties)
+{
+    VariableByteInt propertyLength;
+    propertyLength = publish.getPropertyLength(clientProperties);
+    writeVariableByteInt(propertyLength);
+
+    if (publish.propertyBuilder)
+    {
+        const std::vector<char> &b = publish.propertyBuilder->getGenericBytes();
+        writeBytes(b.data(), b.size());
+    }
+
+    writeBytes(clientProperties.data(), clientProperties.getLen());
+}
+
 void MqttPacket::writeVariableByteInt(const VariableByteInt &v)
 {
     writeBytes(v.data(), v.getLen());
@@ -1771,7 +1839,7 @@ bool MqttPacket::containsClientSpecificProperties() const
     assert(packetType == PacketType::PUBLISH);
     assert(this->externallyReceived);
 
-    if (protocolVersion <= ProtocolVersion::Mqtt311 || !publishData.propertyBuilder)
+    if (protocolVersion <= ProtocolVersion::Mqtt311)
         return false;
 
     // TODO: for the on-line clients, even with expire info, we can just copy the same packet. So, that case can be excluded.
@@ -1802,6 +1870,39 @@ void MqttPacket::readIntoBuf(CirBuf &buf) const
     }
 
     buf.write(bites.data(), bites.size());
+
+    if (!payloadInBites)
+        buf.write(sharedPayload.get(), payloadLen);
+}
+
+/**
+ * @brief MqttPacket::readIntoBufWithoutPayload is like readIntoBuf(), but stops where the payload starts. See sharedPayload.
+ */
+void MqttPacket::readIntoBufWithoutPayload(CirBuf &buf) const
+{
+    assert(packetType == PacketType::PUBLISH);
+    assert(payloadStart > 0);
+    assert(publishData.qos == 0 || packet_id > 0);
+
+    buf.ensureFreeSpace(getSizeIncludingNonPresentHeader() - payloadLen);
+
+    if (!containsFixedHeader())
+    {
+        buf.headPtr()[0] = first_byte;
+        buf.advanceHead(1);
+        remainingLength.readIntoBuf(buf);
+    }
+
+    buf.write(bites.data(), payloadStart);
+}
+
+/**
+ * @brief MqttPacket::shouldSharePayload says whether a payload is big enough to be referenced by write queues, instead of copied.
+ */
+bool MqttPacket::shouldSharePayload(size_t payloadLen)
+{
+    const Settings *settings = ThreadGlobals::getSettings();
+    return settings && settings->sharedPayloadThreshold > 0 && payloadLen >= settings->sharedPayloadThreshold;
 }
 
 
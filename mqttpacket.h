@@ -64,6 +64,11 @@ class MqttPacket
     size_t payloadLen = 0;
     bool hasTopicAlias = false;
 
+    // A large payload is kept out of 'bites', so the write queues of all subscribers this packet is written to can reference it. For
+    // received packets, it points into the received bytes. See Client::writeMqttPacket().
+    std::shared_ptr<const char> sharedPayload;
+    bool payloadInBites = true;
+
     // It's important to understand that this class is used for incoming packets as well as new outgoing packets. When we create
     // new outgoing packets, we generally know exactly who it's for and the information is only stored in this->bites. So, the
     // publishData and fields like hasTopicAlias are invalid in those cases.
@@ -77,6 +82,7 @@ class MqttPacket
     void writeUint16(uint16_t x);
     void writeBytes(const char *b, size_t len);
     void writeProperties(const std::shared_ptr<Mqtt5PropertyBuilder> &properties);
+    void writePublishProperties(const Publish &publish, const ClientSpecificProperties &clientProperties);
     void writeVariableByteInt(const VariableByteInt &v);
     void writeString(const std::string &s);
     uint16_t readTwoBytesToUInt16();
@@ -86,6 +92,8 @@ class MqttPacket
     void readUserProperty();
     std::string readBytesToString(bool validateUtf8 = true, bool alsoCheckInvalidPublishChars = false);
 
+    static bool shouldSharePayload(size_t payloadLen);
+
     void calculateRemainingLength();
     void setPosToDataStart();
     bool atEnd() const;
@@ -104,20 +112,21 @@ public:
     MqttPacket(CirBuf &buf, size_t packet_len, size_t fixed_header_length, std::shared_ptr<Client> &sender); // Constructor for parsing incoming packets.
     MqttPacket(MqttPacket &&other) = default;
 
-    size_t setClientSpecificPropertiesAndGetRequiredSizeForPublish(const ProtocolVersion protocolVersion, Publish &publishData) const;
+    static size_t getRequiredSizeForPublish(const ProtocolVersion protocolVersion, const Publish &publish, const ClientSpecificProperties &clientProperties);
 
     // Constructor for outgoing packets. These may not allocate room for the fixed header, because we don't (always) know the length in advance.
     MqttPacket(const ConnAck &connAck);
     MqttPacket(const SubAck &subAck);
     MqttPacket(const UnsubAck &unsubAck);
-    MqttPacket(const ProtocolVersion protocolVersion, Publish &_publish);
+    MqttPacket(const ProtocolVersion protocolVersion, const Publish &_publish);
+    MqttPacket(const ProtocolVersion protocolVersion, const Publish &_publish, const ClientSpecificProperties &clientProperties);
     MqttPacket(const PubResponse &pubAck);
     MqttPacket(const Disconnect &disconnect);
     MqttPacket(const Auth &auth);
     MqttPacket(const Connect &connect);
     MqttPacket(const Subscribe &subscribe);
 
-    static void bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender);
+    static void bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender, const size_t maxPackets = 0);
 
     void handle();
     ConnectData parseConnectData();
@@ -155,7 +164,10 @@ public:
     uint16_t getPacketId() const;
     void setDuplicate();
     void readIntoBuf(CirBuf &buf) const;
+    void readIntoBufWithoutPayload(CirBuf &buf) const;
     std::string getPayloadCopy() const;
+    size_t getPayloadLen() const { return payloadLen; }
+    const std::shared_ptr<const char> &getSharedPayload() const { return sharedPayload; }
     bool getRetain() const;
     void setRetain();
     const Publish &getPublishData();
@@ -0,0 +1,143 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PACKETWRITER_H
+#define PACKETWRITER_H
+
+#include <cassert>
+#include <cstring>
+
+#include "cirbuf.h"
+#include "types.h"
+#include "variablebyteint.h"
+#include "mqtt5properties.h"
+#include "exceptions.h"
+
+/**
+ * @brief The PacketWriter struct serializes outgoing packets straight into a write buffer, without making an MqttPacket first.
+ *
+ * The protocol version is a template argument, so the MQTT3/MQTT5 differences are decided at compile time. The length is computed
+ * exactly up front, so the fixed header goes first and everything is written in one pass. It's meant for small packets that are made
+ * for one recipient, like QoS acks, where the MqttPacket and its byte vector cost more than the data. Callers make room in the buffer.
+ */
+template<ProtocolVersion version>
+struct PacketWriter
+{
+    static constexpr bool mqtt5 = version >= ProtocolVersion::Mqtt5;
+
+    static uint8_t getPubResponseLength(const ReasonCodes reasonCode)
+    {
+        // "The Reason Code and Property Length can be omitted if the Reason Code is 0x00 (Success) and there are no Properties"
+        return mqtt5 && reasonCode > ReasonCodes::Success ? 5 : 4;
+    }
+
+    template<PacketType packetType>
+    static void writePubResponse(CirBuf &buf, const ReasonCodes reasonCode, const uint16_t packetId)
+    {
+        static_assert(packetType == PacketType::PUBACK || packetType == PacketType::PUBREC || packetType == PacketType::PUBREL ||
+                      packetType == PacketType::PUBCOMP, "Not a publish response");
+
+        constexpr uint8_t firstByte = (static_cast<uint8_t>(packetType) << 4) | (packetType == PacketType::PUBREL ? 0b0010 : 0);
+        const uint8_t length = getPubResponseLength(reasonCode);
+
+        const char bytes[5] = {static_cast<char>(firstByte), static_cast<char>(length - 2), static_cast<char>(packetId >> 8),
+                               static_cast<char>(packetId), static_cast<char>(reasonCode)};
+        buf.write(bytes, length);
+    }
+
+    /**
+     * @brief getPublishLength gives the size of the publish as writePublish() writes it, and the remaining length to give it.
+     * @param qos is given separately, because it's the QoS for this recipient, and that decides whether there is a packet id.
+     * @param clientProperties are the MQTT5 properties for this recipient. See PublishBase::getClientSpecificProperties().
+     */
+    static size_t getPublishLength(const Publish &publish, const char qos, const ClientSpecificProperties &clientProperties, VariableByteInt &remainingLength)
+    {
+        const size_t topicLength = publish.skipTopic ? 0 : publish.topic.length();
+
+        if (topicLength > 0xFFFF)
+            throw ProtocolError("Topic path too long.", ReasonCodes::ProtocolError);
+
+        size_t length = 2 + topicLength + publish.payload.length();
+
+        if (qos)
+            length += 2;
+
+        if (mqtt5)
+        {
+            const uint32_t propertyLength = publish.getPropertyLength(clientProperties);
+            VariableByteInt propertyLengthField;
+            propertyLengthField = propertyLength;
+            length += propertyLengthField.getLen() + propertyLength;
+        }
+
+        remainingLength = length;
+        return 1 + remainingLength.getLen() + length;
+    }
+
+    static void writePublish(CirBuf &buf, const Publish &publish, const char qos, const ClientSpecificProperties &clientProperties,
+                             const VariableByteInt &remainingLength, const uint16_t packetId)
+    {
+        assert(qos == 0 || packetId > 0);
+
+        const std::string &topic = publish.skipTopic ? emptyString() : publish.topic;
+
+        // The fixed header and the topic length, which is at most 7 bytes.
+        char header[7];
+        size_t headerLength = 0;
+        header[headerLength++] = (static_cast<char>(PacketType::PUBLISH) << 4) | (qos << 1) | (static_cast<char>(publish.retain) & 0b00000001);
+        std::memcpy(&header[headerLength], remainingLength.data(), remainingLength.getLen());
+        headerLength += remainingLength.getLen();
+        header[headerLength++] = static_cast<char>(topic.length() >> 8);
+        header[headerLength++] = static_cast<char>(topic.length());
+        buf.write(header, headerLength);
+
+        buf.write(topic.data(), topic.length());
+
+        if (qos)
+        {
+            const char id[2] = {static_cast<char>(packetId >> 8), static_cast<char>(packetId)};
+            buf.write(id, 2);
+        }
+
+        if (mqtt5)
+        {
+            // The block that all recipients share, and then the properties of this one.
+            VariableByteInt propertyLength;
+            propertyLength = publish.getPropertyLength(clientProperties);
+            buf.write(propertyLength.data(), propertyLength.getLen());
+
+            if (publish.propertyBuilder)
+            {
+                const std::vector<char> &generic = publish.propertyBuilder->getGenericBytes();
+                buf.write(generic.data(), generic.size());
+            }
+
+            buf.write(clientProperties.data(), clientProperties.getLen());
+        }
+
+        buf.write(publish.payload.data(), publish.payload.length());
+    }
+
+private:
+    static const std::string &emptyString()
+    {
+        static const std::string empty;
+        return empty;
+    }
+};
+
+#endif // PACKETWRITER_H
@@ -0,0 +1,90 @@
+#!/bin/bash
+#
+# Training workload for profile-guided optimization and BOLT, used by 'build.sh --pgo' and '--bolt'. It runs the load
+# generator's scenarios against the given server binary, over TCP and websockets with MQTT 3.1.1 and 5, and then replays the
+# captures in 'fuzztests'. Instrumented binaries write their profile on exit, so the server is stopped with SIGTERM.
+#
+# Usage: pgo-train.sh <flashmq-binary> <flashmq-bench-binary>
+
+thisfile=$(readlink --canonicalize "$0")
+thisdir=$(dirname "$thisfile")
+
+set -eu
+
+if [[ "$#" -ne 2 ]]; then
+  >&2 echo "Usage: $0 <flashmq-binary> <flashmq-bench-binary>"
+  exit 1
+fi
+
+SERVER=$(readlink --canonicalize "$1")
+BENCH=$(readlink --canonicalize "$2")
+PORT="${FMQ_TRAIN_PORT:-21883}"
+WEBSOCKET_PORT=$((PORT + 1))
+
+WORK_DIR=$(mktemp -d)
+SERVER_PID=""
+
+cleanup()
+{
+  if [[ -n "$SERVER_PID" ]]; then
+    kill "$SERVER_PID" 2> /dev/null || true
+  fi
+  rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+cat > "$WORK_DIR/flashmq.conf" << EOF
+log_file $WORK_DIR/flashmq.log
+storage_dir $WORK_DIR
+allow_anonymous true
+listen {
+  port $PORT
+  protocol mqtt
+}
+listen {
+  port $WEBSOCKET_PORT
+  protocol websockets
+}
+EOF
+
+"$SERVER" --config-file "$WORK_DIR/flashmq.conf" &
+SERVER_PID=$!
+
+for _ in $(seq 100); do
+  if (echo > "/dev/tcp/127.0.0.1/$PORT") 2> /dev/null; then
+    break
+  fi
+  sleep 0.1
+done
+
+bench()
+{
+  echo "Training: $*"
+  # A scenario that doesn't complete still trained the server, so it's not fatal.
+  if ! "$BENCH" --host 127.0.0.1 --timeout 10 "$@" > /dev/null; then
+    >&2 echo "Training scenario did not complete: $*"
+  fi
+}
+
+for protocol in 3.1.1 5; do
+  for qos in 0 1 2; do
+    bench --port "$PORT" --protocol "$protocol" --qos "$qos" --scenario pubsub --messages 5000
+  done
+  bench --port "$PORT" --protocol "$protocol" --qos 1 --scenario fan-out --subscribers 50 --messages 2000
+  bench --port "$PORT" --protocol "$protocol" --scenario fan-in --publishers 50 --messages 1000
+  bench --port "$PORT" --protocol "$protocol" --scenario retained-flood --messages 2000
+  bench --port "$PORT" --protocol "$protocol" --scenario reconnect-storm --connections 200 --rounds 3
+  bench --port "$WEBSOCKET_PORT" --websocket --protocol "$protocol" --qos 1 --scenario pubsub --publishers 4 --subscribers 4 --messages 2000
+done
+
+kill -TERM "$SERVER_PID"
+wait "$SERVER_PID" || true
+SERVER_PID=""
+
+REPLAY_ARGS=()
+for f in "$thisdir"/fuzztests/*.dat; do
+  REPLAY_ARGS+=(--replay "$f")
+done
+
+echo "Training: replay of fuzztests"
+"$SERVER" --config-file "$WORK_DIR/flashmq.conf" "${REPLAY_ARGS[@]}" --replay-rounds 2000 > /dev/null
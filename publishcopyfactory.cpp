@@ -17,11 +17,29 @@ PublishCopyFactory::PublishCopyFactory(Publish *publish) :
 
 }
 
+/**
+ * @brief PublishCopyFactory::needsOwnPacket says whether a client needs a packet for itself, because of properties that differ per client.
+ */
+bool PublishCopyFactory::needsOwnPacket(const ProtocolVersion protocolVersion, uint16_t topic_alias) const
+{
+    if (protocolVersion < ProtocolVersion::Mqtt5)
+        return false;
+
+    if (topic_alias > 0)
+        return true;
+
+    if (packet)
+        return packet->containsClientSpecificProperties();
+
+    assert(publish);
+    return publish->getHasExpireInfo();
+}
+
 MqttPacket *PublishCopyFactory::getOptimumPacket(const char max_qos, const ProtocolVersion protocolVersion, uint16_t topic_alias, bool skip_topic)
 {
     if (packet)
     {
-        if (protocolVersion >= ProtocolVersion::Mqtt5 && (packet->containsClientSpecificProperties() || topic_alias > 0))
+        if (needsOwnPacket(protocolVersion, topic_alias))
         {
             Publish newPublish(packet->getPublishData());
             newPublish.splitTopic = false;
@@ -52,11 +70,68 @@ MqttPacket *PublishCopyFactory::getOptimumPacket(const char max_qos, const Proto
         return cachedPack.get();
     }
 
-    // Getting an instance of a Publish object happens at least on retained messages, will messages and SYS topics. It's low traffic, anyway.
+    // A Publish object is given for retained messages, wills and SYS topics, but also for publishes fanned out by or forwarded to other
+    // threads. Those can have many receivers, so, like above, clients that don't need their own properties share a packet.
     assert(publish);
 
-    this->oneShotPacket = std::make_unique<MqttPacket>(protocolVersion, *publish);
-    return this->oneShotPacket.get();
+    if (needsOwnPacket(protocolVersion, topic_alias))
+    {
+        Publish newPublish(*publish);
+        newPublish.splitTopic = false;
+        newPublish.qos = max_qos;
+        newPublish.topicAlias = topic_alias;
+        newPublish.skipTopic = skip_topic;
+        this->oneShotPacket = std::make_unique<MqttPacket>(protocolVersion, newPublish);
+        return this->oneShotPacket.get();
+    }
+
+    const int cache_key = (static_cast<uint8_t>(protocolVersion) * 10) + max_qos;
+    std::unique_ptr<MqttPacket> &cachedPack = constructedPacketCache[cache_key];
+
+    if (!cachedPack)
+    {
+        Publish newPublish(*publish);
+        newPublish.splitTopic = false;
+        newPublish.qos = max_qos;
+        newPublish.topicAlias = 0;
+        newPublish.skipTopic = false;
+        cachedPack = std::make_unique<MqttPacket>(protocolVersion, newPublish);
+    }
+
+    return cachedPack.get();
+}
+
+/**
+ * @brief PublishCopyFactory::getPublishToWriteDirectly gives a publish to serialize straight into the write buffer of a client, when
+ * getOptimumPacket() would make a packet for that client alone. Otherwise, it returns null, and the packet is shared.
+ *
+ * There is one copy of the publish for all those clients; the fields that differ per client are set on it for each.
+ */
+Publish *PublishCopyFactory::getPublishToWriteDirectly(const char max_qos, const ProtocolVersion protocolVersion, uint16_t topic_alias, bool skip_topic)
+{
+    // The packet, or a copy with another QoS or protocol version, is shared by the clients that don't need their own properties.
+    if (!needsOwnPacket(protocolVersion, topic_alias))
+        return nullptr;
+
+    if (!directPublish)
+    {
+        assert(packet || publish);
+        directPublish = packet ? std::make_unique<Publish>(packet->getPublishData()) : std::make_unique<Publish>(*publish);
+        directPublish->splitTopic = false;
+    }
+
+    directPublish->qos = max_qos;
+    directPublish->topicAlias = topic_alias;
+    directPublish->skipTopic = skip_topic;
+    return directPublish.get();
+}
+
+size_t PublishCopyFactory::getPayloadLen() const
+{
+    if (packet)
+        return packet->getPayloadLen();
+    assert(publish);
+    return publish->payload.length();
 }
 
 char PublishCopyFactory::getEffectiveQos(char max_qos) const
@@ -100,7 +175,7 @@ bool PublishCopyFactory::getRetain() const
 
 Publish PublishCopyFactory::getNewPublish() const
 {
-    assert(packet->getQos() > 0);
+    assert(!packet || packet->getQos() > 0);
     assert(orgQos > 0); // We only need to construct new publishes for QoS. If you're doing it elsewhere, it's a bug.
 
     if (packet)
@@ -115,6 +190,17 @@ Publish PublishCopyFactory::getNewPublish() const
     return p;
 }
 
+/**
+ * @brief PublishCopyFactory::getPublishData gives the original publish, without copying, as opposed to getNewPublish().
+ */
+const Publish &PublishCopyFactory::getPublishData() const
+{
+    if (packet)
+        return packet->getPublishData();
+    assert(publish);
+    return *publish;
+}
+
 std::shared_ptr<Client> PublishCopyFactory::getSender()
 {
     if (packet)
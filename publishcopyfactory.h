@@ -21,8 +21,11 @@ class PublishCopyFactory
     MqttPacket *packet = nullptr;
     Publish *publish = nullptr;
     std::unique_ptr<MqttPacket> oneShotPacket;
+    std::unique_ptr<Publish> directPublish;
     const char orgQos;
     std::unordered_map<uint8_t, std::unique_ptr<MqttPacket>> constructedPacketCache;
+
+    bool needsOwnPacket(const ProtocolVersion protocolVersion, uint16_t topic_alias) const;
 public:
     PublishCopyFactory(MqttPacket *packet);
     PublishCopyFactory(Publish *publish);
@@ -30,11 +33,14 @@ public:
     PublishCopyFactory(PublishCopyFactory &&other) = delete;
 
     MqttPacket *getOptimumPacket(const char max_qos, const ProtocolVersion protocolVersion, uint16_t topic_alias, bool skip_topic);
+    Publish *getPublishToWriteDirectly(const char max_qos, const ProtocolVersion protocolVersion, uint16_t topic_alias, bool skip_topic);
+    size_t getPayloadLen() const;
     char getEffectiveQos(char max_qos) const;
     const std::string &getTopic() const;
     const std::vector<std::string> &getSubtopics();
     bool getRetain() const;
     Publish getNewPublish() const;
+    const Publish &getPublishData() const;
     std::shared_ptr<Client> getSender();
     const std::vector<std::pair<std::string, std::string>> *getUserProperties() const;
 
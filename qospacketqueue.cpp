@@ -27,6 +27,33 @@ size_t QueuedPublish::getApproximateMemoryFootprint() const
 }
 
 
+QoSPublishQueue::QoSPublishQueue() :
+    nextToSend(queue.end())
+{
+
+}
+
+QoSPublishQueue::QoSPublishQueue(const QoSPublishQueue &other) :
+    queue(other.queue),
+    nextToSend(queue.end()),
+    qosQueueBytes(other.qosQueueBytes)
+{
+    const auto sentCount = std::distance(other.queue.begin(), std::list<QueuedPublish>::const_iterator(other.nextToSend));
+    nextToSend = std::next(queue.begin(), sentCount);
+}
+
+QoSPublishQueue &QoSPublishQueue::operator=(const QoSPublishQueue &other)
+{
+    if (this == &other)
+        return *this;
+
+    const auto sentCount = std::distance(other.queue.begin(), std::list<QueuedPublish>::const_iterator(other.nextToSend));
+    this->queue = other.queue;
+    this->nextToSend = std::next(queue.begin(), sentCount);
+    this->qosQueueBytes = other.qosQueueBytes;
+    return *this;
+}
+
 bool QoSPublishQueue::erase(const uint16_t packet_id)
 {
     bool result = false;
@@ -44,6 +71,9 @@ bool QoSPublishQueue::erase(const uint16_t packet_id)
             if (qosQueueBytes < 0) // Should not happen, but correcting a hypothetical bug is fine for this purpose.
                 qosQueueBytes = 0;
 
+            if (it == nextToSend)
+                nextToSend++;
+
             queue.erase(it);
             result = true;
 
@@ -58,6 +88,14 @@ bool QoSPublishQueue::erase(const uint16_t packet_id)
 
 std::list<QueuedPublish>::iterator QoSPublishQueue::erase(std::list<QueuedPublish>::iterator pos)
 {
+    qosQueueBytes -= pos->getApproximateMemoryFootprint();
+    assert(qosQueueBytes >= 0);
+    if (qosQueueBytes < 0)
+        qosQueueBytes = 0;
+
+    if (pos == nextToSend)
+        nextToSend++;
+
     return this->queue.erase(pos);
 }
 
@@ -71,24 +109,57 @@ size_t QoSPublishQueue::getByteSize() const
     return qosQueueBytes;
 }
 
-void QoSPublishQueue::queuePublish(PublishCopyFactory &copyFactory, uint16_t id, char new_max_qos)
+/**
+ * @brief QoSPublishQueue::queuePublish appends a publish.
+ * @param sent says whether it's being sent now. It can only be when all before it have been, to keep the order.
+ */
+void QoSPublishQueue::queuePublish(PublishCopyFactory &copyFactory, uint16_t id, char new_max_qos, bool sent)
 {
     assert(new_max_qos > 0);
-    assert(id > 0);
 
     Publish pub = copyFactory.getNewPublish();
-    pub.splitTopic = false;
-    queue.emplace_back(std::move(pub), id);
-    qosQueueBytes += queue.back().getApproximateMemoryFootprint();
+    queuePublish(std::move(pub), id, sent);
 }
 
-void QoSPublishQueue::queuePublish(Publish &&pub, uint16_t id)
+void QoSPublishQueue::queuePublish(Publish &&pub, uint16_t id, bool sent)
 {
     assert(id > 0);
+    assert(!sent || !hasUnsent());
 
     pub.splitTopic = false;
     queue.emplace_back(std::move(pub), id);
     qosQueueBytes += queue.back().getApproximateMemoryFootprint();
+
+    if (!sent && nextToSend == queue.end())
+        nextToSend = std::prev(queue.end());
+}
+
+bool QoSPublishQueue::hasUnsent() const
+{
+    return nextToSend != queue.end();
+}
+
+/**
+ * @brief QoSPublishQueue::takeNextToSend marks the oldest unsent publish as sent. Only call when there is one.
+ * @return the publish.
+ */
+std::list<QueuedPublish>::iterator QoSPublishQueue::takeNextToSend()
+{
+    assert(hasUnsent());
+    return nextToSend++;
+}
+
+/**
+ * @brief QoSPublishQueue::markAllUnsent is for a new connection, which has to get everything again.
+ */
+void QoSPublishQueue::markAllUnsent()
+{
+    nextToSend = queue.begin();
+}
+
+void QoSPublishQueue::markAllSent()
+{
+    nextToSend = queue.end();
 }
 
 std::list<QueuedPublish>::iterator QoSPublishQueue::begin()
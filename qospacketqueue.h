@@ -24,18 +24,34 @@ public:
     Publish &getPublish();
 };
 
+/**
+ * @brief The QoSPublishQueue class holds the QoS publishes of a session until they're acknowledged, in order.
+ *
+ * It also knows which of them have been sent to the current connection: the ones before 'nextToSend'. The others wait for the client
+ * to have room for them within its receive maximum.
+ */
 class QoSPublishQueue
 {
     std::list<QueuedPublish> queue; // Using list because it's easiest to maintain order [MQTT-4.6.0-6]
+    std::list<QueuedPublish>::iterator nextToSend;
     ssize_t qosQueueBytes = 0;
 
 public:
+    QoSPublishQueue();
+    QoSPublishQueue(const QoSPublishQueue &other);
+    QoSPublishQueue &operator=(const QoSPublishQueue &other);
+
     bool erase(const uint16_t packet_id);
     std::list<QueuedPublish>::iterator erase(std::list<QueuedPublish>::iterator pos);
     size_t size() const;
     size_t getByteSize() const;
-    void queuePublish(PublishCopyFactory &copyFactory, uint16_t id, char new_max_qos);
-    void queuePublish(Publish &&pub, uint16_t id);
+    void queuePublish(PublishCopyFactory &copyFactory, uint16_t id, char new_max_qos, bool sent);
+    void queuePublish(Publish &&pub, uint16_t id, bool sent);
+
+    bool hasUnsent() const;
+    std::list<QueuedPublish>::iterator takeNextToSend();
+    void markAllUnsent();
+    void markAllSent();
 
     std::list<QueuedPublish>::iterator begin();
     std::list<QueuedPublish>::iterator end();
@@ -0,0 +1,193 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "qosspillfile.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <cstring>
+#include <cassert>
+#include <stdexcept>
+#include <vector>
+
+#include "client.h"
+#include "mqttpacket.h"
+#include "utils.h"
+
+QoSSpillFile::QoSSpillFile(const Settings &settings) :
+    cirbuf(1024)
+{
+    const std::string pathTemplate = settings.getQoSSpillFileTemplate();
+    if (pathTemplate.empty())
+        throw std::runtime_error("Spilling QoS messages to disk requires a storage dir.");
+
+    std::vector<char> path(pathTemplate.begin(), pathTemplate.end());
+    path.push_back(0);
+
+    int fd = check<std::runtime_error>(mkstemp(path.data()));
+    unlink(path.data());
+
+    f = fdopen(fd, "w+b");
+    if (f == nullptr)
+    {
+        close(fd);
+        throw std::runtime_error(formatString("Can't open QoS spill file: %s", strerror(errno)));
+    }
+
+    // The MqttPacket constructor wants a sender, like when loading sessions.
+    std::shared_ptr<ThreadData> dummyThreadData;
+    dummyClient = std::make_shared<Client>(0, dummyThreadData, nullptr, false, nullptr, &settings, false);
+    dummyClient->setClientProperties(ProtocolVersion::Mqtt5, "Dummyforloadingspilledqos", "nobody", true, 60);
+}
+
+QoSSpillFile::~QoSSpillFile()
+{
+    if (f)
+        fclose(f);
+}
+
+void QoSSpillFile::truncate()
+{
+    check<std::runtime_error>(ftruncate(fileno(f), 0));
+    readPos = 0;
+    writePos = 0;
+}
+
+/**
+ * @brief QoSSpillFile::compact moves the publishes that weren't read yet to the start of the file, and cuts off the rest.
+ *
+ * Only done when what was read is at least as big as what is left, so moving the bytes costs no more than writing them did.
+ */
+void QoSSpillFile::compact()
+{
+    const long left = writePos - readPos;
+    std::vector<char> buf(65536);
+
+    long done = 0;
+    while (done < left)
+    {
+        const size_t len = std::min<long>(left - done, buf.size());
+
+        if (fseek(f, readPos + done, SEEK_SET) != 0 || fread(buf.data(), 1, len, f) != len)
+            throw std::runtime_error("Error reading QoS spill file.");
+
+        if (fseek(f, done, SEEK_SET) != 0 || fwrite(buf.data(), 1, len, f) != len)
+            throw std::runtime_error(formatString("Error writing QoS spill file: %s", strerror(errno)));
+
+        done += len;
+    }
+
+    if (fflush(f) != 0)
+        throw std::runtime_error(formatString("Error writing QoS spill file: %s", strerror(errno)));
+
+    check<std::runtime_error>(ftruncate(fileno(f), left));
+    readPos = 0;
+    writePos = left;
+}
+
+/**
+ * @brief QoSSpillFile::write appends a publish.
+ * @param pub is not const, because the MqttPacket constructor isn't.
+ *
+ * The message expiry interval that is left is written as property, so expiry keeps working, relative to when it's read back.
+ */
+void QoSSpillFile::write(Publish &pub)
+{
+    assert(pub.qos > 0);
+
+    MqttPacket pack(ProtocolVersion::Mqtt5, pub);
+    pack.setPacketId(1); // Place holder. The session assigns the real one when it takes the publish back.
+
+    const uint32_t packSize = pack.getSizeIncludingNonPresentHeader();
+    const uint16_t fixedHeaderLength = pack.getFixedHeaderLength();
+
+    cirbuf.reset();
+    cirbuf.ensureFreeSpace(packSize + 32);
+    pack.readIntoBuf(cirbuf);
+    assert(cirbuf.usedBytes() == packSize);
+
+    if (fseek(f, writePos, SEEK_SET) != 0)
+        throw std::runtime_error(formatString("Error seeking QoS spill file: %s", strerror(errno)));
+
+    if (fwrite(&fixedHeaderLength, sizeof(fixedHeaderLength), 1, f) != 1 || fwrite(&packSize, sizeof(packSize), 1, f) != 1)
+        throw std::runtime_error(formatString("Error writing QoS spill file: %s", strerror(errno)));
+
+    while (cirbuf.usedBytes() > 0)
+    {
+        const uint32_t len = cirbuf.maxReadSize();
+        if (fwrite(cirbuf.tailPtr(), 1, len, f) != len)
+            throw std::runtime_error(formatString("Error writing QoS spill file: %s", strerror(errno)));
+        cirbuf.advanceTail(len);
+    }
+
+    writePos = ftell(f);
+    count++;
+}
+
+/**
+ * @brief QoSSpillFile::read takes the oldest publish from the file.
+ * @param pub is assigned the publish.
+ * @return false when the file is empty.
+ */
+bool QoSSpillFile::read(Publish &pub)
+{
+    if (count == 0)
+        return false;
+
+    if (fseek(f, readPos, SEEK_SET) != 0)
+        throw std::runtime_error(formatString("Error seeking QoS spill file: %s", strerror(errno)));
+
+    uint16_t fixedHeaderLength = 0;
+    uint32_t packSize = 0;
+
+    if (fread(&fixedHeaderLength, sizeof(fixedHeaderLength), 1, f) != 1 || fread(&packSize, sizeof(packSize), 1, f) != 1)
+        throw std::runtime_error("Error reading QoS spill file.");
+
+    cirbuf.reset();
+    cirbuf.ensureFreeSpace(packSize + 32);
+
+    uint32_t left = packSize;
+    while (left > 0)
+    {
+        const uint32_t len = std::min<uint32_t>(left, cirbuf.maxWriteSize());
+        if (fread(cirbuf.headPtr(), 1, len, f) != len)
+            throw std::runtime_error("Error reading QoS spill file.");
+        cirbuf.advanceHead(len);
+        left -= len;
+    }
+
+    readPos = ftell(f);
+    count--;
+
+    MqttPacket pack(cirbuf, packSize, fixedHeaderLength, dummyClient);
+    pack.parsePublishData();
+    pub = pack.getPublishData();
+    pub.splitTopic = false;
+
+    // Keeping the file from growing forever, also when the consumer never quite catches up.
+    if (count == 0)
+        truncate();
+    else if (readPos >= QOS_SPILL_FILE_COMPACT_BYTES && readPos >= writePos - readPos)
+        compact();
+
+    return true;
+}
+
+size_t QoSSpillFile::size() const
+{
+    return count;
+}
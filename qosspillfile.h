@@ -0,0 +1,64 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef QOSSPILLFILE_H
+#define QOSSPILLFILE_H
+
+#include <stdio.h>
+#include <memory>
+
+#include "forward_declarations.h"
+#include "types.h"
+#include "cirbuf.h"
+
+// Once the publishes that were read take up this much of the file, the rest is moved to the front.
+#define QOS_SPILL_FILE_COMPACT_BYTES 1048576
+
+/**
+ * @brief The QoSSpillFile class holds, in order, the QoS publishes of a session that didn't fit in its in-memory queue.
+ *
+ * The file is unlinked right after creating it, so it's gone when it's closed, even after a crash. That also means the spilled
+ * publishes are not part of the saved sessions.
+ */
+class QoSSpillFile
+{
+#ifdef TESTING
+    friend class MainTests;
+#endif
+
+    FILE *f = nullptr;
+    long readPos = 0;
+    long writePos = 0;
+    size_t count = 0;
+    CirBuf cirbuf;
+    std::shared_ptr<Client> dummyClient;
+
+    void truncate();
+    void compact();
+
+public:
+    QoSSpillFile(const Settings &settings);
+    QoSSpillFile(const QoSSpillFile &other) = delete;
+    QoSSpillFile(QoSSpillFile &&other) = delete;
+    ~QoSSpillFile();
+
+    void write(Publish &pub);
+    bool read(Publish &pub);
+    size_t size() const;
+};
+
+#endif // QOSSPILLFILE_H
@@ -0,0 +1,210 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "replay.h"
+
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "threaddata.h"
+#include "subscriptionstore.h"
+#include "settings.h"
+#include "threadglobals.h"
+#include "client.h"
+#include "mqttpacket.h"
+#include "exceptions.h"
+#include "utils.h"
+#include "logger.h"
+
+void ReplayStats::add(const ReplayStats &other)
+{
+    read += other.read;
+    parse += other.parse;
+    handle += other.handle;
+    write += other.write;
+    disconnect += other.disconnect;
+    packets += other.packets;
+    bytes += other.bytes;
+    errors += other.errors;
+}
+
+Replayer::Replayer(const ReplayOptions &options, std::shared_ptr<Settings> settings, std::shared_ptr<SubscriptionStore> subscriptionStore) :
+    options(options),
+    settings(settings),
+    subscriptionStore(subscriptionStore)
+{
+
+}
+
+/**
+ * @brief Replayer::replayOnce replays one capture file with a new client, like one connection doing what was captured.
+ */
+void Replayer::replayOnce(std::shared_ptr<ThreadData> &threadData, const std::string &path, std::shared_ptr<Client> &subscriber, ReplayStats &stats)
+{
+    // Same convention as fuzzing, for websocket captures.
+    const std::string pathLower = str_tolower(path);
+    const bool websocket = strContains(pathLower, "web");
+
+    int fd = check<std::runtime_error>(open(path.c_str(), O_RDONLY));
+
+    std::vector<MqttPacket> packetQueueIn;
+
+    auto stageStart = std::chrono::steady_clock::now();
+    std::shared_ptr<Client> client = std::make_shared<Client>(fd, threadData, nullptr, websocket, nullptr, settings.get(), true);
+    if (websocket && strContains(pathLower, "upgrade"))
+        client->setFakeUpgraded();
+
+    auto nextStage = [&stageStart](std::chrono::nanoseconds &stageTime)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        stageTime += now - stageStart;
+        stageStart = now;
+    };
+
+    try
+    {
+        bool moreToRead = true;
+        while (moreToRead)
+        {
+            moreToRead = client->readFdIntoBuffer();
+            nextStage(stats.read);
+
+            client->bufferToMqttPackets(packetQueueIn, client);
+            nextStage(stats.parse);
+
+            for (MqttPacket &packet : packetQueueIn)
+            {
+                stats.packets++;
+                stats.bytes += packet.getSizeIncludingNonPresentHeader();
+                packet.handle();
+            }
+            packetQueueIn.clear();
+            nextStage(stats.handle);
+        }
+    }
+    catch (ProtocolError &ex)
+    {
+        // Like the server, it's the end of the connection. Malformed packets end parsing, but counting it as handling is close enough.
+        stats.errors++;
+        client->setDisconnectReason(ex.what());
+        nextStage(stats.handle);
+    }
+
+    subscriber->writeBufIntoFd();
+    nextStage(stats.write);
+
+    client->setDisconnectReason("replay done");
+    client.reset();
+    nextStage(stats.disconnect);
+}
+
+void Replayer::replayInThread(int threadnr, const std::vector<int> &clientFiles, ReplayStats &stats)
+{
+    std::shared_ptr<ThreadData> threadData = std::make_shared<ThreadData>(threadnr, settings);
+    ThreadGlobals::assign(&threadData->authentication);
+    ThreadGlobals::assignThreadData(threadData.get());
+    ThreadGlobals::assignSettings(&threadData->settingsLocalCopy);
+    threadData->initAuthPlugin();
+
+    int fdnull = check<std::runtime_error>(open("/dev/null", O_RDWR));
+    std::shared_ptr<Client> subscriber = std::make_shared<Client>(fdnull, threadData, nullptr, false, nullptr, settings.get(), true);
+    subscriber->setClientProperties(ProtocolVersion::Mqtt311, formatString("replaysubscriber%d", threadnr), "replay", true, 60);
+    subscriber->setAuthenticated(true);
+    subscriptionStore->registerClientAndKickExistingOne(subscriber);
+
+    std::vector<std::string> subtopics;
+    splitTopic("#", subtopics);
+    subscriptionStore->addSubscription(subscriber, "#", subtopics, 0);
+
+    for (int round = 0; round < options.rounds; round++)
+    {
+        for (int fileIndex : clientFiles)
+        {
+            try
+            {
+                replayOnce(threadData, options.files.at(fileIndex), subscriber, stats);
+            }
+            catch (std::exception &ex)
+            {
+                Logger::getInstance()->logf(LOG_ERR, "Error replaying '%s': %s", options.files.at(fileIndex).c_str(), ex.what());
+                stats.errors++;
+            }
+        }
+
+        // There is no thread loop to do what clients queued, like removing themselves.
+        threadData->runQueuedTasks();
+    }
+
+    subscriber.reset();
+    threadData->cleanupAuthPlugin();
+}
+
+/**
+ * @brief Replayer::run replays the capture files with the clients divided over the threads, and prints what it measured.
+ */
+void Replayer::run()
+{
+    const int clients = options.clients > 0 ? options.clients : options.files.size();
+    const int threadCount = std::max(1, std::min(options.threads, clients));
+
+    std::vector<std::vector<int>> clientFilesPerThread(threadCount);
+    for (int i = 0; i < clients; i++)
+    {
+        clientFilesPerThread[i % threadCount].push_back(i % options.files.size());
+    }
+
+    std::vector<ReplayStats> statsPerThread(threadCount);
+    std::vector<std::thread> threads;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        threads.emplace_back(&Replayer::replayInThread, this, i, std::cref(clientFilesPerThread[i]), std::ref(statsPerThread[i]));
+    }
+
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+
+    const std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+    ReplayStats total;
+    for (const ReplayStats &s : statsPerThread)
+    {
+        total.add(s);
+    }
+
+    const double seconds = duration.count();
+    const double packets = std::max<double>(1.0, total.packets);
+
+    printf("Replayed %zu file(s) with %d client(s) on %d thread(s), %d round(s), in %.3f s.\n", options.files.size(), clients, threadCount,
+           options.rounds, seconds);
+    printf("Packets: %lu (%.0f/s). Bytes: %lu (%.1f MB/s). Errors: %lu.\n", total.packets, total.packets / seconds, total.bytes,
+           total.bytes / seconds / 1000000.0, total.errors);
+    puts("Time per stage, summed over threads:");
+
+    const std::vector<std::pair<const char*, std::chrono::nanoseconds>> stages = {
+        {"read", total.read}, {"parse", total.parse}, {"handle", total.handle}, {"write", total.write}, {"disconnect", total.disconnect}};
+
+    for (const std::pair<const char*, std::chrono::nanoseconds> &stage : stages)
+    {
+        printf("  %-12s %12.3f ms %10.1f ns/packet\n", stage.first, stage.second.count() / 1000000.0, stage.second.count() / packets);
+    }
+}
@@ -0,0 +1,75 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+
+#include "forward_declarations.h"
+
+struct ReplayOptions
+{
+    std::vector<std::string> files;
+    int clients = 0; // Zero means one per file.
+    int threads = 1;
+    int rounds = 100;
+};
+
+/**
+ * @brief The ReplayStats struct is what one replay thread measured. The stage times add up to the time the thread spent on clients.
+ */
+struct ReplayStats
+{
+    std::chrono::nanoseconds read = std::chrono::nanoseconds(0);
+    std::chrono::nanoseconds parse = std::chrono::nanoseconds(0);
+    std::chrono::nanoseconds handle = std::chrono::nanoseconds(0);
+    std::chrono::nanoseconds write = std::chrono::nanoseconds(0);
+    std::chrono::nanoseconds disconnect = std::chrono::nanoseconds(0);
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+
+    void add(const ReplayStats &other);
+};
+
+/**
+ * @brief The Replayer class feeds captured client byte streams through in-process clients, as fast as it can, for profiling.
+ *
+ * It's the fuzz mode's way of getting bytes into the server: clients in fuzz mode read from the capture file instead of a
+ * socket and don't touch epoll. Each thread has a subscriber to '#' that writes to /dev/null, so publishes also get matched
+ * and serialized. Every round, each client starts over with a new connection, so the CONNECT in the capture is valid again.
+ */
+class Replayer
+{
+    const ReplayOptions &options;
+    std::shared_ptr<Settings> settings;
+    std::shared_ptr<SubscriptionStore> subscriptionStore;
+
+    void replayInThread(int threadnr, const std::vector<int> &clientFiles, ReplayStats &stats);
+    void replayOnce(std::shared_ptr<ThreadData> &threadData, const std::string &path, std::shared_ptr<Client> &subscriber, ReplayStats &stats);
+
+public:
+    Replayer(const ReplayOptions &options, std::shared_ptr<Settings> settings, std::shared_ptr<SubscriptionStore> subscriptionStore);
+
+    void run();
+};
+
+#endif // REPLAY_H
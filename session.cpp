@@ -16,25 +16,77 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include "cassert"
+#include <algorithm>
 
 #include "session.h"
 #include "client.h"
 #include "threadglobals.h"
 #include "threadglobals.h"
 
+uint64_t DropCounters::getTotalDropped() const
+{
+    return writeBufferFull + receiveMaximum + qosBytesLimit + evictedOldest;
+}
+
+void PacketIdSet::insert(uint16_t id)
+{
+    auto pos = std::lower_bound(ids.begin(), ids.end(), id);
+    if (pos == ids.end() || *pos != id)
+        ids.insert(pos, id);
+}
+
+bool PacketIdSet::erase(uint16_t id)
+{
+    auto pos = std::lower_bound(ids.begin(), ids.end(), id);
+    if (pos == ids.end() || *pos != id)
+        return false;
+    ids.erase(pos);
+    return true;
+}
+
+bool PacketIdSet::contains(uint16_t id) const
+{
+    return std::binary_search(ids.begin(), ids.end(), id);
+}
+
+bool SessionQoSState::isIdle() const
+{
+    return qosPacketQueue.size() == 0 && incomingQoS2MessageIds.empty() && outgoingQoS2MessageIds.empty() &&
+            (!qosSpillFile || qosSpillFile->size() == 0);
+}
+
 Session::Session()
 {
     const Settings &settings = *ThreadGlobals::getSettings();
 
     // Sessions also get defaults from the handleConnect() method, but when you create sessions elsewhere, we do need some sensible defaults.
-    this->flowControlQuota = settings.maxQosMsgPendingPerClient;
+    this->flowControlCealing = std::min<uint32_t>(settings.maxQosMsgPendingPerClient, 0xFFFF);
     this->sessionExpiryInterval = settings.expireSessionsAfterSeconds;
 }
 
+/**
+ * @brief Session::getQoSState gives the QoS state, creating it when the session is compact. Call with qosQueueMutex locked.
+ *
+ * Nothing is in transit when there isn't one, so a new one gets the full quota.
+ */
+SessionQoSState &Session::getQoSState()
+{
+    if (!qosState)
+    {
+        qosState = std::make_unique<SessionQoSState>();
+        qosState->flowControlQuota = flowControlCealing;
+    }
+
+    return *qosState;
+}
+
 void Session::increaseFlowControlQuota()
 {
-    flowControlQuota++;
-    this->flowControlQuota = std::min<int>(flowControlQuota, flowControlCealing);
+    if (!qosState)
+        return;
+
+    qosState->flowControlQuota++;
+    qosState->flowControlQuota = std::min<int>(qosState->flowControlQuota, flowControlCealing);
 }
 
 bool Session::requiresQoSQueueing() const
@@ -56,6 +108,7 @@ bool Session::requiresQoSQueueing() const
 
 void Session::increasePacketId()
 {
+    uint16_t &nextPacketId = qosState->nextPacketId;
     nextPacketId++;
     nextPacketId = std::max<uint16_t>(nextPacketId, 1);
 }
@@ -69,29 +122,35 @@ void Session::increasePacketId()
 Session::Session(const Session &other)
 {
     // Only the QoS data is modified by worker threads (vs (locked) timed events), so it could change during copying, because
-    // it gets called from a separate thread.
-    std::unique_lock<std::mutex> locker(qosQueueMutex);
+    // it gets called from a separate thread. The other's QoS state can also be given up while copying.
+    std::unique_lock<std::mutex> locker(other.qosQueueMutex);
 
     this->username = other.username;
     this->client_id = other.client_id;
-    this->incomingQoS2MessageIds = other.incomingQoS2MessageIds;
-    this->outgoingQoS2MessageIds = other.outgoingQoS2MessageIds;
-    this->nextPacketId = other.nextPacketId;
     this->sessionExpiryInterval = other.sessionExpiryInterval;
     this->willPublish = other.willPublish;
     this->removalQueued = other.removalQueued;
     this->removalQueuedAt = other.removalQueuedAt;
 
+    // The copy always gets a QoS state, so the code storing it doesn't need to deal with compact sessions.
+    SessionQoSState &qos = getQoSState();
 
-    // TODO: perhaps this copy constructor is nonsense now.
+    if (other.qosState)
+    {
+        qos.incomingQoS2MessageIds = other.qosState->incomingQoS2MessageIds;
+        qos.outgoingQoS2MessageIds = other.qosState->outgoingQoS2MessageIds;
+        qos.nextPacketId = other.qosState->nextPacketId;
+
+        // TODO: perhaps this copy constructor is nonsense now.
 
-    // TODO: see git history for a change here. We now copy the whole queued publish. Do we want to address that?
-    this->qosPacketQueue = other.qosPacketQueue;
+        // TODO: see git history for a change here. We now copy the whole queued publish. Do we want to address that?
+        qos.qosPacketQueue = other.qosState->qosPacketQueue;
+    }
 }
 
 Session::~Session()
 {
-    logger->logf(LOG_DEBUG, "Session %s is being destroyed.", getClientId().c_str());
+    Logger::getInstance()->logf(LOG_DEBUG, "Session %s is being destroyed.", getClientId().c_str());
 }
 
 std::unique_ptr<Session> Session::getCopy() const
@@ -120,6 +179,18 @@ void Session::assignActiveConnection(std::shared_ptr<Client> &client)
     this->username = client->getUsername();
     this->willPublish = client->getWill();
     this->removalQueued = false;
+
+    std::lock_guard<std::mutex> locker(qosQueueMutex);
+    this->lastThread = client->lockThreadData();
+}
+
+/**
+ * @brief Session::getLastThread gives the thread of the last client of the session, also when it has disconnected since.
+ */
+std::shared_ptr<ThreadData> Session::getLastThread() const
+{
+    std::lock_guard<std::mutex> locker(qosQueueMutex);
+    return lastThread.lock();
 }
 
 /**
@@ -155,31 +226,206 @@ void Session::writePacket(PublishCopyFactory &copyFactory, const char max_qos)
         {
             std::unique_lock<std::mutex> locker(qosQueueMutex);
 
-            if (this->flowControlQuota <= 0 || (qosPacketQueue.getByteSize() >= settings->maxQosBytesPendingPerClient && qosPacketQueue.size() > 0))
+            SessionQoSState &qos = getQoSState();
+
+            // Once we started spilling, everything goes to disk until it's drained again, to keep the order [MQTT-4.6.0-6].
+            if (qos.qosSpillFile && qos.qosSpillFile->size() > 0)
             {
-                if (QoSLogPrintedAtId != nextPacketId)
-                {
-                    logger->logf(LOG_WARNING, "Dropping QoS message(s) for client '%s', because it hasn't seen enough PUBACK/PUBCOMP/PUBRECs to release places "
-                                              "or it exceeded 'max_qos_bytes_pending_per_client'.", client_id.c_str());
-                    QoSLogPrintedAtId = nextPacketId;
-                }
+                spillQosPublish(copyFactory, effectiveQos);
                 return;
             }
 
+            if (!makeRoomForQosPublish(copyFactory, effectiveQos, c, *settings))
+                return;
+
             increasePacketId();
-            flowControlQuota--;
+
+            // Otherwise, it waits for its turn, when acknowledgements release quota.
+            const bool sendNow = c && qos.flowControlQuota > 0 && !qos.qosPacketQueue.hasUnsent();
 
             if (requiresQoSQueueing())
-                qosPacketQueue.queuePublish(copyFactory, nextPacketId, effectiveQos);
+                qos.qosPacketQueue.queuePublish(copyFactory, qos.nextPacketId, effectiveQos, sendNow);
 
-            if (c)
+            if (sendNow)
             {
-                c->writeMqttPacketAndBlameThisClient(copyFactory, effectiveQos, nextPacketId);
+                qos.flowControlQuota--;
+                c->writeMqttPacketAndBlameThisClient(copyFactory, effectiveQos, qos.nextPacketId);
             }
         }
     }
 }
 
+/**
+ * @brief Session::makeRoomForQosPublish applies the slow consumer policy when the QoS queue is at its limits.
+ * @return whether the publish can be queued.
+ *
+ * The queue holds what the client hasn't acknowledged, and what it has no room for yet because of its receive maximum. So it's
+ * limited by 'max_qos_msg_pending_per_client' and 'max_qos_bytes_pending_per_client', not by the receive maximum.
+ *
+ * Call with qosQueueMutex locked and the QoS state present.
+ */
+bool Session::makeRoomForQosPublish(PublishCopyFactory &copyFactory, const char effectiveQos, const std::shared_ptr<Client> &c, const Settings &settings)
+{
+    SessionQoSState &qos = *qosState;
+
+    auto countLimitHit = [&]() {
+        return qos.qosPacketQueue.size() >= settings.maxQosMsgPendingPerClient;
+    };
+
+    auto bytesLimitHit = [&]() {
+        return qos.qosPacketQueue.getByteSize() >= settings.maxQosBytesPendingPerClient && qos.qosPacketQueue.size() > 0;
+    };
+
+    if (!countLimitHit() && !bytesLimitHit())
+        return true;
+
+    if (settings.slowConsumerPolicy == SlowConsumerPolicy::DropOldest)
+    {
+        while (qos.qosPacketQueue.size() > 0 && (countLimitHit() || bytesLimitHit()))
+        {
+            // With a client, what has been sent stays until it's acknowledged, so the oldest that hasn't been sent goes.
+            if (c && !qos.qosPacketQueue.hasUnsent())
+                break;
+
+            auto oldest = c ? qos.qosPacketQueue.takeNextToSend() : qos.qosPacketQueue.begin();
+            qos.qosPacketQueue.erase(oldest);
+            dropCounters.evictedOldest++;
+        }
+
+        if (!countLimitHit() && !bytesLimitHit())
+            return true;
+    }
+
+    if (settings.slowConsumerPolicy == SlowConsumerPolicy::SpillToDisk)
+    {
+        spillQosPublish(copyFactory, effectiveQos);
+        return false;
+    }
+
+    if (countLimitHit())
+        dropCounters.receiveMaximum++;
+    else
+        dropCounters.qosBytesLimit++;
+
+    if (qos.QoSLogPrintedAtId != qos.nextPacketId)
+    {
+        Logger::getInstance()->logf(LOG_WARNING, "Dropping QoS message(s) for client '%s', because it hasn't seen enough PUBACK/PUBCOMP/PUBRECs to release places "
+                                                 "or it exceeded 'max_qos_bytes_pending_per_client'.", client_id.c_str());
+        qos.QoSLogPrintedAtId = qos.nextPacketId;
+    }
+
+    if (settings.slowConsumerPolicy == SlowConsumerPolicy::Disconnect && c)
+    {
+        c->disconnectSlowConsumer("slow consumer: QoS queue full");
+    }
+
+    return false;
+}
+
+/**
+ * @brief Session::spillQosPublish puts a publish on disk, to be sent when the client has caught up.
+ *
+ * Call with qosQueueMutex locked and the QoS state present.
+ */
+void Session::spillQosPublish(PublishCopyFactory &copyFactory, const char effectiveQos)
+{
+    std::unique_ptr<QoSSpillFile> &qosSpillFile = qosState->qosSpillFile;
+
+    try
+    {
+        if (!qosSpillFile)
+            qosSpillFile = std::make_unique<QoSSpillFile>(*ThreadGlobals::getSettings());
+
+        Publish pub = copyFactory.getNewPublish();
+        pub.qos = effectiveQos;
+        pub.splitTopic = false;
+        qosSpillFile->write(pub);
+        dropCounters.spilledToDisk++;
+    }
+    catch (std::exception &ex)
+    {
+        Logger::getInstance()->logf(LOG_ERR, "Dropping QoS message for client '%s', because spilling to disk failed: %s", client_id.c_str(), ex.what());
+        dropCounters.qosBytesLimit++;
+    }
+}
+
+/**
+ * @brief Session::sendQueuedQosPublishes sends the queued publishes the client hasn't had yet, in order, for as far as its receive
+ * maximum allows. After that, the spilled ones.
+ *
+ * Called on connect and whenever an acknowledgement releases quota, so a backlog streams out at the pace of the client.
+ *
+ * Call with qosQueueMutex locked.
+ */
+void Session::sendQueuedQosPublishes(const std::shared_ptr<Client> &c)
+{
+    if (!c || !qosState)
+        return;
+
+    SessionQoSState &qos = *qosState;
+
+    while (qos.flowControlQuota > 0 && qos.qosPacketQueue.hasUnsent())
+    {
+        auto pos = qos.qosPacketQueue.takeNextToSend();
+        QueuedPublish &queuedPublish = *pos;
+        Publish &pub = queuedPublish.getPublish();
+
+        if (pub.hasExpired())
+        {
+            qos.qosPacketQueue.erase(pos);
+            continue;
+        }
+
+        qos.flowControlQuota--;
+
+        MqttPacket p(c->getProtocolVersion(), pub);
+        p.setPacketId(queuedPublish.getPacketId());
+        //p.setDuplicate(); // TODO: this is wrong. Until we have a retransmission system, no packets can have the DUP bit set.
+
+        c->writeMqttPacketAndBlameThisClient(p);
+    }
+
+    unspillQosPublishes(c);
+}
+
+/**
+ * @brief Session::unspillQosPublishes sends spilled publishes for as far as the QoS queue limits allow. They come after the queued ones.
+ *
+ * Call with qosQueueMutex locked.
+ */
+void Session::unspillQosPublishes(const std::shared_ptr<Client> &c)
+{
+    if (!c || !qosState || !qosState->qosSpillFile || qosState->qosSpillFile->size() == 0 || qosState->qosPacketQueue.hasUnsent())
+        return;
+
+    SessionQoSState &qos = *qosState;
+    const Settings *settings = ThreadGlobals::getSettings();
+
+    try
+    {
+        Publish pub;
+        while (qos.flowControlQuota > 0 && qos.qosPacketQueue.getByteSize() < settings->maxQosBytesPendingPerClient && qos.qosSpillFile->read(pub))
+        {
+            if (pub.hasExpired())
+                continue;
+
+            increasePacketId();
+            qos.flowControlQuota--;
+
+            MqttPacket p(c->getProtocolVersion(), pub);
+            p.setPacketId(qos.nextPacketId);
+            c->writeMqttPacketAndBlameThisClient(p);
+
+            qos.qosPacketQueue.queuePublish(std::move(pub), qos.nextPacketId, true);
+        }
+    }
+    catch (std::exception &ex)
+    {
+        Logger::getInstance()->logf(LOG_ERR, "Discarding spilled QoS messages of client '%s': %s", client_id.c_str(), ex.what());
+        qos.qosSpillFile.reset();
+    }
+}
+
 /**
  * @brief Session::clearQosMessage clears a QOS message from the queue. Note that in QoS 2, that doesn't complete the handshake.
  * @param packet_id
@@ -188,15 +434,20 @@ void Session::writePacket(PublishCopyFactory &copyFactory, const char max_qos)
  */
 bool Session::clearQosMessage(uint16_t packet_id, bool qosHandshakeEnds)
 {
-#ifndef NDEBUG
-    logger->logf(LOG_DEBUG, "Clearing QoS message for '%s', packet id '%d'. Left in queue: %d", client_id.c_str(), packet_id, qosPacketQueue.size());
-#endif
-
     bool result = false;
 
     std::lock_guard<std::mutex> locker(qosQueueMutex);
+
+    // Acknowledging something that was never sent.
+    if (!qosState)
+        return false;
+
+#ifndef NDEBUG
+    Logger::getInstance()->logf(LOG_DEBUG, "Clearing QoS message for '%s', packet id '%d'. Left in queue: %d", client_id.c_str(), packet_id, qosState->qosPacketQueue.size());
+#endif
+
     if (requiresQoSQueueing())
-        result = qosPacketQueue.erase(packet_id);
+        result = qosState->qosPacketQueue.erase(packet_id);
     else
     {
         result = true;
@@ -205,6 +456,7 @@ bool Session::clearQosMessage(uint16_t packet_id, bool qosHandshakeEnds)
     if (qosHandshakeEnds)
     {
         increaseFlowControlQuota();
+        sendQueuedQosPublishes(makeSharedClient());
     }
 
     return result;
@@ -223,6 +475,8 @@ bool Session::clearQosMessage(uint16_t packet_id, bool qosHandshakeEnds)
  * can still decide to drop packets, like when their buffers are full. The clients from where the packet originates will
  * never know that, because IT will have received the PUBACK from FlashMQ. The QoS system is not between publisher
  * and subscriber. Users are required to implement something themselves.
+ *
+ * Publishes beyond the receive maximum of the client aren't dropped, but sent as it acknowledges earlier ones, see sendQueuedQosPublishes().
  */
 void Session::sendAllPendingQosData()
 {
@@ -231,41 +485,20 @@ void Session::sendAllPendingQosData()
     {
         std::lock_guard<std::mutex> locker(qosQueueMutex);
 
-        auto pos = qosPacketQueue.begin();
-        while (pos != qosPacketQueue.end())
-        {
-            QueuedPublish &queuedPublish = *pos;
-            Publish &pub = queuedPublish.getPublish();
+        if (!qosState)
+            return;
 
-            if (pub.hasExpired())
-            {
-                pos = qosPacketQueue.erase(pos);
-                continue;
-            }
+        SessionQoSState &qos = *qosState;
 
-            if (flowControlQuota <= 0)
-            {
-                logger->logf(LOG_WARNING, "Dropping QoS message(s) for client '%s', because it exceeds its receive maximum.", client_id.c_str());
-                pos = qosPacketQueue.erase(pos);
-                continue;
-            }
+        // A new connection hasn't had anything yet, and the PUBRELs take from its receive maximum as well.
+        qos.qosPacketQueue.markAllUnsent();
+        qos.flowControlQuota = std::max<int>(0, static_cast<int>(flowControlCealing) - static_cast<int>(qos.outgoingQoS2MessageIds.size()));
 
-            flowControlQuota--;
+        sendQueuedQosPublishes(c);
 
-            MqttPacket p(c->getProtocolVersion(), pub);
-            p.setPacketId(queuedPublish.getPacketId());
-            //p.setDuplicate(); // TODO: this is wrong. Until we have a retransmission system, no packets can have the DUP bit set.
-
-            c->writeMqttPacketAndBlameThisClient(p);
-
-            pos++;
-        }
-
-        for (const uint16_t packet_id : outgoingQoS2MessageIds)
+        for (const uint16_t packet_id : qos.outgoingQoS2MessageIds)
         {
-            PubResponse pubRel(c->getProtocolVersion(), PacketType::PUBREL, ReasonCodes::Success, packet_id);
-            MqttPacket packet(pubRel);
-            c->writeMqttPacketAndBlameThisClient(packet);
+            c->writePubResponse(PacketType::PUBREL, ReasonCodes::Success, packet_id);
         }
     }
 }
@@ -295,7 +528,7 @@ void Session::addIncomingQoS2MessageId(uint16_t packet_id)
     assert(packet_id > 0);
 
     std::unique_lock<std::mutex> locker(qosQueueMutex);
-    incomingQoS2MessageIds.insert(packet_id);
+    getQoSState().incomingQoS2MessageIds.insert(packet_id);
 }
 
 bool Session::incomingQoS2MessageIdInTransit(uint16_t packet_id)
@@ -303,8 +536,7 @@ bool Session::incomingQoS2MessageIdInTransit(uint16_t packet_id)
     assert(packet_id > 0);
 
     std::unique_lock<std::mutex> locker(qosQueueMutex);
-    const auto it = incomingQoS2MessageIds.find(packet_id);
-    return it != incomingQoS2MessageIds.end();
+    return qosState && qosState->incomingQoS2MessageIds.contains(packet_id);
 }
 
 bool Session::removeIncomingQoS2MessageId(u_int16_t packet_id)
@@ -313,41 +545,37 @@ bool Session::removeIncomingQoS2MessageId(u_int16_t packet_id)
 
     std::unique_lock<std::mutex> locker(qosQueueMutex);
 
+    if (!qosState)
+        return false;
+
 #ifndef NDEBUG
-    logger->logf(LOG_DEBUG, "As QoS 2 receiver: publish released (PUBREL) for '%s', packet id '%d'. Left in queue: %d", client_id.c_str(), packet_id, incomingQoS2MessageIds.size());
+    Logger::getInstance()->logf(LOG_DEBUG, "As QoS 2 receiver: publish released (PUBREL) for '%s', packet id '%d'. Left in queue: %d", client_id.c_str(), packet_id, qosState->incomingQoS2MessageIds.size());
 #endif
 
-    bool result = false;
-
-    const auto it = incomingQoS2MessageIds.find(packet_id);
-    if (it != incomingQoS2MessageIds.end())
-    {
-        incomingQoS2MessageIds.erase(it);
-        result = true;
-    }
-
-    return result;
+    return qosState->incomingQoS2MessageIds.erase(packet_id);
 }
 
 void Session::addOutgoingQoS2MessageId(uint16_t packet_id)
 {
     std::unique_lock<std::mutex> locker(qosQueueMutex);
-    outgoingQoS2MessageIds.insert(packet_id);
+    getQoSState().outgoingQoS2MessageIds.insert(packet_id);
 }
 
 void Session::removeOutgoingQoS2MessageId(u_int16_t packet_id)
 {
     std::unique_lock<std::mutex> locker(qosQueueMutex);
 
+    if (!qosState)
+        return;
+
 #ifndef NDEBUG
-    logger->logf(LOG_DEBUG, "As QoS 2 sender: publish complete (PUBCOMP) for '%s', packet id '%d'. Left in queue: %d", client_id.c_str(), packet_id, outgoingQoS2MessageIds.size());
+    Logger::getInstance()->logf(LOG_DEBUG, "As QoS 2 sender: publish complete (PUBCOMP) for '%s', packet id '%d'. Left in queue: %d", client_id.c_str(), packet_id, qosState->outgoingQoS2MessageIds.size());
 #endif
 
-    const auto it = outgoingQoS2MessageIds.find(packet_id);
-    if (it != outgoingQoS2MessageIds.end())
-        outgoingQoS2MessageIds.erase(it);
+    qosState->outgoingQoS2MessageIds.erase(packet_id);
 
     increaseFlowControlQuota();
+    sendQueuedQosPublishes(makeSharedClient());
 }
 
 /**
@@ -363,8 +591,13 @@ bool Session::getDestroyOnDisconnect() const
 
 void Session::setSessionProperties(uint16_t clientReceiveMax, uint32_t sessionExpiryInterval, bool clean_start, ProtocolVersion protocol_version)
 {
-    this->flowControlQuota = clientReceiveMax;
-    this->flowControlCealing = clientReceiveMax;
+    {
+        std::lock_guard<std::mutex> locker(qosQueueMutex);
+        this->flowControlCealing = clientReceiveMax;
+        if (qosState)
+            qosState->flowControlQuota = clientReceiveMax;
+    }
+
     this->sessionExpiryInterval = sessionExpiryInterval;
 
     if (protocol_version <= ProtocolVersion::Mqtt311 && clean_start)
@@ -406,3 +639,79 @@ uint32_t Session::getCurrentSessionExpiryInterval() const
     return result;
 }
 
+uint16_t Session::getClientReceiveMax() const
+{
+    return this->flowControlCealing;
+}
+
+/**
+ * @brief Session::takeInFlightFromFlowControlQuota accounts for QoS messages a handed over connection still has to acknowledge.
+ *
+ * Setting the session properties gives a full quota, which is right for a new connection because it gets everything resent.
+ */
+void Session::takeInFlightFromFlowControlQuota()
+{
+    std::lock_guard<std::mutex> locker(qosQueueMutex);
+
+    if (!qosState)
+        return;
+
+    // The handed over connection has had everything.
+    qosState->qosPacketQueue.markAllSent();
+
+    const int inFlight = qosState->qosPacketQueue.size() + qosState->outgoingQoS2MessageIds.size();
+    qosState->flowControlQuota = std::max<int>(0, static_cast<int>(flowControlCealing) - inFlight);
+}
+
+/**
+ * @brief Session::compact gives up the QoS state when the client is gone and nothing is in transit, to make offline sessions small.
+ * @return whether the session is compact now.
+ *
+ * It's created again as soon as a QoS message is queued for it, or when the client comes back and uses QoS.
+ */
+bool Session::compact()
+{
+    std::lock_guard<std::mutex> locker(qosQueueMutex);
+
+    if (!qosState)
+        return true;
+
+    if (hasActiveClient() || !qosState->isIdle())
+        return false;
+
+    qosState.reset();
+    return true;
+}
+
+bool Session::isCompact() const
+{
+    std::lock_guard<std::mutex> locker(qosQueueMutex);
+    return !qosState;
+}
+
+DropCounters &Session::getDropCounters()
+{
+    return this->dropCounters;
+}
+
+/**
+ * @brief Session::getQueuedPublishes copies the QoS messages waiting to be delivered or acknowledged, to give to another cluster node.
+ * Messages that were spilled to disk aren't included.
+ */
+std::vector<Publish> Session::getQueuedPublishes()
+{
+    std::vector<Publish> result;
+
+    std::lock_guard<std::mutex> locker(qosQueueMutex);
+
+    if (!qosState)
+        return result;
+
+    result.reserve(qosState->qosPacketQueue.size());
+    for (QueuedPublish &qp : qosState->qosPacketQueue)
+    {
+        result.push_back(qp.getPublish());
+    }
+
+    return result;
+}
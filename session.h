@@ -22,12 +22,68 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <list>
 #include <mutex>
 #include <set>
+#include <atomic>
+#include <vector>
 
 #include "forward_declarations.h"
 #include "logger.h"
 #include "sessionsandsubscriptionsdb.h"
 #include "qospacketqueue.h"
 #include "publishcopyfactory.h"
+#include "qosspillfile.h"
+
+/**
+ * @brief The DropCounters struct counts, per cause, the publishes a session didn't deliver because the client didn't keep up.
+ *
+ * They're atomic, because publishes are written into a session from all threads, and not all causes are under the same lock.
+ */
+struct DropCounters
+{
+    std::atomic<uint64_t> writeBufferFull {0};
+    std::atomic<uint64_t> receiveMaximum {0};
+    std::atomic<uint64_t> qosBytesLimit {0};
+    std::atomic<uint64_t> evictedOldest {0};
+    std::atomic<uint64_t> spilledToDisk {0};
+
+    uint64_t getTotalDropped() const;
+};
+
+/**
+ * @brief The PacketIdSet class is a set of QoS 2 packet ids. It's a sorted vector, because there are rarely more than a few.
+ */
+class PacketIdSet
+{
+    std::vector<uint16_t> ids;
+
+public:
+    void insert(uint16_t id);
+    bool erase(uint16_t id);
+    bool contains(uint16_t id) const;
+    size_t size() const { return ids.size(); }
+    bool empty() const { return ids.empty(); }
+    std::vector<uint16_t>::const_iterator begin() const { return ids.begin(); }
+    std::vector<uint16_t>::const_iterator end() const { return ids.end(); }
+    bool operator==(const PacketIdSet &other) const { return ids == other.ids; }
+};
+
+/**
+ * @brief The SessionQoSState struct is the part of a session that is only needed while QoS messages are in transit.
+ *
+ * Most persistent sessions are offline with nothing pending, so a session only has it when it needs it, and gives it up when its
+ * client is gone and nothing is pending anymore.
+ */
+struct SessionQoSState
+{
+    QoSPublishQueue qosPacketQueue;
+    PacketIdSet incomingQoS2MessageIds;
+    PacketIdSet outgoingQoS2MessageIds;
+    std::unique_ptr<QoSSpillFile> qosSpillFile;
+    int flowControlQuota = 0xFFFF;
+    uint16_t nextPacketId = 0;
+    uint16_t QoSLogPrintedAtId = 0;
+
+    bool isIdle() const;
+};
 
 class Session
 {
@@ -38,33 +94,34 @@ class Session
     friend class SessionsAndSubscriptionsDB;
 
     std::weak_ptr<Client> client;
+    std::weak_ptr<ThreadData> lastThread; // Guarded by qosQueueMutex. The thread of the last client, which stays when it disconnects.
     std::string client_id;
     std::string username;
-    QoSPublishQueue qosPacketQueue;
-    std::set<uint16_t> incomingQoS2MessageIds;
-    std::set<uint16_t> outgoingQoS2MessageIds;
-    std::mutex qosQueueMutex;
-    uint16_t nextPacketId = 0;
+    mutable std::mutex qosQueueMutex;
+    std::unique_ptr<SessionQoSState> qosState; // Guarded by qosQueueMutex. Null means there's nothing in transit.
+    DropCounters dropCounters;
+    std::shared_ptr<WillPublish> willPublish;
+    std::chrono::time_point<std::chrono::steady_clock> removalQueuedAt;
+    uint32_t sessionExpiryInterval = 0;
 
     /**
      * Even though flow control data is not part of the session state, I'm keeping it here because there are already
-     * mutexes that they can be placed under, saving additional synchronization.
+     * mutexes that they can be placed under, saving additional synchronization. The quota is in the QoS state.
      */
-    int flowControlCealing = 0xFFFF;
-    int flowControlQuota = 0xFFFF;
+    uint16_t flowControlCealing = 0xFFFF;
 
-    uint32_t sessionExpiryInterval = 0;
-    uint16_t QoSLogPrintedAtId = 0;
     bool destroyOnDisconnect = false;
-    std::shared_ptr<WillPublish> willPublish;
     bool removalQueued = false;
-    std::chrono::time_point<std::chrono::steady_clock> removalQueuedAt;
-    Logger *logger = Logger::getInstance();
 
+    SessionQoSState &getQoSState();
     void increaseFlowControlQuota();
 
     bool requiresQoSQueueing() const;
     void increasePacketId();
+    bool makeRoomForQosPublish(PublishCopyFactory &copyFactory, const char effectiveQos, const std::shared_ptr<Client> &c, const Settings &settings);
+    void spillQosPublish(PublishCopyFactory &copyFactory, const char effectiveQos);
+    void sendQueuedQosPublishes(const std::shared_ptr<Client> &c);
+    void unspillQosPublishes(const std::shared_ptr<Client> &c);
 
     Session(const Session &other);
 public:
@@ -77,6 +134,7 @@ public:
 
     const std::string &getClientId() const { return client_id; }
     std::shared_ptr<Client> makeSharedClient() const;
+    std::shared_ptr<ThreadData> getLastThread() const;
     void assignActiveConnection(std::shared_ptr<Client> &client);
     void writePacket(PublishCopyFactory &copyFactory, const char max_qos);
     bool clearQosMessage(uint16_t packet_id, bool qosHandshakeEnds);
@@ -100,6 +158,13 @@ public:
     void setQueuedRemovalAt();
     uint32_t getSessionExpiryInterval() const;
     uint32_t getCurrentSessionExpiryInterval() const;
+    uint16_t getClientReceiveMax() const;
+    void takeInFlightFromFlowControlQuota();
+    bool compact();
+    bool isCompact() const;
+
+    DropCounters &getDropCounters();
+    std::vector<Publish> getQueuedPublishes();
 };
 
 #endif // SESSION_H
@@ -132,7 +132,7 @@ SessionsAndSubscriptionsResult SessionsAndSubscriptionsDB::readDataV2()
                 pub.createdAt = timepointFromAge(newPubAge);
 
                 logger->logf(LOG_DEBUG, "Loaded QoS %d message for topic '%s' for session '%s'.", pub.qos, pub.topic.c_str(), ses->getClientId().c_str());
-                ses->qosPacketQueue.queuePublish(std::move(pub), id);
+                ses->getQoSState().qosPacketQueue.queuePublish(std::move(pub), id, false);
             }
 
             const uint32_t nrOfIncomingPacketIds = readUint32(eofFound);
@@ -141,7 +141,7 @@ SessionsAndSubscriptionsResult SessionsAndSubscriptionsDB::readDataV2()
                 uint16_t id = readUint16(eofFound);
                 assert(id > 0);
                 logger->logf(LOG_DEBUG, "Loaded incomming QoS2 message id %d.", id);
-                ses->incomingQoS2MessageIds.insert(id);
+                ses->getQoSState().incomingQoS2MessageIds.insert(id);
             }
 
             const uint32_t nrOfOutgoingPacketIds = readUint32(eofFound);
@@ -150,12 +150,14 @@ SessionsAndSubscriptionsResult SessionsAndSubscriptionsDB::readDataV2()
                 uint16_t id = readUint16(eofFound);
                 assert(id > 0);
                 logger->logf(LOG_DEBUG, "Loaded outgoing QoS2 message id %d.", id);
-                ses->outgoingQoS2MessageIds.insert(id);
+                ses->getQoSState().outgoingQoS2MessageIds.insert(id);
             }
 
+            // Without anything in transit, the session stays compact and the packet ids can start over.
             const uint16_t nextPacketId = readUint16(eofFound);
-            logger->logf(LOG_DEBUG, "Loaded next packetid %d.", ses->nextPacketId);
-            ses->nextPacketId = nextPacketId;
+            logger->logf(LOG_DEBUG, "Loaded next packetid %d.", nextPacketId);
+            if (ses->qosState)
+                ses->qosState->nextPacketId = nextPacketId;
 
             const uint32_t originalSessionExpiryInterval = readUint32(eofFound);
             const uint32_t compensatedSessionExpiry = persistence_state_age > originalSessionExpiryInterval ? 0 : originalSessionExpiryInterval - persistence_state_age;
@@ -260,11 +262,14 @@ void SessionsAndSubscriptionsDB::saveData(const std::vector<std::unique_ptr<Sess
         writeUint32(ses->client_id.length());
         writeCheck(ses->client_id.c_str(), 1, ses->client_id.length(), f);
 
-        const size_t qosPacketsExpected = ses->qosPacketQueue.size();
+        // Copies of sessions always have a QoS state.
+        SessionQoSState &qos = ses->getQoSState();
+
+        const size_t qosPacketsExpected = qos.qosPacketQueue.size();
         size_t qosPacketsCounted = 0;
         writeUint32(qosPacketsExpected);
 
-        for (QueuedPublish &p: ses->qosPacketQueue)
+        for (QueuedPublish &p: qos.qosPacketQueue)
         {
             qosPacketsCounted++;
 
@@ -294,22 +299,22 @@ void SessionsAndSubscriptionsDB::saveData(const std::vector<std::unique_ptr<Sess
 
         assert(qosPacketsExpected == qosPacketsCounted);
 
-        writeUint32(ses->incomingQoS2MessageIds.size());
-        for (uint16_t id : ses->incomingQoS2MessageIds)
+        writeUint32(qos.incomingQoS2MessageIds.size());
+        for (uint16_t id : qos.incomingQoS2MessageIds)
         {
             logger->logf(LOG_DEBUG, "Writing incomming QoS2 message id %d.", id);
             writeUint16(id);
         }
 
-        writeUint32(ses->outgoingQoS2MessageIds.size());
-        for (uint16_t id : ses->outgoingQoS2MessageIds)
+        writeUint32(qos.outgoingQoS2MessageIds.size());
+        for (uint16_t id : qos.outgoingQoS2MessageIds)
         {
             logger->logf(LOG_DEBUG, "Writing outgoing QoS2 message id %d.", id);
             writeUint16(id);
         }
 
-        logger->logf(LOG_DEBUG, "Writing next packetid %d.", ses->nextPacketId);
-        writeUint16(ses->nextPacketId);
+        logger->logf(LOG_DEBUG, "Writing next packetid %d.", qos.nextPacketId);
+        writeUint16(qos.nextPacketId);
 
         writeUint32(ses->getCurrentSessionExpiryInterval());
 
@@ -46,6 +46,19 @@ std::string Settings::getSessionsDBFile() const
     return path;
 }
 
+/**
+ * @brief Settings::getQoSSpillFileTemplate gives a template for mkstemp() for sessions spilling their QoS queue to disk.
+ * @return
+ */
+std::string Settings::getQoSSpillFileTemplate() const
+{
+    if (storageDir.empty())
+        return "";
+
+    std::string path = formatString("%s/%s", storageDir.c_str(), "qosspill.XXXXXX");
+    return path;
+}
+
 /**
  * @brief because 0 means 'forever', we have to translate this.
  * @return
@@ -20,12 +20,34 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 
 #include <memory>
 #include <list>
+#include <vector>
 
 #include "mosquittoauthoptcompatwrap.h"
 #include "listener.h"
+#include "bridgeconfig.h"
 
 #define ABSOLUTE_MAX_PACKET_SIZE 268435461 // 256 MB + 5
 
+/**
+ * @brief What to do with publishes for a client that doesn't keep up, meaning its write buffer or QoS queue hit their limits.
+ */
+enum class SlowConsumerPolicy
+{
+    DropNewest,
+    DropOldest,
+    Disconnect,
+    SpillToDisk
+};
+
+/**
+ * @brief Whether the worker threads share one subscription store, or each has its own with the sessions of its clients.
+ */
+enum class ThreadModel
+{
+    Shared,
+    Sharded
+};
+
 class Settings
 {
     friend class ConfigFileParser;
@@ -62,13 +84,37 @@ public:
     int threadCount = 0;
     uint16_t maxQosMsgPendingPerClient = 512;
     uint maxQosBytesPendingPerClient = 65536;
+    uint32_t clientWriteBufferWatermark = 0; // 0 means the write buffer can grow to a thousand times the packet size.
+    SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::DropNewest;
+    bool publisherBackpressure = false;
+    uint32_t clientReadBudgetBytes = 0; // Per client, per turn of the thread loop. 0 means unlimited.
+    uint32_t clientReadBudgetPackets = 0;
+    uint32_t sharedPayloadThreshold = 65536; // Publish payloads this size or bigger aren't copied into each subscriber's write buffer. 0 disables.
+    bool zeroCopySends = false;
+    std::string handoverSocket; // Unix socket a newly started instance uses to take over listeners and clients.
+    std::vector<int> workerCpus; // Worker thread N is pinned to the Nth CPU in the list. Empty means thread N on CPU N.
+    std::vector<int> timerCpus;
+    std::vector<int> loggerCpus;
+    std::vector<int> saveStateCpus;
+    bool numaLocalClients = false;
+    bool steerByIncomingCpu = false;
+    uint32_t busyPollMicroseconds = 0; // How long a worker keeps polling without events before it blocks again. 0 disables.
+    uint32_t parallelFanOutThreshold = 10000; // Publishes with this many receivers are written by the threads of the receivers. 0 disables.
+    ThreadModel threadModel = ThreadModel::Shared; // Only read at startup.
+    std::string clusterNodeName; // Setting it turns on cluster mode.
+    std::string clusterSecret; // Nodes only link when they know the same one.
+    std::string clusterBindAddress = "127.0.0.1";
+    int clusterPort = 0; // 0 means other nodes can't connect to this one, only the other way around.
+    std::vector<std::string> clusterPeers; // host:port of other nodes.
     std::list<std::shared_ptr<Listener>> listeners; // Default one is created later, when none are defined.
+    std::list<std::shared_ptr<BridgeConfig>> bridges;
 
     AuthOptCompatWrap &getAuthOptsCompat();
     std::unordered_map<std::string, std::string> &getFlashmqAuthPluginOpts();
 
     std::string getRetainedMessagesDBFile() const;
     std::string getSessionsDBFile() const;
+    std::string getQoSSpillFileTemplate() const;
 
     uint32_t getExpireSessionAfterSeconds() const;
 };
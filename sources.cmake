@@ -0,0 +1,107 @@
+# The server's sources, except main.cpp. Included by the main build and by the benchmarks in FlashMQBench, which have
+# their own main.
+set(FLASHMQ_SOURCES
+    ${CMAKE_CURRENT_LIST_DIR}/forward_declarations.h
+    ${CMAKE_CURRENT_LIST_DIR}/mainapp.h
+    ${CMAKE_CURRENT_LIST_DIR}/utils.h
+    ${CMAKE_CURRENT_LIST_DIR}/threaddata.h
+    ${CMAKE_CURRENT_LIST_DIR}/client.h
+    ${CMAKE_CURRENT_LIST_DIR}/session.h
+    ${CMAKE_CURRENT_LIST_DIR}/mqttpacket.h
+    ${CMAKE_CURRENT_LIST_DIR}/exceptions.h
+    ${CMAKE_CURRENT_LIST_DIR}/types.h
+    ${CMAKE_CURRENT_LIST_DIR}/subscriptionstore.h
+    ${CMAKE_CURRENT_LIST_DIR}/rwlockguard.h
+    ${CMAKE_CURRENT_LIST_DIR}/retainedmessage.h
+    ${CMAKE_CURRENT_LIST_DIR}/cirbuf.h
+    ${CMAKE_CURRENT_LIST_DIR}/logger.h
+    ${CMAKE_CURRENT_LIST_DIR}/authplugin.h
+    ${CMAKE_CURRENT_LIST_DIR}/configfileparser.h
+    ${CMAKE_CURRENT_LIST_DIR}/sslctxmanager.h
+    ${CMAKE_CURRENT_LIST_DIR}/timer.h
+    ${CMAKE_CURRENT_LIST_DIR}/iowrapper.h
+    ${CMAKE_CURRENT_LIST_DIR}/mosquittoauthoptcompatwrap.h
+    ${CMAKE_CURRENT_LIST_DIR}/settings.h
+    ${CMAKE_CURRENT_LIST_DIR}/listener.h
+    ${CMAKE_CURRENT_LIST_DIR}/unscopedlock.h
+    ${CMAKE_CURRENT_LIST_DIR}/scopedsocket.h
+    ${CMAKE_CURRENT_LIST_DIR}/bindaddr.h
+    ${CMAKE_CURRENT_LIST_DIR}/oneinstancelock.h
+    ${CMAKE_CURRENT_LIST_DIR}/evpencodectxmanager.h
+    ${CMAKE_CURRENT_LIST_DIR}/acltree.h
+    ${CMAKE_CURRENT_LIST_DIR}/enums.h
+    ${CMAKE_CURRENT_LIST_DIR}/threadlocalutils.h
+    ${CMAKE_CURRENT_LIST_DIR}/flashmq_plugin.h
+    ${CMAKE_CURRENT_LIST_DIR}/retainedmessagesdb.h
+    ${CMAKE_CURRENT_LIST_DIR}/persistencefile.h
+    ${CMAKE_CURRENT_LIST_DIR}/sessionsandsubscriptionsdb.h
+    ${CMAKE_CURRENT_LIST_DIR}/qospacketqueue.h
+    ${CMAKE_CURRENT_LIST_DIR}/qosspillfile.h
+    ${CMAKE_CURRENT_LIST_DIR}/zerocopypins.h
+    ${CMAKE_CURRENT_LIST_DIR}/handover.h
+    ${CMAKE_CURRENT_LIST_DIR}/cluster.h
+    ${CMAKE_CURRENT_LIST_DIR}/threadshards.h
+    ${CMAKE_CURRENT_LIST_DIR}/spscqueue.h
+    ${CMAKE_CURRENT_LIST_DIR}/bridgeconfig.h
+    ${CMAKE_CURRENT_LIST_DIR}/bridge.h
+    ${CMAKE_CURRENT_LIST_DIR}/replay.h
+    ${CMAKE_CURRENT_LIST_DIR}/threadglobals.h
+    ${CMAKE_CURRENT_LIST_DIR}/threadloop.h
+    ${CMAKE_CURRENT_LIST_DIR}/publishcopyfactory.h
+    ${CMAKE_CURRENT_LIST_DIR}/packetwriter.h
+    ${CMAKE_CURRENT_LIST_DIR}/variablebyteint.h
+    ${CMAKE_CURRENT_LIST_DIR}/mqtt5properties.h
+    ${CMAKE_CURRENT_LIST_DIR}/globalstats.h
+    ${CMAKE_CURRENT_LIST_DIR}/derivablecounter.h
+    ${CMAKE_CURRENT_LIST_DIR}/packetdatatypes.h
+
+    ${CMAKE_CURRENT_LIST_DIR}/mainapp.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/utils.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/threaddata.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/client.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/session.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/mqttpacket.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/exceptions.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/types.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/subscriptionstore.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/rwlockguard.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/retainedmessage.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/cirbuf.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/logger.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/authplugin.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/configfileparser.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/sslctxmanager.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/timer.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/iowrapper.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/mosquittoauthoptcompatwrap.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/settings.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/listener.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/unscopedlock.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/scopedsocket.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/bindaddr.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/oneinstancelock.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/evpencodectxmanager.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/acltree.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/threadlocalutils.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/flashmq_plugin.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/retainedmessagesdb.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/persistencefile.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/sessionsandsubscriptionsdb.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/qospacketqueue.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/qosspillfile.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/zerocopypins.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/handover.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/cluster.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/threadshards.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/bridgeconfig.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/bridge.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/replay.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/threadglobals.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/threadloop.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/publishcopyfactory.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/variablebyteint.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/mqtt5properties.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/globalstats.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/derivablecounter.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/packetdatatypes.cpp
+    )
@@ -0,0 +1,84 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+/**
+ * @brief The SpscQueue class is an unbounded lock-free queue for exactly one producing and one consuming thread.
+ *
+ * It's a linked list that always has a dummy node at the head. The producer only touches the tail and the consumer only the head,
+ * so the only thing they share is the 'next' pointer of the last node.
+ */
+template<typename T>
+class SpscQueue
+{
+    struct Node
+    {
+        std::atomic<Node*> next{nullptr};
+        T value;
+    };
+
+    alignas(64) Node *head = nullptr;
+    alignas(64) Node *tail = nullptr;
+
+public:
+    SpscQueue()
+    {
+        head = new Node();
+        tail = head;
+    }
+
+    SpscQueue(const SpscQueue &other) = delete;
+    SpscQueue(SpscQueue &&other) = delete;
+
+    ~SpscQueue()
+    {
+        while (head)
+        {
+            Node *next = head->next.load(std::memory_order_relaxed);
+            delete head;
+            head = next;
+        }
+    }
+
+    void push(T &&value)
+    {
+        Node *node = new Node();
+        node->value = std::move(value);
+        tail->next.store(node, std::memory_order_release);
+        tail = node;
+    }
+
+    bool pop(T &value)
+    {
+        Node *next = head->next.load(std::memory_order_acquire);
+
+        if (!next)
+            return false;
+
+        value = std::move(next->value);
+        delete head;
+        head = next;
+        return true;
+    }
+};
+
+#endif // SPSCQUEUE_H
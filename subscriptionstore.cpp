@@ -23,6 +23,10 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "retainedmessagesdb.h"
 #include "publishcopyfactory.h"
 #include "threadglobals.h"
+#include "cluster.h"
+#include "bridge.h"
+#include "threaddata.h"
+#include "threadshards.h"
 
 ReceivingSubscriber::ReceivingSubscriber(const std::shared_ptr<Session> &ses, char qos) :
     session(ses),
@@ -31,6 +35,14 @@ ReceivingSubscriber::ReceivingSubscriber(const std::shared_ptr<Session> &ses, ch
 
 }
 
+SubscriptionForAdding::SubscriptionForAdding(std::string &&topic, std::vector<std::string> &&subtopics, char qos) :
+    topic(std::move(topic)),
+    subtopics(std::move(subtopics)),
+    qos(qos)
+{
+
+}
+
 SubscriptionNode::SubscriptionNode(const std::string &subtopic) :
     subtopic(subtopic)
 {
@@ -94,16 +106,64 @@ SubscriptionStore::SubscriptionStore() :
 
 }
 
+/**
+ * @brief SubscriptionStore::setCluster makes publishes, retained messages and new subscriptions go to other cluster nodes as well.
+ */
+void SubscriptionStore::setCluster(const std::shared_ptr<ClusterNode> &cluster)
+{
+    this->cluster = cluster;
+}
+
+/**
+ * @brief SubscriptionStore::addBridge makes publishes matching the topics of the bridge go to its upstream server. Only for at startup.
+ */
+void SubscriptionStore::addBridge(const std::shared_ptr<Bridge> &bridge)
+{
+    this->bridges.push_back(bridge);
+}
+
+/**
+ * @brief SubscriptionStore::setShard makes this the store of one worker thread, in the sharded thread model. Only for at startup.
+ * @param retainedStore has the retained messages, for all threads.
+ */
+void SubscriptionStore::setShard(const std::shared_ptr<ThreadShards> &shards, size_t shardIndex, const std::shared_ptr<SubscriptionStore> &retainedStore)
+{
+    this->shards = shards;
+    this->shardIndex = shardIndex;
+    this->retainedStore = retainedStore;
+}
+
+/**
+ * @brief SubscriptionStore::isExactFilter says whether the filter goes in the exact subscriptions, instead of the tree.
+ *
+ * Filters are validated on subscribe, so a '+' or '#' is always a wildcard.
+ */
+bool SubscriptionStore::isExactFilter(const std::string &topic)
+{
+    if (topic.length() > 0 && topic[0] == '$')
+        return false;
+
+    return topic.find_first_of("+#") == std::string::npos;
+}
+
 /**
  * @brief SubscriptionStore::getDeepestNode gets the node in the tree walking the path of 'the/subscription/topic/path', making new nodes as required.
  * @param topic
  * @param subtopics
  * @return
  *
- * caller is responsible for locking.
+ * Filters without wildcards get their node from the exact subscriptions instead. caller is responsible for locking.
  */
 SubscriptionNode *SubscriptionStore::getDeepestNode(const std::string &topic, const std::vector<std::string> &subtopics)
 {
+    if (isExactFilter(topic))
+    {
+        std::unique_ptr<SubscriptionNode> &node = exactSubscriptions[topic];
+        if (!node)
+            node = std::make_unique<SubscriptionNode>(topic);
+        return node.get();
+    }
+
     SubscriptionNode *deepestNode = &root;
     if (topic.length() > 0 && topic[0] == '$')
         deepestNode = &rootDollar;
@@ -144,16 +204,89 @@ void SubscriptionStore::addSubscription(std::shared_ptr<Client> &client, const s
         auto session_it = sessionsByIdConst.find(client->getClientId());
         if (session_it != sessionsByIdConst.end())
         {
-            const std::shared_ptr<Session> &ses = session_it->second;
+            const std::shared_ptr<Session> ses = session_it->second;
             deepestNode->addSubscriber(ses, qos);
+
+            // Under the lock, because the client may be in another thread than the one that rebuilds it.
+            if (shards)
+                shards->getInterest(shardIndex).add(topic);
+
             lock_guard.unlock();
+
+            if (cluster)
+                cluster->subscriptionAdded(topic);
+
             giveClientRetainedMessages(ses, subtopics, qos);
         }
     }
 }
 
+/**
+ * @brief SubscriptionStore::addSubscriptions adds all topic filters of a subscribe at once, with one lock and session lookup.
+ *
+ * Clients like gateways subscribe to thousands of filters in one packet. Retained messages matching several of the filters are
+ * only given once.
+ */
+void SubscriptionStore::addSubscriptions(std::shared_ptr<Client> &client, const std::vector<SubscriptionForAdding> &subscriptions, bool giveRetainedMessages)
+{
+    if (subscriptions.empty())
+        return;
+
+    RWLockGuard lock_guard(&subscriptionsRwlock);
+    lock_guard.wrlock();
+
+    auto session_it = sessionsByIdConst.find(client->getClientId());
+    if (session_it == sessionsByIdConst.end())
+        return;
+
+    const std::shared_ptr<Session> ses = session_it->second;
+
+    for (const SubscriptionForAdding &sub : subscriptions)
+    {
+        SubscriptionNode *deepestNode = getDeepestNode(sub.topic, sub.subtopics);
+        deepestNode->addSubscriber(ses, sub.qos);
+    }
+
+    if (shards)
+    {
+        ShardInterest &interest = shards->getInterest(shardIndex);
+        for (const SubscriptionForAdding &sub : subscriptions)
+            interest.add(sub.topic);
+    }
+
+    lock_guard.unlock();
+
+    if (cluster)
+    {
+        std::vector<std::string> topics;
+        topics.reserve(subscriptions.size());
+        for (const SubscriptionForAdding &sub : subscriptions)
+            topics.push_back(sub.topic);
+        cluster->subscriptionsAdded(topics);
+    }
+
+    if (giveRetainedMessages)
+        giveClientRetainedMessages(ses, subscriptions);
+}
+
 void SubscriptionStore::removeSubscription(std::shared_ptr<Client> &client, const std::string &topic)
 {
+    if (isExactFilter(topic))
+    {
+        RWLockGuard lock_guard(&subscriptionsRwlock);
+        lock_guard.wrlock();
+
+        auto node_it = exactSubscriptions.find(topic);
+        auto session_it = sessionsByIdConst.find(client->getClientId());
+        if (node_it == exactSubscriptions.end() || session_it == sessionsByIdConst.end())
+            return;
+
+        node_it->second->removeSubscriber(session_it->second);
+        if (node_it->second->getSubscribers().empty())
+            exactSubscriptions.erase(node_it);
+        return;
+    }
+
     const std::list<std::string> subtopics = split(topic, '/');
 
     SubscriptionNode *deepestNode = &root;
@@ -227,12 +360,34 @@ void SubscriptionStore::registerClientAndKickExistingOne(std::shared_ptr<Client>
 {
     ThreadGlobals::getThreadData()->queueClientNextKeepAliveCheckLocked(client, true);
 
-    RWLockGuard lock_guard(&subscriptionsRwlock);
-    lock_guard.wrlock();
-
     if (client->getClientId().empty())
         throw ProtocolError("Trying to store client without an ID.", ReasonCodes::ProtocolError);
 
+    if (cluster)
+        cluster->takeOverSessionFromOtherNodes(client->getClientId(), !clean_start);
+
+    // In the sharded thread model, the session may be in the store of another thread.
+    if (shards)
+    {
+        shards->registerClient(shardIndex, client, clean_start, clientReceiveMax, sessionExpiryInterval);
+        return;
+    }
+
+    registerClientLocally(client, clean_start, clientReceiveMax, sessionExpiryInterval);
+}
+
+/**
+ * @brief SubscriptionStore::registerClientLocally gives the client the session with its id in this store, kicking the client that has it.
+ */
+void SubscriptionStore::registerClientLocally(std::shared_ptr<Client> &client, bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval)
+{
+    // Declared before the lock, because when its own thread already let go of it, the client is destroyed when this reference goes, and
+    // the destructor needs the lock too.
+    std::shared_ptr<Client> cl;
+
+    RWLockGuard lock_guard(&subscriptionsRwlock);
+    lock_guard.wrlock();
+
     std::shared_ptr<Session> session;
     auto session_it = sessionsById.find(client->getClientId());
     if (session_it != sessionsById.end())
@@ -241,7 +396,7 @@ void SubscriptionStore::registerClientAndKickExistingOne(std::shared_ptr<Client>
 
         if (session)
         {
-            std::shared_ptr<Client> cl = session->makeSharedClient();
+            cl = session->makeSharedClient();
 
             if (cl)
             {
@@ -266,6 +421,42 @@ void SubscriptionStore::registerClientAndKickExistingOne(std::shared_ptr<Client>
     session->sendAllPendingQosData();
 }
 
+/**
+ * @brief SubscriptionStore::registerHandedOverClient attaches a connection handed over by the previous process to its loaded session.
+ *
+ * Unlike for a connecting client, a clean start doesn't give a new session, because it's the same connection. Pending QoS messages
+ * are not retransmitted; the client has seen them already, or they are in the write buffer that came with the connection.
+ */
+void SubscriptionStore::registerHandedOverClient(std::shared_ptr<Client> &client)
+{
+    const std::unique_ptr<StowedClientRegistrationData> &registrationData = client->getRegistrationData();
+    assert(registrationData);
+
+    ThreadGlobals::getThreadData()->queueClientNextKeepAliveCheckLocked(client, true);
+
+    // Its session was loaded in this thread, or is made here.
+    if (shards)
+        shards->setSessionShard(client->getClientId(), shardIndex);
+
+    RWLockGuard lock_guard(&subscriptionsRwlock);
+    lock_guard.wrlock();
+
+    std::shared_ptr<Session> &session = sessionsById[client->getClientId()];
+
+    if (!session)
+    {
+        logger->logf(LOG_WARNING, "No saved session found for handed over client '%s'. Its subscriptions are lost.", client->getClientId().c_str());
+        session = std::make_shared<Session>();
+    }
+
+    session->assignActiveConnection(client);
+    client->assignSession(session);
+    session->setSessionProperties(registrationData->clientReceiveMax, registrationData->sessionExpiryInterval, registrationData->clean_start,
+                                  client->getProtocolVersion());
+    session->takeInFlightFromFlowControlQuota();
+    client->clearRegistrationData();
+}
+
 /**
  * @brief SubscriptionStore::lockSession returns the session if it exists. Returning is done keep the shared pointer active, to
  * avoid race conditions with session removal.
@@ -353,6 +544,17 @@ void SubscriptionStore::queueWillMessage(const std::shared_ptr<WillPublish> &wil
         return;
 
     const int delay = forceNow ? 0 : willMessage->will_delay;
+
+    // Clients can be destroyed in any thread, but in the sharded thread model, only the thread of the store may publish from it.
+    if (delay == 0 && shards && !shards->inThreadOf(shardIndex))
+    {
+        if (session)
+            session->clearWill();
+
+        shards->getThread(shardIndex)->queueWillMessage(willMessage, session);
+        return;
+    }
+
     logger->logf(LOG_DEBUG, "Queueing will on topic '%s', with delay %d seconds.", willMessage->topic.c_str(), delay );
 
     if (delay == 0)
@@ -446,6 +648,30 @@ void SubscriptionStore::publishRecursively(std::vector<std::string>::const_itera
 }
 
 void SubscriptionStore::queuePacketAtSubscribers(PublishCopyFactory &copyFactory, bool dollar)
+{
+    if (!dollar)
+    {
+        for (const std::shared_ptr<Bridge> &bridge : bridges)
+        {
+            if (bridge->matches(copyFactory.getSubtopics()))
+                bridge->forward(copyFactory);
+        }
+
+        if (cluster)
+            cluster->forwardPublish(copyFactory);
+    }
+
+    if (shards)
+        shards->forwardPublish(shardIndex, copyFactory, dollar);
+
+    queuePacketAtLocalSubscribers(copyFactory, dollar);
+}
+
+/**
+ * @brief SubscriptionStore::queuePacketAtLocalSubscribers gives the publish to the subscribers on this server only. That's what's done with
+ * publishes from other cluster nodes. In the sharded thread model, it's only the subscribers in this store's thread.
+ */
+void SubscriptionStore::queuePacketAtLocalSubscribers(PublishCopyFactory &copyFactory, bool dollar)
 {
     SubscriptionNode *startNode = dollar ? &rootDollar : &root;
 
@@ -455,36 +681,151 @@ void SubscriptionStore::queuePacketAtSubscribers(PublishCopyFactory &copyFactory
         const std::vector<std::string> &subtopics = copyFactory.getSubtopics();
         RWLockGuard lock_guard(&subscriptionsRwlock);
         lock_guard.rdlock();
+
+        if (!dollar && !exactSubscriptions.empty())
+        {
+            auto exact_it = exactSubscriptions.find(copyFactory.getTopic());
+            if (exact_it != exactSubscriptions.end())
+                publishNonRecursively(exact_it->second->getSubscribers(), subscriberSessions);
+        }
+
         publishRecursively(subtopics.begin(), subtopics.end(), startNode, subscriberSessions);
     }
 
+    // Sharded stores only have subscribers in their own thread.
+    if (!shards && shouldFanOutInParallel(subscriberSessions))
+    {
+        fanOutInParallel(copyFactory, subscriberSessions);
+        return;
+    }
+
     for(const ReceivingSubscriber &x : subscriberSessions)
     {
         x.session->writePacket(copyFactory, x.qos);
     }
 }
 
+/**
+ * @brief SubscriptionStore::shouldFanOutInParallel says whether the receivers are enough to have the threads they live in write to them.
+ *
+ * When this thread still has fan-outs in progress elsewhere, all its publishes go that way, so receivers get them in order.
+ */
+bool SubscriptionStore::shouldFanOutInParallel(const std::forward_list<ReceivingSubscriber> &subscriberSessions)
+{
+    const ThreadData *ownThread = ThreadGlobals::getThreadData();
+    const Settings *settings = ThreadGlobals::getSettings();
+
+    if (!ownThread || !settings || settings->parallelFanOutThreshold == 0)
+        return false;
+
+    if (ownThread->fanOutsPending > 0)
+        return true;
+
+    uint32_t count = 0;
+    for (auto it = subscriberSessions.begin(); it != subscriberSessions.end(); it++)
+    {
+        if (++count >= settings->parallelFanOutThreshold)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief SubscriptionStore::fanOutInParallel gives each thread a task to write the publish to the receivers living in it. This thread does
+ * its own receivers, and the ones without a connection, unless their last thread still has fan-outs of this thread to do.
+ *
+ * The other threads get a copy of the publish, because the packet is this thread's. Publishers aren't paused for backpressure by
+ * receivers in other threads, because that can only be done from their own thread.
+ */
+void SubscriptionStore::fanOutInParallel(PublishCopyFactory &copyFactory, const std::forward_list<ReceivingSubscriber> &subscriberSessions)
+{
+    ThreadData *ownThread = ThreadGlobals::getThreadData();
+    assert(ownThread);
+
+    std::unordered_map<ThreadData*, std::pair<std::shared_ptr<ThreadData>, std::shared_ptr<std::vector<ReceivingSubscriber>>>> receiversPerThread;
+    std::vector<const ReceivingSubscriber*> ownReceivers;
+
+    // Earlier publishes may still be on their way to receivers that have disconnected since, in the fan-out of the thread they were in.
+    const std::unordered_set<const ThreadData*> threadsWithFanOutsPending = ownThread->getThreadsWithFanOutsPending();
+
+    for (const ReceivingSubscriber &x : subscriberSessions)
+    {
+        std::shared_ptr<Client> c = x.session->makeSharedClient();
+        std::shared_ptr<ThreadData> td = c ? c->lockThreadData() : std::shared_ptr<ThreadData>();
+
+        if (!td && !threadsWithFanOutsPending.empty())
+        {
+            td = x.session->getLastThread();
+
+            if (td && threadsWithFanOutsPending.find(td.get()) == threadsWithFanOutsPending.end())
+                td.reset();
+        }
+
+        if (!td || td.get() == ownThread)
+        {
+            ownReceivers.push_back(&x);
+            continue;
+        }
+
+        auto &threadReceivers = receiversPerThread[td.get()];
+        if (!threadReceivers.first)
+        {
+            threadReceivers.first = td;
+            threadReceivers.second = std::make_shared<std::vector<ReceivingSubscriber>>();
+        }
+        threadReceivers.second->push_back(x);
+    }
+
+    if (!receiversPerThread.empty())
+    {
+        std::shared_ptr<Publish> publish = std::make_shared<Publish>(copyFactory.getPublishData());
+        publish->retain = copyFactory.getRetain();
+        if (publish->subtopics.empty())
+            splitTopic(publish->topic, publish->subtopics);
+
+        const std::shared_ptr<ThreadData> origin = ownThread->shared_from_this();
+
+        for (auto &pair : receiversPerThread)
+        {
+            pair.second.first->queueFanOut(publish, pair.second.second, origin);
+        }
+    }
+
+    for (const ReceivingSubscriber *x : ownReceivers)
+    {
+        x->session->writePacket(copyFactory, x->qos);
+    }
+}
+
+/**
+ * @brief SubscriptionStore::giveClientRetainedMessagesRecursively collects the retained messages matching the subscription. Call with the read
+ * lock of the shard.
+ * @param nodesWithExpired gets the nodes that have expired messages, which can't be removed with only a read lock.
+ */
 void SubscriptionStore::giveClientRetainedMessagesRecursively(std::vector<std::string>::const_iterator cur_subtopic_it,
                                                               std::vector<std::string>::const_iterator end, RetainedMessageNode *this_node,
-                                                              bool poundMode, std::forward_list<Publish> &packetList) const
+                                                              bool poundMode, std::forward_list<Publish> &packetList,
+                                                              std::vector<RetainedMessageNode*> &nodesWithExpired)
 {
     if (cur_subtopic_it == end)
     {
-        auto pos = this_node->retainedMessages.begin();
-        while (pos != this_node->retainedMessages.end())
+        bool expiredFound = false;
+        for (const RetainedMessage &rm : this_node->retainedMessages)
         {
-            auto cur = pos++;
-            if (cur->publish.hasExpired())
-                this_node->retainedMessages.erase(cur);
+            if (rm.publish.hasExpired())
+                expiredFound = true;
             else
-                packetList.emplace_front(cur->publish); // TODO: hmm, const stuff forces me/it to make copy
+                packetList.emplace_front(rm.publish); // TODO: hmm, const stuff forces me/it to make copy
         }
+        if (expiredFound)
+            nodesWithExpired.push_back(this_node);
         if (poundMode)
         {
             for (auto &pair : this_node->children)
             {
                 std::unique_ptr<RetainedMessageNode> &child = pair.second;
-                giveClientRetainedMessagesRecursively(cur_subtopic_it, end, child.get(), poundMode, packetList);
+                giveClientRetainedMessagesRecursively(cur_subtopic_it, end, child.get(), poundMode, packetList, nodesWithExpired);
             }
         }
 
@@ -501,7 +842,7 @@ void SubscriptionStore::giveClientRetainedMessagesRecursively(std::vector<std::s
         {
             std::unique_ptr<RetainedMessageNode> &child = pair.second;
             if (child) // I don't think it can ever be unset, but I'd rather avoid a crash.
-                giveClientRetainedMessagesRecursively(next_subtopic, end, child.get(), poundFound, packetList);
+                giveClientRetainedMessagesRecursively(next_subtopic, end, child.get(), poundFound, packetList, nodesWithExpired);
         }
     }
     else
@@ -510,85 +851,294 @@ void SubscriptionStore::giveClientRetainedMessagesRecursively(std::vector<std::s
 
         if (children)
         {
-            giveClientRetainedMessagesRecursively(next_subtopic, end, children, false, packetList);
+            giveClientRetainedMessagesRecursively(next_subtopic, end, children, false, packetList, nodesWithExpired);
         }
     }
 }
 
-void SubscriptionStore::giveClientRetainedMessages(const std::shared_ptr<Session> &ses,
-                                                   const std::vector<std::string> &subscribeSubtopics, char max_qos)
+void SubscriptionStore::giveClientRetainedMessagesFromShard(RetainedMessagesShard *shard, std::vector<std::string>::const_iterator cur_subtopic_it,
+                                                            std::vector<std::string>::const_iterator end, bool poundMode, std::forward_list<Publish> &packetList)
 {
-    RetainedMessageNode *startNode = &retainedMessagesRoot;
-    if (!subscribeSubtopics.empty() && !subscribeSubtopics[0].empty() > 0 && subscribeSubtopics[0][0] == '$')
-        startNode = &retainedMessagesRootDollar;
-
-    std::forward_list<Publish> packetList;
+    std::vector<RetainedMessageNode*> nodesWithExpired;
 
     {
-        RWLockGuard locker(&retainedMessagesRwlock);
+        RWLockGuard locker(&shard->rwlock);
         locker.rdlock();
-        giveClientRetainedMessagesRecursively(subscribeSubtopics.begin(), subscribeSubtopics.end(), startNode, false, packetList);
+        giveClientRetainedMessagesRecursively(cur_subtopic_it, end, &shard->node, poundMode, packetList, nodesWithExpired);
     }
 
-    for(Publish &publish : packetList)
+    removeExpiredRetainedMessages(shard, nodesWithExpired);
+}
+
+void SubscriptionStore::removeExpiredRetainedMessages(RetainedMessagesShard *shard, const std::vector<RetainedMessageNode*> &nodesWithExpired)
+{
+    if (nodesWithExpired.empty())
+        return;
+
+    // Nodes are never removed, so they're still there.
+    RWLockGuard locker(&shard->rwlock);
+    locker.wrlock();
+    for (RetainedMessageNode *node : nodesWithExpired)
     {
-        PublishCopyFactory copyFactory(&publish);
-        ses->writePacket(copyFactory, max_qos);
+        node->removeExpired(retainedMessageCount);
     }
 }
 
-void SubscriptionStore::setRetainedMessage(const Publish &publish, const std::vector<std::string> &subtopics)
+/**
+ * @brief SubscriptionStore::getRetainedMessagesShard gets the shard for topics starting with the subtopic.
+ * @param create whether to create it when it doesn't exist.
+ * @return the shard, or nullptr when it doesn't exist and create is false.
+ */
+RetainedMessagesShard *SubscriptionStore::getRetainedMessagesShard(const std::string &firstSubtopic, bool create)
 {
-    assert(!subtopics.empty());
+    {
+        RWLockGuard locker(&retainedMessagesRwlock);
+        locker.rdlock();
+
+        auto pos = retainedMessageShards.find(firstSubtopic);
+        if (pos != retainedMessageShards.end())
+            return pos->second.get();
+    }
 
-    RetainedMessageNode *deepestNode = &retainedMessagesRoot;
-    if (!subtopics.empty() && !subtopics[0].empty() > 0 && subtopics[0][0] == '$')
-        deepestNode = &retainedMessagesRootDollar;
+    if (!create)
+        return nullptr;
 
     RWLockGuard locker(&retainedMessagesRwlock);
     locker.wrlock();
 
-    for(const std::string &subtopic : subtopics)
-    {
-        std::unique_ptr<RetainedMessageNode> &selectedChildren = deepestNode->children[subtopic];
+    std::unique_ptr<RetainedMessagesShard> &shard = retainedMessageShards[firstSubtopic];
+    if (!shard)
+        shard = std::make_unique<RetainedMessagesShard>();
+    return shard.get();
+}
 
-        if (!selectedChildren)
-        {
-            selectedChildren = std::make_unique<RetainedMessageNode>();
-        }
-        deepestNode = selectedChildren.get();
-    }
+/**
+ * @brief SubscriptionStore::getRetainedMessagesShards gets the shards of topics that start with a '$', or of the ones that don't.
+ */
+std::vector<RetainedMessagesShard*> SubscriptionStore::getRetainedMessagesShards(bool dollar)
+{
+    std::vector<RetainedMessagesShard*> result;
 
-    assert(deepestNode);
+    RWLockGuard locker(&retainedMessagesRwlock);
+    locker.rdlock();
 
-    if (deepestNode)
+    result.reserve(retainedMessageShards.size());
+    for (auto &pair : retainedMessageShards)
     {
-        deepestNode->addPayload(publish, retainedMessageCount);
+        const std::string &firstSubtopic = pair.first;
+        const bool isDollar = !firstSubtopic.empty() && firstSubtopic[0] == '$';
+        if (isDollar == dollar)
+            result.push_back(pair.second.get());
     }
+
+    return result;
 }
 
-// Clean up the weak pointers to sessions and remove nodes that are empty.
-int SubscriptionNode::cleanSubscriptions()
+void SubscriptionStore::giveClientRetainedMessages(const std::shared_ptr<Session> &ses,
+                                                   const std::vector<std::string> &subscribeSubtopics, char max_qos)
 {
-    int subscribersLeftInChildren = 0;
-    auto childrenIt = children.begin();
-    while(childrenIt != children.end())
+    if (retainedStore)
     {
-        int n = childrenIt->second->cleanSubscriptions();
-        subscribersLeftInChildren += n;
+        retainedStore->giveClientRetainedMessages(ses, subscribeSubtopics, max_qos);
+        return;
+    }
 
-        if (n > 0)
-            childrenIt++;
-        else
+    if (subscribeSubtopics.empty())
+        return;
+
+    std::forward_list<Publish> packetList;
+
+    const std::string &firstSubtopic = subscribeSubtopics.front();
+    const auto next_subtopic = std::next(subscribeSubtopics.begin());
+    const bool poundFound = firstSubtopic == "#";
+
+    if (poundFound || firstSubtopic == "+")
+    {
+        // Wildcards don't match topics starting with a '$' [MQTT-4.7.2-1].
+        for (RetainedMessagesShard *shard : getRetainedMessagesShards(false))
         {
-            Logger::getInstance()->logf(LOG_DEBUG, "Removing orphaned subscriber node from %s", childrenIt->first.c_str());
-            childrenIt = children.erase(childrenIt);
+            giveClientRetainedMessagesFromShard(shard, next_subtopic, subscribeSubtopics.end(), poundFound, packetList);
         }
     }
+    else
+    {
+        RetainedMessagesShard *shard = getRetainedMessagesShard(firstSubtopic, false);
+        if (shard)
+            giveClientRetainedMessagesFromShard(shard, next_subtopic, subscribeSubtopics.end(), false, packetList);
+    }
 
-    std::list<std::unique_ptr<SubscriptionNode>*> wildcardChildren;
-    wildcardChildren.push_back(&childrenPlus);
-    wildcardChildren.push_back(&childrenPound);
+    for(Publish &publish : packetList)
+    {
+        PublishCopyFactory copyFactory(&publish);
+        ses->writePacket(copyFactory, max_qos);
+    }
+}
+
+/**
+ * @brief SubscriptionStore::giveClientRetainedMessages gives the retained messages of several filters, like the ones of one subscribe.
+ *
+ * The filters are grouped by shard, so each shard is locked once. A retained message matching several filters is given once, with the
+ * highest QoS of those filters.
+ */
+void SubscriptionStore::giveClientRetainedMessages(const std::shared_ptr<Session> &ses, const std::vector<SubscriptionForAdding> &subscriptions)
+{
+    if (retainedStore)
+    {
+        retainedStore->giveClientRetainedMessages(ses, subscriptions);
+        return;
+    }
+
+    if (subscriptions.size() == 1)
+    {
+        const SubscriptionForAdding &sub = subscriptions.front();
+        giveClientRetainedMessages(ses, sub.subtopics, sub.qos);
+        return;
+    }
+
+    std::unordered_map<RetainedMessagesShard*, std::vector<const SubscriptionForAdding*>> subscriptionsPerShard;
+    std::vector<RetainedMessagesShard*> nonDollarShards;
+    bool haveNonDollarShards = false;
+
+    for (const SubscriptionForAdding &sub : subscriptions)
+    {
+        if (sub.subtopics.empty())
+            continue;
+
+        const std::string &firstSubtopic = sub.subtopics.front();
+
+        if (firstSubtopic == "#" || firstSubtopic == "+")
+        {
+            if (!haveNonDollarShards)
+            {
+                nonDollarShards = getRetainedMessagesShards(false);
+                haveNonDollarShards = true;
+            }
+
+            // Wildcards don't match topics starting with a '$' [MQTT-4.7.2-1].
+            for (RetainedMessagesShard *shard : nonDollarShards)
+                subscriptionsPerShard[shard].push_back(&sub);
+        }
+        else
+        {
+            RetainedMessagesShard *shard = getRetainedMessagesShard(firstSubtopic, false);
+            if (shard)
+                subscriptionsPerShard[shard].push_back(&sub);
+        }
+    }
+
+    std::forward_list<Publish> packetList;
+    std::unordered_map<std::string, char> qosPerTopic;
+
+    for (auto &pair : subscriptionsPerShard)
+    {
+        RetainedMessagesShard *shard = pair.first;
+        std::vector<RetainedMessageNode*> nodesWithExpired;
+
+        {
+            RWLockGuard locker(&shard->rwlock);
+            locker.rdlock();
+
+            for (const SubscriptionForAdding *sub : pair.second)
+            {
+                std::forward_list<Publish> matching;
+                const bool poundFound = sub->subtopics.front() == "#";
+                giveClientRetainedMessagesRecursively(std::next(sub->subtopics.begin()), sub->subtopics.end(), &shard->node, poundFound,
+                                                      matching, nodesWithExpired);
+
+                matching.remove_if([&qosPerTopic, sub](const Publish &publish) {
+                    auto inserted = qosPerTopic.emplace(publish.topic, sub->qos);
+                    if (inserted.second)
+                        return false;
+                    inserted.first->second = std::max(inserted.first->second, sub->qos);
+                    return true;
+                });
+
+                packetList.splice_after(packetList.before_begin(), matching);
+            }
+        }
+
+        removeExpiredRetainedMessages(shard, nodesWithExpired);
+    }
+
+    for(Publish &publish : packetList)
+    {
+        PublishCopyFactory copyFactory(&publish);
+        ses->writePacket(copyFactory, qosPerTopic[publish.topic]);
+    }
+}
+
+void SubscriptionStore::setRetainedMessage(const Publish &publish, const std::vector<std::string> &subtopics)
+{
+    if (retainedStore)
+    {
+        retainedStore->setRetainedMessage(publish, subtopics);
+        return;
+    }
+
+    if (cluster && !publish.topic.empty() && publish.topic[0] != '$')
+        cluster->forwardRetainedMessage(publish);
+
+    setLocalRetainedMessage(publish, subtopics);
+}
+
+void SubscriptionStore::setLocalRetainedMessage(const Publish &publish, const std::vector<std::string> &subtopics)
+{
+    assert(!subtopics.empty());
+
+    if (subtopics.empty())
+        return;
+
+    // No need to make a shard to remove something from.
+    RetainedMessagesShard *shard = getRetainedMessagesShard(subtopics.front(), !publish.payload.empty());
+
+    if (!shard)
+        return;
+
+    RWLockGuard locker(&shard->rwlock);
+    locker.wrlock();
+
+    RetainedMessageNode *deepestNode = &shard->node;
+    for (auto it = std::next(subtopics.begin()); it != subtopics.end(); it++)
+    {
+        std::unique_ptr<RetainedMessageNode> &selectedChildren = deepestNode->children[*it];
+
+        if (!selectedChildren)
+        {
+            selectedChildren = std::make_unique<RetainedMessageNode>();
+        }
+        deepestNode = selectedChildren.get();
+    }
+
+    assert(deepestNode);
+
+    if (deepestNode)
+    {
+        deepestNode->addPayload(publish, retainedMessageCount);
+    }
+}
+
+// Clean up the weak pointers to sessions and remove nodes that are empty.
+int SubscriptionNode::cleanSubscriptions()
+{
+    int subscribersLeftInChildren = 0;
+    auto childrenIt = children.begin();
+    while(childrenIt != children.end())
+    {
+        int n = childrenIt->second->cleanSubscriptions();
+        subscribersLeftInChildren += n;
+
+        if (n > 0)
+            childrenIt++;
+        else
+        {
+            Logger::getInstance()->logf(LOG_DEBUG, "Removing orphaned subscriber node from %s", childrenIt->first.c_str());
+            childrenIt = children.erase(childrenIt);
+        }
+    }
+
+    std::list<std::unique_ptr<SubscriptionNode>*> wildcardChildren;
+    wildcardChildren.push_back(&childrenPlus);
+    wildcardChildren.push_back(&childrenPound);
 
     for (std::unique_ptr<SubscriptionNode> *node : wildcardChildren)
     {
@@ -637,11 +1187,74 @@ void SubscriptionStore::removeSession(const std::shared_ptr<Session> &session)
     RWLockGuard lock_guard(&subscriptionsRwlock);
     lock_guard.wrlock();
 
+    // When a client was taken over, its destructor may come after the new client registered a new session under the same id.
     auto session_it = sessionsById.find(clientid);
-    if (session_it != sessionsById.end())
+    if (session_it != sessionsById.end() && session_it->second == session)
     {
         sessionsById.erase(session_it);
     }
+
+    lock_guard.unlock();
+
+    if (shards)
+        shards->forgetSession(clientid, shardIndex);
+}
+
+/**
+ * @brief SubscriptionStore::releaseSession removes the session, because its client connected to another cluster node. Unlike
+ * removeSession(), it doesn't send the will; that's for when the client is disconnected.
+ * @return the session, or null when there is none.
+ */
+std::shared_ptr<Session> SubscriptionStore::releaseSession(const std::string &clientid)
+{
+    RWLockGuard lock_guard(&subscriptionsRwlock);
+    lock_guard.wrlock();
+
+    auto session_it = sessionsById.find(clientid);
+    if (session_it == sessionsById.end())
+        return std::shared_ptr<Session>();
+
+    std::shared_ptr<Session> session = session_it->second;
+    sessionsById.erase(session_it);
+    return session;
+}
+
+/**
+ * @brief SubscriptionStore::adoptSessionState gives the subscriptions and queued QoS messages of a session elsewhere to the session here.
+ *
+ * The subscriptions don't get the retained messages again, because it's a resumed session, not a subscribe.
+ */
+void SubscriptionStore::adoptSessionState(const ClusterSessionState &state)
+{
+    std::shared_ptr<Session> session = lockSession(state.clientId);
+    std::shared_ptr<Client> client = session ? session->makeSharedClient() : std::shared_ptr<Client>();
+
+    if (!client)
+    {
+        logger->logf(LOG_WARNING, "Session of client '%s' was handed over, but the client is gone.", state.clientId.c_str());
+        return;
+    }
+
+    std::vector<SubscriptionForAdding> subscriptions;
+    subscriptions.reserve(state.subscriptions.size());
+    for (const std::pair<std::string, char> &sub : state.subscriptions)
+    {
+        std::string topic = sub.first;
+        std::vector<std::string> subtopics;
+        splitTopic(topic, subtopics);
+        subscriptions.emplace_back(std::move(topic), std::move(subtopics), sub.second);
+    }
+    addSubscriptions(client, subscriptions, false);
+
+    for (const Publish &publish : state.publishes)
+    {
+        Publish p(publish);
+        PublishCopyFactory factory(&p);
+        session->writePacket(factory, p.qos);
+    }
+
+    logger->logf(LOG_NOTICE, "Client '%s' got %d subscriptions and %d queued messages of its previous session.",
+                 state.clientId.c_str(), state.subscriptions.size(), state.publishes.size());
 }
 
 /**
@@ -714,19 +1327,61 @@ void SubscriptionStore::removeExpiredSessionsClients()
 
         logger->logf(LOG_NOTICE, "Rebuilding subscription tree");
         root.cleanSubscriptions();
+
+        auto exact_it = exactSubscriptions.begin();
+        while (exact_it != exactSubscriptions.end())
+        {
+            if (exact_it->second->cleanSubscriptions() == 0)
+                exact_it = exactSubscriptions.erase(exact_it);
+            else
+                exact_it++;
+        }
         lastTreeCleanup = now;
+        lock_guard.unlock();
+
+        rebuildShardInterest();
+    }
+}
+
+/**
+ * @brief SubscriptionStore::rebuildShardInterest clears what other threads know of filters that have no subscribers anymore.
+ */
+void SubscriptionStore::rebuildShardInterest()
+{
+    if (!shards)
+        return;
+
+    std::set<std::string> filters;
+
+    {
+        RWLockGuard lock_guard(&subscriptionsRwlock);
+        lock_guard.rdlock();
+        getSubscriptionFilters(&root, "", true, filters);
+        getSubscriptionFilters(&rootDollar, "", true, filters);
+
+        for (auto &pair : exactSubscriptions)
+        {
+            getSubscriptionFilters(pair.second.get(), pair.first, true, filters);
+        }
+
+        // Still under the lock, so filters added in the meantime aren't lost.
+        shards->getInterest(shardIndex).rebuild(filters);
     }
 }
 
 /**
  * @brief SubscriptionStore::queueSessionRemoval places session efficiently in a sorted map that is periodically dequeued.
  * @param session
+ *
+ * This is when a session goes offline, so it's also made compact, if it has nothing in transit.
  */
 void SubscriptionStore::queueSessionRemoval(const std::shared_ptr<Session> &session)
 {
     if (!session)
         return;
 
+    session->compact();
+
     std::chrono::time_point<std::chrono::steady_clock> removeAt = std::chrono::steady_clock::now() + std::chrono::seconds(session->getSessionExpiryInterval());
     std::chrono::seconds secondsSinceEpoch = std::chrono::duration_cast<std::chrono::seconds>(removeAt.time_since_epoch());
     session->setQueuedRemovalAt();
@@ -737,6 +1392,9 @@ void SubscriptionStore::queueSessionRemoval(const std::shared_ptr<Session> &sess
 
 int64_t SubscriptionStore::getRetainedMessageCount() const
 {
+    if (retainedStore)
+        return retainedStore->getRetainedMessageCount();
+
     return retainedMessageCount;
 }
 
@@ -755,9 +1413,143 @@ int64_t SubscriptionStore::getSubscriptionCount()
     countSubscriptions(&root, count);
     countSubscriptions(&rootDollar, count);
 
+    for (auto &pair : exactSubscriptions)
+    {
+        countSubscriptions(pair.second.get(), count);
+    }
+
     return count;
 }
 
+/**
+ * @brief SubscriptionStore::getWorstSlowConsumers gets the sessions that dropped the most publishes.
+ * @param max
+ * @return pairs of the amount of dropped publishes and the session, sorted by the former.
+ */
+std::vector<std::pair<uint64_t, std::shared_ptr<Session>>> SubscriptionStore::getWorstSlowConsumers(size_t max)
+{
+    std::vector<std::pair<uint64_t, std::shared_ptr<Session>>> result;
+
+    {
+        RWLockGuard lock_guard(&subscriptionsRwlock);
+        lock_guard.rdlock();
+
+        for (const auto &pair : sessionsByIdConst)
+        {
+            const std::shared_ptr<Session> &ses = pair.second;
+
+            // Taking a snapshot of the total, because the counters keep changing while sorting.
+            const uint64_t dropped = ses->getDropCounters().getTotalDropped();
+            if (dropped > 0)
+                result.emplace_back(dropped, ses);
+        }
+    }
+
+    auto cmp = [](const std::pair<uint64_t, std::shared_ptr<Session>> &a, const std::pair<uint64_t, std::shared_ptr<Session>> &b) {
+        return a.first > b.first;
+    };
+
+    const size_t n = std::min(max, result.size());
+    std::partial_sort(result.begin(), result.begin() + n, result.end(), cmp);
+    result.resize(n);
+
+    return result;
+}
+
+/**
+ * @brief SubscriptionStore::getSubscriptionFilters gives the topic filters that have at least one subscriber. Filters starting with '$'
+ * are not included.
+ */
+void SubscriptionStore::getSubscriptionFilters(std::set<std::string> &outputList)
+{
+    RWLockGuard lock_guard(&subscriptionsRwlock);
+    lock_guard.rdlock();
+    getSubscriptionFilters(&root, "", true, outputList);
+
+    for (auto &pair : exactSubscriptions)
+    {
+        getSubscriptionFilters(pair.second.get(), pair.first, true, outputList);
+    }
+}
+
+void SubscriptionStore::getSubscriptionFilters(SubscriptionNode *this_node, const std::string &composedTopic, bool root,
+                                               std::set<std::string> &outputList) const
+{
+    for (auto &pair : this_node->getSubscribers())
+    {
+        if (!pair.second.session.expired())
+        {
+            outputList.insert(composedTopic);
+            break;
+        }
+    }
+
+    for (auto &pair : this_node->children)
+    {
+        const std::string topicAtNextLevel = root ? pair.first : composedTopic + "/" + pair.first;
+        getSubscriptionFilters(pair.second.get(), topicAtNextLevel, false, outputList);
+    }
+
+    if (this_node->childrenPlus)
+    {
+        const std::string topicAtNextLevel = root ? "+" : composedTopic + "/+";
+        getSubscriptionFilters(this_node->childrenPlus.get(), topicAtNextLevel, false, outputList);
+    }
+
+    if (this_node->childrenPound)
+    {
+        const std::string topicAtNextLevel = root ? "#" : composedTopic + "/#";
+        getSubscriptionFilters(this_node->childrenPound.get(), topicAtNextLevel, false, outputList);
+    }
+}
+
+/**
+ * @brief SubscriptionStore::getSubscriptionsOfSession gives the filters and QoS levels the session is subscribed with.
+ *
+ * This walks the whole tree, so it's only for rare occasions, like when a session moves to another cluster node.
+ */
+std::vector<std::pair<std::string, char>> SubscriptionStore::getSubscriptionsOfSession(const std::shared_ptr<Session> &session)
+{
+    std::unordered_map<std::string, std::list<SubscriptionForSerializing>> allSubscriptions;
+
+    {
+        RWLockGuard lock_guard(&subscriptionsRwlock);
+        lock_guard.rdlock();
+        getSubscriptions(allSubscriptions);
+        getSubscriptions(&rootDollar, "", true, allSubscriptions);
+    }
+
+    std::vector<std::pair<std::string, char>> result;
+
+    for (auto &pair : allSubscriptions)
+    {
+        for (const SubscriptionForSerializing &sub : pair.second)
+        {
+            if (sub.clientId == session->getClientId())
+                result.emplace_back(pair.first, sub.qos);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief SubscriptionStore::getRetainedMessages copies the retained messages, except the ones with topics starting with a '$'.
+ *
+ * The shards are locked one by one, so it's not a snapshot of one moment.
+ */
+void SubscriptionStore::getRetainedMessages(std::vector<RetainedMessage> &outputList)
+{
+    outputList.reserve(retainedMessageCount);
+
+    for (RetainedMessagesShard *shard : getRetainedMessagesShards(false))
+    {
+        RWLockGuard locker(&shard->rwlock);
+        locker.rdlock();
+        getRetainedMessages(&shard->node, outputList);
+    }
+}
+
 void SubscriptionStore::getRetainedMessages(RetainedMessageNode *this_node, std::vector<RetainedMessage> &outputList) const
 {
     for(const RetainedMessage &rm : this_node->retainedMessages)
@@ -813,6 +1605,19 @@ void SubscriptionStore::getSubscriptions(SubscriptionNode *this_node, const std:
     }
 }
 
+/**
+ * @brief SubscriptionStore::getSubscriptions gets the subscriptions of the tree and the exact subscriptions, except the ones starting with '$'.
+ */
+void SubscriptionStore::getSubscriptions(std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &outputList)
+{
+    getSubscriptions(&root, "", true, outputList);
+
+    for (auto &pair : exactSubscriptions)
+    {
+        getSubscriptions(pair.second.get(), pair.first, true, outputList);
+    }
+}
+
 void SubscriptionStore::countSubscriptions(SubscriptionNode *this_node, int64_t &count) const
 {
     for (auto &pair : this_node->getSubscribers())
@@ -847,13 +1652,7 @@ void SubscriptionStore::saveRetainedMessages(const std::string &filePath)
     logger->logf(LOG_INFO, "Saving retained messages to '%s'", filePath.c_str());
 
     std::vector<RetainedMessage> result;
-
-    {
-        RWLockGuard locker(&retainedMessagesRwlock);
-        locker.rdlock();
-        result.reserve(retainedMessageCount);
-        getRetainedMessages(&retainedMessagesRoot, result);
-    }
+    getRetainedMessages(result);
 
     logger->logf(LOG_DEBUG, "Collected %ld retained messages to save.", result.size());
 
@@ -877,7 +1676,7 @@ void SubscriptionStore::loadRetainedMessages(const std::string &filePath)
         for (RetainedMessage &rm : messages)
         {
             splitTopic(rm.publish.topic, rm.publish.subtopics);
-            setRetainedMessage(rm.publish, rm.publish.subtopics);
+            setLocalRetainedMessage(rm.publish, rm.publish.subtopics);
         }
     }
     catch (PersistenceFileCantBeOpened &ex)
@@ -888,29 +1687,58 @@ void SubscriptionStore::loadRetainedMessages(const std::string &filePath)
 
 void SubscriptionStore::saveSessionsAndSubscriptions(const std::string &filePath)
 {
-    logger->logf(LOG_INFO, "Saving sessions and subscriptions to '%s'", filePath.c_str());
+    saveSessionsAndSubscriptions(filePath, {this});
+}
 
-    std::vector<std::unique_ptr<Session>> sessionCopies;
-    std::unordered_map<std::string, std::list<SubscriptionForSerializing>> subscriptionCopies;
+void SubscriptionStore::loadSessionsAndSubscriptions(const std::string &filePath)
+{
+    loadSessionsAndSubscriptions(filePath, {this}, std::unordered_map<std::string, size_t>());
+}
 
-    {
-        RWLockGuard lock_guard(&subscriptionsRwlock);
-        lock_guard.rdlock();
+void SubscriptionStore::collectSessionsAndSubscriptions(std::vector<std::unique_ptr<Session>> &sessionCopies,
+                                                        std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &subscriptionCopies)
+{
+    RWLockGuard lock_guard(&subscriptionsRwlock);
+    lock_guard.rdlock();
 
-        sessionCopies.reserve(sessionsByIdConst.size());
+    sessionCopies.reserve(sessionCopies.size() + sessionsByIdConst.size());
 
-        for (const auto &pair : sessionsByIdConst)
-        {
-            const Session &org = *pair.second.get();
+    for (const auto &pair : sessionsByIdConst)
+    {
+        const Session &org = *pair.second.get();
 
-            // Sessions created with clean session need to be destroyed when disconnecting, so no point in saving them.
-            if (org.getDestroyOnDisconnect())
+        // Sessions created with clean session need to be destroyed when disconnecting, so no point in saving them. Unless
+        // their connection is handed over to a new process.
+        if (org.getDestroyOnDisconnect())
+        {
+            std::shared_ptr<Client> c = org.makeSharedClient();
+            if (!c || !c->isHandedOver())
                 continue;
-
-            sessionCopies.push_back(org.getCopy());
         }
 
-        getSubscriptions(&root, "", true, subscriptionCopies);
+        sessionCopies.push_back(org.getCopy());
+    }
+
+    getSubscriptions(subscriptionCopies);
+}
+
+/**
+ * @brief SubscriptionStore::saveSessionsAndSubscriptions saves the sessions of several stores in one file, for the sharded thread model.
+ *
+ * The stores are locked one by one, so it's not a snapshot of one moment.
+ */
+void SubscriptionStore::saveSessionsAndSubscriptions(const std::string &filePath, const std::vector<SubscriptionStore*> &stores)
+{
+    Logger *logger = Logger::getInstance();
+
+    logger->logf(LOG_INFO, "Saving sessions and subscriptions to '%s'", filePath.c_str());
+
+    std::vector<std::unique_ptr<Session>> sessionCopies;
+    std::unordered_map<std::string, std::list<SubscriptionForSerializing>> subscriptionCopies;
+
+    for (SubscriptionStore *store : stores)
+    {
+        store->collectSessionsAndSubscriptions(sessionCopies, subscriptionCopies);
     }
 
     // Then write the copies to disk, after having released the lock
@@ -922,8 +1750,63 @@ void SubscriptionStore::saveSessionsAndSubscriptions(const std::string &filePath
     db.saveData(sessionCopies, subscriptionCopies);
 }
 
-void SubscriptionStore::loadSessionsAndSubscriptions(const std::string &filePath)
+void SubscriptionStore::addLoadedSessionsAndSubscriptions(SessionsAndSubscriptionsResult &loadedData)
+{
+    // Before locking the store, because the directory of sessions is locked first.
+    if (shards)
+    {
+        for (std::shared_ptr<Session> &session : loadedData.sessions)
+            shards->setSessionShard(session->getClientId(), shardIndex);
+    }
+
+    RWLockGuard locker(&subscriptionsRwlock);
+    locker.wrlock();
+
+    for (std::shared_ptr<Session> &session : loadedData.sessions)
+    {
+        sessionsById[session->getClientId()] = session;
+        queueSessionRemoval(session);
+        queueWillMessage(session->getWill(), session);
+    }
+
+    std::vector<std::string> subtopics;
+
+    for (auto &pair : loadedData.subscriptions)
+    {
+        const std::string &topic = pair.first;
+        const std::list<SubscriptionForSerializing> &subs = pair.second;
+
+        for (const SubscriptionForSerializing &sub : subs)
+        {
+            splitTopic(topic, subtopics);
+            SubscriptionNode *subscriptionNode = getDeepestNode(topic, subtopics);
+
+            auto session_it = sessionsByIdConst.find(sub.clientId);
+            if (session_it != sessionsByIdConst.end())
+            {
+                const std::shared_ptr<Session> &ses = session_it->second;
+                subscriptionNode->addSubscriber(ses, sub.qos);
+
+                if (shards)
+                    shards->getInterest(shardIndex).add(topic);
+            }
+
+        }
+    }
+}
+
+/**
+ * @brief SubscriptionStore::loadSessionsAndSubscriptions loads the sessions into several stores, for the sharded thread model.
+ * @param shardsOfClients says which store has the session of a client, like the clients that were handed over. The other sessions are
+ * spread by hash of the client id.
+ */
+void SubscriptionStore::loadSessionsAndSubscriptions(const std::string &filePath, const std::vector<SubscriptionStore*> &stores,
+                                                     const std::unordered_map<std::string, size_t> &shardsOfClients)
 {
+    assert(!stores.empty());
+
+    Logger *logger = Logger::getInstance();
+
     try
     {
         logger->logf(LOG_INFO, "Loading '%s'", filePath.c_str());
@@ -932,37 +1815,39 @@ void SubscriptionStore::loadSessionsAndSubscriptions(const std::string &filePath
         db.openRead();
         SessionsAndSubscriptionsResult loadedData = db.readData();
 
-        RWLockGuard locker(&subscriptionsRwlock);
-        locker.wrlock();
+        if (stores.size() == 1)
+        {
+            stores.front()->addLoadedSessionsAndSubscriptions(loadedData);
+            return;
+        }
+
+        std::vector<SessionsAndSubscriptionsResult> parts(stores.size());
+        std::unordered_map<std::string, size_t> shardOfSession;
+        std::hash<std::string> hasher;
 
         for (std::shared_ptr<Session> &session : loadedData.sessions)
         {
-            sessionsById[session->getClientId()] = session;
-            queueSessionRemoval(session);
-            queueWillMessage(session->getWill(), session);
+            const std::string &clientId = session->getClientId();
+            auto shard_it = shardsOfClients.find(clientId);
+            const size_t shard = shard_it != shardsOfClients.end() ? shard_it->second : hasher(clientId) % stores.size();
+            shardOfSession[clientId] = shard;
+            parts.at(shard).sessions.push_back(session);
         }
 
-        std::vector<std::string> subtopics;
-
         for (auto &pair : loadedData.subscriptions)
         {
-            const std::string &topic = pair.first;
-            const std::list<SubscriptionForSerializing> &subs = pair.second;
-
-            for (const SubscriptionForSerializing &sub : subs)
+            for (const SubscriptionForSerializing &sub : pair.second)
             {
-                splitTopic(topic, subtopics);
-                SubscriptionNode *subscriptionNode = getDeepestNode(topic, subtopics);
-
-                auto session_it = sessionsByIdConst.find(sub.clientId);
-                if (session_it != sessionsByIdConst.end())
-                {
-                    const std::shared_ptr<Session> &ses = session_it->second;
-                    subscriptionNode->addSubscriber(ses, sub.qos);
-                }
-
+                auto shard_it = shardOfSession.find(sub.clientId);
+                if (shard_it != shardOfSession.end())
+                    parts[shard_it->second].subscriptions[pair.first].push_back(sub);
             }
         }
+
+        for (size_t i = 0; i < stores.size(); i++)
+        {
+            stores[i]->addLoadedSessionsAndSubscriptions(parts[i]);
+        }
     }
     catch (PersistenceFileCantBeOpened &ex)
     {
@@ -991,7 +1876,7 @@ void Subscription::reset()
     qos = 0;
 }
 
-void RetainedMessageNode::addPayload(const Publish &publish, int64_t &totalCount)
+void RetainedMessageNode::addPayload(const Publish &publish, std::atomic<int64_t> &totalCount)
 {
     const int64_t countBefore = retainedMessages.size();
     RetainedMessage rm(publish);
@@ -1018,6 +1903,20 @@ void RetainedMessageNode::addPayload(const Publish &publish, int64_t &totalCount
     totalCount += diffCount;
 }
 
+void RetainedMessageNode::removeExpired(std::atomic<int64_t> &totalCount)
+{
+    auto pos = retainedMessages.begin();
+    while (pos != retainedMessages.end())
+    {
+        auto cur = pos++;
+        if (cur->publish.hasExpired())
+        {
+            retainedMessages.erase(cur);
+            totalCount--;
+        }
+    }
+}
+
 /**
  * @brief RetainedMessageNode::getChildren return the children or nullptr when there are none. Const, so doesn't default construct.
  * @param subtopic
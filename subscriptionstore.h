@@ -24,7 +24,10 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <mutex>
 #include <map>
 #include <vector>
+#include <set>
 #include <pthread.h>
+#include <atomic>
+#include <stdint.h>
 
 #include "forward_declarations.h"
 
@@ -52,6 +55,18 @@ public:
     ReceivingSubscriber(const std::shared_ptr<Session> &ses, char qos);
 };
 
+/**
+ * @brief The SubscriptionForAdding struct is one topic filter of a subscribe, so all filters of a packet can be added at once.
+ */
+struct SubscriptionForAdding
+{
+    std::string topic;
+    std::vector<std::string> subtopics;
+    char qos = 0;
+
+    SubscriptionForAdding(std::string &&topic, std::vector<std::string> &&subtopics, char qos);
+};
+
 class SubscriptionNode
 {
     std::string subtopic;
@@ -82,10 +97,22 @@ class RetainedMessageNode
     std::unordered_map<std::string, std::unique_ptr<RetainedMessageNode>> children;
     std::unordered_set<RetainedMessage> retainedMessages;
 
-    void addPayload(const Publish &publish, int64_t &totalCount);
+    void addPayload(const Publish &publish, std::atomic<int64_t> &totalCount);
+    void removeExpired(std::atomic<int64_t> &totalCount);
     RetainedMessageNode *getChildren(const std::string &subtopic) const;
 };
 
+/**
+ * @brief The RetainedMessagesShard struct is the retained messages under one first subtopic, with its own lock.
+ *
+ * This way, setting retained messages and giving them to new subscribers only block each other when their topics start the same.
+ */
+struct RetainedMessagesShard
+{
+    pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+    RetainedMessageNode node;
+};
+
 class QueuedWill
 {
     std::weak_ptr<WillPublish> will;
@@ -102,10 +129,13 @@ class SubscriptionStore
 {
 #ifdef TESTING
     friend class MainTests;
+    friend class MicroBench;
 #endif
 
     SubscriptionNode root;
     SubscriptionNode rootDollar;
+    // Filters without wildcards, by full topic, so matching them is one lookup. Filters starting with '$' stay in the '$' tree.
+    std::unordered_map<std::string, std::unique_ptr<SubscriptionNode>> exactSubscriptions;
     pthread_rwlock_t subscriptionsRwlock = PTHREAD_RWLOCK_INITIALIZER;
     std::unordered_map<std::string, std::shared_ptr<Session>> sessionsById;
     const std::unordered_map<std::string, std::shared_ptr<Session>> &sessionsByIdConst;
@@ -113,60 +143,101 @@ class SubscriptionStore
     std::mutex queuedSessionRemovalsMutex;
     std::map<std::chrono::seconds, std::vector<std::weak_ptr<Session>>> queuedSessionRemovals;
 
+    // Only guards the map. Shards are never removed, so they can be used after releasing it.
     pthread_rwlock_t retainedMessagesRwlock = PTHREAD_RWLOCK_INITIALIZER;
-    RetainedMessageNode retainedMessagesRoot;
-    RetainedMessageNode retainedMessagesRootDollar;
-    int64_t retainedMessageCount = 0;
+    std::unordered_map<std::string, std::unique_ptr<RetainedMessagesShard>> retainedMessageShards;
+    std::atomic<int64_t> retainedMessageCount {0};
 
     std::mutex pendingWillsMutex;
     std::map<std::chrono::seconds, std::vector<QueuedWill>> pendingWillMessages;
 
     std::chrono::time_point<std::chrono::steady_clock> lastTreeCleanup;
 
+    std::shared_ptr<ClusterNode> cluster;
+    std::vector<std::shared_ptr<Bridge>> bridges; // Only changed at startup, so read without lock.
+
+    // Only in the sharded thread model. The retained messages are in the global store, because they're for all threads.
+    std::shared_ptr<ThreadShards> shards;
+    size_t shardIndex = 0;
+    std::shared_ptr<SubscriptionStore> retainedStore;
+
     Logger *logger = Logger::getInstance();
 
     static void publishNonRecursively(const std::unordered_map<std::string, Subscription> &subscribers,
                                std::forward_list<ReceivingSubscriber> &targetSessions);
+    static bool shouldFanOutInParallel(const std::forward_list<ReceivingSubscriber> &subscriberSessions);
+    static void fanOutInParallel(PublishCopyFactory &copyFactory, const std::forward_list<ReceivingSubscriber> &subscriberSessions);
     static void publishRecursively(std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
                             SubscriptionNode *this_node, std::forward_list<ReceivingSubscriber> &targetSessions);
-    void giveClientRetainedMessagesRecursively(std::vector<std::string>::const_iterator cur_subtopic_it,
-                                               std::vector<std::string>::const_iterator end, RetainedMessageNode *this_node, bool poundMode,
-                                               std::forward_list<Publish> &packetList) const;
+    static void giveClientRetainedMessagesRecursively(std::vector<std::string>::const_iterator cur_subtopic_it,
+                                                      std::vector<std::string>::const_iterator end, RetainedMessageNode *this_node, bool poundMode,
+                                                      std::forward_list<Publish> &packetList, std::vector<RetainedMessageNode*> &nodesWithExpired);
+    void giveClientRetainedMessagesFromShard(RetainedMessagesShard *shard, std::vector<std::string>::const_iterator cur_subtopic_it,
+                                             std::vector<std::string>::const_iterator end, bool poundMode, std::forward_list<Publish> &packetList);
+    void removeExpiredRetainedMessages(RetainedMessagesShard *shard, const std::vector<RetainedMessageNode*> &nodesWithExpired);
+    RetainedMessagesShard *getRetainedMessagesShard(const std::string &firstSubtopic, bool create);
+    std::vector<RetainedMessagesShard*> getRetainedMessagesShards(bool dollar);
     void getRetainedMessages(RetainedMessageNode *this_node, std::vector<RetainedMessage> &outputList) const;
     void getSubscriptions(SubscriptionNode *this_node, const std::string &composedTopic, bool root,
                           std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &outputList) const;
+    void getSubscriptions(std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &outputList);
     void countSubscriptions(SubscriptionNode *this_node, int64_t &count) const;
+    void getSubscriptionFilters(SubscriptionNode *this_node, const std::string &composedTopic, bool root, std::set<std::string> &outputList) const;
 
+    static bool isExactFilter(const std::string &topic);
     SubscriptionNode *getDeepestNode(const std::string &topic, const std::vector<std::string> &subtopics);
+    void rebuildShardInterest();
+    void collectSessionsAndSubscriptions(std::vector<std::unique_ptr<Session>> &sessionCopies,
+                                         std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &subscriptionCopies);
+    void addLoadedSessionsAndSubscriptions(SessionsAndSubscriptionsResult &loadedData);
 public:
     SubscriptionStore();
 
+    void setCluster(const std::shared_ptr<ClusterNode> &cluster);
+    void addBridge(const std::shared_ptr<Bridge> &bridge);
+    void setShard(const std::shared_ptr<ThreadShards> &shards, size_t shardIndex, const std::shared_ptr<SubscriptionStore> &retainedStore);
+
     void addSubscription(std::shared_ptr<Client> &client, const std::string &topic, const std::vector<std::string> &subtopics, char qos);
+    void addSubscriptions(std::shared_ptr<Client> &client, const std::vector<SubscriptionForAdding> &subscriptions, bool giveRetainedMessages = true);
     void removeSubscription(std::shared_ptr<Client> &client, const std::string &topic);
     void registerClientAndKickExistingOne(std::shared_ptr<Client> &client);
     void registerClientAndKickExistingOne(std::shared_ptr<Client> &client, bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval);
+    void registerClientLocally(std::shared_ptr<Client> &client, bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval);
+    void registerHandedOverClient(std::shared_ptr<Client> &client);
     std::shared_ptr<Session> lockSession(const std::string &clientid);
 
     void sendQueuedWillMessages();
     void queueWillMessage(const std::shared_ptr<WillPublish> &willMessage, const std::shared_ptr<Session> &session, bool forceNow = false);
     void queuePacketAtSubscribers(PublishCopyFactory &copyFactory, bool dollar = false);
+    void queuePacketAtLocalSubscribers(PublishCopyFactory &copyFactory, bool dollar = false);
     void giveClientRetainedMessages(const std::shared_ptr<Session> &ses,
                                     const std::vector<std::string> &subscribeSubtopics, char max_qos);
+    void giveClientRetainedMessages(const std::shared_ptr<Session> &ses, const std::vector<SubscriptionForAdding> &subscriptions);
 
     void setRetainedMessage(const Publish &publish, const std::vector<std::string> &subtopics);
+    void setLocalRetainedMessage(const Publish &publish, const std::vector<std::string> &subtopics);
+    void getRetainedMessages(std::vector<RetainedMessage> &outputList);
 
     void removeSession(const std::shared_ptr<Session> &session);
+    std::shared_ptr<Session> releaseSession(const std::string &clientid);
+    void adoptSessionState(const ClusterSessionState &state);
     void removeExpiredSessionsClients();
 
     int64_t getRetainedMessageCount() const;
     uint64_t getSessionCount() const;
     int64_t getSubscriptionCount();
+    void getSubscriptionFilters(std::set<std::string> &outputList);
+    std::vector<std::pair<std::string, char>> getSubscriptionsOfSession(const std::shared_ptr<Session> &session);
+    std::vector<std::pair<uint64_t, std::shared_ptr<Session>>> getWorstSlowConsumers(size_t max);
 
     void saveRetainedMessages(const std::string &filePath);
     void loadRetainedMessages(const std::string &filePath);
 
     void saveSessionsAndSubscriptions(const std::string &filePath);
     void loadSessionsAndSubscriptions(const std::string &filePath);
+    static void saveSessionsAndSubscriptions(const std::string &filePath, const std::vector<SubscriptionStore*> &stores);
+    static void loadSessionsAndSubscriptions(const std::string &filePath, const std::vector<SubscriptionStore*> &stores,
+                                             const std::unordered_map<std::string, size_t> &shardsOfClients);
 
     void queueSessionRemoval(const std::shared_ptr<Session> &session);
 };
@@ -19,8 +19,12 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <string>
 #include <sstream>
 #include <cassert>
+#include <algorithm>
+#include <iterator>
 
 #include "globalstats.h"
+#include "cluster.h"
+#include "threadshards.h"
 
 KeepAliveCheck::KeepAliveCheck(const std::shared_ptr<Client> client) :
     client(client)
@@ -28,6 +32,26 @@ KeepAliveCheck::KeepAliveCheck(const std::shared_ptr<Client> client) :
 
 }
 
+ZeroCopyDrain::ZeroCopyDrain(int fd, const ZeroCopyPins &pins) :
+    fd(fd),
+    pins(pins),
+    giveUpAt(std::chrono::steady_clock::now() + std::chrono::seconds(ZERO_COPY_DRAIN_TIMEOUT_SECONDS))
+{
+
+}
+
+PendingFanOut::PendingFanOut(const std::shared_ptr<ThreadData> &origin, const ThreadData *target) :
+    origin(origin),
+    target(target)
+{
+    origin->fanOutStarted(target);
+}
+
+PendingFanOut::~PendingFanOut()
+{
+    origin->fanOutDone(target);
+}
+
 ThreadData::ThreadData(int threadnr, std::shared_ptr<Settings> settings) :
     settingsLocalCopy(*settings.get()),
     authentication(settingsLocalCopy),
@@ -48,6 +72,14 @@ ThreadData::ThreadData(int threadnr, std::shared_ptr<Settings> settings) :
     check<std::runtime_error>(epoll_ctl(this->epollfd, EPOLL_CTL_ADD, taskEventFd, &ev));
 }
 
+ThreadData::~ThreadData()
+{
+    for (ZeroCopyDrain &drain : zeroCopyDrains)
+    {
+        close(drain.fd);
+    }
+}
+
 void ThreadData::start(thread_f f)
 {
     this->thread = std::thread(f, this);
@@ -60,9 +92,12 @@ void ThreadData::start(thread_f f)
     const char *c_str = name.c_str();
     pthread_setname_np(native, c_str);
 
+    const std::vector<int> &cpus = settingsLocalCopy.workerCpus;
+    const int cpu = cpus.empty() ? threadnr : cpus[threadnr % cpus.size()];
+
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
-    CPU_SET(threadnr, &cpuset);
+    CPU_SET(cpu, &cpuset);
     check<std::runtime_error>(pthread_setaffinity_np(native, sizeof(cpuset), &cpuset));
 
     // It's not really necessary to get affinity again, but now I'm logging truth instead assumption.
@@ -72,7 +107,10 @@ void ThreadData::start(thread_f f)
         if (CPU_ISSET(j, &cpuset))
             pinned_cpu = j;
 
-    logger->logf(LOG_NOTICE, "Thread '%s' pinned to CPU %d", c_str, pinned_cpu);
+    this->pinnedCpu = pinned_cpu;
+    this->numaNode = getCpuNumaNode(pinned_cpu);
+
+    logger->logf(LOG_NOTICE, "Thread '%s' pinned to CPU %d, NUMA node %d", c_str, pinned_cpu, numaNode);
 }
 
 void ThreadData::quit()
@@ -106,6 +144,20 @@ void ThreadData::queueSendingQueuedWills()
     wakeUpThread();
 }
 
+/**
+ * @brief ThreadData::queueWillMessage sends a will from this thread's store, for when a client goes in another thread, in the sharded thread
+ * model. Only the thread itself may publish from its store.
+ */
+void ThreadData::queueWillMessage(const std::shared_ptr<WillPublish> &willMessage, const std::shared_ptr<Session> &session)
+{
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    auto f = std::bind(&ThreadData::sendWillMessage, this, willMessage, session);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
 void ThreadData::queueRemoveExpiredSessions()
 {
     std::lock_guard<std::mutex> locker(taskQueueMutex);
@@ -181,14 +233,73 @@ void ThreadData::publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadDat
 
     publishStat("$SYS/broker/retained messages/count", subscriptionStore->getRetainedMessageCount());
 
-    publishStat("$SYS/broker/sessions/total", subscriptionStore->getSessionCount());
+    // In the sharded thread model, the sessions are spread over the stores of the threads.
+    std::vector<std::shared_ptr<SubscriptionStore>> stores;
+    for (const std::shared_ptr<ThreadData> &thread : threads)
+    {
+        if (thread->subscriptionStore)
+            stores.push_back(thread->subscriptionStore);
+    }
+    if (stores.empty())
+        stores.push_back(subscriptionStore);
+
+    uint64_t sessionCount = 0;
+    int64_t subscriptionCount = 0;
+    std::vector<std::pair<uint64_t, std::shared_ptr<Session>>> slowConsumers;
+
+    for (const std::shared_ptr<SubscriptionStore> &store : stores)
+    {
+        sessionCount += store->getSessionCount();
+        subscriptionCount += store->getSubscriptionCount();
+
+        std::vector<std::pair<uint64_t, std::shared_ptr<Session>>> storeSlowConsumers = store->getWorstSlowConsumers(SLOW_CONSUMERS_ON_SYS_TOPIC);
+        std::move(storeSlowConsumers.begin(), storeSlowConsumers.end(), std::back_inserter(slowConsumers));
+    }
+
+    if (stores.size() > 1)
+    {
+        std::sort(slowConsumers.begin(), slowConsumers.end(), [](const std::pair<uint64_t, std::shared_ptr<Session>> &a,
+                                                                 const std::pair<uint64_t, std::shared_ptr<Session>> &b) {
+            return a.first > b.first;
+        });
+
+        if (slowConsumers.size() > SLOW_CONSUMERS_ON_SYS_TOPIC)
+            slowConsumers.resize(SLOW_CONSUMERS_ON_SYS_TOPIC);
+    }
+
+    publishStat("$SYS/broker/sessions/total", sessionCount);
+
+    publishStat("$SYS/broker/subscriptions/count", subscriptionCount);
+
+    for (size_t i = 0; i < slowConsumers.size(); i++)
+    {
+        const std::shared_ptr<Session> &ses = slowConsumers[i].second;
+        DropCounters &counters = ses->getDropCounters();
+
+        const std::string payload = formatString("%s dropped=%lu write_buffer_full=%lu receive_maximum=%lu qos_bytes_limit=%lu evicted_oldest=%lu spilled_to_disk=%lu",
+                                                 ses->getClientId().c_str(), slowConsumers[i].first, counters.writeBufferFull.load(),
+                                                 counters.receiveMaximum.load(), counters.qosBytesLimit.load(), counters.evictedOldest.load(),
+                                                 counters.spilledToDisk.load());
+        publishStat(formatString("$SYS/broker/clients/slow/%zu", i + 1), payload);
+    }
 
-    publishStat("$SYS/broker/subscriptions/count", subscriptionStore->getSubscriptionCount());
+    // An empty payload removes the retained message of ranks that are no longer occupied.
+    for (size_t i = slowConsumers.size(); i < slowConsumersPublished; i++)
+    {
+        publishStat(formatString("$SYS/broker/clients/slow/%zu", i + 1), "");
+    }
+
+    slowConsumersPublished = slowConsumers.size();
 }
 
 void ThreadData::publishStat(const std::string &topic, uint64_t n)
 {
     const std::string payload = std::to_string(n);
+    publishStat(topic, payload);
+}
+
+void ThreadData::publishStat(const std::string &topic, const std::string &payload)
+{
     Publish p(topic, payload, 0);
     PublishCopyFactory factory(&p);
     std::shared_ptr<SubscriptionStore> subscriptionStore = MainApp::getMainApp()->getSubscriptionStore();
@@ -202,6 +313,11 @@ void ThreadData::sendQueuedWills()
     subscriptionStore->sendQueuedWillMessages();
 }
 
+void ThreadData::sendWillMessage(std::shared_ptr<WillPublish> willMessage, std::shared_ptr<Session> session)
+{
+    subscriptionStore->queueWillMessage(willMessage, session, true);
+}
+
 void ThreadData::removeExpiredSessions()
 {
     std::shared_ptr<SubscriptionStore> subscriptionStore = MainApp::getMainApp()->getSubscriptionStore();
@@ -212,9 +328,11 @@ void ThreadData::sendAllWills()
 {
     std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
 
-    for(auto &pair : clients_by_fd)
+    for(std::shared_ptr<Client> &c : clients_by_fd)
     {
-        std::shared_ptr<Client> &c = pair.second;
+        if (!c || c->isHandedOver())
+            continue;
+
         c->sendOrQueueWill();
     }
 
@@ -227,11 +345,14 @@ void ThreadData::sendAllDisconnects()
 
     {
         std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
-        clientsFound.reserve(clients_by_fd.size());
+        clientsFound.reserve(clientCount);
 
-        for(auto &pair : clients_by_fd)
+        for(std::shared_ptr<Client> &c : clients_by_fd)
         {
-            clientsFound.push_back(pair.second);
+            if (!c || c->isHandedOver())
+                continue;
+
+            clientsFound.push_back(c);
         }
     }
 
@@ -243,6 +364,246 @@ void ThreadData::sendAllDisconnects()
     allDisconnectsSent = true;
 }
 
+/**
+ * @brief ThreadData::prepareHandover stops handling the clients that will live on in the new process, when upgrading.
+ */
+void ThreadData::prepareHandover()
+{
+    std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
+
+    int count = 0;
+    for(std::shared_ptr<Client> &c : clients_by_fd)
+    {
+        if (c && c->prepareHandover())
+            count++;
+    }
+
+    logger->logf(LOG_NOTICE, "Thread %d prepared %d clients for handover.", threadnr, count);
+
+    allClientsPreparedForHandover = true;
+}
+
+void ThreadData::queuePrepareHandover()
+{
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    auto f = std::bind(&ThreadData::prepareHandover, this);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
+/**
+ * @brief ThreadData::getHandedOverClients is for when the thread has stopped.
+ */
+std::vector<std::shared_ptr<Client>> ThreadData::getHandedOverClients()
+{
+    std::vector<std::shared_ptr<Client>> result;
+
+    std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
+
+    for(std::shared_ptr<Client> &c : clients_by_fd)
+    {
+        if (c && c->isHandedOver())
+            result.push_back(c);
+    }
+
+    return result;
+}
+
+/**
+ * @brief ThreadData::queueAdoptHandedOverClient makes this thread take a connection that was handed over by the previous process.
+ * @param client has been restored with Client::readHandoverState().
+ */
+void ThreadData::queueAdoptHandedOverClient(const std::shared_ptr<Client> &client)
+{
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    auto f = std::bind(&ThreadData::adoptHandedOverClient, this, client);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
+void ThreadData::adoptHandedOverClient(std::shared_ptr<Client> client)
+{
+    try
+    {
+        addClient(client);
+        MainApp::getMainApp()->getSubscriptionStore()->registerHandedOverClient(client);
+
+        // What the old process had buffered but not handled or written yet.
+        addClientWithPendingInput(client);
+        if (!client->writeBufIntoFd())
+            removeClient(client);
+    }
+    catch (std::exception &ex)
+    {
+        logger->logf(LOG_ERR, "Error adopting handed over client: %s", ex.what());
+        removeClient(client);
+    }
+}
+
+/**
+ * @brief ThreadData::queueClusterPublishes gives publishes received from another cluster node to the local subscribers, in this thread.
+ */
+void ThreadData::queueClusterPublishes(const std::shared_ptr<std::vector<Publish>> &publishes)
+{
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    auto f = std::bind(&ThreadData::handleClusterPublishes, this, publishes);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
+void ThreadData::handleClusterPublishes(std::shared_ptr<std::vector<Publish>> publishes)
+{
+    std::shared_ptr<SubscriptionStore> subscriptionStore = MainApp::getMainApp()->getSubscriptionStore();
+
+    for (Publish &publish : *publishes)
+    {
+        try
+        {
+            splitTopic(publish.topic, publish.subtopics);
+
+            if (publish.retain)
+            {
+                subscriptionStore->setLocalRetainedMessage(publish, publish.subtopics);
+                continue;
+            }
+
+            PublishCopyFactory factory(&publish);
+            subscriptionStore->queuePacketAtLocalSubscribers(factory);
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Error handling publish from cluster node: %s", ex.what());
+        }
+    }
+}
+
+void ThreadData::queueReleaseClusterSession(const std::string &peerName, const std::string &clientId, bool wantState)
+{
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    auto f = std::bind(&ThreadData::releaseClusterSession, this, peerName, clientId, wantState);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
+void ThreadData::releaseClusterSession(const std::string &peerName, const std::string &clientId, bool wantState)
+{
+    try
+    {
+        MainApp::getMainApp()->getCluster()->releaseSession(peerName, clientId, wantState);
+    }
+    catch (std::exception &ex)
+    {
+        logger->logf(LOG_ERR, "Error releasing session of '%s' to cluster node: %s", clientId.c_str(), ex.what());
+    }
+}
+
+void ThreadData::queueAdoptClusterSessionState(const std::shared_ptr<ClusterSessionState> &state)
+{
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    auto f = std::bind(&ThreadData::adoptClusterSessionState, this, state);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
+void ThreadData::adoptClusterSessionState(std::shared_ptr<ClusterSessionState> state)
+{
+    try
+    {
+        MainApp::getMainApp()->getCluster()->adoptSessionState(*state);
+    }
+    catch (std::exception &ex)
+    {
+        logger->logf(LOG_ERR, "Error adopting session of '%s' from cluster node: %s", state->clientId.c_str(), ex.what());
+    }
+}
+
+/**
+ * @brief ThreadData::queueFanOut gives this thread its part of a publish with many receivers, the ones that live in this thread.
+ * @param origin is the thread that received the publish, which keeps count of its fan-outs in progress.
+ */
+void ThreadData::queueFanOut(const std::shared_ptr<Publish> &publish, const std::shared_ptr<std::vector<ReceivingSubscriber>> &receivers,
+                             const std::shared_ptr<ThreadData> &origin)
+{
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    std::shared_ptr<PendingFanOut> pending = std::make_shared<PendingFanOut>(origin, this);
+
+    auto f = std::bind(&ThreadData::fanOut, this, publish, receivers, pending);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
+/**
+ * @brief ThreadData::fanOut writes the publish to its receivers. The fan-out stops being pending when the task is destroyed, not here.
+ */
+void ThreadData::fanOut(std::shared_ptr<Publish> publish, std::shared_ptr<std::vector<ReceivingSubscriber>> receivers, std::shared_ptr<PendingFanOut> pending)
+{
+    (void)pending;
+
+    PublishCopyFactory factory(publish.get());
+
+    for (const ReceivingSubscriber &x : *receivers)
+    {
+        try
+        {
+            x.session->writePacket(factory, x.qos);
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Error writing publish to '%s': %s", x.session->getClientId().c_str(), ex.what());
+        }
+    }
+}
+
+void ThreadData::fanOutStarted(const ThreadData *target)
+{
+    std::lock_guard<std::mutex> locker(fanOutsPendingMutex);
+    fanOutsPendingPerThread[target]++;
+    fanOutsPending++;
+}
+
+void ThreadData::fanOutDone(const ThreadData *target)
+{
+    std::lock_guard<std::mutex> locker(fanOutsPendingMutex);
+
+    auto pos = fanOutsPendingPerThread.find(target);
+    assert(pos != fanOutsPendingPerThread.end());
+
+    if (pos != fanOutsPendingPerThread.end() && --pos->second <= 0)
+        fanOutsPendingPerThread.erase(pos);
+
+    fanOutsPending--;
+}
+
+/**
+ * @brief ThreadData::getThreadsWithFanOutsPending gives the threads that still have to do fan-outs of this thread. Receivers without a
+ * client that were last in one of those threads have to go through there too, to get the publishes in order.
+ */
+std::unordered_set<const ThreadData*> ThreadData::getThreadsWithFanOutsPending()
+{
+    std::unordered_set<const ThreadData*> result;
+
+    std::lock_guard<std::mutex> locker(fanOutsPendingMutex);
+
+    for (auto &pair : fanOutsPendingPerThread)
+    {
+        result.insert(pair.first);
+    }
+
+    return result;
+}
+
 void ThreadData::removeQueuedClients()
 {
     // Using shared pointers to have a claiming reference in case we lose the clients between the two locks.
@@ -267,23 +628,59 @@ void ThreadData::removeQueuedClients()
         std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
         for(const std::shared_ptr<Client> &client : clients)
         {
-            int fd = client->getFd();
-            clients_by_fd.erase(fd);
+            eraseClientLocked(client->getFd());
         }
     }
 }
 
+/**
+ * @brief ThreadData::giveClient is for other threads handing a client to this one. The client table is only changed by this thread.
+ *
+ * The socket does go in epoll right away, because the giving thread may already write to the client, which changes its events. Events
+ * that come before the client is in the table are level-triggered, so they come again.
+ */
 void ThreadData::giveClient(std::shared_ptr<Client> client)
+{
+    addClientToEpoll(client->getFd());
+
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    auto f = std::bind(&ThreadData::insertClient, this, client);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
+void ThreadData::addClient(std::shared_ptr<Client> client)
+{
+    insertClient(client);
+    addClientToEpoll(client->getFd());
+}
+
+void ThreadData::insertClient(std::shared_ptr<Client> client)
 {
     const int fd = client->getFd();
 
+    // Resizing would leave the event loop with a dangling slot.
+    assert(fdBeingHandled < 0);
+
     {
         std::lock_guard<std::mutex> locker(clients_by_fd_mutex);
+
+        if (static_cast<size_t>(fd) >= clients_by_fd.size())
+            clients_by_fd.resize(std::max<size_t>(fd + 1, clients_by_fd.size() * 2));
+
+        if (!clients_by_fd[fd])
+            clientCount++;
+
         clients_by_fd[fd] = client;
     }
 
     queueClientNextKeepAliveCheckLocked(client, false);
+}
 
+void ThreadData::addClientToEpoll(int fd)
+{
     struct epoll_event ev;
     memset(&ev, 0, sizeof (struct epoll_event));
     ev.data.fd = fd;
@@ -291,16 +688,78 @@ void ThreadData::giveClient(std::shared_ptr<Client> client)
     check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev));
 }
 
-std::shared_ptr<Client> ThreadData::getClient(int fd)
+/**
+ * @brief ThreadData::queueCreateClient has the client for an accepted connection created in this thread.
+ *
+ * That way, the client and its buffers are allocated from this thread's malloc arena and first touched here, so they're on the
+ * NUMA node of the CPU this thread is pinned to.
+ */
+void ThreadData::queueCreateClient(int fd, SSL *ssl, bool websocket, const sockaddr_in6 &addr, const Settings *settings)
 {
-    std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
 
-    auto pos = clients_by_fd.find(fd);
+    auto f = std::bind(&ThreadData::createClient, this, fd, ssl, websocket, addr, settings);
+    taskQueue.push_front(f);
 
-    if (pos == clients_by_fd.end())
-        return std::shared_ptr<Client>();
+    wakeUpThread();
+}
 
-    return pos->second;
+void ThreadData::createClient(int fd, SSL *ssl, bool websocket, sockaddr_in6 addr, const Settings *settings)
+{
+    try
+    {
+        std::shared_ptr<Client> client = std::make_shared<Client>(fd, shared_from_this(), ssl, websocket, reinterpret_cast<struct sockaddr*>(&addr), settings);
+        addClient(client);
+    }
+    catch (std::exception &ex)
+    {
+        logger->logf(LOG_ERR, "Error creating client: %s", ex.what());
+    }
+}
+
+/**
+ * @brief ThreadData::eraseClientLocked empties the client's slot. Call it from this thread, with clients_by_fd_mutex held.
+ */
+void ThreadData::eraseClientLocked(int fd)
+{
+    if (fd < 0 || static_cast<size_t>(fd) >= clients_by_fd.size() || !clients_by_fd[fd])
+        return;
+
+    if (fd == fdBeingHandled)
+    {
+        fdBeingHandledErased = true;
+        return;
+    }
+
+    clients_by_fd[fd].reset();
+    clientCount--;
+}
+
+void ThreadData::startHandlingClientEvent(int fd)
+{
+    fdBeingHandled = fd;
+    fdBeingHandledErased = false;
+}
+
+/**
+ * @brief ThreadData::doneHandlingClientEvent empties the slot of the client that was handled, if it was removed in the meantime.
+ */
+void ThreadData::doneHandlingClientEvent()
+{
+    const int fd = fdBeingHandled;
+    fdBeingHandled = -1;
+
+    if (!fdBeingHandledErased)
+        return;
+
+    fdBeingHandledErased = false;
+
+    // Destroyed after unlocking, because the destructor may need the lock.
+    std::shared_ptr<Client> client;
+
+    std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
+    client = clients_by_fd[fd];
+    eraseClientLocked(fd);
 }
 
 void ThreadData::removeClientQueued(const std::shared_ptr<Client> &client)
@@ -330,11 +789,8 @@ void ThreadData::removeClientQueued(int fd)
 
     {
         std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
-        auto client_it = this->clients_by_fd.find(fd);
-        if (client_it != this->clients_by_fd.end())
-        {
-            clientFound = client_it->second;
-        }
+        if (fd >= 0 && static_cast<size_t>(fd) < clients_by_fd.size())
+            clientFound = clients_by_fd[fd];
     }
 
     if (clientFound)
@@ -364,7 +820,7 @@ void ThreadData::removeClient(std::shared_ptr<Client> client)
     client->markAsDisconnecting();
 
     std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
-    clients_by_fd.erase(client->getFd());
+    eraseClientLocked(client->getFd());
 }
 
 void ThreadData::queueDoKeepAliveCheck()
@@ -377,6 +833,113 @@ void ThreadData::queueDoKeepAliveCheck()
     wakeUpThread();
 }
 
+/**
+ * @brief ThreadData::queueResumeBackpressuredClient makes a publisher that was paused for backpressure read again, in its own thread.
+ * @param client
+ */
+void ThreadData::queueResumeBackpressuredClient(const std::shared_ptr<Client> &client)
+{
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    std::weak_ptr<Client> weakClient = client;
+    auto f = std::bind(&ThreadData::resumeBackpressuredClient, this, weakClient);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
+void ThreadData::resumeBackpressuredClient(std::weak_ptr<Client> client)
+{
+    std::shared_ptr<Client> c = client.lock();
+    if (c)
+    {
+        c->resumeAfterBackpressure();
+        addClientWithPendingInput(c);
+    }
+}
+
+/**
+ * @brief ThreadData::runQueuedTasks runs what other threads queued for this one, in the order they were queued.
+ *
+ * The tasks are taken out of the queue first, because they can queue new tasks themselves.
+ */
+void ThreadData::runQueuedTasks()
+{
+    std::forward_list<std::function<void()>> copiedTasks;
+
+    {
+        std::lock_guard<std::mutex> locker(taskQueueMutex);
+        for(auto &f : taskQueue)
+        {
+            copiedTasks.push_front(std::move(f));
+        }
+        taskQueue.clear();
+    }
+
+    for(auto &f : copiedTasks)
+    {
+        f();
+    }
+}
+
+/**
+ * @brief ThreadData::queueDrainZeroCopySends keeps the socket and payloads of a removed client until its zero-copy sends are done.
+ * @param fd is closed by this thread. The connection should already be shut down.
+ *
+ * Can be called from any thread, because the last reference to a client can go anywhere.
+ */
+void ThreadData::queueDrainZeroCopySends(int fd, const ZeroCopyPins &pins)
+{
+    std::lock_guard<std::mutex> locker(taskQueueMutex);
+
+    auto f = std::bind(&ThreadData::drainZeroCopySends, this, fd, pins);
+    taskQueue.push_front(f);
+
+    wakeUpThread();
+}
+
+void ThreadData::drainZeroCopySends(int fd, ZeroCopyPins pins)
+{
+    zeroCopyDrains.emplace_back(fd, pins);
+}
+
+/**
+ * @brief ThreadData::reapZeroCopyDrains closes the sockets of removed clients once the kernel reported their zero-copy sends done.
+ *
+ * This runs with the keep-alive check; there's no hurry. We give up on peers that don't take the data at all, like the kernel
+ * does for closed sockets eventually.
+ */
+void ThreadData::reapZeroCopyDrains()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    auto pos = zeroCopyDrains.begin();
+    while (pos != zeroCopyDrains.end())
+    {
+        pos->pins.reap(pos->fd);
+
+        if (!pos->pins.empty() && pos->giveUpAt > now)
+        {
+            pos++;
+            continue;
+        }
+
+        if (!pos->pins.empty())
+            logger->logf(LOG_WARNING, "Giving up waiting for %zu zero-copy sends on fd %d of a removed client.", pos->pins.size(), pos->fd);
+
+        close(pos->fd);
+        pos = zeroCopyDrains.erase(pos);
+    }
+}
+
+void ThreadData::addClientWithPendingInput(const std::shared_ptr<Client> &client)
+{
+    if (!client->hasPendingInput() || client->isPausedByBackpressure())
+        return;
+
+    clientsWithPendingInput.push_back(client);
+}
+
 void ThreadData::queueQuit()
 {
     std::lock_guard<std::mutex> locker(taskQueueMutex);
@@ -409,7 +972,7 @@ void ThreadData::queuePasswdFileReload()
 
 int ThreadData::getNrOfClients() const
 {
-    return clients_by_fd.size();
+    return clientCount;
 }
 
 void ThreadData::queueAuthPluginPeriodicEvent()
@@ -451,6 +1014,8 @@ void ThreadData::doKeepAliveCheck()
 {
     logger->logf(LOG_DEBUG, "doKeepAliveCheck in thread %d", threadnr);
 
+    reapZeroCopyDrains();
+
     const std::chrono::seconds now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch());
 
     try
@@ -517,7 +1082,7 @@ void ThreadData::doKeepAliveCheck()
             for (std::shared_ptr<Client> c : clientsToRemove)
             {
                 c->setDisconnectReason("Keep-alive expired: " + c->getKeepAliveInfoString());
-                clients_by_fd.erase(c->getFd());
+                eraseClientLocked(c->getFd());
             }
         }
     }
@@ -575,6 +1140,29 @@ void ThreadData::wakeUpThread()
     check<std::runtime_error>(write(taskEventFd, &one, sizeof(uint64_t)));
 }
 
+/**
+ * @brief ThreadData::wakeUpForShardMessages wakes up the thread for messages from other threads, unless that's already pending.
+ */
+void ThreadData::wakeUpForShardMessages()
+{
+    if (shardMessagesPending.exchange(true, std::memory_order_acq_rel))
+        return;
+
+    wakeUpThread();
+}
+
+void ThreadData::handleShardMessages()
+{
+    if (!shards)
+        return;
+
+    // Cleared before handling, so messages sent in the meantime wake the thread up again.
+    shardMessagesPending.exchange(false, std::memory_order_acq_rel);
+
+    if (shards->handleMessages(threadnr))
+        wakeUpForShardMessages();
+}
+
 
 
 
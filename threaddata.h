@@ -23,9 +23,11 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <map>
+#include <vector>
 #include <unordered_set>
 #include <unordered_map>
 #include <mutex>
+#include <atomic>
 #include <functional>
 #include <chrono>
 #include <forward_list>
@@ -38,6 +40,10 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "authplugin.h"
 #include "logger.h"
 #include "derivablecounter.h"
+#include "zerocopypins.h"
+
+#define SLOW_CONSUMERS_ON_SYS_TOPIC 10
+#define ZERO_COPY_DRAIN_TIMEOUT_SECONDS 60
 
 typedef void (*thread_f)(ThreadData *);
 
@@ -49,31 +55,91 @@ struct KeepAliveCheck
     KeepAliveCheck(const std::shared_ptr<Client> client);
 };
 
-class ThreadData
+/**
+ * @brief The ZeroCopyDrain struct is the socket of a removed client that still has zero-copy sends in flight.
+ */
+struct ZeroCopyDrain
+{
+    int fd = -1;
+    ZeroCopyPins pins;
+    std::chrono::time_point<std::chrono::steady_clock> giveUpAt;
+
+    ZeroCopyDrain(int fd, const ZeroCopyPins &pins);
+};
+
+/**
+ * @brief The PendingFanOut struct counts a fan-out at its origin for as long as the task for it exists, so also when the task is discarded
+ * without running, like when the target thread stops.
+ */
+struct PendingFanOut
 {
-    std::unordered_map<int, std::shared_ptr<Client>> clients_by_fd;
+    const std::shared_ptr<ThreadData> origin;
+    const ThreadData *target;
+
+    PendingFanOut(const std::shared_ptr<ThreadData> &origin, const ThreadData *target);
+    PendingFanOut(const PendingFanOut &other) = delete;
+    ~PendingFanOut();
+};
+
+class ThreadData : public std::enable_shared_from_this<ThreadData>
+{
+#ifdef TESTING
+    friend class MainTests;
+#endif
+
+    // Indexed by fd. Only this thread changes it, with the mutex held, so the event loop can read it without locking. Other threads lock.
+    std::vector<std::shared_ptr<Client>> clients_by_fd;
     std::mutex clients_by_fd_mutex;
+    std::atomic<int> clientCount{0};
     Logger *logger;
 
+    // The slot the event loop is handling. Removing that client is put off until it's done, so the slot stays valid.
+    int fdBeingHandled = -1;
+    bool fdBeingHandledErased = false;
+
     std::mutex clientsToRemoveMutex;
     std::forward_list<std::weak_ptr<Client>> clientsQueuedForRemoving;
 
     std::mutex queuedKeepAliveMutex;
     std::map<std::chrono::seconds, std::vector<KeepAliveCheck>> queuedKeepAliveChecks;
 
+    size_t slowConsumersPublished = 0;
+
+    std::mutex fanOutsPendingMutex;
+    std::unordered_map<const ThreadData*, int> fanOutsPendingPerThread;
+
+    // The kernel may still read the payloads of their zero-copy sends, so we keep them, and the sockets to hear when it's done.
+    std::vector<ZeroCopyDrain> zeroCopyDrains;
+
     void reload(std::shared_ptr<Settings> settings);
     void wakeUpThread();
     void doKeepAliveCheck();
     void quit();
     void publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadData>> &threads);
     void publishStat(const std::string &topic, uint64_t n);
+    void publishStat(const std::string &topic, const std::string &payload);
     void sendQueuedWills();
+    void sendWillMessage(std::shared_ptr<WillPublish> willMessage, std::shared_ptr<Session> session);
     void removeExpiredSessions();
     void sendAllWills();
     void sendAllDisconnects();
+    void prepareHandover();
+    void adoptHandedOverClient(std::shared_ptr<Client> client);
+    void handleClusterPublishes(std::shared_ptr<std::vector<Publish>> publishes);
+    void releaseClusterSession(const std::string &peerName, const std::string &clientId, bool wantState);
+    void adoptClusterSessionState(std::shared_ptr<ClusterSessionState> state);
+    void fanOut(std::shared_ptr<Publish> publish, std::shared_ptr<std::vector<ReceivingSubscriber>> receivers, std::shared_ptr<PendingFanOut> pending);
+    void createClient(int fd, SSL *ssl, bool websocket, struct sockaddr_in6 addr, const Settings *settings);
+    void addClient(std::shared_ptr<Client> client);
+    void insertClient(std::shared_ptr<Client> client);
+    void addClientToEpoll(int fd);
+    void eraseClientLocked(int fd);
     void queueClientNextKeepAliveCheck(std::shared_ptr<Client> &client, bool keepRechecking);
 
     void removeQueuedClients();
+    void resumeBackpressuredClient(std::weak_ptr<Client> client);
+    void drainZeroCopySends(int fd, ZeroCopyPins pins);
+    void reapZeroCopyDrains();
 
 public:
     Settings settingsLocalCopy; // Is updated on reload, within the thread loop.
@@ -82,13 +148,31 @@ public:
     bool finished = false;
     bool allWillsQueued = false;
     bool allDisconnectsSent = false;
+    bool allClientsPreparedForHandover = false;
     std::thread thread;
     int threadnr = 0;
+    int pinnedCpu = -1;
+    int numaNode = -1;
     int epollfd = 0;
     int taskEventFd = 0;
     std::mutex taskQueueMutex;
     std::forward_list<std::function<void()>> taskQueue;
 
+    // Fan-outs this thread gave to other threads that haven't been done yet. Until then, its publishes go the same way, to keep the order.
+    std::atomic<int> fanOutsPending{0};
+    void fanOutStarted(const ThreadData *target);
+    void fanOutDone(const ThreadData *target);
+    std::unordered_set<const ThreadData*> getThreadsWithFanOutsPending();
+
+    // Only in the sharded thread model: the sessions and subscriptions of the clients of this thread, and the channels with the others.
+    std::shared_ptr<SubscriptionStore> subscriptionStore;
+    std::shared_ptr<ThreadShards> shards;
+    std::atomic<bool> shardMessagesPending{false};
+
+    // Clients that ran out of read budget get another turn in the next iteration of the thread loop.
+    std::vector<std::weak_ptr<Client>> clientsWithPendingInput;
+    uint64_t loopIteration = 0;
+
     DerivableCounter receivedMessageCounter;
     DerivableCounter sentMessageCounter;
     DerivableCounter mqttConnectCounter;
@@ -96,11 +180,29 @@ public:
     ThreadData(int threadnr, std::shared_ptr<Settings> settings);
     ThreadData(const ThreadData &other) = delete;
     ThreadData(ThreadData &&other) = delete;
+    ~ThreadData();
 
     void start(thread_f f);
 
     void giveClient(std::shared_ptr<Client> client);
-    std::shared_ptr<Client> getClient(int fd);
+    void queueCreateClient(int fd, SSL *ssl, bool websocket, const struct sockaddr_in6 &addr, const Settings *settings);
+
+    /**
+     * @brief getClientFromOwnThread is the lock-free lookup for the event loop. Other threads must not use it.
+     * @return the slot for the fd, or nullptr. Pointer, because the shared_ptr is not copied. Between startHandlingClientEvent()
+     * and doneHandlingClientEvent(), the slot isn't emptied, not even when the client is removed.
+     */
+    std::shared_ptr<Client> *getClientFromOwnThread(int fd)
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= clients_by_fd.size())
+            return nullptr;
+
+        return &clients_by_fd[fd];
+    }
+
+    void startHandlingClientEvent(int fd);
+    void doneHandlingClientEvent();
+
     void removeClientQueued(const std::shared_ptr<Client> &client);
     void removeClientQueued(int fd);
     void removeClient(std::shared_ptr<Client> client);
@@ -114,8 +216,15 @@ public:
     void queuePasswdFileReload();
     void queuePublishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadData>> &threads);
     void queueSendingQueuedWills();
+    void queueWillMessage(const std::shared_ptr<WillPublish> &willMessage, const std::shared_ptr<Session> &session);
     void queueRemoveExpiredSessions();
     void queueClientNextKeepAliveCheckLocked(std::shared_ptr<Client> &client, bool keepRechecking);
+    void queueResumeBackpressuredClient(const std::shared_ptr<Client> &client);
+    void queueDrainZeroCopySends(int fd, const ZeroCopyPins &pins);
+    void addClientWithPendingInput(const std::shared_ptr<Client> &client);
+    void runQueuedTasks();
+    void wakeUpForShardMessages();
+    void handleShardMessages();
 
     int getNrOfClients() const;
 
@@ -124,6 +233,14 @@ public:
 
     void queueSendWills();
     void queueSendDisconnects();
+    void queuePrepareHandover();
+    void queueAdoptHandedOverClient(const std::shared_ptr<Client> &client);
+    void queueClusterPublishes(const std::shared_ptr<std::vector<Publish>> &publishes);
+    void queueReleaseClusterSession(const std::string &peerName, const std::string &clientId, bool wantState);
+    void queueAdoptClusterSessionState(const std::shared_ptr<ClusterSessionState> &state);
+    void queueFanOut(const std::shared_ptr<Publish> &publish, const std::shared_ptr<std::vector<ReceivingSubscriber>> &receivers,
+                     const std::shared_ptr<ThreadData> &origin);
+    std::vector<std::shared_ptr<Client>> getHandedOverClients();
 };
 
 #endif // THREADDATA_H
@@ -17,6 +17,124 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 
 #include "threadloop.h"
 
+/**
+ * @brief handleClientEvents reads, handles and writes for a client, as reported by epoll.
+ *
+ * Reading is done within the configured budgets, at most once per iteration of the thread loop. Clients that have input
+ * left are put in the list of clients with pending input, so other clients get their turn first.
+ */
+void handleClientEvents(ThreadData *threadData, std::shared_ptr<Client> &client, uint32_t events, std::vector<MqttPacket> &packetQueueIn)
+{
+    Logger *logger = Logger::getInstance();
+
+    try
+    {
+        // With zero-copy sends, the kernel reports completions on the error queue, which also sets EPOLLERR.
+        if ((events & EPOLLERR) && !(events & EPOLLHUP) && client->reapZeroCopyCompletions())
+            events &= ~EPOLLERR;
+
+        if (events & (EPOLLERR | EPOLLHUP))
+        {
+            client->setDisconnectReason("epoll says socket is in ERR or HUP state.");
+            threadData->removeClient(client);
+            return;
+        }
+        if (client->isSsl() && !client->isSslAccepted())
+        {
+            client->startOrContinueSslAccept();
+            return;
+        }
+        if (((events & EPOLLIN) || ((events & EPOLLOUT) && client->getSslReadWantsWrite())) && client->takeTurn(threadData->loopIteration))
+        {
+            const Settings &settings = threadData->settingsLocalCopy;
+            VectorClearGuard vectorClear(packetQueueIn);
+            bool readSuccess = client->readFdIntoBuffer(settings.clientReadBudgetBytes);
+            client->bufferToMqttPackets(packetQueueIn, client, settings.clientReadBudgetPackets);
+
+            for (MqttPacket &packet : packetQueueIn)
+            {
+#ifdef TESTING
+                if (client->onPacketReceived)
+                    client->onPacketReceived(packet);
+                else
+#endif
+                packet.handle();
+            }
+
+            if (!readSuccess)
+            {
+                client->setDisconnectReason("socket disconnect detected");
+                threadData->removeClient(client);
+                return;
+            }
+
+            threadData->addClientWithPendingInput(client);
+        }
+        if ((events & EPOLLOUT) || ((events & EPOLLIN) && client->getSslWriteWantsRead()))
+        {
+            if (!client->writeBufIntoFd())
+            {
+                threadData->removeClient(client);
+                return;
+            }
+
+            if (client->readyForDisconnecting())
+            {
+                threadData->removeClient(client);
+                return;
+            }
+        }
+    }
+    catch (ProtocolError &ex)
+    {
+        client->setDisconnectReason(ex.what());
+        if (client->getProtocolVersion() >= ProtocolVersion::Mqtt5 && client->hasConnectPacketSeen())
+        {
+            Disconnect d(client->getProtocolVersion(), ex.reasonCode);
+            MqttPacket p(d);
+            client->writeMqttPacket(p);
+            client->setReadyForDisconnect();
+
+            // When a client's TCP buffers are full (when the client is gone, for instance), EPOLLOUT will never be
+            // reported. In those cases, the client is not removed; not until the keep-alive mechanism anyway. Is
+            // that a problem?
+        }
+        else
+        {
+            logger->logf(LOG_ERR, "Protocol error: %s. Removing client.", ex.what());
+            threadData->removeClient(client);
+        }
+    }
+    catch(std::exception &ex)
+    {
+        client->setDisconnectReason(ex.what());
+        logger->logf(LOG_ERR, "Packet read/write error: %s. Removing client.", ex.what());
+        threadData->removeClient(client);
+    }
+}
+
+/**
+ * @brief handleClientsWithPendingInput gives the clients that weren't done reading within their budget another turn, round-robin.
+ *
+ * Clients that end up in the list twice only get one turn, because that is checked in handleClientEvents().
+ */
+void handleClientsWithPendingInput(ThreadData *threadData, std::vector<MqttPacket> &packetQueueIn)
+{
+    std::vector<std::weak_ptr<Client>> clientsWithPendingInput;
+    clientsWithPendingInput.swap(threadData->clientsWithPendingInput);
+
+    for (std::weak_ptr<Client> &weakClient : clientsWithPendingInput)
+    {
+        std::shared_ptr<Client> client = weakClient.lock();
+
+        // Resuming after backpressure puts it back in the list.
+        if (client && !client->isPausedByBackpressure())
+        {
+            handleClientEvents(threadData, client, EPOLLIN, packetQueueIn);
+        }
+    }
+}
+
 void do_thread_work(ThreadData *threadData)
 {
     int epoll_fd = threadData->epollfd;
@@ -44,9 +162,29 @@ void do_thread_work(ThreadData *threadData)
         instance->quit();
     }
 
+    // In busy-poll mode, we keep polling without sleeping until there have been no events for the spin budget.
+    std::chrono::time_point<std::chrono::steady_clock> lastEventAt = std::chrono::steady_clock::now();
+
     while (threadData->running)
     {
-        int fdcount = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+        threadData->loopIteration++;
+
+        // Don't sleep when clients still have input we haven't gotten to. Housekeeping is queued by the timer, so the timeout
+        // only matters for noticing we have to stop.
+        int timeout = threadData->clientsWithPendingInput.empty() ? 100 : 0;
+
+        const uint32_t busyPollMicroseconds = threadData->settingsLocalCopy.busyPollMicroseconds;
+        if (busyPollMicroseconds > 0 && timeout > 0)
+        {
+            const auto spinUntil = lastEventAt + std::chrono::microseconds(busyPollMicroseconds);
+            if (std::chrono::steady_clock::now() < spinUntil)
+                timeout = 0;
+        }
+
+        int fdcount = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+
+        if (busyPollMicroseconds > 0 && (fdcount > 0 || !threadData->clientsWithPendingInput.empty()))
+            lastEventAt = std::chrono::steady_clock::now();
 
         if (fdcount < 0)
         {
@@ -54,7 +192,12 @@ void do_thread_work(ThreadData *threadData)
                 continue;
             logger->logf(LOG_ERR, "Problem waiting for fd: %s", strerror(errno));
         }
-        else if (fdcount > 0)
+
+        // The clients that weren't done reading within their budget go before the ones epoll reports.
+        if (!threadData->clientsWithPendingInput.empty())
+            handleClientsWithPendingInput(threadData, packetQueueIn);
+
+        if (fdcount > 0)
         {
             for (int i = 0; i < fdcount; i++)
             {
@@ -66,106 +209,20 @@ void do_thread_work(ThreadData *threadData)
                     uint64_t eventfd_value = 0;
                     check<std::runtime_error>(read(fd, &eventfd_value, sizeof(uint64_t)));
 
-                    std::forward_list<std::function<void()>> copiedTasks;
-
-                    {
-                        std::lock_guard<std::mutex> locker(threadData->taskQueueMutex);
-                        for(auto &f : threadData->taskQueue)
-                        {
-                            copiedTasks.push_front(std::move(f));
-                        }
-                        threadData->taskQueue.clear();
-                    }
-
-                    for(auto &f : copiedTasks)
-                    {
-                        f();
-                    }
+                    threadData->runQueuedTasks();
+                    threadData->handleShardMessages();
 
                     continue;
                 }
 
-                std::shared_ptr<Client> client = threadData->getClient(fd);
+                // Handling the slot itself saves copying the shared pointer for every event.
+                std::shared_ptr<Client> *client = threadData->getClientFromOwnThread(fd);
 
-                if (client)
+                if (client && *client)
                 {
-                    try
-                    {
-                        if (cur_ev.events & (EPOLLERR | EPOLLHUP))
-                        {
-                            client->setDisconnectReason("epoll says socket is in ERR or HUP state.");
-                            threadData->removeClient(client);
-                            continue;
-                        }
-                        if (client->isSsl() && !client->isSslAccepted())
-                        {
-                            client->startOrContinueSslAccept();
-                            continue;
-                        }
-                        if ((cur_ev.events & EPOLLIN) || ((cur_ev.events & EPOLLOUT) && client->getSslReadWantsWrite()))
-                        {
-                            VectorClearGuard vectorClear(packetQueueIn);
-                            bool readSuccess = client->readFdIntoBuffer();
-                            client->bufferToMqttPackets(packetQueueIn, client);
-
-                            for (MqttPacket &packet : packetQueueIn)
-                            {
-#ifdef TESTING
-                                if (client->onPacketReceived)
-                                    client->onPacketReceived(packet);
-                                else
-#endif
-                                packet.handle();
-                            }
-
-                            if (!readSuccess)
-                            {
-                                client->setDisconnectReason("socket disconnect detected");
-                                threadData->removeClient(client);
-                                continue;
-                            }
-                        }
-                        if ((cur_ev.events & EPOLLOUT) || ((cur_ev.events & EPOLLIN) && client->getSslWriteWantsRead()))
-                        {
-                            if (!client->writeBufIntoFd())
-                            {
-                                threadData->removeClient(client);
-                                continue;
-                            }
-
-                            if (client->readyForDisconnecting())
-                            {
-                                threadData->removeClient(client);
-                                continue;
-                            }
-                        }
-                    }
-                    catch (ProtocolError &ex)
-                    {
-                        client->setDisconnectReason(ex.what());
-                        if (client->getProtocolVersion() >= ProtocolVersion::Mqtt5 && client->hasConnectPacketSeen())
-                        {
-                            Disconnect d(client->getProtocolVersion(), ex.reasonCode);
-                            MqttPacket p(d);
-                            client->writeMqttPacket(p);
-                            client->setReadyForDisconnect();
-
-                            // When a client's TCP buffers are full (when the client is gone, for instance), EPOLLOUT will never be
-                            // reported. In those cases, the client is not removed; not until the keep-alive mechanism anyway. Is
-                            // that a problem?
-                        }
-                        else
-                        {
-                            logger->logf(LOG_ERR, "Protocol error: %s. Removing client.", ex.what());
-                            threadData->removeClient(client);
-                        }
-                    }
-                    catch(std::exception &ex)
-                    {
-                        client->setDisconnectReason(ex.what());
-                        logger->logf(LOG_ERR, "Packet read/write error: %s. Removing client.", ex.what());
-                        threadData->removeClient(client);
-                    }
+                    threadData->startHandlingClientEvent(fd);
+                    handleClientEvents(threadData, *client, cur_ev.events, packetQueueIn);
+                    threadData->doneHandlingClientEvent();
                 }
             }
         }
@@ -181,5 +238,16 @@ void do_thread_work(ThreadData *threadData)
         logger->logf(LOG_ERR, "Error cleaning auth back-end: %s", ex.what());
     }
 
+    {
+        // Tasks that won't run anymore. Dropping them also ends the fan-outs other threads are waiting on. They're destroyed after
+        // unlocking, because what they hold on to may queue tasks when it goes.
+        std::forward_list<std::function<void()>> droppedTasks;
+
+        {
+            std::lock_guard<std::mutex> locker(threadData->taskQueueMutex);
+            droppedTasks.swap(threadData->taskQueue);
+        }
+    }
+
     threadData->finished = true;
 }
@@ -41,6 +41,8 @@ public:
     }
 };
 
+void handleClientEvents(ThreadData *threadData, std::shared_ptr<Client> &client, uint32_t events, std::vector<MqttPacket> &packetQueueIn);
+void handleClientsWithPendingInput(ThreadData *threadData, std::vector<MqttPacket> &packetQueueIn);
 void do_thread_work(ThreadData *threadData);
 
 
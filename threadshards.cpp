@@ -0,0 +1,336 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "threadshards.h"
+
+#include <functional>
+#include <cassert>
+
+#include "utils.h"
+#include "types.h"
+#include "threadglobals.h"
+#include "threaddata.h"
+#include "subscriptionstore.h"
+#include "publishcopyfactory.h"
+
+size_t ShardInterest::getBitIndex(const std::string &firstSubtopic)
+{
+    return std::hash<std::string>()(firstSubtopic) % (SHARD_INTEREST_WORDS * 64);
+}
+
+std::string ShardInterest::getFirstSubtopic(const std::string &filter)
+{
+    const size_t slash = filter.find('/');
+    return filter.substr(0, slash);
+}
+
+/**
+ * @brief ShardInterest::add is done before the subscribe is acknowledged, so publishes sent after that are seen by the other threads.
+ */
+void ShardInterest::add(const std::string &filter)
+{
+    const std::string firstSubtopic = getFirstSubtopic(filter);
+
+    if (firstSubtopic == "+" || firstSubtopic == "#")
+    {
+        firstLevelWildcard.store(true, std::memory_order_release);
+        return;
+    }
+
+    const size_t bit = getBitIndex(firstSubtopic);
+    words[bit / 64].fetch_or(1ULL << (bit % 64), std::memory_order_release);
+}
+
+/**
+ * @brief ShardInterest::rebuild replaces the summary with one of the filters that are left. Adding and rebuilding is done with the lock of
+ * the store held, so one doesn't undo the other.
+ *
+ * The words are replaced one by one, but a filter that is still there has its bit in the old and new word.
+ */
+void ShardInterest::rebuild(const std::set<std::string> &filters)
+{
+    std::array<uint64_t, SHARD_INTEREST_WORDS> newWords {};
+    bool newFirstLevelWildcard = false;
+
+    for (const std::string &filter : filters)
+    {
+        const std::string firstSubtopic = getFirstSubtopic(filter);
+
+        if (firstSubtopic == "+" || firstSubtopic == "#")
+        {
+            newFirstLevelWildcard = true;
+            continue;
+        }
+
+        const size_t bit = getBitIndex(firstSubtopic);
+        newWords[bit / 64] |= 1ULL << (bit % 64);
+    }
+
+    for (size_t i = 0; i < SHARD_INTEREST_WORDS; i++)
+    {
+        words[i].store(newWords[i], std::memory_order_release);
+    }
+
+    firstLevelWildcard.store(newFirstLevelWildcard, std::memory_order_release);
+}
+
+/**
+ * @brief ShardInterest::mightMatch says whether the shard may have subscribers for the topic. Filters starting with a wildcard don't match
+ * topics starting with '$' [MQTT-4.7.2-1].
+ */
+bool ShardInterest::mightMatch(const std::vector<std::string> &subtopics, bool dollar) const
+{
+    if (subtopics.empty())
+        return false;
+
+    if (!dollar && firstLevelWildcard.load(std::memory_order_acquire))
+        return true;
+
+    const size_t bit = getBitIndex(subtopics.front());
+    return words[bit / 64].load(std::memory_order_acquire) & (1ULL << (bit % 64));
+}
+
+SessionShard::SessionShard(size_t shard) :
+    shard(shard)
+{
+
+}
+
+ThreadShards::ThreadShards(size_t count) :
+    count(count)
+{
+    channels.reserve(count * count);
+    for (size_t i = 0; i < count * count; i++)
+    {
+        channels.push_back(std::make_unique<SpscQueue<ShardMessage>>());
+    }
+
+    interests.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        interests.push_back(std::make_unique<ShardInterest>());
+    }
+}
+
+/**
+ * @brief ThreadShards::setThreads is for before the threads start, so nothing is sent before they're known.
+ */
+void ThreadShards::setThreads(const std::vector<std::shared_ptr<ThreadData>> &threads)
+{
+    assert(threads.size() == count);
+
+    this->threads.clear();
+    for (const std::shared_ptr<ThreadData> &thread : threads)
+    {
+        this->threads.push_back(thread.get());
+    }
+}
+
+size_t ThreadShards::getCount() const
+{
+    return count;
+}
+
+ShardInterest &ThreadShards::getInterest(size_t shard)
+{
+    return *interests.at(shard);
+}
+
+ThreadData *ThreadShards::getThread(size_t shard) const
+{
+    return threads.at(shard);
+}
+
+/**
+ * @brief ThreadShards::inThreadOf says whether the caller is the thread of the shard, which is the only one that may send from it.
+ */
+bool ThreadShards::inThreadOf(size_t shard) const
+{
+    return ThreadGlobals::getThreadData() == threads.at(shard);
+}
+
+/**
+ * @brief ThreadShards::send puts the message in the channel of the two threads, and wakes up the receiving one if it isn't yet.
+ */
+void ThreadShards::send(size_t from, size_t to, ShardMessage &&msg)
+{
+    channels[from * count + to]->push(std::move(msg));
+    threads[to]->wakeUpForShardMessages();
+}
+
+/**
+ * @brief ThreadShards::forwardPublish gives the publish to the other threads that may have subscribers for it.
+ *
+ * Like with fan-outs to other threads, they get a copy of the publish, because the packet is this thread's, and the publisher isn't paused
+ * for backpressure by their receivers.
+ */
+void ThreadShards::forwardPublish(size_t fromShard, PublishCopyFactory &copyFactory, bool dollar)
+{
+    const std::vector<std::string> &subtopics = copyFactory.getSubtopics();
+    std::shared_ptr<Publish> publish;
+
+    for (size_t to = 0; to < count; to++)
+    {
+        if (to == fromShard || !interests[to]->mightMatch(subtopics, dollar))
+            continue;
+
+        if (!publish)
+        {
+            publish = std::make_shared<Publish>(copyFactory.getPublishData());
+            publish->retain = copyFactory.getRetain();
+            if (publish->subtopics.empty())
+                splitTopic(publish->topic, publish->subtopics);
+        }
+
+        ShardMessage msg;
+        msg.publish = publish;
+        msg.dollar = dollar;
+        send(fromShard, to, std::move(msg));
+    }
+}
+
+/**
+ * @brief ThreadShards::handleMessages handles what the other threads sent to this one. Runs in the thread of the shard.
+ * @return whether messages are left. Only a limited number is handled at once, so the thread also gets to its clients, like reading
+ * the acks that make room for more QoS messages.
+ */
+bool ThreadShards::handleMessages(size_t shard)
+{
+    const std::shared_ptr<SubscriptionStore> &store = threads.at(shard)->subscriptionStore;
+    ShardMessage msg;
+    bool messagesLeft = false;
+
+    for (size_t from = 0; from < count; from++)
+    {
+        if (from == shard)
+            continue;
+
+        SpscQueue<ShardMessage> &channel = *channels[from * count + shard];
+        size_t handled = 0;
+
+        while (channel.pop(msg))
+        {
+            try
+            {
+                PublishCopyFactory factory(msg.publish.get());
+                store->queuePacketAtLocalSubscribers(factory, msg.dollar);
+            }
+            catch (std::exception &ex)
+            {
+                logger->logf(LOG_ERR, "Error handling message from thread %zu: %s", from, ex.what());
+            }
+
+            if (++handled >= SHARD_MESSAGES_PER_CHANNEL_AT_ONCE)
+            {
+                messagesLeft = true;
+                break;
+            }
+        }
+    }
+
+    return messagesLeft;
+}
+
+/**
+ * @brief ThreadShards::registerClient registers the client in the store that has its session, which is the one of this thread when there is
+ * none yet. The session stays where it is, so the client can use it right away, with the subscriptions and queued messages it has.
+ */
+void ThreadShards::registerClient(size_t fromShard, std::shared_ptr<Client> &client, bool clean_start, uint16_t clientReceiveMax,
+                                  uint32_t sessionExpiryInterval)
+{
+    const std::string &clientId = client->getClientId();
+    size_t shard = fromShard;
+
+    {
+        std::lock_guard<std::mutex> locker(sessionShardsMutex);
+
+        SessionShard &sessionShard = sessionShards.emplace(clientId, fromShard).first->second;
+        sessionShard.registering++;
+        shard = sessionShard.shard;
+    }
+
+    if (shard != fromShard)
+        logger->logf(LOG_DEBUG, "Client '%s' connected to thread %zu. Its session stays in thread %zu.", clientId.c_str(), fromShard, shard);
+
+    try
+    {
+        const std::shared_ptr<SubscriptionStore> &store = threads.at(shard)->subscriptionStore;
+        client->setSessionStore(store);
+        store->registerClientLocally(client, clean_start, clientReceiveMax, sessionExpiryInterval);
+    }
+    catch (std::exception &ex)
+    {
+        registrationDone(clientId);
+        throw;
+    }
+
+    registrationDone(clientId);
+}
+
+void ThreadShards::registrationDone(const std::string &clientId)
+{
+    std::lock_guard<std::mutex> locker(sessionShardsMutex);
+
+    auto pos = sessionShards.find(clientId);
+    assert(pos != sessionShards.end());
+
+    if (pos != sessionShards.end())
+        pos->second.registering--;
+}
+
+/**
+ * @brief ThreadShards::lockSession gives the session of the client id, from the store of whichever thread has it.
+ */
+std::shared_ptr<Session> ThreadShards::lockSession(const std::string &clientId)
+{
+    std::lock_guard<std::mutex> locker(sessionShardsMutex);
+
+    auto pos = sessionShards.find(clientId);
+    if (pos == sessionShards.end())
+        return std::shared_ptr<Session>();
+
+    return threads.at(pos->second.shard)->subscriptionStore->lockSession(clientId);
+}
+
+/**
+ * @brief ThreadShards::setSessionShard is for sessions that are put in a store directly, like when loading them.
+ */
+void ThreadShards::setSessionShard(const std::string &clientId, size_t shard)
+{
+    std::lock_guard<std::mutex> locker(sessionShardsMutex);
+    sessionShards.emplace(clientId, shard).first->second.shard = shard;
+}
+
+/**
+ * @brief ThreadShards::forgetSession is for after the store of the shard removed the session. Call without holding the lock of the store.
+ *
+ * The client id is only forgotten when no client is being registered with it, and the store didn't get a new session for it in the
+ * meantime. Those would count on the session being in that store.
+ */
+void ThreadShards::forgetSession(const std::string &clientId, size_t shard)
+{
+    std::lock_guard<std::mutex> locker(sessionShardsMutex);
+
+    auto pos = sessionShards.find(clientId);
+    if (pos == sessionShards.end() || pos->second.shard != shard || pos->second.registering > 0)
+        return;
+
+    if (threads.at(shard)->subscriptionStore->lockSession(clientId))
+        return;
+
+    sessionShards.erase(pos);
+}
@@ -0,0 +1,124 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADSHARDS_H
+#define THREADSHARDS_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <array>
+#include <set>
+#include <mutex>
+#include <unordered_map>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "forward_declarations.h"
+#include "spscqueue.h"
+#include "logger.h"
+
+#define SHARD_INTEREST_WORDS 64
+#define SHARD_MESSAGES_PER_CHANNEL_AT_ONCE 256
+
+/**
+ * @brief The ShardInterest class summarizes the topic filters of one shard, so publishes only go to shards that may have subscribers.
+ *
+ * It has a bit per hash of the first level of the filters, and a flag for filters starting with a wildcard, which match all topics
+ * except the ones starting with '$'. Bits are set on subscribe and only cleared by rebuilding it from the filters that are left, so it
+ * can give false positives, but no false negatives. Other threads read it without locking.
+ */
+class ShardInterest
+{
+    std::array<std::atomic<uint64_t>, SHARD_INTEREST_WORDS> words {};
+    std::atomic<bool> firstLevelWildcard {false};
+
+    static size_t getBitIndex(const std::string &firstSubtopic);
+    static std::string getFirstSubtopic(const std::string &filter);
+
+public:
+    void add(const std::string &filter);
+    void rebuild(const std::set<std::string> &filters);
+    bool mightMatch(const std::vector<std::string> &subtopics, bool dollar) const;
+};
+
+struct ShardMessage
+{
+    std::shared_ptr<Publish> publish;
+    bool dollar = false;
+};
+
+/**
+ * @brief The SessionShard struct says which thread has the session of a client id, and how many registrations of clients are counting on
+ * it staying there.
+ */
+struct SessionShard
+{
+    size_t shard = 0;
+    int registering = 0;
+
+    SessionShard(size_t shard);
+};
+
+/**
+ * @brief The ThreadShards class connects the worker threads in the sharded thread model, where each thread has its own subscription store.
+ *
+ * A session is made in the store of the thread its client first connects to, and stays there. A directory of client ids says which
+ * thread has it, so a client that connects to another thread later uses the session there, with its subscriptions and queued messages.
+ * Mostly clients stay in one thread, so publishing and subscribing don't contend with other threads. Publishes go to the other threads
+ * over a lock-free channel per pair of threads, but only to the ones whose interest summary matches. Only the thread of a store sends
+ * from it. Retained messages are for all threads, so they stay in the global store.
+ */
+class ThreadShards
+{
+    const size_t count;
+
+    // The threads are owned by MainApp, which outlives this.
+    std::vector<ThreadData*> threads;
+    std::vector<std::unique_ptr<SpscQueue<ShardMessage>>> channels; // Indexed by sender * count + receiver.
+    std::vector<std::unique_ptr<ShardInterest>> interests;
+
+    std::mutex sessionShardsMutex;
+    std::unordered_map<std::string, SessionShard> sessionShards;
+
+    Logger *logger = Logger::getInstance();
+
+    void send(size_t from, size_t to, ShardMessage &&msg);
+    void registrationDone(const std::string &clientId);
+
+public:
+    ThreadShards(size_t count);
+    ThreadShards(const ThreadShards &other) = delete;
+    ThreadShards(ThreadShards &&other) = delete;
+
+    void setThreads(const std::vector<std::shared_ptr<ThreadData>> &threads);
+    size_t getCount() const;
+    ShardInterest &getInterest(size_t shard);
+    ThreadData *getThread(size_t shard) const;
+    bool inThreadOf(size_t shard) const;
+
+    void forwardPublish(size_t fromShard, PublishCopyFactory &copyFactory, bool dollar);
+    bool handleMessages(size_t shard);
+
+    void registerClient(size_t fromShard, std::shared_ptr<Client> &client, bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval);
+    std::shared_ptr<Session> lockSession(const std::string &clientId);
+    void setSessionShard(const std::string &clientId, size_t shard);
+    void forgetSession(const std::string &clientId, size_t shard);
+};
+
+#endif // THREADSHARDS_H
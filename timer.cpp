@@ -68,6 +68,18 @@ void Timer::start()
 
     pthread_t native = this->t.native_handle();
     pthread_setname_np(native, "Timer");
+    setThreadAffinity(native, cpus);
+}
+
+/**
+ * @brief Timer::setAffinity sets the CPUs of the timer thread, now or when it starts.
+ */
+void Timer::setAffinity(const std::vector<int> &cpus)
+{
+    this->cpus = cpus;
+
+    if (t.joinable())
+        setThreadAffinity(t.native_handle(), cpus);
 }
 
 void Timer::stop()
@@ -51,6 +51,7 @@ class Timer
     Logger *logger = Logger::getInstance();
     std::vector<CallbackEntry> callbacks;
     std::mutex callbacksMutex;
+    std::vector<int> cpus;
 
     void sortAndSetSleeptimeTillNext();
     void process();
@@ -59,6 +60,7 @@ public:
     Timer();
     ~Timer();
     void start();
+    void setAffinity(const std::vector<int> &cpus);
     void stop();
     void addCallback(std::function<void()> f, uint64_t interval_ms, const std::string &name);
 };
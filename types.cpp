@@ -126,7 +126,7 @@ PublishBase::PublishBase(const std::string &topic, const std::string &payload, c
  * @return
  *
  * The protocol version is not part of the Publish object, because it's used to send publishes to MQTT3 and MQTT5 clients, so that
- * has to be added later. See the `MqttPacket::MqttPacket(const ProtocolVersion protocolVersion, Publish &_publish)`
+ * has to be added later. See the `MqttPacket::MqttPacket(const ProtocolVersion protocolVersion, const Publish &_publish)`
  * constructor.
  */
 size_t PublishBase::getLengthWithoutFixedHeader() const
@@ -141,18 +141,12 @@ size_t PublishBase::getLengthWithoutFixedHeader() const
 }
 
 /**
- * @brief Publish::setClientSpecificProperties generates the properties byte array for one client. You're supposed to call it before any publish.
- *
+ * @brief PublishBase::getClientSpecificProperties encodes the properties for one recipient. They're not stored in the propertyBuilder,
+ * because that is shared with other recipients, and other threads.
  */
-void PublishBase::setClientSpecificProperties()
+ClientSpecificProperties PublishBase::getClientSpecificProperties() const
 {
-    if (!hasExpireInfo && this->topicAlias == 0)
-        return;
-
-    if (propertyBuilder)
-        propertyBuilder->clearClientSpecificBytes();
-    else
-        propertyBuilder = std::make_shared<Mqtt5PropertyBuilder>();
+    ClientSpecificProperties result;
 
     if (hasExpireInfo)
     {
@@ -160,17 +154,22 @@ void PublishBase::setClientSpecificProperties()
         std::chrono::seconds delay = std::chrono::duration_cast<std::chrono::seconds>(now - createdAt);
         int32_t newExpire = (this->expiresAfter - delay).count();
         if (newExpire > 0)
-            propertyBuilder->writeMessageExpiryInterval(newExpire);
+            result.writeMessageExpiryInterval(newExpire);
     }
 
     if (topicAlias > 0)
-        propertyBuilder->writeTopicAlias(this->topicAlias);
+        result.writeTopicAlias(this->topicAlias);
+
+    return result;
 }
 
-void PublishBase::clearClientSpecificProperties()
+/**
+ * @brief PublishBase::getPropertyLength is the length of the MQTT5 properties for one recipient, without the length field itself.
+ */
+uint32_t PublishBase::getPropertyLength(const ClientSpecificProperties &clientProperties) const
 {
-    if (propertyBuilder)
-        propertyBuilder->clearClientSpecificBytes();
+    const size_t genericLength = propertyBuilder ? propertyBuilder->getGenericBytes().size() : 0;
+    return genericLength + clientProperties.getLen();
 }
 
 void PublishBase::constructPropertyBuilder()
@@ -379,6 +378,12 @@ size_t Connect::getLengthWithoutFixedHeader() const
         result += will->payload.length() + 2;
     }
 
+    if (!username.empty())
+        result += username.length() + 2;
+
+    if (!password.empty())
+        result += password.length() + 2;
+
     return result;
 }
 
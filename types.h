@@ -193,6 +193,7 @@ public:
 class PublishBase
 {
     friend class SessionsAndSubscriptionsDB;
+    friend class ClusterMessage;
 
     bool hasExpireInfo = false;
     std::chrono::time_point<std::chrono::steady_clock> createdAt;
@@ -206,13 +207,13 @@ public:
     bool splitTopic = true;
     uint16_t topicAlias = 0;
     bool skipTopic = false;
-    std::shared_ptr<Mqtt5PropertyBuilder> propertyBuilder; // Only contains data for sending, not receiving
+    std::shared_ptr<Mqtt5PropertyBuilder> propertyBuilder; // Only contains data for sending, not receiving. Shared by copies, so don't change it.
 
     PublishBase() = default;
     PublishBase(const std::string &topic, const std::string &payload, char qos);
     size_t getLengthWithoutFixedHeader() const;
-    void setClientSpecificProperties();
-    void clearClientSpecificProperties();
+    ClientSpecificProperties getClientSpecificProperties() const;
+    uint32_t getPropertyLength(const ClientSpecificProperties &clientProperties) const;
     void constructPropertyBuilder();
     bool hasUserProperties() const;
     bool hasExpired() const;
@@ -285,6 +286,7 @@ struct Connect
     std::string clientid;
     std::string username;
     std::string password;
+    uint16_t keepalive = 60;
     std::shared_ptr<WillPublish> will;
     std::shared_ptr<Mqtt5PropertyBuilder> propertyBuilder;
 
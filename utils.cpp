@@ -24,6 +24,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <dirent.h>
+#include <sched.h>
 
 #include "openssl/ssl.h"
 #include "openssl/err.h"
@@ -541,13 +543,13 @@ void testSsl(const std::string &fullchain, const std::string &privkey)
     }
 }
 
-std::string formatString(const std::string str, ...)
+std::string formatString(const char *str, ...)
 {
     char buf[512];
 
     va_list valist;
     va_start(valist, str);
-    vsnprintf(buf, 512, str.c_str(), valist);
+    vsnprintf(buf, 512, str, valist);
     va_end(valist);
 
     size_t len = strlen(buf);
@@ -705,3 +707,103 @@ ReasonCodes authResultToReasonCode(AuthResult authResult)
         return ReasonCodes::UnspecifiedError;
     }
 }
+
+static int parseCpuNumber(std::string s)
+{
+    trim(s);
+
+    if (s.empty() || !std::all_of(s.begin(), s.end(), [](char c) { return isdigit(c); }))
+        throw std::invalid_argument(s);
+
+    return std::stoi(s);
+}
+
+/**
+ * @brief parseCpuList parses a CPU list in the format the kernel uses, like '0-3,8,10-11'.
+ */
+std::vector<int> parseCpuList(const std::string &s)
+{
+    std::vector<int> result;
+
+    for (std::string part : split(s, ',', std::numeric_limits<int>::max(), false))
+    {
+        trim(part);
+
+        std::vector<std::string> range = splitToVector(part, '-');
+
+        try
+        {
+            if (range.size() < 1 || range.size() > 2)
+                throw std::invalid_argument(part);
+
+            const int first = parseCpuNumber(range.front());
+            const int last = parseCpuNumber(range.back());
+
+            if (first < 0 || last < first || last >= CPU_SETSIZE)
+                throw std::invalid_argument(part);
+
+            for (int cpu = first; cpu <= last; cpu++)
+            {
+                if (std::find(result.begin(), result.end(), cpu) == result.end())
+                    result.push_back(cpu);
+            }
+        }
+        catch (std::exception &ex)
+        {
+            throw ConfigFileException(formatString("CPU list '%s' is invalid at '%s'.", s.c_str(), part.c_str()));
+        }
+    }
+
+    if (result.empty())
+        throw ConfigFileException(formatString("CPU list '%s' is empty.", s.c_str()));
+
+    return result;
+}
+
+/**
+ * @brief getCpuNumaNode looks in sysfs what NUMA node a CPU is on.
+ * @return the node, or -1 when unknown.
+ */
+int getCpuNumaNode(int cpu)
+{
+    const std::string path = formatString("/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL)
+        return -1;
+
+    int node = -1;
+    struct dirent *entry = nullptr;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4]))
+        {
+            node = std::atoi(&entry->d_name[4]);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+/**
+ * @brief setThreadAffinity pins a thread to a set of CPUs. An empty list means all CPUs the process is allowed on.
+ */
+void setThreadAffinity(pthread_t native, const std::vector<int> &cpus)
+{
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+
+    if (cpus.empty())
+        check<std::runtime_error>(sched_getaffinity(0, sizeof(cpuset), &cpuset));
+
+    for (int cpu : cpus)
+    {
+        CPU_SET(cpu, &cpuset);
+    }
+
+    const int rc = pthread_setaffinity_np(native, sizeof(cpuset), &cpuset);
+    if (rc != 0)
+        throw std::runtime_error(formatString("Setting thread affinity failed: %s", strerror(rc)));
+}
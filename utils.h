@@ -30,6 +30,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <arpa/inet.h>
 #include "unistd.h"
 #include "sys/stat.h"
+#include <pthread.h>
 
 #include "cirbuf.h"
 #include "bindaddr.h"
@@ -89,7 +90,7 @@ std::string generateWebsocketAnswer(const std::string &acceptString, const std::
 
 void testSsl(const std::string &fullchain, const std::string &privkey);
 
-std::string formatString(const std::string str, ...);
+std::string formatString(const char *str, ...) __attribute__((format(printf, 1, 2)));
 
 std::string dirnameOf(const std::string& fname);
 
@@ -135,5 +136,9 @@ std::chrono::time_point<std::chrono::steady_clock> timepointFromAge(const uint32
 
 ReasonCodes authResultToReasonCode(AuthResult authResult);
 
+std::vector<int> parseCpuList(const std::string &s);
+int getCpuNumaNode(int cpu);
+void setThreadAffinity(pthread_t native, const std::vector<int> &cpus);
+
 
 #endif // UTILS_H
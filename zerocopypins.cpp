@@ -0,0 +1,128 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "zerocopypins.h"
+
+#include <cstring>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+/**
+ * @brief ZeroCopyPins::pin registers a successful zero-copy send of (part of) a payload.
+ */
+void ZeroCopyPins::pin(const std::shared_ptr<const char> &payload)
+{
+    const uint32_t sendNr = sendCounter++;
+
+    if (!pins.empty() && pins.back().second == payload)
+        pins.back().first = sendNr;
+    else
+        pins.emplace_back(sendNr, payload);
+}
+
+/**
+ * @brief ZeroCopyPins::release lets go of the payloads of the sends up to and including the given number.
+ *
+ * Notifications come in order, so everything up to the end of a reported range is done. The numbers wrap around.
+ */
+void ZeroCopyPins::release(uint32_t doneUpTo)
+{
+    while (!pins.empty() && static_cast<int32_t>(doneUpTo - pins.front().first) >= 0)
+        pins.pop_front();
+}
+
+/**
+ * @brief ZeroCopyPins::reap reads the completion notifications from the socket's error queue and releases the payloads.
+ * @return whether the kernel said it copied the data anyway, like it does on loopback. Zero-copy is then only overhead.
+ */
+bool ZeroCopyPins::reap(int fd)
+{
+    bool copied = false;
+
+#ifdef MSG_ZEROCOPY
+    while (!pins.empty())
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        // Not a notification, like when the socket is shut down.
+        if (msg.msg_controllen == 0)
+            break;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err serr;
+            std::memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+
+            if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            release(serr.ee_data);
+
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                copied = true;
+        }
+    }
+#else
+    (void)fd;
+#endif
+
+    return copied;
+}
+
+/**
+ * @brief ZeroCopyPins::getPinnedSendNumbers gives what the new process needs to expect the notifications of unfinished sends, on handover.
+ */
+std::vector<uint32_t> ZeroCopyPins::getPinnedSendNumbers() const
+{
+    std::vector<uint32_t> result;
+    for (auto &pin : pins)
+    {
+        result.push_back(pin.first);
+    }
+    return result;
+}
+
+/**
+ * @brief ZeroCopyPins::restore continues the numbering of a handed over socket. The kernel keeps its own reference to the pages of
+ * the unfinished sends of the old process, so there is nothing to reference.
+ */
+void ZeroCopyPins::restore(uint32_t sendCounter, const std::vector<uint32_t> &pinnedSendNumbers)
+{
+    this->sendCounter = sendCounter;
+
+    pins.clear();
+    for (uint32_t sendNr : pinnedSendNumbers)
+    {
+        pins.emplace_back(sendNr, nullptr);
+    }
+}
@@ -0,0 +1,49 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ZEROCOPYPINS_H
+#define ZEROCOPYPINS_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * @brief The ZeroCopyPins class keeps the payloads of zero-copy sends referenced until the kernel reports it's done with them.
+ *
+ * Every successful send() with MSG_ZEROCOPY gets the next number of a counter of the socket. Completion notifications on the socket's
+ * error queue report ranges of those numbers. Until then, the kernel may still read the memory, so it can't be freed and reused.
+ */
+class ZeroCopyPins
+{
+    uint32_t sendCounter = 0;
+    std::deque<std::pair<uint32_t, std::shared_ptr<const char>>> pins; // The last send number that used the payload.
+
+public:
+    void pin(const std::shared_ptr<const char> &payload);
+    void release(uint32_t doneUpTo);
+    bool reap(int fd);
+    bool empty() const { return pins.empty(); }
+    size_t size() const { return pins.size(); }
+
+    uint32_t getSendCounter() const { return sendCounter; }
+    std::vector<uint32_t> getPinnedSendNumbers() const;
+    void restore(uint32_t sendCounter, const std::vector<uint32_t> &pinnedSendNumbers);
+};
+
+#endif // ZEROCOPYPINS_H